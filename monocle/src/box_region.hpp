@@ -0,0 +1,363 @@
+#pragma once
+
+#include "game/source_math.hpp"
+#include "prng.hpp"
+
+#include <stdint.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <initializer_list>
+#include <numeric>
+#include <vector>
+
+namespace mon {
+
+struct AABB {
+    Vector mins, maxs;
+
+    AABB() {}
+    AABB(const Vector& p1, const Vector& p2)
+        : mins{fminf(p1[0], p2[0]), fminf(p1[1], p2[1]), fminf(p1[2], p2[2])},
+          maxs{fmaxf(p1[0], p2[0]), fmaxf(p1[1], p2[1]), fmaxf(p1[2], p2[2])}
+    {}
+
+    bool VectorInBox(const Vector& pt) const
+    {
+        return pt.x > mins.x && pt.y > mins.y && pt.z > mins.z && pt.x < maxs.x && pt.y < maxs.y && pt.z < maxs.z;
+    }
+
+    Vector RandomPtInBox(small_prng& rng) const
+    {
+        return {rng.next_float(mins[0], maxs[0]), rng.next_float(mins[1], maxs[1]), rng.next_float(mins[2], maxs[2])};
+    }
+
+    // maps a point in the unit cube to the box
+    Vector PtInBox(const float* unit) const
+    {
+        return {
+            mins[0] + unit[0] * (maxs[0] - mins[0]),
+            mins[1] + unit[1] * (maxs[1] - mins[1]),
+            mins[2] + unit[2] * (maxs[2] - mins[2]),
+        };
+    }
+
+    // distance from a point inside the box to its closest face, negative if the point is outside
+    float Margin(const Vector& pt) const
+    {
+        float margin = INFINITY;
+        for (int i = 0; i < 3; i++)
+            margin = std::min({margin, pt[i] - mins[i], maxs[i] - pt[i]});
+        return margin;
+    }
+
+    // true if the point is in the box grown by margin on every side, works with float & double vectors
+    template <typename V>
+    bool NearBox(const V& pt, float margin) const
+    {
+        for (int i = 0; i < 3; i++)
+            if (pt[i] < mins[i] - margin || pt[i] > maxs[i] + margin)
+                return false;
+        return true;
+    }
+
+    // the volume, or the area of the box projected along flat_axis if it's 0-2
+    double Measure(int flat_axis = -1) const
+    {
+        double m = 1;
+        for (int i = 0; i < 3; i++)
+            if (i != flat_axis)
+                m *= (double)maxs[i] - mins[i];
+        return m;
+    }
+
+    void Extend(const AABB& o)
+    {
+        for (int i = 0; i < 3; i++) {
+            mins[i] = std::min(mins[i], o.mins[i]);
+            maxs[i] = std::max(maxs[i], o.maxs[i]);
+        }
+    }
+};
+
+/*
+* Walker's alias method, picks index i with probability weights[i] / sum(weights) in constant time.
+* Falls back to a uniform distribution if every weight is 0.
+*/
+class AliasTable {
+    // the probability of keeping the index that the random value falls on, scaled to 2^32
+    std::vector<uint64_t> keep;
+    std::vector<uint32_t> alias;
+
+public:
+    AliasTable() = default;
+
+    explicit AliasTable(const std::vector<double>& weights) : keep(weights.size()), alias(weights.size())
+    {
+        const size_t n = weights.size();
+        double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+        std::vector<double> scaled(n);
+        for (size_t i = 0; i < n; i++)
+            scaled[i] = total > 0 ? weights[i] * n / total : 1.0;
+        // "small" is a macro in windows headers
+        std::vector<uint32_t> under, over;
+        for (size_t i = 0; i < n; i++)
+            (scaled[i] < 1 ? under : over).push_back((uint32_t)i);
+        while (!under.empty() && !over.empty()) {
+            uint32_t s = under.back(), l = over.back();
+            under.pop_back();
+            keep[s] = (uint64_t)(scaled[s] * 0x1p32);
+            alias[s] = l;
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1) {
+                over.pop_back();
+                under.push_back(l);
+            }
+        }
+        // whatever is left has a probability of 1 up to rounding
+        for (std::vector<uint32_t>* rest : {&under, &over}) {
+            for (uint32_t i : *rest) {
+                keep[i] = 1ull << 32;
+                alias[i] = i;
+            }
+        }
+    }
+
+    size_t Size() const
+    {
+        return keep.size();
+    }
+
+    // maps a uniformly distributed 32 bit value to an index, the high bits pick the column & the low bits the side
+    size_t Sample(uint32_t r) const
+    {
+        MON_ASSERT(!keep.empty());
+        uint64_t x = (uint64_t)r * keep.size();
+        size_t i = (size_t)(x >> 32);
+        return (x & 0xffffffff) < keep[i] ? i : alias[i];
+    }
+};
+
+/*
+* A region made of boxes, e.g. a target space or the position spaces of a portal. Boxes can
+* overlap. Point queries go through a bounding volume hierarchy so they stay cheap for regions
+* made of hundreds of boxes (like the brushes of a map area), and boxes can be sampled weighted by
+* their volume or by their area along one axis so that small boxes aren't sampled as often as large
+* ones. The hierarchy only needs the bounds of each primitive, so other primitives (e.g. triangles)
+* could be added the same way. The region is immutable after construction except through Add.
+*/
+class BoxRegion {
+    struct Node {
+        AABB bounds;
+        // for leaves, the range in order; for inner nodes, the second child (the first is the next node)
+        uint32_t first;
+        uint32_t count;
+    };
+
+    static constexpr uint32_t MAX_LEAF_SIZE = 4;
+
+    std::vector<AABB> boxes;
+    // box indices in leaf order
+    std::vector<uint32_t> order;
+    std::vector<Node> nodes;
+    // [axis] is weighted by the area projected along axis, [3] by volume
+    std::array<AliasTable, 4> samplers;
+
+    uint32_t Build(uint32_t first, uint32_t count)
+    {
+        uint32_t idx = (uint32_t)nodes.size();
+        nodes.push_back({boxes[order[first]], first, count});
+        // twice the centers, only the order matters
+        Vector first_center = boxes[order[first]].mins + boxes[order[first]].maxs;
+        AABB centers{first_center, first_center};
+        for (uint32_t i = first; i < first + count; i++) {
+            const AABB& box = boxes[order[i]];
+            nodes[idx].bounds.Extend(box);
+            Vector c = box.mins + box.maxs;
+            centers.Extend(AABB{c, c});
+        }
+        if (count <= MAX_LEAF_SIZE)
+            return idx;
+        // median split along the longest axis of the box centers
+        Vector extent = centers.maxs - centers.mins;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        uint32_t mid = first + count / 2;
+        auto center_less = [&](uint32_t a, uint32_t b) {
+            return boxes[a].mins[axis] + boxes[a].maxs[axis] < boxes[b].mins[axis] + boxes[b].maxs[axis];
+        };
+        std::nth_element(order.begin() + first, order.begin() + mid, order.begin() + first + count, center_less);
+        Build(first, mid - first);
+        uint32_t second = Build(mid, first + count - mid);
+        nodes[idx].first = second;
+        nodes[idx].count = 0;
+        return idx;
+    }
+
+    void Rebuild()
+    {
+        order.resize(boxes.size());
+        std::iota(order.begin(), order.end(), 0);
+        nodes.clear();
+        if (!boxes.empty())
+            Build(0, (uint32_t)boxes.size());
+        for (int s = 0; s < 4; s++) {
+            std::vector<double> weights(boxes.size());
+            for (size_t i = 0; i < boxes.size(); i++)
+                weights[i] = boxes[i].Measure(s < 3 ? s : -1);
+            samplers[s] = AliasTable{weights};
+        }
+    }
+
+    /*
+    * Calls visit(box) for the boxes in every leaf whose node bounds pass enter(bounds). Stops and
+    * returns true as soon as visit returns true.
+    */
+    template <typename Enter, typename Visit>
+    bool Traverse(Enter&& enter, Visit&& visit) const
+    {
+        if (nodes.empty())
+            return false;
+        uint32_t stack[64];
+        int sp = 0;
+        stack[sp++] = 0;
+        while (sp > 0) {
+            const Node& node = nodes[stack[--sp]];
+            if (!enter(node.bounds))
+                continue;
+            if (node.count == 0) {
+                MON_ASSERT(sp + 2 <= 64);
+                stack[sp++] = node.first;
+                stack[sp++] = (uint32_t)(&node - nodes.data()) + 1;
+                continue;
+            }
+            for (uint32_t i = node.first; i < node.first + node.count; i++)
+                if (visit(boxes[order[i]]))
+                    return true;
+        }
+        return false;
+    }
+
+public:
+    BoxRegion() = default;
+
+    BoxRegion(const AABB& box) : boxes{box}
+    {
+        Rebuild();
+    }
+
+    BoxRegion(std::initializer_list<AABB> boxes) : boxes{boxes}
+    {
+        Rebuild();
+    }
+
+    explicit BoxRegion(std::vector<AABB> boxes) : boxes{std::move(boxes)}
+    {
+        Rebuild();
+    }
+
+    // rebuilds the hierarchy, prefer constructing the region from every box at once
+    void Add(const AABB& box)
+    {
+        boxes.push_back(box);
+        Rebuild();
+    }
+
+    size_t size() const
+    {
+        return boxes.size();
+    }
+
+    bool empty() const
+    {
+        return boxes.empty();
+    }
+
+    const AABB& operator[](size_t i) const
+    {
+        return boxes[i];
+    }
+
+    auto begin() const
+    {
+        return boxes.begin();
+    }
+
+    auto end() const
+    {
+        return boxes.end();
+    }
+
+    const AABB& Bounds() const
+    {
+        MON_ASSERT(!nodes.empty());
+        return nodes[0].bounds;
+    }
+
+    // true if the point is strictly inside any of the boxes
+    bool VectorInRegion(const Vector& pt) const
+    {
+        return Traverse([&](const AABB& bounds) { return bounds.NearBox(pt, 0.f); },
+                        [&](const AABB& box) { return box.VectorInBox(pt); });
+    }
+
+    // true if the point is in any of the boxes grown by margin, works with float & double vectors
+    template <typename V>
+    bool NearRegion(const V& pt, float margin) const
+    {
+        return Traverse([&](const AABB& bounds) { return bounds.NearBox(pt, margin); },
+                        [&](const AABB& box) { return box.NearBox(pt, margin); });
+    }
+
+    /*
+    * The largest AABB::Margin of any box. For a point inside the region this is a lower bound for
+    * the distance to the region's boundary (exact if the boxes don't touch). A node's margin is
+    * never smaller than the margin of a box inside of it, so nodes that can't beat the best margin
+    * so far are skipped.
+    */
+    float Margin(const Vector& pt) const
+    {
+        float best = -INFINITY;
+        Traverse([&](const AABB& bounds) { return bounds.Margin(pt) > best; },
+                 [&](const AABB& box) {
+                     best = std::max(best, box.Margin(pt));
+                     return false;
+                 });
+        return best;
+    }
+
+    // calls f(index) for every box that overlaps area (including boxes that only touch it)
+    template <typename F>
+    void ForEachOverlapping(const AABB& area, F&& f) const
+    {
+        auto overlaps = [&area](const AABB& box) {
+            for (int i = 0; i < 3; i++)
+                if (box.maxs[i] < area.mins[i] || box.mins[i] > area.maxs[i])
+                    return false;
+            return true;
+        };
+        Traverse(overlaps, [&](const AABB& box) {
+            if (overlaps(box))
+                f((size_t)(&box - boxes.data()));
+            return false;
+        });
+    }
+
+    /*
+    * Picks a box weighted by its area projected along flat_axis (e.g. the locked axis of a portal)
+    * or by volume if flat_axis is -1. Boxes without any area/volume are never picked unless none
+    * of the boxes have any.
+    */
+    size_t SampleIndex(uint32_t r, int flat_axis = -1) const
+    {
+        MON_ASSERT(flat_axis >= -1 && flat_axis < 3);
+        return samplers[flat_axis < 0 ? 3 : flat_axis].Sample(r);
+    }
+
+    // uses a single value from the prng
+    size_t SampleIndex(small_prng& rng, int flat_axis = -1) const
+    {
+        return SampleIndex(rng(), flat_axis);
+    }
+};
+
+} // namespace mon
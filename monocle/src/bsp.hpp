@@ -0,0 +1,437 @@
+#pragma once
+
+#include "game/source_math.hpp"
+#include "box_region.hpp"
+#include "mapped_file.hpp"
+#include "portal_placement.hpp"
+#include "vag_search.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+/*
+* Reads the world geometry of Portal 1 maps (.bsp versions 19-21, the 5135 maps are version 20)
+* and turns the portalable surfaces into SearchPortals. Only what's needed for that is read: the
+* faces of the world model with their planes, polygons, and materials. Displacements and brush
+* entities (doors, func_brush, etc.) are skipped.
+*/
+
+namespace mon {
+
+// surface flags from the texinfo lump, see bspflags.h in the SDK
+enum BspSurfaceFlags : int32_t {
+    BSP_SURF_SKY2D = 0x2,
+    BSP_SURF_SKY = 0x4,
+    BSP_SURF_WARP = 0x8,
+    BSP_SURF_TRANS = 0x10,
+    BSP_SURF_NOPORTAL = 0x20,
+    BSP_SURF_TRIGGER = 0x40,
+    BSP_SURF_NODRAW = 0x80,
+    BSP_SURF_HINT = 0x100,
+    BSP_SURF_SKIP = 0x200,
+
+    BSP_SURF_NOT_PORTALABLE = BSP_SURF_SKY2D | BSP_SURF_SKY | BSP_SURF_WARP | BSP_SURF_TRANS | BSP_SURF_NOPORTAL |
+                              BSP_SURF_TRIGGER | BSP_SURF_NODRAW | BSP_SURF_HINT | BSP_SURF_SKIP,
+};
+
+struct BspFace {
+    // the face's index in the map's face lump
+    int index;
+    // the convex polygon of the face
+    std::vector<Vector> verts;
+    // the plane of the face, the normal points out of the solid: dot(normal, verts[i]) == dist
+    Vector normal;
+    float dist;
+    std::string material;
+    int32_t surface_flags;
+    AABB bounds;
+
+    // the area of the polygon
+    double Area() const
+    {
+        double cross[3]{};
+        for (size_t i = 1; i + 1 < verts.size(); i++) {
+            Vector a = verts[i] - verts[0], b = verts[i + 1] - verts[0];
+            cross[0] += (double)a.y * b.z - (double)a.z * b.y;
+            cross[1] += (double)a.z * b.x - (double)a.x * b.z;
+            cross[2] += (double)a.x * b.y - (double)a.y * b.x;
+        }
+        return std::sqrt(cross[0] * cross[0] + cross[1] * cross[1] + cross[2] * cross[2]) / 2;
+    }
+
+    // the axis of the normal if the face is axis aligned, otherwise -1
+    int NormalAxis() const
+    {
+        for (int i = 0; i < 3; i++)
+            if (std::fabs(normal[i]) == 1.f)
+                return i;
+        return -1;
+    }
+};
+
+class BspMap {
+    // on-disk layout, see bspfile.h in the SDK
+    struct Lump {
+        int32_t offset, length, version;
+        char four_cc[4];
+    };
+
+    struct Header {
+        char ident[4];
+        int32_t version;
+        Lump lumps[64];
+        int32_t map_revision;
+    };
+
+    struct Plane {
+        Vector normal;
+        float dist;
+        int32_t type;
+    };
+
+    struct TexData {
+        Vector reflectivity;
+        int32_t name_idx;
+        int32_t width, height, view_width, view_height;
+    };
+
+    struct TexInfo {
+        float texture_vecs[2][4];
+        float lightmap_vecs[2][4];
+        int32_t flags;
+        int32_t tex_data;
+    };
+
+    struct Face {
+        uint16_t plane;
+        uint8_t side;
+        uint8_t on_node;
+        int32_t first_edge;
+        int16_t n_edges;
+        int16_t tex_info;
+        int16_t disp_info;
+        int16_t fog_volume;
+        uint8_t styles[4];
+        int32_t light_offset;
+        float area;
+        int32_t lightmap_mins[2];
+        int32_t lightmap_size[2];
+        int32_t orig_face;
+        uint16_t n_prims;
+        uint16_t first_prim;
+        uint32_t smoothing_groups;
+    };
+
+    struct Model {
+        Vector mins, maxs, origin;
+        int32_t head_node;
+        int32_t first_face, n_faces;
+    };
+
+    static_assert(sizeof(Header) == 1036);
+    static_assert(sizeof(Plane) == 20);
+    static_assert(sizeof(TexData) == 32);
+    static_assert(sizeof(TexInfo) == 72);
+    static_assert(sizeof(Face) == 56);
+    static_assert(sizeof(Model) == 48);
+
+    enum LumpIndex {
+        LUMP_PLANES = 1,
+        LUMP_TEXDATA = 2,
+        LUMP_VERTEXES = 3,
+        LUMP_TEXINFO = 6,
+        LUMP_FACES = 7,
+        LUMP_EDGES = 12,
+        LUMP_SURFEDGES = 13,
+        LUMP_MODELS = 14,
+        LUMP_TEXDATA_STRING_DATA = 43,
+        LUMP_TEXDATA_STRING_TABLE = 44,
+    };
+
+    std::vector<BspFace> faces;
+    // the bounds of every face, for spatial queries
+    BoxRegion face_bounds;
+    std::string err;
+
+    bool Fail(std::string msg)
+    {
+        err = std::move(msg);
+        return false;
+    }
+
+    // copies a lump into a vector of T, false if the lump doesn't fit in the file
+    template <typename T>
+    static bool ReadLump(const uint8_t* data, size_t size, const Header& hdr, LumpIndex idx, std::vector<T>& out)
+    {
+        const Lump& lump = hdr.lumps[idx];
+        if (lump.offset < 0 || lump.length < 0 || (size_t)lump.offset + (size_t)lump.length > size ||
+            lump.length % sizeof(T) != 0)
+            return false;
+        out.resize(lump.length / sizeof(T));
+        memcpy(out.data(), data + lump.offset, out.size() * sizeof(T));
+        return true;
+    }
+
+public:
+    const std::string& Error() const
+    {
+        return err;
+    }
+
+    // the faces of the world model that aren't displacements
+    const std::vector<BspFace>& Faces() const
+    {
+        return faces;
+    }
+
+    // calls f(face) for every face whose bounds overlap area
+    template <typename F>
+    void ForEachFaceIn(const AABB& area, F&& f) const
+    {
+        face_bounds.ForEachOverlapping(area, [&](size_t i) { f(faces[i]); });
+    }
+
+    // reads a map from memory, on failure Error() describes the problem
+    bool Parse(const uint8_t* data, size_t size)
+    {
+        faces.clear();
+        Header hdr;
+        if (size < sizeof hdr)
+            return Fail("file is too small");
+        memcpy(&hdr, data, sizeof hdr);
+        if (memcmp(hdr.ident, "VBSP", 4))
+            return Fail("not a bsp file");
+        if (hdr.version < 19 || hdr.version > 21)
+            return Fail("unsupported bsp version " + std::to_string(hdr.version));
+
+        std::vector<Plane> planes;
+        std::vector<TexData> tex_datas;
+        std::vector<Vector> verts;
+        std::vector<TexInfo> tex_infos;
+        std::vector<Face> map_faces;
+        std::vector<std::array<uint16_t, 2>> edges;
+        std::vector<int32_t> surf_edges;
+        std::vector<Model> models;
+        std::vector<char> string_data;
+        std::vector<int32_t> string_table;
+        for (LumpIndex idx : {LUMP_PLANES, LUMP_TEXDATA, LUMP_VERTEXES, LUMP_TEXINFO, LUMP_FACES, LUMP_EDGES,
+                              LUMP_SURFEDGES, LUMP_MODELS, LUMP_TEXDATA_STRING_DATA, LUMP_TEXDATA_STRING_TABLE})
+            if (memcmp(hdr.lumps[idx].four_cc, "\0\0\0\0", 4))
+                return Fail("compressed lumps are not supported");
+        if (!ReadLump(data, size, hdr, LUMP_PLANES, planes) || !ReadLump(data, size, hdr, LUMP_TEXDATA, tex_datas) ||
+            !ReadLump(data, size, hdr, LUMP_VERTEXES, verts) || !ReadLump(data, size, hdr, LUMP_TEXINFO, tex_infos) ||
+            !ReadLump(data, size, hdr, LUMP_FACES, map_faces) || !ReadLump(data, size, hdr, LUMP_EDGES, edges) ||
+            !ReadLump(data, size, hdr, LUMP_SURFEDGES, surf_edges) || !ReadLump(data, size, hdr, LUMP_MODELS, models) ||
+            !ReadLump(data, size, hdr, LUMP_TEXDATA_STRING_DATA, string_data) ||
+            !ReadLump(data, size, hdr, LUMP_TEXDATA_STRING_TABLE, string_table))
+            return Fail("bad lump");
+        if (models.empty())
+            return Fail("no world model");
+
+        const Model& world = models[0];
+        if (world.first_face < 0 || world.n_faces < 0 || (size_t)world.first_face + world.n_faces > map_faces.size())
+            return Fail("bad world model");
+        std::vector<AABB> bounds;
+        for (int fi = world.first_face; fi < world.first_face + world.n_faces; fi++) {
+            const Face& f = map_faces[fi];
+            if (f.disp_info != -1 || f.tex_info < 0)
+                continue;
+            if (f.plane >= planes.size() || (size_t)f.tex_info >= tex_infos.size() || f.first_edge < 0 ||
+                f.n_edges < 3 || (size_t)f.first_edge + f.n_edges > surf_edges.size())
+                return Fail("bad face " + std::to_string(fi));
+            BspFace& face = faces.emplace_back();
+            face.index = fi;
+            const Plane& plane = planes[f.plane];
+            face.normal = f.side ? -plane.normal : plane.normal;
+            face.dist = f.side ? -plane.dist : plane.dist;
+            for (int e = f.first_edge; e < f.first_edge + f.n_edges; e++) {
+                int32_t se = surf_edges[e];
+                size_t edge_idx = (size_t)std::abs((int64_t)se);
+                if (edge_idx >= edges.size())
+                    return Fail("bad edge in face " + std::to_string(fi));
+                uint16_t v = edges[edge_idx][se < 0];
+                if (v >= verts.size())
+                    return Fail("bad vertex in face " + std::to_string(fi));
+                face.verts.push_back(verts[v]);
+            }
+            const TexInfo& ti = tex_infos[f.tex_info];
+            face.surface_flags = ti.flags;
+            if (ti.tex_data >= 0 && (size_t)ti.tex_data < tex_datas.size()) {
+                int32_t name_idx = tex_datas[ti.tex_data].name_idx;
+                if (name_idx >= 0 && (size_t)name_idx < string_table.size() && string_table[name_idx] >= 0 &&
+                    (size_t)string_table[name_idx] < string_data.size()) {
+                    const char* name = string_data.data() + string_table[name_idx];
+                    face.material.assign(name, strnlen(name, string_data.size() - string_table[name_idx]));
+                }
+            }
+            face.bounds = AABB{face.verts[0], face.verts[0]};
+            for (const Vector& v : face.verts)
+                face.bounds.Extend(AABB{v, v});
+            bounds.push_back(face.bounds);
+        }
+        face_bounds = BoxRegion{std::move(bounds)};
+        return true;
+    }
+
+    bool Load(const std::filesystem::path& path)
+    {
+        MappedFile file;
+        if (!file.Open(path))
+            return Fail("could not open " + path.string());
+        return Parse(file.Data(), file.Size());
+    }
+};
+
+struct PortalSurfaceParams {
+    // faces with any of these surface flags are skipped
+    int32_t excluded_flags = BSP_SURF_NOT_PORTALABLE;
+    // if set, only faces whose material passes are used (e.g. to skip black tiles in maps that don't use noportal)
+    std::function<bool(std::string_view material)> material_filter;
+    // only faces that overlap this are used
+    std::optional<AABB> within;
+    // a bit for each SearchPortalType that should be generated, SPT_PLANE is used for sloped faces
+    uint32_t types = 0b1111111;
+};
+
+/*
+* Generates a SearchPortal for every plane of the map with portalable faces, SPT_WALL_* for axis
+* aligned planes and SPT_PLANE for sloped ones. The lock option of a wall is the plane moved by
+* PORTAL_SURFACE_OFFSET, SPT_PLANE uses the plane itself and PortalPlacement adds the offset. The
+* position spaces are the faces on the plane, merged where they share an edge and shrunk so that the
+* portal fits. Walls are shrunk by the portal's half width & height, floors & ceilings by half its
+* diagonal since their yaw can be anything, and sloped faces by the portal's extent along the two
+* free axes (see SearchPortal::LockAxis). This is a simplification of how the game fits portals; it
+* never bumps a portal away from an edge or lets it hang over one. Faces that aren't rectangles
+* along the free axes are skipped since a portal in their bounding box could hang over the edge
+* (this includes sloped faces that are also rotated about the locked axis), as are faces that the
+* portal only fits on exactly.
+*/
+inline std::vector<SearchPortal> FindPortalSurfaces(const BspMap& map, const PortalSurfaceParams& params = {})
+{
+    // (type, normal, lock value) -> face rects as (mins, maxs) in the two free axes
+    using Rect = std::array<float, 4>;
+    using PlaneKey = std::tuple<SearchPortalType, float, float, float, float>;
+    std::map<PlaneKey, std::vector<Rect>> planes;
+
+    auto add_face = [&](const BspFace& face) {
+        if (face.surface_flags & params.excluded_flags)
+            return;
+        if (params.material_filter && !params.material_filter(face.material))
+            return;
+        int normal_axis = face.NormalAxis();
+        bool positive = normal_axis >= 0 && face.normal[normal_axis] > 0;
+        auto type = normal_axis < 0 ? SPT_PLANE : (SearchPortalType)(normal_axis * 2 + !positive);
+        if (!(params.types & (1u << type)))
+            return;
+        int axis = SearchPortal{.type = type, .plane_normal = face.normal}.LockAxis();
+        // the face covers its whole bounding box when seen along the locked axis
+        if (face.Area() * std::fabs(face.normal[axis]) < face.bounds.Measure(axis) * 0.999)
+            return;
+        float lock = face.dist;
+        if (type != SPT_PLANE) {
+            // dot(normal, pt) == dist, so the plane is at +-dist along the axis
+            double wall = positive ? face.dist : -face.dist;
+            lock = (float)(wall + (positive ? PORTAL_SURFACE_OFFSET : -PORTAL_SURFACE_OFFSET));
+        }
+        int a0 = axis == 0 ? 1 : 0, a1 = axis == 2 ? 1 : 2;
+        planes[{type, face.normal.x, face.normal.y, face.normal.z, lock}].push_back(
+            {face.bounds.mins[a0], face.bounds.mins[a1], face.bounds.maxs[a0], face.bounds.maxs[a1]});
+    };
+    if (params.within)
+        map.ForEachFaceIn(*params.within, add_face);
+    else
+        std::for_each(map.Faces().begin(), map.Faces().end(), add_face);
+
+    std::vector<SearchPortal> out;
+    for (auto& [key, rects] : planes) {
+        auto [type, nx, ny, nz, lock] = key;
+        // merge rects that share a whole edge until nothing changes, vbsp splits big walls into a grid
+        for (bool merged = true; merged;) {
+            merged = false;
+            for (size_t i = 0; i < rects.size() && !merged; i++) {
+                for (size_t j = i + 1; j < rects.size() && !merged; j++) {
+                    Rect& a = rects[i];
+                    const Rect& b = rects[j];
+                    for (int d = 0; d < 2 && !merged; d++) {
+                        int o = 1 - d;
+                        bool same_span = a[o] == b[o] && a[o + 2] == b[o + 2];
+                        if (same_span && (a[d + 2] == b[d] || b[d + 2] == a[d])) {
+                            a[d] = std::min(a[d], b[d]);
+                            a[d + 2] = std::max(a[d + 2], b[d + 2]);
+                            merged = true;
+                        }
+                    }
+                    if (merged)
+                        rects.erase(rects.begin() + j);
+                }
+            }
+        }
+
+        SearchPortal sp{
+            .lock_opts{lock},
+            .type = type,
+            .locked = false,
+            .plane_normal = type == SPT_PLANE ? Vector{nx, ny, nz} : Vector{0, 0, 1},
+        };
+        const Vector& n = sp.plane_normal;
+        int axis = sp.LockAxis();
+        int a0 = axis == 0 ? 1 : 0, a1 = axis == 2 ? 1 : 2;
+        float shrink[2];
+        if (axis == 2 && (type != SPT_PLANE || PortalPlacement{n, lock}.level)) {
+            shrink[0] = shrink[1] = std::hypot(PORTAL_HALF_WIDTH, PORTAL_HALF_HEIGHT);
+        } else if (type == SPT_PLANE) {
+            // the portal's right is level and its up goes up the slope
+            Vector r = Vector{n.y, -n.x, 0} * (1.f / std::hypot(n.x, n.y));
+            Vector u{n.y * r.z - n.z * r.y, n.z * r.x - n.x * r.z, n.x * r.y - n.y * r.x};
+            shrink[0] = std::fabs(r[a0]) * PORTAL_HALF_WIDTH + std::fabs(u[a0]) * PORTAL_HALF_HEIGHT;
+            shrink[1] = std::fabs(r[a1]) * PORTAL_HALF_WIDTH + std::fabs(u[a1]) * PORTAL_HALF_HEIGHT;
+        } else {
+            // walls have the portal's up along z
+            shrink[0] = PORTAL_HALF_WIDTH;
+            shrink[1] = PORTAL_HALF_HEIGHT;
+        }
+        std::vector<AABB> spaces;
+        for (const Rect& r : rects) {
+            Vector mins, maxs;
+            mins[a0] = r[0] + shrink[0];
+            mins[a1] = r[1] + shrink[1];
+            maxs[a0] = r[2] - shrink[0];
+            maxs[a1] = r[3] - shrink[1];
+            // faces exactly the size of the portal would give a space with no width to sample from
+            if (!(mins[a0] < maxs[a0] && mins[a1] < maxs[a1]))
+                continue;
+            mins[axis] = maxs[axis] = lock;
+            if (type == SPT_PLANE) {
+                // the box spans the plane over the space so that it sits on the surface
+                mins[axis] = INFINITY;
+                maxs[axis] = -INFINITY;
+                for (float x : {mins[a0], maxs[a0]}) {
+                    for (float y : {mins[a1], maxs[a1]}) {
+                        float c = (lock - n[a0] * x - n[a1] * y) / n[axis];
+                        mins[axis] = std::min(mins[axis], c);
+                        maxs[axis] = std::max(maxs[axis], c);
+                    }
+                }
+            }
+            spaces.emplace_back(mins, maxs);
+        }
+        if (spaces.empty())
+            continue;
+        sp.pos_spaces = BoxRegion{std::move(spaces)};
+        out.push_back(std::move(sp));
+    }
+    return out;
+}
+
+} // namespace mon
@@ -0,0 +1,480 @@
+#pragma once
+
+#include "game/source_math.hpp"
+#include "teleport_chain/generate.hpp"
+#include "mapped_file.hpp"
+#include "ctpl_stl.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <condition_variable>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MON_CORPUS_SSE2
+#include <emmintrin.h>
+#endif
+
+/*
+* Reads large text files of portal placements & player positions, e.g. console logs that people
+* shared, and re-checks them with the teleport chain. A corpus is made of statements (one per line
+* or separated by ';'), only two kinds of statements are used and everything else is skipped:
+*
+* ent_fire "blue" newlocation "x y z pitch yaw roll"   (same as Portal::NewLocationCmd)
+* setpos x y z                                         (same as Entity::SetPosCmd)
+*
+* Every setpos after both portals have been placed is a record. The portals are the latest blue &
+* orange newlocations before it, and the portal that was placed last decides the placement order
+* (the same order as PortalPair::NewLocationCmd prints them in).
+*
+* The file is memory mapped and split into chunks at line boundaries which are parsed in parallel
+* with std::from_chars. Portal::FromString is too slow for millions of lines since it tries
+* from_chars at every character. Records depend on placements from earlier chunks, so the chunks
+* only gather the parsed numbers and a short sequential pass links them up before the portals are
+* constructed (in parallel again). Consecutive records with the same portals share a pair.
+*/
+
+namespace mon {
+
+// the first '\n' in [p, end) or end
+inline const char* FindNewline(const char* p, const char* end)
+{
+#ifdef MON_CORPUS_SSE2
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), nl));
+        if (mask)
+            return p + std::countr_zero((unsigned)mask);
+    }
+    for (; p < end; p++)
+        if (*p == '\n')
+            return p;
+    return end;
+#else
+    const void* nl = memchr(p, '\n', end - p);
+    return nl ? (const char*)nl : end;
+#endif
+}
+
+struct CorpusParams {
+    GameVersion gv = GV_5135;
+    // setpos doesn't say if the player is crouched, the searches generate crouched players
+    bool crouched = true;
+    // the targetnames in the newlocation statements, case sensitive
+    std::string blue_name = "blue";
+    std::string orange_name = "orange";
+    int n_threads = 0;
+    // chunks are at least this big, small files are parsed on one thread
+    size_t min_chunk_size = 1 << 20;
+};
+
+struct CorpusStats {
+    uint64_t n_lines = 0;
+    uint64_t n_newlocations = 0;
+    uint64_t n_setpos = 0;
+    // setpos/newlocation statements without enough numbers
+    uint64_t n_malformed = 0;
+    // newlocation statements for something other than blue or orange
+    uint64_t n_other_ents = 0;
+    // setpos statements from before both portals were placed
+    uint64_t n_orphans = 0;
+};
+
+class CommandCorpus {
+    enum TokenType : uint8_t {
+        TT_BLUE,
+        TT_ORANGE,
+        TT_SETPOS,
+    };
+
+    struct Token {
+        float v[6];
+        TokenType type;
+        // 0-based line within the chunk
+        uint32_t line;
+    };
+
+    struct Chunk {
+        const char* begin;
+        const char* end;
+        std::vector<Token> tokens;
+        uint64_t n_lines = 0;
+        CorpusStats stats;
+    };
+
+    struct PendingPair {
+        float blue[6];
+        float orange[6];
+        PlacementOrder order;
+    };
+
+    std::vector<PortalPair> pairs;
+    std::vector<Entity> ents;
+    std::vector<uint32_t> ent_pairs;
+    std::vector<uint64_t> ent_lines;
+    CorpusStats stats;
+    std::string err;
+
+    // parses n floats with any delimiters in between, stops at end
+    static bool ParseFloats(const char*& p, const char* end, float* out, int n)
+    {
+        for (int i = 0; i < n; i++) {
+            while (p < end && !(*p >= '0' && *p <= '9') && *p != '-' && *p != '.')
+                ++p;
+            auto [ptr, ec] = std::from_chars(p, end, out[i]);
+            if (ec != std::errc{})
+                return false;
+            p = ptr;
+        }
+        return true;
+    }
+
+    static std::string_view Trim(std::string_view sv)
+    {
+        constexpr std::string_view junk = " \t\r\"\\";
+        size_t first = sv.find_first_not_of(junk);
+        if (first == std::string_view::npos)
+            return {};
+        return sv.substr(first, sv.find_last_not_of(junk) - first + 1);
+    }
+
+    static void ParseStatement(std::string_view st, uint32_t line, const CorpusParams& params, Chunk& chunk)
+    {
+        Token tok;
+        tok.line = line;
+        const char* end = st.data() + st.size();
+        size_t kw = st.find("setpos");
+        if (kw != std::string_view::npos) {
+            chunk.stats.n_setpos++;
+            const char* p = st.data() + kw + 6;
+            if (!ParseFloats(p, end, tok.v, 3)) {
+                chunk.stats.n_malformed++;
+                return;
+            }
+            tok.type = TT_SETPOS;
+            chunk.tokens.push_back(tok);
+            return;
+        }
+        kw = st.find("newlocation");
+        if (kw == std::string_view::npos)
+            return;
+        chunk.stats.n_newlocations++;
+        std::string_view name = st.substr(0, kw);
+        size_t ent_fire = name.find("ent_fire");
+        if (ent_fire != std::string_view::npos)
+            name.remove_prefix(ent_fire + 8);
+        name = Trim(name);
+        if (name == params.blue_name) {
+            tok.type = TT_BLUE;
+        } else if (name == params.orange_name) {
+            tok.type = TT_ORANGE;
+        } else {
+            chunk.stats.n_other_ents++;
+            return;
+        }
+        const char* p = st.data() + kw + 11;
+        if (!ParseFloats(p, end, tok.v, 6)) {
+            chunk.stats.n_malformed++;
+            return;
+        }
+        chunk.tokens.push_back(tok);
+    }
+
+    static void ParseChunk(Chunk& chunk, const CorpusParams& params)
+    {
+        uint32_t line = 0;
+        for (const char* p = chunk.begin; p < chunk.end; line++) {
+            const char* eol = FindNewline(p, chunk.end);
+            std::string_view sv{p, (size_t)(eol - p)};
+            for (size_t st_end; !sv.empty(); sv.remove_prefix(std::min(st_end + 1, sv.size()))) {
+                st_end = std::min(sv.find(';'), sv.size());
+                ParseStatement(sv.substr(0, st_end), line, params, chunk);
+            }
+            p = eol + 1;
+        }
+        chunk.n_lines = line;
+    }
+
+    static int NumThreads(int n_threads)
+    {
+        return n_threads > 0 ? n_threads : std::max(1, (int)std::thread::hardware_concurrency());
+    }
+
+public:
+    CommandCorpus() = default;
+
+    const std::string& Error() const
+    {
+        return err;
+    }
+
+    // every pair that's used by a record
+    const std::vector<PortalPair>& Pairs() const
+    {
+        return pairs;
+    }
+
+    // the player of each record
+    const std::vector<Entity>& Ents() const
+    {
+        return ents;
+    }
+
+    size_t NumRecords() const
+    {
+        return ents.size();
+    }
+
+    const PortalPair& PairOf(size_t record) const
+    {
+        return pairs[ent_pairs[record]];
+    }
+
+    // the 1-based line number of the record's setpos
+    uint64_t LineOf(size_t record) const
+    {
+        return ent_lines[record];
+    }
+
+    const CorpusStats& Stats() const
+    {
+        return stats;
+    }
+
+    // never fails, statements that can't be parsed are counted in Stats()
+    void Parse(std::string_view text, const CorpusParams& params = {})
+    {
+        pairs.clear();
+        ents.clear();
+        ent_pairs.clear();
+        ent_lines.clear();
+        stats = {};
+
+        const int n_threads = NumThreads(params.n_threads);
+        size_t n_chunks = std::clamp(text.size() / std::max(params.min_chunk_size, (size_t)1), (size_t)1,
+                                     (size_t)n_threads * 4);
+        std::vector<Chunk> chunks;
+        const char* end = text.data() + text.size();
+        for (const char* p = text.data(); p < end;) {
+            size_t left = n_chunks - chunks.size();
+            const char* chunk_end = left <= 1 ? end : FindNewline(p + (end - p) / left, end);
+            chunk_end = chunk_end == end ? end : chunk_end + 1;
+            chunks.push_back({.begin = p, .end = chunk_end});
+            p = chunk_end;
+        }
+
+        if (chunks.size() > 1) {
+            ctpl::thread_pool pool{std::min(n_threads, (int)chunks.size())};
+            for (Chunk& chunk : chunks)
+                pool.push([&](int) -> void { ParseChunk(chunk, params); });
+            pool.stop(true);
+        } else if (!chunks.empty()) {
+            ParseChunk(chunks[0], params);
+        }
+
+        // link the records to the latest placements, this has to go through the chunks in order
+        std::vector<PendingPair> pending;
+        std::optional<Token> blue, orange;
+        bool orange_last = false, new_pair = true;
+        uint64_t line_base = 1;
+        for (const Chunk& chunk : chunks) {
+            for (const Token& tok : chunk.tokens) {
+                switch (tok.type) {
+                    case TT_BLUE:
+                    case TT_ORANGE:
+                        (tok.type == TT_BLUE ? blue : orange) = tok;
+                        orange_last = tok.type == TT_ORANGE;
+                        new_pair = true;
+                        break;
+                    case TT_SETPOS:
+                        if (!blue || !orange) {
+                            stats.n_orphans++;
+                            break;
+                        }
+                        if (new_pair) {
+                            PendingPair& pp = pending.emplace_back();
+                            memcpy(pp.blue, blue->v, sizeof pp.blue);
+                            memcpy(pp.orange, orange->v, sizeof pp.orange);
+                            pp.order = orange_last ? PlacementOrder::_ORANGE_UPTM : PlacementOrder::_BLUE_UPTM;
+                            new_pair = false;
+                        }
+                        ents.push_back(Entity::CreatePlayerFromOrigin({tok.v[0], tok.v[1], tok.v[2]}, params.crouched));
+                        ent_pairs.push_back((uint32_t)pending.size() - 1);
+                        ent_lines.push_back(line_base + tok.line);
+                        break;
+                }
+            }
+            line_base += chunk.n_lines;
+            stats.n_lines += chunk.n_lines;
+            stats.n_newlocations += chunk.stats.n_newlocations;
+            stats.n_setpos += chunk.stats.n_setpos;
+            stats.n_malformed += chunk.stats.n_malformed;
+            stats.n_other_ents += chunk.stats.n_other_ents;
+        }
+
+        // constructing the portals is most of the work for a corpus of unique placements
+        auto build = [&params, &pending](size_t first, size_t last) {
+            std::vector<PortalPair> out;
+            out.reserve(last - first);
+            for (size_t i = first; i < last; i++) {
+                const PendingPair& pp = pending[i];
+                out.emplace_back(Vector{pp.blue[0], pp.blue[1], pp.blue[2]},
+                                 QAngle{pp.blue[3], pp.blue[4], pp.blue[5]},
+                                 Vector{pp.orange[0], pp.orange[1], pp.orange[2]},
+                                 QAngle{pp.orange[3], pp.orange[4], pp.orange[5]},
+                                 pp.order,
+                                 params.gv);
+            }
+            return out;
+        };
+        const size_t n_ranges = std::min((size_t)n_threads * 4, pending.size() / 1024 + 1);
+        if (n_ranges > 1) {
+            std::vector<std::vector<PortalPair>> ranges(n_ranges);
+            ctpl::thread_pool pool{std::min(n_threads, (int)n_ranges)};
+            for (size_t r = 0; r < n_ranges; r++)
+                pool.push([&, r](int) -> void {
+                    MonocleFloatingPointScope scope{};
+                    ranges[r] = build(pending.size() * r / n_ranges, pending.size() * (r + 1) / n_ranges);
+                });
+            pool.stop(true);
+            pairs.reserve(pending.size());
+            for (auto& range : ranges)
+                pairs.insert(pairs.end(), range.begin(), range.end());
+        } else {
+            pairs = build(0, pending.size());
+        }
+    }
+
+    bool Load(const std::filesystem::path& path, const CorpusParams& params = {})
+    {
+        MappedFile file;
+        if (!file.Open(path)) {
+            err = "could not open " + path.string();
+            return false;
+        }
+        Parse(std::string_view{(const char*)file.Data(), file.Size()}, params);
+        return true;
+    }
+};
+
+struct CorpusVerifyParams {
+    size_t n_max_teleports = 10;
+    // the portal the player starts at, if not set it's the closest one (the TeleportChainParams default)
+    std::optional<bool> tp_from_blue;
+    bool project_to_first_portal_plane = true;
+    bool map_origin_empty = false;
+    int n_threads = 0;
+    // records are handed out to the threads in blocks of this many
+    size_t block_size = 4096;
+    // finished blocks that are waiting for an earlier one, the threads wait once there's this many
+    size_t max_blocks_ahead = 64;
+};
+
+struct CorpusVerdict {
+    uint64_t line;
+    bool tp_from_blue;
+    bool max_tps_exceeded;
+    int cum_teleports;
+    uint32_t total_n_teleports;
+    Vector final_center;
+
+    static constexpr const char* CSV_HEADER = "line,tp_from_blue,cum_teleports,total_teleports,max_tps_exceeded,x,y,z";
+
+    void WriteCsv(FILE* f) const
+    {
+        fprintf(f,
+                "%llu,%d,%d,%u,%d,%.9g,%.9g,%.9g\n",
+                (unsigned long long)line,
+                tp_from_blue,
+                cum_teleports,
+                total_n_teleports,
+                max_tps_exceeded,
+                final_center.x,
+                final_center.y,
+                final_center.z);
+    }
+};
+
+/*
+* Runs the chain of every record in the corpus and calls emit(const CorpusVerdict&) for each one in
+* input order. The records are verified in blocks on several threads, whichever thread finishes the
+* oldest block emits it (and any blocks after it that are already done), so emit is never called
+* concurrently and the results don't have to be held until the end.
+*/
+template <typename F>
+void VerifyCorpus(const CommandCorpus& corpus, const CorpusVerifyParams& vp, F&& emit)
+{
+    const size_t n_records = corpus.NumRecords();
+    const size_t block_size = std::max(vp.block_size, (size_t)1);
+    const size_t n_blocks = (n_records + block_size - 1) / block_size;
+    const size_t max_ahead = std::max(vp.max_blocks_ahead, (size_t)1);
+    int n_threads = vp.n_threads > 0 ? vp.n_threads : std::max(1, (int)std::thread::hardware_concurrency());
+    n_threads = (int)std::min((size_t)n_threads, std::max(n_blocks, (size_t)1));
+
+    std::atomic_size_t next_block{0};
+    std::mutex mtx;
+    std::condition_variable cv;
+    size_t next_emit = 0;
+    std::map<size_t, std::vector<CorpusVerdict>> done;
+
+    ctpl::thread_pool pool{n_threads};
+    for (int t = 0; t < n_threads; t++) {
+        pool.push([&](int) -> void {
+            MonocleFloatingPointScope scope{};
+            TeleportChainResult result;
+
+            for (size_t b; (b = next_block.fetch_add(1, std::memory_order_relaxed)) < n_blocks;) {
+                {
+                    std::unique_lock lock{mtx};
+                    cv.wait(lock, [&] { return b < next_emit + max_ahead; });
+                }
+                std::vector<CorpusVerdict> verdicts;
+                verdicts.reserve(block_size);
+                for (size_t i = b * block_size; i < std::min((b + 1) * block_size, n_records); i++) {
+                    TeleportChainParams params{&corpus.PairOf(i), corpus.Ents()[i]};
+                    if (vp.tp_from_blue)
+                        params.first_tp_from_blue = *vp.tp_from_blue;
+                    params.project_to_first_portal_plane = vp.project_to_first_portal_plane;
+                    params.map_origin_empty = vp.map_origin_empty;
+                    params.n_max_teleports = vp.n_max_teleports;
+                    params.record_flags = TCRF_NONE;
+                    GenerateTeleportChain(params, result);
+                    verdicts.push_back({
+                        .line = corpus.LineOf(i),
+                        .tp_from_blue = params.first_tp_from_blue,
+                        .max_tps_exceeded = result.max_tps_exceeded,
+                        .cum_teleports = result.cum_teleports,
+                        .total_n_teleports = (uint32_t)result.total_n_teleports,
+                        .final_center = result.ent.GetCenter(),
+                    });
+                }
+                std::lock_guard lock{mtx};
+                done.emplace(b, std::move(verdicts));
+                if (b != next_emit)
+                    continue;
+                for (auto it = done.begin(); it != done.end() && it->first == next_emit; it = done.erase(it)) {
+                    for (const CorpusVerdict& verdict : it->second)
+                        emit(verdict);
+                    next_emit++;
+                }
+                cv.notify_all();
+            }
+        });
+    }
+    pool.stop(true);
+    MON_ASSERT(done.empty());
+}
+
+} // namespace mon
@@ -0,0 +1,564 @@
+#pragma once
+
+#include "game/source_math.hpp"
+#include "teleport_chain/generate.hpp"
+#include "outcome_raster.hpp"
+#include "overlay.hpp"
+#include "search_job.hpp"
+#include "json.hpp"
+#include "ctpl_stl.h"
+
+#include <stdint.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <format>
+#include <functional>
+#include <istream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+* A long running process that answers small queries so that tools don't pay for process startup
+* and cold caches on every call. Requests & responses are JSON objects, one per line, like the SPT
+* IPC protocol. Every request has an integer id and a type, responses have the same id & type (or
+* the type "error" with an "error" message, or "cancelled"). Requests run asynchronously so
+* responses can come back in any order:
+*
+* {"id": 1, "type": "chain", "blue": {"pos": [x, y, z], "ang": [p, y, r]}, "orange": {...},
+*  "order": "ORANGE_OPEN_BLUE_NEW_LOCATION", "ent": {"origin": [x, y, z], "crouched": true}}
+*     -> {"id": 1, "type": "chain", "vag": true, "cum_teleports": -1, "total_teleports": 3, ...}
+*
+* {"id": 2, "type": "overlay", <same as chain>, "y_res": 100, "tga": "out.tga"}
+*     -> {"id": 2, "type": "overlay", "width": 55, "height": 100, "vags": 1234, "vag_fraction": 0.22}
+*
+* {"id": 3, "type": "search", "job": {<a search job, see search_job.hpp>}}
+*     -> {"id": 3, "type": "search", "results": [{"name": ..., "hits": [{"newlocation": ..., ...}]}]}
+*
+* {"id": 4, "type": "cancel", "target": 3}   -> {"id": 4, "type": "ack"}, then {"id": 3, "type": "cancelled"}
+*                                               (an error if 3 already got its response)
+* {"id": 5, "type": "stats"}                 -> cache & request counters
+* {"type": "quit"}                           -> stops reading, requests in flight still finish
+*
+* The entity is given by its player "origin" (like setpos) or "center", or a "ball" center with a
+* "radius". Chains & overlays also take "game_version", "tp_from_blue" (the closest portal by
+* default), "max_teleports", "project" (project_to_first_portal_plane), and "map_origin_empty".
+*
+* Portals and portal pairs are kept in LRU caches since tools tend to ask about the same few pairs
+* over and over. Overlay rows and searches run on a pool that lives as long as the daemon. Searches
+* are run in slices of iterations so that they can be cancelled between slices.
+*/
+
+namespace mon {
+
+struct DaemonParams {
+    // threads for overlay rows & each search, 0 uses all cores
+    int n_threads = 0;
+    // how many requests are handled at the same time, the rest wait in a queue
+    int n_concurrent_requests = 4;
+    size_t portal_cache_size = 4096;
+    size_t pair_cache_size = 4096;
+    // searches check for cancellation after this many iterations (rounded to the job's shard alignment)
+    int search_slice = 1 << 18;
+};
+
+template <size_t N>
+struct U32ArrayHash {
+    size_t operator()(const std::array<uint32_t, N>& a) const
+    {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (uint32_t v : a)
+            h = (h ^ v) * 0x100000001b3ull;
+        return (size_t)h;
+    }
+};
+
+// a thread safe LRU cache, values are shared so that evicting them doesn't affect whoever is still using them
+template <typename K, typename V, typename Hash>
+class LruCache {
+    using Entry = std::pair<K, std::shared_ptr<const V>>;
+
+    size_t capacity;
+    // most recently used first
+    std::list<Entry> entries;
+    std::unordered_map<K, typename std::list<Entry>::iterator, Hash> index;
+    mutable std::mutex mtx;
+    uint64_t n_hits = 0, n_misses = 0;
+
+public:
+    explicit LruCache(size_t capacity) : capacity{std::max(capacity, (size_t)1)} {}
+
+    // returns the cached value or caches make(), make is called without holding the lock
+    template <typename Make>
+    std::shared_ptr<const V> Get(const K& key, Make&& make)
+    {
+        {
+            std::lock_guard lock{mtx};
+            auto it = index.find(key);
+            if (it != index.end()) {
+                n_hits++;
+                entries.splice(entries.begin(), entries, it->second);
+                return it->second->second;
+            }
+            n_misses++;
+        }
+        auto value = std::make_shared<const V>(make());
+        std::lock_guard lock{mtx};
+        // another thread may have made the same value in the meantime
+        if (auto it = index.find(key); it != index.end())
+            return it->second->second;
+        entries.emplace_front(key, value);
+        index.emplace(key, entries.begin());
+        if (entries.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        return value;
+    }
+
+    std::string StatsJson() const
+    {
+        std::lock_guard lock{mtx};
+        return std::format("{{\"size\":{},\"hits\":{},\"misses\":{}}}", entries.size(), n_hits, n_misses);
+    }
+};
+
+class QueryDaemon {
+    // the bits of pos & ang and the game version
+    using PortalKey = std::array<uint32_t, 7>;
+    // both portals and the placement order
+    using PairKey = std::array<uint32_t, 15>;
+
+    DaemonParams dp;
+    std::function<void(std::string_view)> write;
+    std::mutex write_mtx;
+
+    LruCache<PortalKey, Portal, U32ArrayHash<7>> portal_cache;
+    LruCache<PairKey, PortalPair, U32ArrayHash<15>> pair_cache;
+
+    // maps are only loaded once
+    SearchJobReader job_reader;
+    std::mutex job_reader_mtx;
+
+    std::mutex mtx;
+    std::condition_variable idle_cv;
+    // the cancellation flags of the requests in flight
+    std::map<int64_t, std::shared_ptr<std::atomic_bool>> in_flight;
+    uint64_t n_handled = 0;
+
+    // declared last so that the pools are stopped before anything they use is destroyed
+    ctpl::thread_pool compute_pool;
+    ctpl::thread_pool request_pool;
+
+    static int NumThreads(int n)
+    {
+        return n > 0 ? n : std::max(1, (int)std::thread::hardware_concurrency());
+    }
+
+    void Reply(std::string_view line)
+    {
+        std::lock_guard lock{write_mtx};
+        write(line);
+    }
+
+    void ReplyError(std::optional<int64_t> id, std::string_view msg)
+    {
+        Reply(std::format("{{\"id\":{},\"type\":\"error\",\"error\":{}}}",
+                          id ? std::to_string(*id) : "null",
+                          JsonQuote(msg)));
+    }
+
+    static bool ReadVec3(const JsonValue* v, float* out)
+    {
+        if (!v || v->Items().size() != 3)
+            return false;
+        for (int i = 0; i < 3; i++) {
+            auto f = v->Items()[i].AsNumber<float>();
+            if (!f)
+                return false;
+            out[i] = *f;
+        }
+        return true;
+    }
+
+    static bool ReadGameVersion(const JsonValue& req, GameVersion& gv, std::string& err)
+    {
+        gv = GV_5135;
+        const JsonValue* v = req.Find("game_version");
+        if (!v)
+            return true;
+        if (v->AsString() == "5135")
+            return true;
+        if (v->AsString() == "9862575") {
+            gv = GV_9862575;
+            return true;
+        }
+        err = "game_version must be 5135 or 9862575";
+        return false;
+    }
+
+    std::shared_ptr<const Portal> GetPortal(const Vector& pos, const QAngle& ang, GameVersion gv)
+    {
+        PortalKey key;
+        memcpy(key.data(), &pos, sizeof pos);
+        memcpy(key.data() + 3, &ang, sizeof ang);
+        key[6] = gv;
+        return portal_cache.Get(key, [&] { return Portal{pos, ang, gv}; });
+    }
+
+    std::shared_ptr<const PortalPair> ReadPair(const JsonValue& req, std::string& err)
+    {
+        GameVersion gv;
+        if (!ReadGameVersion(req, gv, err))
+            return nullptr;
+        std::shared_ptr<const Portal> portals[2];
+        for (int i = 0; i < 2; i++) {
+            const char* name = i ? "orange" : "blue";
+            const JsonValue* p = req.Find(name);
+            Vector pos;
+            QAngle ang;
+            if (!p || !ReadVec3(p->Find("pos"), &pos.x) || !ReadVec3(p->Find("ang"), &ang.x)) {
+                err = std::format("{} needs a pos & ang", name);
+                return nullptr;
+            }
+            portals[i] = GetPortal(pos, ang, gv);
+        }
+        const JsonValue* order_v = req.Find("order");
+        auto order = PlacementOrderFromName(order_v ? order_v->AsString().value_or("") : "");
+        if (!order) {
+            err = "unknown placement order";
+            return nullptr;
+        }
+        PairKey key;
+        for (int i = 0; i < 2; i++) {
+            memcpy(key.data() + i * 7, &portals[i]->pos, sizeof(Vector));
+            memcpy(key.data() + i * 7 + 3, &portals[i]->ang, sizeof(QAngle));
+            key[i * 7 + 6] = gv;
+        }
+        key[14] = (uint32_t)*order;
+        return pair_cache.Get(key, [&] { return PortalPair{*portals[0], *portals[1], *order}; });
+    }
+
+    static bool ReadEnt(const JsonValue& req, Entity& ent, std::string& err)
+    {
+        const JsonValue* e = req.Find("ent");
+        Vector v;
+        bool crouched = true;
+        if (e)
+            if (const JsonValue* c = e->Find("crouched"); c && c->AsBool())
+                crouched = *c->AsBool();
+        if (!e) {
+            err = "missing ent";
+        } else if (ReadVec3(e->Find("origin"), &v.x)) {
+            ent = Entity::CreatePlayerFromOrigin(v, crouched);
+            return true;
+        } else if (ReadVec3(e->Find("center"), &v.x)) {
+            ent = Entity::CreatePlayerFromCenter(v, crouched);
+            return true;
+        } else if (ReadVec3(e->Find("ball"), &v.x)) {
+            auto radius = e->Find("radius") ? e->Find("radius")->AsNumber<float>() : std::nullopt;
+            if (radius) {
+                ent = Entity::CreateBall(v, *radius);
+                return true;
+            }
+            err = "a ball needs a radius";
+        } else {
+            err = "ent needs an origin, center, or ball";
+        }
+        return false;
+    }
+
+    // the pair is returned so that it stays alive while the params point to it
+    std::shared_ptr<const PortalPair> ReadChainParams(const JsonValue& req,
+                                                      TeleportChainParams& params,
+                                                      std::string& err)
+    {
+        auto pp = ReadPair(req, err);
+        Entity ent;
+        if (!pp || !ReadEnt(req, ent, err))
+            return nullptr;
+        params = TeleportChainParams{pp.get(), ent};
+        params.record_flags = TCRF_NONE;
+        auto read_bool = [&req](const char* key, bool& out) {
+            if (const JsonValue* v = req.Find(key); v && v->AsBool())
+                out = *v->AsBool();
+        };
+        read_bool("tp_from_blue", params.first_tp_from_blue);
+        read_bool("project", params.project_to_first_portal_plane);
+        read_bool("map_origin_empty", params.map_origin_empty);
+        if (const JsonValue* v = req.Find("max_teleports"); v && v->AsNumber<uint32_t>())
+            params.n_max_teleports = *v->AsNumber<uint32_t>();
+        return pp;
+    }
+
+    bool HandleChain(const JsonValue& req, std::string& body, std::string& err)
+    {
+        TeleportChainParams params;
+        auto pp = ReadChainParams(req, params, err);
+        if (!pp)
+            return false;
+        TeleportChainResult result;
+        GenerateTeleportChain(params, result);
+        Vector c = result.ent.GetCenter();
+        body = std::format("\"vag\":{},\"cum_teleports\":{},\"total_teleports\":{},\"max_tps_exceeded\":{},"
+                           "\"tp_from_blue\":{},\"center\":[{:.9g},{:.9g},{:.9g}]",
+                           ChainOutcome::FromResult(result).IsVag(),
+                           result.cum_teleports,
+                           result.total_n_teleports,
+                           result.max_tps_exceeded,
+                           params.first_tp_from_blue,
+                           c.x,
+                           c.y,
+                           c.z);
+        return true;
+    }
+
+    bool HandleOverlay(const JsonValue& req, const std::atomic_bool& cancel, std::string& body, std::string& err)
+    {
+        TeleportChainParams params;
+        auto pp = ReadChainParams(req, params, err);
+        if (!pp)
+            return false;
+        uint32_t y_res = 100;
+        if (const JsonValue* v = req.Find("y_res")) {
+            auto n = v->AsNumber<uint32_t>();
+            if (!n || *n < 2 || *n > 4096) {
+                err = "y_res must be between 2 and 4096";
+                return false;
+            }
+            y_res = *n;
+        }
+        bool nudge = false;
+        if (const JsonValue* v = req.Find("nudge"); v && v->AsBool())
+            nudge = *v->AsBool();
+        OutcomeRaster raster = RenderOverlayOutcomes(params, y_res, nudge, ORC_NONE, &compute_pool, &cancel);
+        if (cancel)
+            return false;
+        size_t n_vags = 0;
+        for (size_t i = 0; i < raster.Size(); i++)
+            n_vags += raster.Outcomes()[i].IsVag();
+        if (const JsonValue* tga = req.Find("tga"); tga && tga->AsString())
+            raster.WriteTga(std::string{*tga->AsString()}.c_str(), OutcomePalette::Default());
+        body = std::format("\"width\":{},\"height\":{},\"vags\":{},\"vag_fraction\":{:.6f}",
+                           raster.Width(),
+                           raster.Height(),
+                           n_vags,
+                           (double)n_vags / raster.Size());
+        return true;
+    }
+
+    static std::string HitJson(const SearchResult& hit)
+    {
+        Vector c = hit.ent.GetCenter();
+        return std::format("{{\"iteration\":{},\"order\":\"{}\",\"newlocation\":{},{}"
+                           "\"center\":[{:.9g},{:.9g},{:.9g}]}}",
+                           hit.n_iterations,
+                           PlacementOrderStrs[(int)hit.pp.order],
+                           JsonQuote(hit.pp.NewLocationCmd("; ")),
+                           hit.ent.is_player ? std::format("\"setpos\":{},", JsonQuote(hit.ent.SetPosCmd())) : "",
+                           c.x,
+                           c.y,
+                           c.z);
+    }
+
+    bool HandleSearch(const JsonValue& req, const std::atomic_bool& cancel, std::string& body, std::string& err)
+    {
+        const JsonValue* job_v = req.Find("job");
+        if (!job_v) {
+            err = "missing job";
+            return false;
+        }
+        std::optional<std::vector<SearchJob>> jobs;
+        {
+            std::lock_guard lock{job_reader_mtx};
+            jobs = job_reader.Read(*job_v);
+            if (!jobs)
+                err = job_reader.Error();
+        }
+        if (!jobs)
+            return false;
+        body = "\"results\":[";
+        for (const SearchJob& job : *jobs) {
+            auto start = std::chrono::steady_clock::now();
+            const int64_t total = job.NumIterations();
+            const int align = job.ShardAlignment();
+            const int slice = std::max(align, dp.search_slice / align * align);
+            SearchStats stats;
+            std::optional<SearchResult> found;
+            VagHitTopK top_k{job.collect};
+            int64_t done = 0;
+            for (; done < total && !found; done += slice) {
+                if (cancel)
+                    return false;
+                int count = (int)std::min<int64_t>(slice, total - done);
+                SearchJobResult res = RunSearchJobRange(job, (int)done, count, compute_pool);
+                stats += res.stats;
+                found = std::move(res.found);
+                for (RankedVagHit& hit : res.hits)
+                    top_k.Push(std::move(hit));
+            }
+            std::string hits;
+            if (found)
+                hits = HitJson(*found);
+            for (const RankedVagHit& hit : top_k.TakeSorted())
+                hits += (hits.empty() ? "" : ",") + HitJson(hit.hit);
+            body += std::format("{}{{\"name\":{},\"iterations\":{},\"chains\":{},\"seconds\":{:.3f},"
+                                "\"hits\":[{}]}}",
+                                &job == &jobs->front() ? "" : ",",
+                                JsonQuote(job.name),
+                                std::min(done, total),
+                                stats.n_chains,
+                                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+                                hits);
+        }
+        body += ']';
+        return true;
+    }
+
+    void Handle(const JsonValue& req, int64_t id, std::string type, std::shared_ptr<std::atomic_bool> cancel)
+    {
+        MonocleFloatingPointScope scope{};
+        std::string body, err;
+        bool ok = false;
+        if (type == "chain")
+            ok = HandleChain(req, body, err);
+        else if (type == "overlay")
+            ok = HandleOverlay(req, *cancel, body, err);
+        else
+            ok = HandleSearch(req, *cancel, body, err);
+
+        /*
+        * Reply under the lock that cancel requests take, so that a cancel either gets its ack before
+        * this checks the flag (and the reply is "cancelled") or finds the request gone.
+        */
+        std::lock_guard lock{mtx};
+        in_flight.erase(id);
+        if (*cancel)
+            Reply(std::format("{{\"id\":{},\"type\":\"cancelled\"}}", id));
+        else if (!ok)
+            ReplyError(id, err);
+        else
+            Reply(std::format("{{\"id\":{},\"type\":\"{}\",{}}}", id, type, body));
+        n_handled++;
+        idle_cv.notify_all();
+    }
+
+public:
+    // write is called with one response at a time (without the newline), possibly from different threads
+    QueryDaemon(const DaemonParams& dp, std::function<void(std::string_view)> write)
+        : dp{dp},
+          write{std::move(write)},
+          portal_cache{dp.portal_cache_size},
+          pair_cache{dp.pair_cache_size},
+          compute_pool{NumThreads(dp.n_threads)},
+          request_pool{std::max(dp.n_concurrent_requests, 1)}
+    {}
+
+    ~QueryDaemon()
+    {
+        Wait();
+    }
+
+    // handles one request line, returns false if it asked the daemon to quit
+    bool Submit(std::string_view line)
+    {
+        std::string err;
+        auto req = JsonParser::Parse(line, &err);
+        if (!req || !req->IsObject()) {
+            ReplyError({}, req ? "expected an object" : err);
+            return true;
+        }
+        const JsonValue* id_v = req->Find("id");
+        std::optional<int64_t> id = id_v ? id_v->AsNumber<int64_t>() : std::nullopt;
+        const JsonValue* type_v = req->Find("type");
+        std::string type{type_v ? type_v->AsString().value_or("") : ""};
+
+        if (type == "quit")
+            return false;
+        if (!id) {
+            ReplyError({}, "expected an integer id");
+            return true;
+        }
+        if (type == "cancel") {
+            const JsonValue* target_v = req->Find("target");
+            auto target = target_v ? target_v->AsNumber<int64_t>() : std::nullopt;
+            std::lock_guard lock{mtx};
+            auto it = target ? in_flight.find(*target) : in_flight.end();
+            if (it == in_flight.end()) {
+                ReplyError(id, "no such request");
+                return true;
+            }
+            *it->second = true;
+            Reply(std::format("{{\"id\":{},\"type\":\"ack\"}}", *id));
+            return true;
+        }
+        if (type == "stats") {
+            std::unique_lock lock{mtx};
+            size_t n_in_flight = in_flight.size();
+            uint64_t handled = n_handled;
+            lock.unlock();
+            Reply(std::format("{{\"id\":{},\"type\":\"stats\",\"in_flight\":{},\"handled\":{},"
+                              "\"portal_cache\":{},\"pair_cache\":{}}}",
+                              *id,
+                              n_in_flight,
+                              handled,
+                              portal_cache.StatsJson(),
+                              pair_cache.StatsJson()));
+            return true;
+        }
+        if (type != "chain" && type != "overlay" && type != "search") {
+            ReplyError(id, "unknown request type");
+            return true;
+        }
+        auto cancel = std::make_shared<std::atomic_bool>(false);
+        {
+            std::lock_guard lock{mtx};
+            if (!in_flight.emplace(*id, cancel).second) {
+                ReplyError(id, "a request with this id is still in flight");
+                return true;
+            }
+        }
+        request_pool.push([this, req = std::move(*req), id = *id, type = std::move(type), cancel](int) {
+            Handle(req, id, type, cancel);
+        });
+        return true;
+    }
+
+    // waits until every request that was submitted so far has been answered
+    void Wait()
+    {
+        std::unique_lock lock{mtx};
+        idle_cv.wait(lock, [this] { return in_flight.empty(); });
+    }
+};
+
+// reads requests from in until it ends or a quit request and writes the responses to out
+inline void RunDaemon(std::istream& in, std::ostream& out, const DaemonParams& dp = {})
+{
+    QueryDaemon daemon{dp, [&out](std::string_view line) {
+                           out << line << '\n';
+                           out.flush();
+                       }};
+    for (std::string line; std::getline(in, line);) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.find_first_not_of(" \t") == std::string::npos)
+            continue;
+        if (!daemon.Submit(line))
+            break;
+    }
+    daemon.Wait();
+}
+
+} // namespace mon
@@ -0,0 +1,371 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <charconv>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/*
+* A minimal JSON reader for config & job files. Numbers keep their source text so that they can be
+* parsed directly as floats, this matters for values like lock options that have to be exact. Not
+* meant to be fast and doesn't support \u escapes outside of ASCII. Output is written with
+* std::format, JsonQuote is there for strings that may need escaping.
+*/
+
+namespace mon {
+
+class JsonValue {
+public:
+    enum Type {
+        J_NULL,
+        J_BOOL,
+        J_NUMBER,
+        J_STRING,
+        J_ARRAY,
+        J_OBJECT,
+    };
+
+    using Array = std::vector<JsonValue>;
+    using Object = std::vector<std::pair<std::string, JsonValue>>;
+
+private:
+    Type type = J_NULL;
+    bool b = false;
+    // the number text or the string contents
+    std::string str;
+    Array arr;
+    Object obj;
+
+    friend class JsonParser;
+
+public:
+    Type GetType() const
+    {
+        return type;
+    }
+
+    bool IsNull() const
+    {
+        return type == J_NULL;
+    }
+
+    bool IsBool() const
+    {
+        return type == J_BOOL;
+    }
+
+    bool IsNumber() const
+    {
+        return type == J_NUMBER;
+    }
+
+    bool IsString() const
+    {
+        return type == J_STRING;
+    }
+
+    bool IsArray() const
+    {
+        return type == J_ARRAY;
+    }
+
+    bool IsObject() const
+    {
+        return type == J_OBJECT;
+    }
+
+    std::optional<bool> AsBool() const
+    {
+        if (type != J_BOOL)
+            return {};
+        return b;
+    }
+
+    template <typename T>
+    std::optional<T> AsNumber() const
+    {
+        if (type != J_NUMBER)
+            return {};
+        T v;
+        auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), v);
+        if (ec != std::errc{} || ptr != str.data() + str.size())
+            return {};
+        return v;
+    }
+
+    std::optional<std::string_view> AsString() const
+    {
+        if (type != J_STRING)
+            return {};
+        return std::string_view{str};
+    }
+
+    // empty if this isn't an array
+    const Array& Items() const
+    {
+        return arr;
+    }
+
+    // empty if this isn't an object
+    const Object& Members() const
+    {
+        return obj;
+    }
+
+    // the member with the given key, or nullptr if this isn't an object or there's no such member
+    const JsonValue* Find(std::string_view key) const
+    {
+        for (auto& [k, v] : obj)
+            if (k == key)
+                return &v;
+        return nullptr;
+    }
+};
+
+class JsonParser {
+    std::string_view src;
+    size_t pos = 0;
+    std::string error;
+    // nesting limit so that a malicious file can't overflow the stack
+    static constexpr int MAX_DEPTH = 64;
+
+    bool Fail(const char* msg)
+    {
+        if (error.empty())
+            error = std::string{msg} + " at offset " + std::to_string(pos);
+        return false;
+    }
+
+    void SkipWhitespace()
+    {
+        while (pos < src.size() && (src[pos] == ' ' || src[pos] == '\t' || src[pos] == '\n' || src[pos] == '\r'))
+            pos++;
+    }
+
+    bool Consume(std::string_view lit)
+    {
+        if (src.substr(pos, lit.size()) != lit)
+            return false;
+        pos += lit.size();
+        return true;
+    }
+
+    bool ParseString(std::string& out)
+    {
+        if (pos >= src.size() || src[pos] != '"')
+            return Fail("expected string");
+        pos++;
+        out.clear();
+        while (pos < src.size() && src[pos] != '"') {
+            char c = src[pos++];
+            if ((unsigned char)c < 0x20)
+                return Fail("control character in string");
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos >= src.size())
+                break;
+            switch (char e = src[pos++]) {
+                case '"':
+                case '\\':
+                case '/':
+                    out += e;
+                    break;
+                case 'b':
+                    out += '\b';
+                    break;
+                case 'f':
+                    out += '\f';
+                    break;
+                case 'n':
+                    out += '\n';
+                    break;
+                case 'r':
+                    out += '\r';
+                    break;
+                case 't':
+                    out += '\t';
+                    break;
+                case 'u': {
+                    uint32_t cp;
+                    const char* hex_end = src.data() + std::min(pos + 4, src.size());
+                    auto [ptr, ec] = std::from_chars(src.data() + pos, hex_end, cp, 16);
+                    if (ec != std::errc{} || ptr != src.data() + pos + 4)
+                        return Fail("bad \\u escape");
+                    if (cp >= 0x80)
+                        return Fail("non-ASCII \\u escapes are not supported");
+                    out += (char)cp;
+                    pos += 4;
+                    break;
+                }
+                default:
+                    return Fail("bad escape");
+            }
+        }
+        if (pos >= src.size())
+            return Fail("unterminated string");
+        pos++;
+        return true;
+    }
+
+    bool ParseNumber(JsonValue& v)
+    {
+        size_t start = pos;
+        if (pos < src.size() && src[pos] == '-')
+            pos++;
+        auto digits = [this] {
+            size_t n = 0;
+            for (; pos < src.size() && src[pos] >= '0' && src[pos] <= '9'; pos++)
+                n++;
+            return n;
+        };
+        if (!digits())
+            return Fail("expected digits");
+        if (pos < src.size() && src[pos] == '.') {
+            pos++;
+            if (!digits())
+                return Fail("expected digits after '.'");
+        }
+        if (pos < src.size() && (src[pos] == 'e' || src[pos] == 'E')) {
+            pos++;
+            if (pos < src.size() && (src[pos] == '+' || src[pos] == '-'))
+                pos++;
+            if (!digits())
+                return Fail("expected exponent digits");
+        }
+        v.type = JsonValue::J_NUMBER;
+        v.str = src.substr(start, pos - start);
+        return true;
+    }
+
+    bool ParseValue(JsonValue& v, int depth)
+    {
+        if (depth > MAX_DEPTH)
+            return Fail("nested too deeply");
+        SkipWhitespace();
+        if (pos >= src.size())
+            return Fail("unexpected end of input");
+        switch (src[pos]) {
+            case 'n':
+                if (!Consume("null"))
+                    return Fail("bad literal");
+                v.type = JsonValue::J_NULL;
+                return true;
+            case 't':
+            case 'f':
+                v.type = JsonValue::J_BOOL;
+                v.b = src[pos] == 't';
+                if (!Consume(v.b ? "true" : "false"))
+                    return Fail("bad literal");
+                return true;
+            case '"':
+                v.type = JsonValue::J_STRING;
+                return ParseString(v.str);
+            case '[':
+                pos++;
+                v.type = JsonValue::J_ARRAY;
+                SkipWhitespace();
+                if (pos < src.size() && src[pos] == ']') {
+                    pos++;
+                    return true;
+                }
+                for (;;) {
+                    if (!ParseValue(v.arr.emplace_back(), depth + 1))
+                        return false;
+                    SkipWhitespace();
+                    if (pos < src.size() && src[pos] == ',') {
+                        pos++;
+                        continue;
+                    }
+                    if (pos < src.size() && src[pos] == ']') {
+                        pos++;
+                        return true;
+                    }
+                    return Fail("expected ',' or ']'");
+                }
+            case '{':
+                pos++;
+                v.type = JsonValue::J_OBJECT;
+                SkipWhitespace();
+                if (pos < src.size() && src[pos] == '}') {
+                    pos++;
+                    return true;
+                }
+                for (;;) {
+                    SkipWhitespace();
+                    auto& [key, member] = v.obj.emplace_back();
+                    if (!ParseString(key))
+                        return false;
+                    SkipWhitespace();
+                    if (pos >= src.size() || src[pos] != ':')
+                        return Fail("expected ':'");
+                    pos++;
+                    if (!ParseValue(member, depth + 1))
+                        return false;
+                    SkipWhitespace();
+                    if (pos < src.size() && src[pos] == ',') {
+                        pos++;
+                        continue;
+                    }
+                    if (pos < src.size() && src[pos] == '}') {
+                        pos++;
+                        return true;
+                    }
+                    return Fail("expected ',' or '}'");
+                }
+            default:
+                return ParseNumber(v);
+        }
+    }
+
+public:
+    // on failure, err (if given) is set to a description of the problem
+    static std::optional<JsonValue> Parse(std::string_view src, std::string* err = nullptr)
+    {
+        JsonParser parser;
+        parser.src = src;
+        JsonValue v;
+        bool ok = parser.ParseValue(v, 0);
+        if (ok) {
+            parser.SkipWhitespace();
+            if (parser.pos != src.size())
+                ok = parser.Fail("trailing characters");
+        }
+        if (!ok) {
+            if (err)
+                *err = parser.error;
+            return {};
+        }
+        return v;
+    }
+};
+
+// a JSON string literal with the contents of sv, control characters are escaped as \u00XX
+inline std::string JsonQuote(std::string_view sv)
+{
+    std::string out;
+    out.reserve(sv.size() + 2);
+    out += '"';
+    for (char c : sv) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            constexpr char hex[] = "0123456789abcdef";
+            out += "\\u00";
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+    return out;
+}
+
+} // namespace mon
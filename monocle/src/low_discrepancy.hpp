@@ -0,0 +1,166 @@
+#pragma once
+
+#include "monocle_config.hpp"
+#include "prng.hpp"
+
+#include <stdint.h>
+#include <algorithm>
+#include <array>
+#include <utility>
+
+/*
+* Low discrepancy sequences, these cover the unit cube more evenly than independent random
+* samples. Every point is computed directly from its index so a sequence can be split into blocks
+* and generated in parallel. All samplers have Point(uint64_t index, float* out), which writes
+* MAX_DIMS values in [0, 1).
+*/
+
+namespace mon {
+
+// largest float less than 1, the conversions below can round up to 1 otherwise
+constexpr float LD_ONE_MINUS_EPS = 0x1.fffffep-1f;
+
+/*
+* Halton sequence using the first MAX_DIMS primes as bases. If scrambled, the digits in each
+* dimension are permuted by a random permutation (that keeps 0 fixed) derived from the seed, which
+* removes the correlation between dimensions with larger bases.
+*/
+class HaltonSampler {
+public:
+    static constexpr int MAX_DIMS = 16;
+
+private:
+    static constexpr std::array<uint32_t, MAX_DIMS> PRIMES{2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53};
+    // perms[d][digit] for base PRIMES[d]
+    std::array<std::array<uint8_t, 53>, MAX_DIMS> perms;
+
+public:
+    explicit HaltonSampler(bool scramble = false, uint32_t seed = 0)
+    {
+        small_prng rng{seed};
+        for (int d = 0; d < MAX_DIMS; d++) {
+            for (uint32_t i = 0; i < PRIMES[d]; i++)
+                perms[d][i] = (uint8_t)i;
+            if (!scramble)
+                continue;
+            // Fisher-Yates over the non-zero digits
+            for (uint32_t i = PRIMES[d] - 1; i > 1; i--)
+                std::swap(perms[d][i], perms[d][1 + rng.next_int(0, (int)i)]);
+        }
+    }
+
+    float RadicalInverse(uint64_t index, int dim) const
+    {
+        MON_ASSERT(dim >= 0 && dim < MAX_DIMS);
+        const uint32_t base = PRIMES[dim];
+        const double inv_base = 1.0 / base;
+        double inv = inv_base, result = 0;
+        for (; index; index /= base, inv *= inv_base)
+            result += perms[dim][index % base] * inv;
+        return std::min((float)result, LD_ONE_MINUS_EPS);
+    }
+
+    void Point(uint64_t index, float* out) const
+    {
+        for (int d = 0; d < MAX_DIMS; d++)
+            out[d] = RadicalInverse(index, d);
+    }
+};
+
+/*
+* Sobol sequence with the direction numbers from Joe & Kuo (new-joe-kuo-6.21201). If scrambled,
+* each dimension is XORed with a random value derived from the seed (a digital shift), which keeps
+* the sequence's stratification properties. Only the first 2^32 points are distinct.
+*/
+class SobolSampler {
+public:
+    static constexpr int MAX_DIMS = 12;
+
+private:
+    static constexpr int N_BITS = 32;
+
+    struct Primitive {
+        uint32_t s, a;
+        std::array<uint32_t, 5> m;
+    };
+
+    // dimensions 2 and up, dimension 1 is the van der Corput sequence
+    static constexpr std::array<Primitive, MAX_DIMS - 1> PRIMITIVES{{
+        {1, 0, {1}},
+        {2, 1, {1, 3}},
+        {3, 1, {1, 3, 1}},
+        {3, 2, {1, 1, 1}},
+        {4, 1, {1, 1, 3, 3}},
+        {4, 4, {1, 3, 5, 13}},
+        {5, 2, {1, 1, 5, 5, 17}},
+        {5, 4, {1, 1, 5, 5, 5}},
+        {5, 7, {1, 1, 7, 11, 19}},
+        {5, 11, {1, 1, 5, 1, 1}},
+        {5, 13, {1, 1, 1, 3, 11}},
+    }};
+
+    std::array<std::array<uint32_t, N_BITS>, MAX_DIMS> dirs;
+    std::array<uint32_t, MAX_DIMS> shifts{};
+
+public:
+    explicit SobolSampler(bool scramble = false, uint32_t seed = 0)
+    {
+        for (int k = 0; k < N_BITS; k++)
+            dirs[0][k] = 1u << (N_BITS - 1 - k);
+        for (int d = 1; d < MAX_DIMS; d++) {
+            const Primitive& prim = PRIMITIVES[d - 1];
+            auto& v = dirs[d];
+            for (uint32_t k = 0; k < prim.s; k++)
+                v[k] = prim.m[k] << (N_BITS - 1 - k);
+            for (uint32_t k = prim.s; k < N_BITS; k++) {
+                v[k] = v[k - prim.s] ^ (v[k - prim.s] >> prim.s);
+                for (uint32_t j = 1; j < prim.s; j++)
+                    v[k] ^= ((prim.a >> (prim.s - 1 - j)) & 1) * v[k - j];
+            }
+        }
+        if (scramble) {
+            small_prng rng{seed};
+            for (uint32_t& shift : shifts)
+                shift = rng();
+        }
+    }
+
+    uint32_t PointBits(uint64_t index, int dim) const
+    {
+        MON_ASSERT(dim >= 0 && dim < MAX_DIMS);
+        uint32_t x = shifts[dim];
+        for (int k = 0; index && k < N_BITS; k++, index >>= 1)
+            if (index & 1)
+                x ^= dirs[dim][k];
+        return x;
+    }
+
+    void Point(uint64_t index, float* out) const
+    {
+        for (int d = 0; d < MAX_DIMS; d++)
+            out[d] = std::min((float)(PointBits(index, d) * 0x1p-32), LD_ONE_MINUS_EPS);
+    }
+};
+
+/*
+* Not low discrepancy, but has the same interface as the samplers above so that plain random
+* samples can be used in the same places. Each point is generated from its own counter-based
+* stream of the seed (see xoshiro_prng::stream).
+*/
+class PrngSampler {
+    uint32_t seed;
+
+public:
+    static constexpr int MAX_DIMS = 16;
+
+    explicit PrngSampler(uint32_t seed = 0) : seed{seed} {}
+
+    void Point(uint64_t index, float* out) const
+    {
+        xoshiro_prng rng = xoshiro_prng::stream(seed, index);
+        for (int d = 0; d < MAX_DIMS; d++)
+            out[d] = std::min(rng.next_float01(), LD_ONE_MINUS_EPS);
+    }
+};
+
+} // namespace mon
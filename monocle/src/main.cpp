@@ -1,15 +1,24 @@
 #include "game/source_math.hpp"
 #include "teleport_chain/generate.hpp"
 #include "prng.hpp"
-#include "tga.hpp"
-#include "ctpl_stl.h"
 #include "vag_search.hpp"
+#include "overlay.hpp"
+#include "overlay_contour.hpp"
+#include "overlay_volume.hpp"
+#include "search_job.hpp"
+#include "shard_queue.hpp"
+#include "survey.hpp"
+#include "command_corpus.hpp"
+#include "daemon.hpp"
+#include "spt_ipc.hpp"
 
 #include <iostream>
 #include <algorithm>
 #include <ranges>
 #include <numeric>
 #include <fstream>
+#include <sstream>
+#include <string_view>
 #include <vector>
 
 enum PITCH_YAW_TYPE {
@@ -78,65 +87,6 @@ static mon::QAngle RandomAng(small_prng& rng, PITCH_YAW_TYPE type, bool has_roll
     return {p, y, has_roll ? rng.next_float(-180.f, 180.f) : 0.f};
 }
 
-static void CreateOverlayPortalImage(const mon::TeleportChainParams& paramsTemplate,
-                                     const char* file_name,
-                                     size_t y_res,
-                                     bool rand_nudge = false)
-{
-    size_t x_res = (size_t)((double)y_res * mon::PORTAL_HALF_WIDTH / mon::PORTAL_HALF_HEIGHT);
-    struct pixel {
-        uint8_t b, g, r, a;
-    };
-    std::vector<pixel> pixels{y_res * x_res};
-    int n_threads = std::thread::hardware_concurrency();
-    ctpl::thread_pool pool{n_threads ? n_threads : 4};
-    for (size_t y = 0; y < y_res; y++) {
-
-        pool.push([x_res, y_res, y, &paramsTemplate, &pixels, rand_nudge](int) -> void {
-            small_prng rng{y};
-            mon::TeleportChainParams params = paramsTemplate;
-            mon::TeleportChainResult result;
-
-            const mon::Portal& p = paramsTemplate.EntryPortal();
-            // orientation is as if we're looking at the portal
-            float oy = mon::PORTAL_HALF_HEIGHT * (-1 + 1.f / y_res);
-            float ty = 1 - (float)y / (y_res - 1);
-            float my = oy * (1 - 2 * ty);
-            mon::Vector u_off = p.u * my;
-
-            for (size_t x = 0; x < x_res; x++) {
-                float rx = rand_nudge ? rng.next_float(-.1f, .1f) : 0.f;
-                float ox = mon::PORTAL_HALF_WIDTH * (-1 + 1.f / x_res);
-                float tx = 1 - ((float)x + rx) / (x_res - 1);
-                float mx = ox * (1 - 2 * tx);
-
-                mon::Vector r_off = p.r * mx;
-                params.ent = paramsTemplate.ent.WithNewCenter(p.pos + r_off + u_off);
-                params.record_flags = mon::TCRF_NONE;
-
-                GenerateTeleportChain(params, result);
-
-                pixel& pix = pixels[x_res * y + x];
-                pix.a = 255;
-                if (result.max_tps_exceeded)
-                    pix.r = pix.g = pix.b = 0;
-                else if (result.cum_teleports == 0)
-                    pix.r = pix.g = pix.b = 125;
-                else if (result.cum_teleports == 1)
-                    pix.r = pix.g = pix.b = 255;
-                else if (result.cum_teleports < 0 && result.cum_teleports >= -3)
-                    pix.r = (uint8_t)(85 * -result.cum_teleports);
-                else if (result.cum_teleports > 1 && result.cum_teleports <= 4)
-                    pix.g = (uint8_t)(85 * (result.cum_teleports - 1));
-                else
-                    pix.b = 255;
-            }
-        });
-    }
-    pool.stop(true);
-    tga_write(file_name, x_res, y_res, (uint8_t*)pixels.data(), 4, 3);
-}
-
 static void FindVagIn04()
 {
     small_prng rng{0};
@@ -185,7 +135,7 @@ static void FindVagIn04()
         printf("%s\n", result.ent.SetPosCmd().c_str());
         const char* file_name = "04_blue.tga";
         printf("Found portal, generating overlay image\n");
-        CreateOverlayPortalImage(params, file_name, 1000);
+        mon::CreateOverlayPortalImage(params, file_name, 1000);
         break;
     }
 }
@@ -224,7 +174,7 @@ static void FindVag18StartCeilCubeRoom()
     }
     (*result).print();
     printf("generating overlay image...\n");
-    CreateOverlayPortalImage(ss.params, __FUNCTION__ ".tga", 1000);
+    mon::CreateOverlayPortalImage(ss.params, __FUNCTION__ ".tga", 1000);
 }
 
 static void FindComplexChain()
@@ -261,7 +211,7 @@ static void FindComplexChain()
         printf("%s\n", pp.NewLocationCmd().c_str());
         printf("%s\n", result.ent.SetPosCmd().c_str());
         printf("generating overlay image...\n");
-        CreateOverlayPortalImage(params, "complex_chain.tga", 1000);
+        mon::CreateOverlayPortalImage(params, "complex_chain.tga", 1000);
         break;
     }
 }
@@ -332,7 +282,7 @@ static void CreateSpinAnimation()
             params.pp = &pp2;
             char name[32];
             sprintf_s(name, "spin_anim/ang_%03d.tga", (360 + (j % 360)) % 360);
-            CreateOverlayPortalImage(params, name, 350);
+            mon::CreateOverlayPortalImage(params, name, 350);
         }
         break;
     }
@@ -444,8 +394,11 @@ static void FindVagIn09EleTop()
         .tp_from_blue = false,
         .tp_player = true,
     };
-    small_prng rng{0};
-    auto sr = ss.FindVag(rng, 1000000);
+    // test a few entry points on every pair, the stats show how many pairs that took
+    ss.entry_scan_per_side = 3;
+    mon::SearchStats stats;
+    auto sr = ss.FindVagParallel(0, 1000000, 0, &stats);
+    stats.print();
     if (sr)
         sr->print();
 }
@@ -482,8 +435,11 @@ static void FindVagIn09EleBottom()
         .tp_from_blue = false,
         .tp_player = true,
     };
-    small_prng rng{0};
-    auto sr = ss.FindVag(rng, 1000000);
+    // every lock option & placement order for each sample, the samples are random
+    mon::PrngSampler sampler{0};
+    mon::SearchStats stats;
+    auto sr = ss.FindVagEnumerated(sampler, 1000000 / (int)ss.NumDiscreteCombos(), 0, 0, &stats);
+    stats.print();
     if (sr)
         sr->print();
 }
@@ -510,8 +466,11 @@ static void FindVagIn11()
         .tp_from_blue = false,
         .tp_player = true,
     };
-    small_prng rng{0};
-    auto sr = ss.FindVag(rng, 1000000);
+    mon::SobolSampler sampler{true, 0};
+    // rerunning continues from the last checkpoint
+    mon::SearchCheckpointParams checkpoint{.path = "checkpoints/find_vag_11.ckpt"};
+    mon::SearchProgressParams progress{.label = "11"};
+    auto sr = ss.FindVagSampled(sampler, 1000000, 0, 0, nullptr, &checkpoint, &progress);
     if (sr)
         sr->print();
 }
@@ -552,9 +511,573 @@ static void FindKnownVagIn11()
     }
 }
 
-int main()
+static void CollectVagsIn11()
+{
+    mon::SearchSpace ss{
+        .blue_search{
+            .lock_opts{383.96875f},
+            .type = mon::SPT_WALL_ZN,
+            .pos_spaces = {mon::AABB{{-860, 280, 450}, {-551, -43, 380}}},
+        },
+        .orange_search{
+            .lock_opts{
+                -64.03125f,
+                -64.0312653f,
+            },
+            .type = mon::SPT_WALL_XN,
+            .pos_spaces = {mon::AABB{{-80, -816, 284}, {-40, -1154, 509}}},
+        },
+        .target_space = mon::AABB{{-106, -1427, 1597}, {-273, -1282, 1729}},
+        .entry_pos_search = mon::SEPF_LOWER,
+        .valid_placement_orders{
+            mon::PlacementOrder::ORANGE_OPEN_BLUE_NEW_LOCATION,
+            mon::PlacementOrder::BLUE_OPEN_ORANGE_NEW_LOCATION,
+        },
+        .tp_from_blue = false,
+        .tp_player = true,
+    };
+    auto hits = ss.CollectVags(0, 1000000, {.max_hits = 5});
+    for (const mon::RankedVagHit& rh : hits) {
+        printf("%.1f%% of the entry face VAGs, %.1f units from the target edge\n",
+               rh.face_vag_fraction * 100.f,
+               rh.target_margin);
+        rh.hit.print();
+    }
+    if (!hits.empty()) {
+        mon::RankedVagHit refined = ss.RefineHit(hits[0], 0);
+        printf("refined best hit: %.1f%% of the entry face VAGs\n", refined.face_vag_fraction * 100.f);
+        refined.hit.print();
+    }
+}
+
+// the portals from the README with the player at the center of orange
+static mon::TeleportChainParams ReadmeChainParams()
+{
+    static const mon::PortalPair pp{
+        {1189.75232f, 1036.28369f, 923.913574f},
+        {-58.4471817f, -44.0751495f, 0.f},
+        {874.779541f, 1159.03931f, 891.764954f},
+        {37.8783722f, 129.905914f, 0.f},
+        mon::PlacementOrder::ORANGE_OPEN_BLUE_NEW_LOCATION,
+        mon::GV_5135,
+    };
+    mon::TeleportChainParams params{&pp, mon::Entity::CreatePlayerFromCenter(pp.orange.pos, true)};
+    params.n_max_teleports = 10;
+    return params;
+}
+
+static void CreateReadmeUlpLattice()
+{
+    // look at a small window around the center of orange
+    mon::TeleportChainParams params = ReadmeChainParams();
+
+    mon::UlpLatticeParams lattice{.half_ulps_x = 300, .half_ulps_y = 500};
+    auto [raster, stats] = mon::RenderUlpLatticeRaster(params, lattice);
+    printf("%llu/%llu (%.6f) positions VAG\n",
+           (unsigned long long)stats.n_vag,
+           (unsigned long long)stats.n_total,
+           stats.VagFraction());
+    raster.WriteTga("readme_ulp_lattice.tga", mon::OutcomePalette::Default());
+}
+
+static void CreateReadmeContours()
+{
+    // trace the regions on the whole face of orange
+    mon::TeleportChainParams params = ReadmeChainParams();
+
+    mon::RegionContours rc = mon::ExtractAdaptiveContours(params, {.n_levels = 7, .n_edge_bisections = 4});
+    printf("%zu contours from %zu chains\n", rc.contours.size(), rc.n_chain_evals);
+    std::ofstream{"readme_contours.svg"} << rc.ToSvg();
+}
+
+static void CreateReadmeOverlays()
+{
+    // render both placement orders at once
+    mon::CreateOverlayPortalImagesAllOrders(ReadmeChainParams(), "readme_overlay", 1000);
+}
+
+static void CreateReadmeVolume()
+{
+    // see how the overlay changes as the player moves through orange
+    mon::TeleportChainParams params = ReadmeChainParams();
+
+    mon::OutcomeVolume vol =
+        mon::RenderOverlayVolume(params, {.y_res = 300, .n_slices = 128, .f_min = -2.f, .f_max = 2.f});
+    printf("%zu runs (%zu bytes)\n", vol.NumRuns(), vol.CompressedSize());
+    vol.Save("readme_volume.mov");
+    for (uint32_t z = 0; z < vol.Depth(); z += 16) {
+        auto name = std::format("readme_volume/slice_{:03}.tga", z);
+        vol.Slice(z).WriteTga(name.c_str(), mon::OutcomePalette::Default());
+    }
+}
+
+static void PrintJobResult(const mon::SearchJob& job, const mon::SearchJobResult& res)
+{
+    printf("\n[%s] finished in %.1fs\n", job.name.c_str(), res.seconds);
+    res.stats.print();
+    if (res.found)
+        res.found->print();
+    for (const mon::RankedVagHit& rh : res.hits) {
+        printf("%.1f%% of the entry face VAGs, %.1f units from the target edge\n",
+               rh.face_vag_fraction * 100.f,
+               rh.target_margin);
+        rh.hit.print();
+    }
+    fflush(stdout);
+}
+
+/*
+* monocle_personal [-c n_concurrent_jobs] [-t n_threads] [-p progress.jsonl] job.json...
+* Runs every job from the given job files (see search_job.hpp) in one process. Progress is printed
+* to stderr and optionally written as JSONL.
+*/
+static int RunJobFiles(int argc, char** argv)
+{
+    mon::BatchRunParams bp{.progress = mon::SearchProgressParams{}};
+    std::vector<mon::SearchJob> jobs;
+    mon::SearchJobReader reader;
+    std::ofstream progress_file;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if ((arg == "-c" || arg == "-t") && i + 1 < argc) {
+            (arg == "-c" ? bp.n_concurrent_jobs : bp.n_threads) = atoi(argv[++i]);
+            continue;
+        }
+        if (arg == "-p" && i + 1 < argc) {
+            progress_file.open(argv[++i], std::ios::app);
+            bp.progress->jsonl_out = &progress_file;
+            continue;
+        }
+        auto file_jobs = reader.Load(arg);
+        if (!file_jobs) {
+            fprintf(stderr, "%s\n", reader.Error().c_str());
+            return 1;
+        }
+        jobs.insert(jobs.end(), file_jobs->begin(), file_jobs->end());
+    }
+    printf("running %zu jobs\n", jobs.size());
+    mon::RunSearchJobs(jobs, bp, [](const mon::SearchJob& job, mon::SearchJobResult&& res) {
+        PrintJobResult(job, res);
+    });
+    return 0;
+}
+
+/*
+* monocle_personal -coordinate queue_dir [-s shard_iterations] [-d dead_timeout_s] job.json
+* Splits the jobs into shards in the queue directory (see shard_queue.hpp) and waits for workers to
+* search them. Can be restarted with the same job file to continue.
+*/
+static int RunCoordinator(int argc, char** argv)
+{
+    mon::ShardQueueParams qp{.dir = argv[2]};
+    const char* job_path = nullptr;
+    for (int i = 3; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "-s" && i + 1 < argc)
+            qp.shard_iterations = atoi(argv[++i]);
+        else if (arg == "-d" && i + 1 < argc)
+            qp.dead_timeout = std::chrono::seconds{atoi(argv[++i])};
+        else
+            job_path = argv[i];
+    }
+    if (!job_path) {
+        fprintf(stderr, "no job file given\n");
+        return 1;
+    }
+    std::ifstream file{job_path, std::ios::binary};
+    std::stringstream text;
+    text << file.rdbuf();
+    mon::SearchJobReader reader;
+    auto jobs = reader.Parse(text.str());
+    if (!jobs) {
+        fprintf(stderr, "%s: %s\n", job_path, reader.Error().c_str());
+        return 1;
+    }
+    mon::SearchCoordinator coordinator{qp, *jobs, text.str()};
+    if (!coordinator.Init()) {
+        fprintf(stderr, "%s\n", coordinator.Error().c_str());
+        return 1;
+    }
+    printf("waiting for workers on %s\n", qp.dir.string().c_str());
+    size_t last_done = SIZE_MAX;
+    while (!coordinator.Poll()) {
+        if (!coordinator.Error().empty()) {
+            fprintf(stderr, "%s\n", coordinator.Error().c_str());
+            return 1;
+        }
+        auto [n_done, n_total] = coordinator.ShardCounts();
+        if (n_done != last_done)
+            fprintf(stderr, "%zu/%zu shards done\n", n_done, n_total);
+        last_done = n_done;
+        std::this_thread::sleep_for(qp.poll_interval);
+    }
+    auto results = coordinator.Run();
+    if (!coordinator.Error().empty()) {
+        fprintf(stderr, "%s\n", coordinator.Error().c_str());
+        return 1;
+    }
+    for (size_t i = 0; i < results.size(); i++)
+        PrintJobResult((*jobs)[i], results[i]);
+    return 0;
+}
+
+/*
+* monocle_personal -work queue_dir [-t n_threads] [-id name]
+* Searches shards from a queue until the coordinator is done. Start as many as there are machines
+* (or more with fewer threads each).
+*/
+static int RunWorker(int argc, char** argv)
+{
+    mon::ShardQueueParams qp{.dir = argv[2]};
+    int n_threads = 0;
+    std::string id;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        std::string_view arg = argv[i];
+        if (arg == "-t")
+            n_threads = atoi(argv[i + 1]);
+        else if (arg == "-id")
+            id = argv[i + 1];
+    }
+    mon::SearchProgressParams progress{};
+    mon::SearchWorker worker{qp, id, n_threads, &progress};
+    printf("worker %s waiting for shards on %s\n", worker.Id().c_str(), qp.dir.string().c_str());
+    int n_shards = worker.Run();
+    if (!worker.Error().empty()) {
+        fprintf(stderr, "%s\n", worker.Error().c_str());
+        return 1;
+    }
+    printf("searched %d shards\n", n_shards);
+    return 0;
+}
+
+/*
+* monocle_personal -survey map.bsp x1 y1 z1 x2 y2 z2 [-n samples_per_pair] [-t n_threads] [-o report.txt]
+* Surveys every pair of portalable surfaces on the map (see survey.hpp) for player VAGs that land
+* in the given box. The player enters orange & the report is printed to stdout unless -o is given.
+*/
+static int RunSurvey(int argc, char** argv)
+{
+    mon::BspMap map;
+    if (!map.Load(argv[2])) {
+        fprintf(stderr, "%s: %s\n", argv[2], map.Error().c_str());
+        return 1;
+    }
+    mon::Vector corners[2];
+    for (int i = 0; i < 6; i++)
+        corners[i / 3][i % 3] = (float)atof(argv[3 + i]);
+    mon::SearchSpace ss{
+        .target_space = mon::AABB{corners[0], corners[1]},
+        .entry_pos_search = mon::SEPF_ANY,
+        .valid_placement_orders{
+            mon::PlacementOrder::ORANGE_OPEN_BLUE_NEW_LOCATION,
+            mon::PlacementOrder::BLUE_OPEN_ORANGE_NEW_LOCATION,
+        },
+        .tp_from_blue = false,
+        .tp_player = true,
+    };
+    mon::SurveyParams sp;
+    const char* report_path = nullptr;
+    for (int i = 9; i + 1 < argc; i += 2) {
+        std::string_view arg = argv[i];
+        if (arg == "-n")
+            sp.samples_per_pair = atoi(argv[i + 1]);
+        else if (arg == "-t")
+            sp.n_threads = atoi(argv[i + 1]);
+        else if (arg == "-o")
+            report_path = argv[i + 1];
+    }
+    auto surfaces = mon::FindPortalSurfaces(map);
+    mon::VagSurvey survey{ss, surfaces, sp};
+    fprintf(stderr, "surveying %zu surfaces (%zu pairs)\n", surfaces.size(), survey.NumPairs());
+    mon::SurveyStats stats;
+    auto results = survey.Run(&stats);
+    FILE* report = report_path ? fopen(report_path, "w") : stdout;
+    if (!report) {
+        fprintf(stderr, "failed to open %s\n", report_path);
+        return 1;
+    }
+    survey.PrintReport(report, results, stats);
+    if (report != stdout)
+        fclose(report);
+    return 0;
+}
+
+/*
+* monocle_personal -verify corpus.txt [-t n_threads] [-n max_teleports] [-standing] [-o results.csv]
+* Re-runs the chain of every setpos in a file of newlocation & setpos commands (see
+* command_corpus.hpp) and writes one csv row per record in file order, to stdout unless -o is given.
+*/
+static int RunVerifyCorpus(int argc, char** argv)
+{
+    mon::CorpusParams params;
+    mon::CorpusVerifyParams vp;
+    const char* out_path = nullptr;
+    for (int i = 3; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "-standing")
+            params.crouched = false;
+        else if (arg == "-t" && i + 1 < argc)
+            params.n_threads = vp.n_threads = atoi(argv[++i]);
+        else if (arg == "-n" && i + 1 < argc)
+            vp.n_max_teleports = (size_t)atoi(argv[++i]);
+        else if (arg == "-o" && i + 1 < argc)
+            out_path = argv[++i];
+    }
+    mon::CommandCorpus corpus;
+    auto start = std::chrono::steady_clock::now();
+    if (!corpus.Load(argv[2], params)) {
+        fprintf(stderr, "%s\n", corpus.Error().c_str());
+        return 1;
+    }
+    const mon::CorpusStats& stats = corpus.Stats();
+    fprintf(stderr,
+            "parsed %llu lines in %.2fs: %zu records, %zu pairs, %llu malformed, %llu orphaned setpos\n",
+            (unsigned long long)stats.n_lines,
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+            corpus.NumRecords(),
+            corpus.Pairs().size(),
+            (unsigned long long)stats.n_malformed,
+            (unsigned long long)stats.n_orphans);
+    FILE* out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "failed to open %s\n", out_path);
+        return 1;
+    }
+    fprintf(out, "%s\n", mon::CorpusVerdict::CSV_HEADER);
+    mon::VerifyCorpus(corpus, vp, [out](const mon::CorpusVerdict& v) { v.WriteCsv(out); });
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
+
+/*
+* monocle_personal -daemon [-t n_threads] [-r n_concurrent_requests]
+* Answers JSON line requests from stdin on stdout until stdin closes (see daemon.hpp).
+*/
+static int RunQueryDaemon(int argc, char** argv)
+{
+    mon::DaemonParams dp;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        std::string_view arg = argv[i];
+        if (arg == "-t")
+            dp.n_threads = atoi(argv[i + 1]);
+        else if (arg == "-r")
+            dp.n_concurrent_requests = atoi(argv[i + 1]);
+    }
+    mon::RunDaemon(std::cin, std::cout, dp);
+    return 0;
+}
+
+/*
+* monocle_personal -daemon-bench [n_requests]
+* Measures the round trip latency of daemon requests from a client in the same process, so only
+* the request handling is measured and not the pipe. Each request goes through the same JSON line
+* protocol as in -daemon mode.
+*/
+static int RunDaemonBench(int argc, char** argv)
+{
+    using clock = std::chrono::steady_clock;
+    const int n = argc > 2 ? std::max(atoi(argv[2]), 1) : 2000;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::map<int64_t, clock::time_point> sent;
+    std::vector<double> latencies;
+    mon::QueryDaemon daemon{{}, [&](std::string_view line) {
+                                auto now = clock::now();
+                                auto res = mon::JsonParser::Parse(line);
+                                const mon::JsonValue* id_v = res ? res->Find("id") : nullptr;
+                                auto id = id_v ? id_v->AsNumber<int64_t>() : std::nullopt;
+                                std::lock_guard lock{mtx};
+                                if (!id || !sent.contains(*id)) {
+                                    fprintf(stderr, "unexpected response: %.*s\n", (int)line.size(), line.data());
+                                    return;
+                                }
+                                latencies.push_back(std::chrono::duration<double, std::micro>(now - sent[*id]).count());
+                                sent.erase(*id);
+                                cv.notify_all();
+                            }};
+    int64_t next_id = 0;
+    auto submit = [&](std::string_view body) {
+        int64_t id = next_id++;
+        std::string line = std::format("{{\"id\":{},{}}}", id, body);
+        {
+            std::lock_guard lock{mtx};
+            sent[id] = clock::now();
+        }
+        daemon.Submit(line);
+    };
+    auto wait_all = [&] {
+        std::unique_lock lock{mtx};
+        cv.wait(lock, [&] { return sent.empty(); });
+    };
+    auto report = [&](const char* name, double seconds) {
+        std::sort(latencies.begin(), latencies.end());
+        auto pct = [&](double p) { return latencies[std::min((size_t)(p * latencies.size()), latencies.size() - 1)]; };
+        printf("%-24s %6zu requests, p50 %8.1fus, p90 %8.1fus, p99 %8.1fus, max %8.1fus, %8.0f requests/s\n",
+               name,
+               latencies.size(),
+               pct(.5),
+               pct(.9),
+               pct(.99),
+               latencies.back(),
+               latencies.size() / seconds);
+        latencies.clear();
+    };
+
+    // 19 Lochness, the entry point is moved around so that every chain is different
+    auto chain = [](int i, bool new_pair) {
+        return std::format(R"("blue":{{"pos":[-416.247498,735.368835,255.96875],"ang":[90,-90.2385559,0]}},)"
+                           R"("orange":{{"pos":[-394.776428,{},38.8377686],"ang":[-44.9994202,180,0]}},)"
+                           R"("order":"ORANGE_OPEN_BLUE_NEW_LOCATION",)"
+                           R"("ent":{{"origin":[{},735.368835,219.97],"crouched":false}})",
+                           new_pair ? -56.0312462f + i * .001f : -56.0312462f,
+                           -416.247498f + (i % 100) * .01f);
+    };
+    struct {
+        const char* name;
+        bool pipelined;
+        bool new_pairs;
+    } runs[]{
+        {"chain, cached pair", false, false},
+        {"chain, new pair", false, true},
+        {"chain, pipelined", true, false},
+    };
+    for (auto& run : runs) {
+        auto start = clock::now();
+        for (int i = 0; i < n; i++) {
+            submit(R"("type":"chain",)" + chain(i, run.new_pairs));
+            if (!run.pipelined)
+                wait_all();
+        }
+        wait_all();
+        report(run.name, std::chrono::duration<double>(clock::now() - start).count());
+    }
+    auto start = clock::now();
+    for (int i = 0; i < std::max(n / 100, 1); i++) {
+        submit(R"("type":"overlay","y_res":64,)" + chain(i, false));
+        wait_all();
+    }
+    report("overlay, 64 rows", std::chrono::duration<double>(clock::now() - start).count());
+    return 0;
+}
+
+/*
+* monocle_personal -spt-standin [-p port] [-upstream port] [-replay session.jsonl] [-record session.jsonl] [-standing]
+* Pretends to be the game with SPT's IPC enabled until enter is pressed (see spt_ipc.hpp). With
+* -upstream it forwards everything to the real game instead, -record saves the session on exit.
+*/
+static int RunSptStandIn(int argc, char** argv)
+{
+    mon::SptIpcStandInParams sp;
+    const char* record_path = nullptr;
+    std::optional<mon::SptIpcRecording> replay;
+    for (int i = 2; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "-standing") {
+            sp.engine.crouched = false;
+        } else if (arg == "-p" && i + 1 < argc) {
+            sp.port = (uint16_t)atoi(argv[++i]);
+        } else if (arg == "-upstream" && i + 1 < argc) {
+            sp.upstream_port = (uint16_t)atoi(argv[++i]);
+        } else if (arg == "-record" && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (arg == "-replay" && i + 1 < argc) {
+            std::string err;
+            replay = mon::SptIpcRecording::Load(argv[++i], &err);
+            if (!replay) {
+                fprintf(stderr, "%s: %s\n", argv[i], err.c_str());
+                return 1;
+            }
+            sp.replay = &*replay;
+        }
+    }
+    mon::SptIpcStandIn standin{sp};
+    if (!standin.IsListening()) {
+        fprintf(stderr, "failed to listen on port %d\n", sp.port);
+        return 1;
+    }
+    fprintf(stderr, "listening on port %d, press enter to stop\n", standin.Port());
+    std::cin.get();
+    standin.Stop();
+    mon::SptIpcStandInStats stats = standin.Stats();
+    fprintf(stderr,
+            "%llu clients, %llu messages, %llu replayed, %llu replay mismatches\n",
+            (unsigned long long)stats.n_clients,
+            (unsigned long long)stats.n_client_msgs,
+            (unsigned long long)stats.n_replayed,
+            (unsigned long long)stats.n_replay_mismatches);
+    if (record_path && !standin.Recording().Save(record_path)) {
+        fprintf(stderr, "failed to write %s\n", record_path);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+* monocle_personal -spt-replay session.jsonl... [-tol units] [-standing]
+* Runs recorded sessions through monocle's teleport logic and reports the replies that don't
+* match, exits with 1 if there were any.
+*/
+static int RunSptReplay(int argc, char** argv)
+{
+    mon::SptIpcReplayParams rp;
+    std::vector<const char*> paths;
+    for (int i = 2; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "-standing")
+            rp.engine.crouched = false;
+        else if (arg == "-tol" && i + 1 < argc)
+            rp.tolerance = atof(argv[++i]);
+        else
+            paths.push_back(argv[i]);
+    }
+    bool all_match = true;
+    for (const char* path : paths) {
+        std::string err;
+        std::optional<mon::SptIpcRecording> rec = mon::SptIpcRecording::Load(path, &err);
+        if (!rec) {
+            fprintf(stderr, "%s: %s\n", path, err.c_str());
+            return 1;
+        }
+        mon::SptIpcReplayReport report = mon::ReplayRecording(*rec, rp);
+        printf("%s: %zu commands, %zu replies, %zu mismatches\n",
+               path,
+               report.n_client_msgs,
+               report.n_replies_compared,
+               report.n_mismatches);
+        for (auto& diff : report.diffs)
+            printf("  message %zu\n    expected: %s\n    actual:   %s\n",
+                   diff.msg_idx,
+                   diff.expected.c_str(),
+                   diff.actual.c_str());
+        all_match &= report.n_mismatches == 0;
+    }
+    return all_match ? 0 : 1;
+}
+
+int main(int argc, char** argv)
 {
     mon::MonocleFloatingPointScope scope{};
 
+    if (argc > 2 && std::string_view{argv[1]} == "-coordinate")
+        return RunCoordinator(argc, argv);
+    if (argc > 2 && std::string_view{argv[1]} == "-work")
+        return RunWorker(argc, argv);
+    if (argc > 8 && std::string_view{argv[1]} == "-survey")
+        return RunSurvey(argc, argv);
+    if (argc > 2 && std::string_view{argv[1]} == "-verify")
+        return RunVerifyCorpus(argc, argv);
+    if (argc > 1 && std::string_view{argv[1]} == "-daemon")
+        return RunQueryDaemon(argc, argv);
+    if (argc > 1 && std::string_view{argv[1]} == "-daemon-bench")
+        return RunDaemonBench(argc, argv);
+    if (argc > 1 && std::string_view{argv[1]} == "-spt-standin")
+        return RunSptStandIn(argc, argv);
+    if (argc > 2 && std::string_view{argv[1]} == "-spt-replay")
+        return RunSptReplay(argc, argv);
+    if (argc > 1)
+        return RunJobFiles(argc, argv);
+
     FindKnownVagIn11();
 }
@@ -0,0 +1,188 @@
+#pragma once
+
+#include "monocle_config.hpp"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <filesystem>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace mon {
+
+/*
+* A minimal memory mapped file. The whole file is mapped at once, so on 32-bit builds this is
+* limited by the available address space (roughly 1-2GB) rather than disk space.
+*/
+class MappedFile {
+    uint8_t* ptr = nullptr;
+    size_t len = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+
+    void Close()
+    {
+#ifdef _WIN32
+        if (ptr)
+            UnmapViewOfFile(ptr);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        mapping = nullptr;
+#else
+        if (ptr)
+            munmap(ptr, len);
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+#endif
+        ptr = nullptr;
+        len = 0;
+    }
+
+    // size == 0 means map the existing file as is, otherwise the file is created/truncated to size
+    bool Map(const std::filesystem::path& path, bool writable, size_t size)
+    {
+        Close();
+#ifdef _WIN32
+        file = CreateFileW(path.c_str(),
+                           writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+                           FILE_SHARE_READ,
+                           nullptr,
+                           size ? CREATE_ALWAYS : OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL,
+                           nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        if (!size) {
+            LARGE_INTEGER file_size;
+            if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0 ||
+                (uint64_t)file_size.QuadPart > SIZE_MAX) {
+                Close();
+                return false;
+            }
+            size = (size_t)file_size.QuadPart;
+        }
+        uint64_t size64 = size;
+        mapping = CreateFileMappingW(file,
+                                     nullptr,
+                                     writable ? PAGE_READWRITE : PAGE_READONLY,
+                                     (DWORD)(size64 >> 32),
+                                     (DWORD)size64,
+                                     nullptr);
+        if (!mapping) {
+            Close();
+            return false;
+        }
+        ptr = (uint8_t*)MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+#else
+        fd = open(path.c_str(), writable ? (O_RDWR | (size ? O_CREAT | O_TRUNC : 0)) : O_RDONLY, 0644);
+        if (fd < 0)
+            return false;
+        if (size) {
+            if (ftruncate(fd, (off_t)size) != 0) {
+                Close();
+                return false;
+            }
+        } else {
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+                Close();
+                return false;
+            }
+            size = (size_t)st.st_size;
+        }
+        void* p = mmap(nullptr, size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+        ptr = p == MAP_FAILED ? nullptr : (uint8_t*)p;
+#endif
+        if (!ptr) {
+            Close();
+            return false;
+        }
+        len = size;
+        return true;
+    }
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& o) noexcept
+    {
+        *this = std::move(o);
+    }
+
+    MappedFile& operator=(MappedFile&& o) noexcept
+    {
+        if (this == &o)
+            return *this;
+        Close();
+        std::swap(ptr, o.ptr);
+        std::swap(len, o.len);
+#ifdef _WIN32
+        std::swap(file, o.file);
+        std::swap(mapping, o.mapping);
+#else
+        std::swap(fd, o.fd);
+#endif
+        return *this;
+    }
+
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    // maps an existing file
+    bool Open(const std::filesystem::path& path, bool writable = false)
+    {
+        return Map(path, writable, 0);
+    }
+
+    // creates (or truncates) a file of the given size and maps it for writing
+    bool Create(const std::filesystem::path& path, size_t size)
+    {
+        MON_ASSERT(size > 0);
+        if (!path.parent_path().empty())
+            std::filesystem::create_directories(path.parent_path());
+        return Map(path, true, size);
+    }
+
+    bool IsOpen() const
+    {
+        return !!ptr;
+    }
+
+    uint8_t* Data() const
+    {
+        return ptr;
+    }
+
+    size_t Size() const
+    {
+        return len;
+    }
+};
+
+} // namespace mon
@@ -0,0 +1,406 @@
+#pragma once
+
+#include "monocle_config.hpp"
+#include "game/source_math.hpp"
+#include "teleport_chain/generate.hpp"
+#include "mapped_file.hpp"
+#include "tga.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include <memory>
+#include <optional>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+
+namespace mon {
+
+/*
+* A single byte summary of a chain result. The low 7 bits are cum_teleports as a two's complement
+* integer (saturated to [CUM_MIN, CUM_MAX]) and the high bit is set if the chain exceeded the
+* teleport limit.
+*/
+struct ChainOutcome {
+    uint8_t bits;
+
+    static constexpr uint8_t EXCEEDED_BIT = 0x80;
+    static constexpr int CUM_MIN = -64;
+    static constexpr int CUM_MAX = 63;
+
+    static constexpr ChainOutcome Pack(bool max_tps_exceeded, int cum_teleports)
+    {
+        int cum = cum_teleports < CUM_MIN ? CUM_MIN : (cum_teleports > CUM_MAX ? CUM_MAX : cum_teleports);
+        return {(uint8_t)((max_tps_exceeded ? EXCEEDED_BIT : 0) | (cum & 0x7f))};
+    }
+
+    static constexpr ChainOutcome FromResult(const TeleportChainResult& result)
+    {
+        return Pack(result.max_tps_exceeded, result.cum_teleports);
+    }
+
+    constexpr bool MaxTpsExceeded() const
+    {
+        return bits & EXCEEDED_BIT;
+    }
+
+    // sign extend the low 7 bits
+    constexpr int CumTeleports() const
+    {
+        return ((bits & 0x7f) ^ 0x40) - 0x40;
+    }
+
+    constexpr bool IsVag() const
+    {
+        return !MaxTpsExceeded() && CumTeleports() == -1;
+    }
+
+    constexpr bool operator==(const ChainOutcome&) const = default;
+};
+
+// optional per-pixel channels stored alongside the outcome bytes
+enum OutcomeRasterChannels : uint32_t {
+    ORC_NONE = 0,
+    // uint32_t - TeleportChainResult::total_n_teleports
+    ORC_TOTAL_TELEPORTS = 1 << 0,
+    // int32_t - TeleportChainResult::cum_teleports, not saturated
+    ORC_EXACT_CUM = 1 << 1,
+    // Vector - the center of TeleportChainResult::ent
+    ORC_FINAL_POS = 1 << 2,
+
+    ORC_ALL = ORC_TOTAL_TELEPORTS | ORC_EXACT_CUM | ORC_FINAL_POS,
+};
+
+struct OverlayPixel {
+    uint8_t b, g, r, a;
+};
+
+// since outcomes are a single byte, a palette is just a lookup table
+struct OutcomePalette {
+    std::array<OverlayPixel, 256> lut;
+
+    OverlayPixel operator()(ChainOutcome o) const
+    {
+        return lut[o.bits];
+    }
+
+    /*
+    * - white: normal teleport
+    * - red: VAG (darker for cum -1, brighter for -2 & -3)
+    * - grey: teleported back to the entry portal
+    * - green: more teleports than a normal teleport
+    * - black: chain limit exceeded
+    * - blue: anything else
+    */
+    static OutcomePalette Default()
+    {
+        OutcomePalette pal;
+        for (int i = 0; i < 256; i++) {
+            ChainOutcome o{(uint8_t)i};
+            int cum = o.CumTeleports();
+            OverlayPixel& pix = pal.lut[i];
+            pix = {0, 0, 0, 255};
+            if (o.MaxTpsExceeded())
+                ;
+            else if (cum == 0)
+                pix.r = pix.g = pix.b = 125;
+            else if (cum == 1)
+                pix.r = pix.g = pix.b = 255;
+            else if (cum < 0 && cum >= -3)
+                pix.r = (uint8_t)(85 * -cum);
+            else if (cum > 1 && cum <= 4)
+                pix.g = (uint8_t)(85 * (cum - 1));
+            else
+                pix.b = 255;
+        }
+        return pal;
+    }
+
+    // VAGs are red, everything else is white
+    static OutcomePalette VagMask()
+    {
+        OutcomePalette pal;
+        for (int i = 0; i < 256; i++) {
+            bool vag = ChainOutcome{(uint8_t)i}.IsVag();
+            pal.lut[i] = vag ? OverlayPixel{0, 0, 255, 255} : OverlayPixel{255, 255, 255, 255};
+        }
+        return pal;
+    }
+};
+
+/*
+* On-disk layout of an outcome raster (all little endian):
+* - OutcomeRasterFileHeader
+* - uint8_t outcomes[layers][width * height]
+* - the side channels in the same order as OutcomeRasterChannels, each aligned to 16 bytes and
+*   with one entry per layer & pixel
+*
+* The in-memory layout is exactly the same, so a raster can be mapped directly from a file.
+*/
+struct OutcomeRasterFileHeader {
+    static constexpr char MAGIC[4] = {'M', 'O', 'R', 'S'};
+    static constexpr uint32_t VERSION = 1;
+
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels; // OutcomeRasterChannels
+    uint32_t layers;   // 0 is treated the same as 1
+    uint32_t _reserved[10];
+};
+static_assert(sizeof(OutcomeRasterFileHeader) == 64);
+
+/*
+* A grid of chain outcomes, e.g. one outcome per pixel of an overlay image. Colors are only
+* applied when exporting so that the same render can be re-colored, diffed, or aggregated later.
+* Rasters can either live in memory or be backed by a memory mapped file.
+*/
+class OutcomeRaster {
+    std::unique_ptr<uint8_t[]> mem;
+    MappedFile map;
+    uint8_t* base = nullptr;
+    size_t total_size = 0;
+
+    static constexpr size_t Align16(size_t x)
+    {
+        return (x + 15) & ~(size_t)15;
+    }
+
+    OutcomeRasterFileHeader& Header() const
+    {
+        MON_ASSERT(!!base);
+        return *(OutcomeRasterFileHeader*)base;
+    }
+
+    // byte offset of a channel from the start of the header
+    static size_t ChannelOffset(uint32_t width,
+                                uint32_t height,
+                                uint32_t channels,
+                                uint32_t layers,
+                                OutcomeRasterChannels which)
+    {
+        size_t n = (size_t)width * height * (layers ? layers : 1);
+        size_t off = Align16(sizeof(OutcomeRasterFileHeader) + n);
+        if (which == ORC_TOTAL_TELEPORTS)
+            return off;
+        if (channels & ORC_TOTAL_TELEPORTS)
+            off += Align16(n * sizeof(uint32_t));
+        if (which == ORC_EXACT_CUM)
+            return off;
+        if (channels & ORC_EXACT_CUM)
+            off += Align16(n * sizeof(int32_t));
+        if (which == ORC_FINAL_POS)
+            return off;
+        if (channels & ORC_FINAL_POS)
+            off += Align16(n * sizeof(Vector));
+        return off; // ORC_NONE -> total size
+    }
+
+    template <typename T>
+    T* Channel(OutcomeRasterChannels which, uint32_t layer) const
+    {
+        MON_ASSERT(layer < Layers());
+        if (!(Channels() & which))
+            return nullptr;
+        return (T*)(base + ChannelOffset(Width(), Height(), Channels(), Layers(), which)) + layer * Size();
+    }
+
+    void InitHeader(uint32_t width, uint32_t height, uint32_t channels, uint32_t layers)
+    {
+        OutcomeRasterFileHeader& hdr = Header();
+        memset(&hdr, 0, sizeof hdr);
+        memcpy(hdr.magic, OutcomeRasterFileHeader::MAGIC, sizeof hdr.magic);
+        hdr.version = OutcomeRasterFileHeader::VERSION;
+        hdr.width = width;
+        hdr.height = height;
+        hdr.channels = channels;
+        hdr.layers = layers;
+    }
+
+public:
+    OutcomeRaster() = default;
+
+    /*
+    * In-memory raster, all outcomes are zero initialized. Multiple layers can be used to store
+    * several renders of the same grid, e.g. one per placement order.
+    */
+    OutcomeRaster(uint32_t width, uint32_t height, uint32_t channels = ORC_NONE, uint32_t layers = 1)
+    {
+        MON_ASSERT(layers > 0);
+        total_size = ChannelOffset(width, height, channels, layers, ORC_NONE);
+        mem = std::make_unique<uint8_t[]>(total_size);
+        base = mem.get();
+        InitHeader(width, height, channels, layers);
+    }
+
+    // file-backed raster, useful for renders that don't fit in memory
+    static std::optional<OutcomeRaster> Create(const std::filesystem::path& path,
+                                               uint32_t width,
+                                               uint32_t height,
+                                               uint32_t channels = ORC_NONE,
+                                               uint32_t layers = 1)
+    {
+        MON_ASSERT(layers > 0);
+        OutcomeRaster raster;
+        raster.total_size = ChannelOffset(width, height, channels, layers, ORC_NONE);
+        if (!raster.map.Create(path, raster.total_size))
+            return {};
+        raster.base = raster.map.Data();
+        raster.InitHeader(width, height, channels, layers);
+        return raster;
+    }
+
+    // maps a raster that was previously written with Save() or Create()
+    static std::optional<OutcomeRaster> Open(const std::filesystem::path& path, bool writable = false)
+    {
+        OutcomeRaster raster;
+        if (!raster.map.Open(path, writable) || raster.map.Size() < sizeof(OutcomeRasterFileHeader))
+            return {};
+        raster.base = raster.map.Data();
+        const OutcomeRasterFileHeader& hdr = raster.Header();
+        if (memcmp(hdr.magic, OutcomeRasterFileHeader::MAGIC, sizeof hdr.magic) ||
+            hdr.version != OutcomeRasterFileHeader::VERSION || (hdr.channels & ~ORC_ALL))
+            return {};
+        raster.total_size = ChannelOffset(hdr.width, hdr.height, hdr.channels, hdr.layers, ORC_NONE);
+        if (raster.map.Size() < raster.total_size)
+            return {};
+        return raster;
+    }
+
+    bool Save(const std::filesystem::path& path) const
+    {
+        if (!path.parent_path().empty())
+            std::filesystem::create_directories(path.parent_path());
+        std::ofstream file{path, std::ios::binary};
+        file.write((const char*)base, total_size);
+        return !!file;
+    }
+
+    uint32_t Width() const
+    {
+        return Header().width;
+    }
+
+    uint32_t Height() const
+    {
+        return Header().height;
+    }
+
+    uint32_t Channels() const
+    {
+        return Header().channels;
+    }
+
+    uint32_t Layers() const
+    {
+        return Header().layers ? Header().layers : 1;
+    }
+
+    // number of pixels in a single layer
+    size_t Size() const
+    {
+        return (size_t)Width() * Height();
+    }
+
+    ChainOutcome* Outcomes(uint32_t layer = 0) const
+    {
+        MON_ASSERT(layer < Layers());
+        return (ChainOutcome*)(base + sizeof(OutcomeRasterFileHeader)) + layer * Size();
+    }
+
+    ChainOutcome& At(size_t x, size_t y, uint32_t layer = 0) const
+    {
+        MON_ASSERT(x < Width() && y < Height());
+        return Outcomes(layer)[y * Width() + x];
+    }
+
+    // side channels, these are null if the raster was created without them
+    uint32_t* TotalTeleports(uint32_t layer = 0) const
+    {
+        return Channel<uint32_t>(ORC_TOTAL_TELEPORTS, layer);
+    }
+
+    int32_t* ExactCum(uint32_t layer = 0) const
+    {
+        return Channel<int32_t>(ORC_EXACT_CUM, layer);
+    }
+
+    Vector* FinalPos(uint32_t layer = 0) const
+    {
+        return Channel<Vector>(ORC_FINAL_POS, layer);
+    }
+
+    // writes the outcome and any side channels for a single index
+    void Set(size_t i, const TeleportChainResult& result, uint32_t layer = 0) const
+    {
+        MON_ASSERT(i < Size());
+        Outcomes(layer)[i] = ChainOutcome::FromResult(result);
+        if (uint32_t* tt = TotalTeleports(layer))
+            tt[i] = (uint32_t)result.total_n_teleports;
+        if (int32_t* ec = ExactCum(layer))
+            ec[i] = result.cum_teleports;
+        if (Vector* fp = FinalPos(layer))
+            fp[i] = result.ent.GetCenter();
+    }
+
+    // number of times each outcome byte appears
+    std::array<size_t, 256> Histogram(uint32_t layer = 0) const
+    {
+        std::array<size_t, 256> hist{};
+        const ChainOutcome* outcomes = Outcomes(layer);
+        for (size_t i = 0, n = Size(); i < n; i++)
+            hist[outcomes[i].bits]++;
+        return hist;
+    }
+
+    size_t CountVags(uint32_t layer = 0) const
+    {
+        std::array<size_t, 256> hist = Histogram(layer);
+        size_t n = 0;
+        for (int i = 0; i < 256; i++)
+            if (ChainOutcome{(uint8_t)i}.IsVag())
+                n += hist[i];
+        return n;
+    }
+
+    // number of outcomes that differ between a layer of this raster and a layer of another raster of the same size
+    size_t CountDiffs(const OutcomeRaster& o, uint32_t layer = 0, uint32_t o_layer = 0) const
+    {
+        MON_ASSERT(Width() == o.Width() && Height() == o.Height());
+        const ChainOutcome* a = Outcomes(layer);
+        const ChainOutcome* b = o.Outcomes(o_layer);
+        size_t n = 0;
+        for (size_t i = 0, sz = Size(); i < sz; i++)
+            n += a[i].bits != b[i].bits;
+        return n;
+    }
+
+    void WriteTga(const char* file_name, const OutcomePalette& palette, uint32_t layer = 0) const
+    {
+        const ChainOutcome* outcomes = Outcomes(layer);
+        std::vector<OverlayPixel> pixels(Size());
+        for (size_t i = 0; i < pixels.size(); i++)
+            pixels[i] = palette(outcomes[i]);
+        tga_write(file_name, Width(), Height(), (uint8_t*)pixels.data(), 4, 3);
+    }
+
+    // pixels that are the same in both rasters are greyed out, otherwise uses the palette from this raster
+    void WriteDiffTga(const char* file_name,
+                      const OutcomeRaster& o,
+                      const OutcomePalette& palette,
+                      uint32_t layer = 0,
+                      uint32_t o_layer = 0) const
+    {
+        MON_ASSERT(Width() == o.Width() && Height() == o.Height());
+        const ChainOutcome* a = Outcomes(layer);
+        const ChainOutcome* b = o.Outcomes(o_layer);
+        std::vector<OverlayPixel> pixels(Size());
+        for (size_t i = 0; i < pixels.size(); i++)
+            pixels[i] = a[i] == b[i] ? OverlayPixel{60, 60, 60, 255} : palette(a[i]);
+        tga_write(file_name, Width(), Height(), (uint8_t*)pixels.data(), 4, 3);
+    }
+};
+
+} // namespace mon
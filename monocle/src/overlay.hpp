@@ -0,0 +1,313 @@
+#pragma once
+
+#include "game/source_math.hpp"
+#include "teleport_chain/generate.hpp"
+#include "prng.hpp"
+#include "ctpl_stl.h"
+#include "outcome_raster.hpp"
+#include "teleport_chain/ulp_diff.hpp"
+
+#include <array>
+#include <atomic>
+#include <format>
+#include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace mon {
+
+/*
+* Maps a (possibly fractional) pixel in an overlay image to an offset from the portal center along
+* the portal's r & u vectors. The orientation is as if we're looking at the portal.
+*/
+inline std::pair<float, float> OverlayPixelToFaceOffset(float x, float y, size_t x_res, size_t y_res)
+{
+    float oy = PORTAL_HALF_HEIGHT * (-1 + 1.f / y_res);
+    float ty = 1 - y / (y_res - 1);
+    float my = oy * (1 - 2 * ty);
+
+    float ox = PORTAL_HALF_WIDTH * (-1 + 1.f / x_res);
+    float tx = 1 - x / (x_res - 1);
+    float mx = ox * (1 - 2 * tx);
+
+    return {mx, my};
+}
+
+inline size_t OverlayXRes(size_t y_res)
+{
+    return (size_t)((double)y_res * PORTAL_HALF_WIDTH / PORTAL_HALF_HEIGHT);
+}
+
+namespace detail {
+
+/*
+* Renders one layer per portal pair, all of the pairs must share the same entry portal. The rows
+* run on pool if given (and a new pool otherwise). Rows that start after cancel is set are skipped
+* and left empty.
+*/
+inline OutcomeRaster RenderOverlayLayers(const TeleportChainParams& paramsTemplate,
+                                         const PortalPair* const* pairs,
+                                         uint32_t n_pairs,
+                                         size_t y_res,
+                                         bool rand_nudge,
+                                         uint32_t channels,
+                                         ctpl::thread_pool* pool,
+                                         const std::atomic_bool* cancel)
+{
+    size_t x_res = OverlayXRes(y_res);
+    OutcomeRaster raster{(uint32_t)x_res, (uint32_t)y_res, channels, n_pairs};
+    std::optional<ctpl::thread_pool> own_pool;
+    if (!pool) {
+        int n_threads = std::thread::hardware_concurrency();
+        pool = &own_pool.emplace(n_threads ? n_threads : 4);
+    }
+    std::vector<std::future<void>> rows;
+    rows.reserve(y_res);
+    for (size_t y = 0; y < y_res; y++) {
+
+        rows.push_back(pool->push([x_res, y_res, y, &paramsTemplate, &raster, rand_nudge, pairs, n_pairs, cancel](int) {
+            if (cancel && cancel->load(std::memory_order_relaxed))
+                return;
+            std::vector<float> nudges(x_res, 0.f);
+            if (rand_nudge)
+                xoshiro_prng_x4{xoshiro_prng::stream(0, y)}.fill_floats(nudges.data(), x_res, -.1f, .1f);
+            TeleportChainParams params = paramsTemplate;
+            params.record_flags = TCRF_NONE;
+            TeleportChainResult result;
+
+            const Portal& p = paramsTemplate.EntryPortal();
+
+            for (size_t x = 0; x < x_res; x++) {
+                auto [mx, my] = OverlayPixelToFaceOffset((float)x + nudges[x], (float)y, x_res, y_res);
+                params.ent = paramsTemplate.ent.WithNewCenter(p.pos + p.r * mx + p.u * my);
+                for (uint32_t layer = 0; layer < n_pairs; layer++) {
+                    params.pp = pairs[layer];
+                    GenerateTeleportChain(params, result);
+                    raster.Set(x_res * y + x, result, layer);
+                }
+            }
+        }));
+    }
+    for (std::future<void>& row : rows)
+        row.get();
+    return raster;
+}
+
+} // namespace detail
+
+/*
+* Generates a chain for each pixel on the entry portal, the entity is moved to each point on the
+* portal and everything else in the params is kept the same. The outcome of each chain is written
+* to the raster and the side channels are populated if requested. Long running processes can pass
+* their own pool and a cancellation flag (see detail::RenderOverlayLayers).
+*/
+inline OutcomeRaster RenderOverlayOutcomes(const TeleportChainParams& paramsTemplate,
+                                           size_t y_res,
+                                           bool rand_nudge = false,
+                                           uint32_t channels = ORC_NONE,
+                                           ctpl::thread_pool* pool = nullptr,
+                                           const std::atomic_bool* cancel = nullptr)
+{
+    const PortalPair* pp = paramsTemplate.pp;
+    return detail::RenderOverlayLayers(paramsTemplate, &pp, 1, y_res, rand_nudge, channels, pool, cancel);
+}
+
+/*
+* Same as RenderOverlayOutcomes, but evaluates every placement order at each pixel. Both orders
+* use the same portals and only differ in their teleport matrices, so the portals are only built
+* once and each entity position is reused for both chains. Layer i of the result is the render for
+* (PlacementOrder)i, the order in the params is ignored.
+*/
+inline OutcomeRaster RenderOverlayOutcomesAllOrders(const TeleportChainParams& paramsTemplate,
+                                                    size_t y_res,
+                                                    bool rand_nudge = false,
+                                                    uint32_t channels = ORC_NONE)
+{
+    MON_ASSERT(!!paramsTemplate.pp);
+    std::array<PortalPair, (size_t)PlacementOrder::COUNT> pairs{
+        PortalPair{paramsTemplate.pp->blue, paramsTemplate.pp->orange, (PlacementOrder)0},
+        PortalPair{paramsTemplate.pp->blue, paramsTemplate.pp->orange, (PlacementOrder)1},
+    };
+    std::array<const PortalPair*, pairs.size()> pair_ptrs;
+    for (size_t i = 0; i < pairs.size(); i++)
+        pair_ptrs[i] = &pairs[i];
+    return detail::RenderOverlayLayers(paramsTemplate,
+                                       pair_ptrs.data(),
+                                       (uint32_t)pair_ptrs.size(),
+                                       y_res,
+                                       rand_nudge,
+                                       channels,
+                                       nullptr,
+                                       nullptr);
+}
+
+// renders the overlay outcomes and writes them to a .tga file with the default palette
+inline void CreateOverlayPortalImage(const TeleportChainParams& paramsTemplate,
+                                     const char* file_name,
+                                     size_t y_res,
+                                     bool rand_nudge = false)
+{
+    RenderOverlayOutcomes(paramsTemplate, y_res, rand_nudge).WriteTga(file_name, OutcomePalette::Default());
+}
+
+// renders both placement orders in one pass and writes them to <file_prefix>_<order>.tga
+inline void CreateOverlayPortalImagesAllOrders(const TeleportChainParams& paramsTemplate,
+                                               const char* file_prefix,
+                                               size_t y_res,
+                                               bool rand_nudge = false)
+{
+    OutcomeRaster raster = RenderOverlayOutcomesAllOrders(paramsTemplate, y_res, rand_nudge);
+    for (uint32_t layer = 0; layer < raster.Layers(); layer++) {
+        std::string file_name = std::format("{}_{}.tga", file_prefix, PlacementOrderStrs[layer]);
+        raster.WriteTga(file_name.c_str(), OutcomePalette::Default(), layer);
+    }
+}
+
+struct UlpLatticeParams {
+    // offset of the window center from the entry portal center along the portal's r & u vectors
+    float r_off = 0.f, u_off = 0.f;
+    // the window spans [-half_ulps, half_ulps] ulps from the window center along each free axis
+    uint32_t half_ulps_x = 64, half_ulps_y = 64;
+    // number of lattice rows per task, rows are delivered to the sink in order
+    size_t rows_per_chunk = 8;
+};
+
+struct UlpLatticeStats {
+    /*
+    * The two world axes that are enumerated, the remaining axis is the largest component of the
+    * entry portal normal and is set by projecting the entity onto the portal plane. Columns
+    * step along free_axes[0] and rows step along free_axes[1].
+    */
+    int free_axes[2];
+    uint64_t n_total = 0;
+    uint64_t n_vag = 0;
+    std::array<uint64_t, 256> histogram{};
+
+    // exact as a ratio, n_vag / n_total
+    double VagFraction() const
+    {
+        return n_total ? (double)n_vag / (double)n_total : 0.;
+    }
+};
+
+/*
+* Runs compute(size_t chunk) -> std::vector<ChainOutcome> for every chunk in [0, n_chunks) on a
+* thread pool and passes the results to sink(size_t chunk, const std::vector<ChainOutcome>&) in
+* chunk order. Chunks that finish early are held until the ones before them are done, and sink is
+* never called concurrently, so only the out of order chunks have to be kept in memory.
+*/
+template <typename ComputeFn, typename SinkFn>
+void RunOrderedChunks(size_t n_chunks, ComputeFn&& compute, SinkFn&& sink)
+{
+    std::mutex mtx;
+    std::map<size_t, std::vector<ChainOutcome>> finished_chunks;
+    size_t next_chunk = 0;
+
+    int n_threads = std::thread::hardware_concurrency();
+    ctpl::thread_pool pool{n_threads ? n_threads : 4};
+    for (size_t chunk = 0; chunk < n_chunks; chunk++) {
+        pool.push([&, chunk](int) -> void {
+            std::vector<ChainOutcome> outcomes = compute(chunk);
+            std::lock_guard lock{mtx};
+            finished_chunks.emplace(chunk, std::move(outcomes));
+            // flush any chunks that are now in order
+            for (auto it = finished_chunks.begin(); it != finished_chunks.end() && it->first == next_chunk;
+                 it = finished_chunks.erase(it), next_chunk++)
+                sink(next_chunk, it->second);
+        });
+    }
+    pool.stop(true);
+    MON_ASSERT(finished_chunks.empty() && next_chunk == n_chunks);
+}
+
+/*
+* Overlay images sample the portal on an arbitrary grid, so the patterns in them depend on the
+* image resolution. Instead, this enumerates every representable entity position (the player
+* origin or ball center) in a small window on the entry portal and runs a chain for each one.
+*
+* The window is centered at the given offset and the two world axes that aren't the largest
+* component of the portal normal are stepped one ulp at a time; the last axis is determined by
+* projecting the entity to the portal plane (params.project_to_first_portal_plane is forced on).
+*
+* row_sink is called as row_sink(size_t row, const ChainOutcome* outcomes, size_t n_cols) in row
+* order and never concurrently, so huge windows can be streamed instead of stored.
+*/
+template <typename RowSink>
+UlpLatticeStats RenderUlpLattice(const TeleportChainParams& paramsTemplate,
+                                 const UlpLatticeParams& lattice,
+                                 RowSink&& row_sink)
+{
+    const Portal& p = paramsTemplate.EntryPortal();
+    Entity center_ent = paramsTemplate.ent.WithNewCenter(p.pos + p.r * lattice.r_off + p.u * lattice.u_off);
+    const Vector center_pos = center_ent.GetPosRef();
+
+    int norm_ax = 0;
+    for (int i = 1; i < 3; i++)
+        if (std::fabsf(p.plane.n[i]) > std::fabsf(p.plane.n[norm_ax]))
+            norm_ax = i;
+    int a0 = (norm_ax + 1) % 3, a1 = (norm_ax + 2) % 3;
+    // put the axis that's closest to the portal's right vector along the columns
+    if (std::fabsf(p.r[a1]) > std::fabsf(p.r[a0]))
+        std::swap(a0, a1);
+
+    UlpLatticeStats stats{.free_axes = {a0, a1}};
+
+    size_t n_cols = (size_t)lattice.half_ulps_x * 2 + 1;
+    size_t n_rows = (size_t)lattice.half_ulps_y * 2 + 1;
+    size_t rows_per_chunk = lattice.rows_per_chunk ? lattice.rows_per_chunk : 1;
+    size_t n_chunks = (n_rows + rows_per_chunk - 1) / rows_per_chunk;
+
+    RunOrderedChunks(
+        n_chunks,
+        [&](size_t chunk) {
+            TeleportChainParams params = paramsTemplate;
+            params.project_to_first_portal_plane = true;
+            params.record_flags = TCRF_NONE;
+            TeleportChainResult result;
+
+            size_t row_begin = chunk * rows_per_chunk;
+            size_t row_end = std::min(row_begin + rows_per_chunk, n_rows);
+            std::vector<ChainOutcome> outcomes((row_end - row_begin) * n_cols);
+
+            for (size_t row = row_begin; row < row_end; row++) {
+                params.ent = center_ent;
+                Vector& pos = params.ent.GetPosRef();
+                pos[a1] = ulp::StepUlpsF(center_pos[a1], (int32_t)row - (int32_t)lattice.half_ulps_y);
+                for (size_t col = 0; col < n_cols; col++) {
+                    pos[a0] = ulp::StepUlpsF(center_pos[a0], (int32_t)col - (int32_t)lattice.half_ulps_x);
+                    GenerateTeleportChain(params, result);
+                    outcomes[(row - row_begin) * n_cols + col] = ChainOutcome::FromResult(result);
+                }
+            }
+            return outcomes;
+        },
+        [&](size_t chunk, const std::vector<ChainOutcome>& outcomes) {
+            for (ChainOutcome o : outcomes) {
+                stats.histogram[o.bits]++;
+                stats.n_vag += o.IsVag();
+            }
+            stats.n_total += outcomes.size();
+            for (size_t r = 0; r < outcomes.size() / n_cols; r++)
+                row_sink(chunk * rows_per_chunk + r, outcomes.data() + r * n_cols, n_cols);
+        });
+    return stats;
+}
+
+// convenience wrapper, renders the whole lattice into a raster (row 0 is the top of the image)
+inline std::pair<OutcomeRaster, UlpLatticeStats> RenderUlpLatticeRaster(const TeleportChainParams& paramsTemplate,
+                                                                        const UlpLatticeParams& lattice)
+{
+    OutcomeRaster raster{lattice.half_ulps_x * 2 + 1, lattice.half_ulps_y * 2 + 1};
+    UlpLatticeStats stats =
+        RenderUlpLattice(paramsTemplate, lattice, [&raster](size_t row, const ChainOutcome* outcomes, size_t n) {
+            memcpy(&raster.At(0, raster.Height() - 1 - row), outcomes, n * sizeof(ChainOutcome));
+        });
+    return {std::move(raster), stats};
+}
+
+} // namespace mon
@@ -0,0 +1,493 @@
+#pragma once
+
+#include "game/source_math.hpp"
+#include "teleport_chain/generate.hpp"
+#include "ctpl_stl.h"
+#include "outcome_raster.hpp"
+#include "overlay.hpp"
+
+#include <stdint.h>
+#include <algorithm>
+#include <array>
+#include <format>
+#include <future>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace mon {
+
+// the regions shown in overlay images
+enum OverlayRegion : uint8_t {
+    OR_NORMAL,        // white, cum == 1
+    OR_VAG,           // red, cum == -1
+    OR_BACK_TO_ENTRY, // grey, cum == 0
+    OR_OTHER,         // anything else (including exceeded chains)
+    OR_COUNT,
+
+    OR_OUTSIDE = 0xff, // off the portal face, not part of any region
+};
+
+inline constexpr std::array<const char*, OR_COUNT> OverlayRegionStrs{
+    "normal",
+    "vag",
+    "back_to_entry",
+    "other",
+};
+
+constexpr OverlayRegion ClassifyOutcome(ChainOutcome o)
+{
+    if (o.MaxTpsExceeded())
+        return OR_OTHER;
+    switch (o.CumTeleports()) {
+        case 1:
+            return OR_NORMAL;
+        case -1:
+            return OR_VAG;
+        case 0:
+            return OR_BACK_TO_ENTRY;
+        default:
+            return OR_OTHER;
+    }
+}
+
+// a closed loop in portal-local coordinates (offsets along r & u), the region is to the left of the loop
+struct RegionContour {
+    OverlayRegion region;
+    std::vector<std::pair<float, float>> pts;
+};
+
+struct RegionContours {
+    std::vector<RegionContour> contours;
+    // the number of chains that were generated to create the contours
+    size_t n_chain_evals = 0;
+    // loops that didn't close because the grid was inconsistent and were left out, 0 unless there's a bug
+    size_t n_open_contours = 0;
+
+    // the viewbox is the portal face as if you're looking at it, holes are handled with the nonzero fill rule
+    std::string ToSvg() const
+    {
+        static constexpr std::array<const char*, OR_COUNT> fills{"#ffffff", "#ff0000", "#7d7d7d", "#0000ff"};
+        std::string out = std::format(
+            "<svg xmlns=\"http://www.w3.org/2000/svg\" viewBox=\"{} {} {} {}\">\n"
+            "<rect x=\"{}\" y=\"{}\" width=\"{}\" height=\"{}\" "
+            "fill=\"none\" stroke=\"black\" stroke-width=\"0.2\"/>\n",
+            -PORTAL_HALF_WIDTH,
+            -PORTAL_HALF_HEIGHT,
+            2 * PORTAL_HALF_WIDTH,
+            2 * PORTAL_HALF_HEIGHT,
+            -PORTAL_HALF_WIDTH,
+            -PORTAL_HALF_HEIGHT,
+            2 * PORTAL_HALF_WIDTH,
+            2 * PORTAL_HALF_HEIGHT);
+        for (int region = 0; region < OR_COUNT; region++) {
+            std::string d;
+            for (const RegionContour& c : contours) {
+                if (c.region != region)
+                    continue;
+                for (size_t i = 0; i < c.pts.size(); i++)
+                    d += std::format("{}" MON_F_FMT " " MON_F_FMT, i ? " L" : " M", -c.pts[i].first, -c.pts[i].second);
+                d += " Z";
+            }
+            if (!d.empty())
+                out += std::format("<path class=\"{}\" fill=\"{}\" fill-rule=\"nonzero\" d=\"{}\"/>\n",
+                                   OverlayRegionStrs[region],
+                                   fills[region],
+                                   d);
+        }
+        return out + "</svg>\n";
+    }
+
+    std::string ToJson() const
+    {
+        std::string out = std::format("{{\"n_chain_evals\":{},\"contours\":[", n_chain_evals);
+        for (size_t i = 0; i < contours.size(); i++) {
+            out += std::format("{}{{\"region\":\"{}\",\"pts\":[", i ? "," : "", OverlayRegionStrs[contours[i].region]);
+            for (size_t j = 0; j < contours[i].pts.size(); j++)
+                out += std::format("{}[" MON_F_FMT "," MON_F_FMT "]",
+                                   j ? "," : "",
+                                   contours[i].pts[j].first,
+                                   contours[i].pts[j].second);
+            out += "]}";
+        }
+        return out + "]}";
+    }
+};
+
+/*
+* Marching squares over a grid of region nodes. The grid is padded by a ring of OR_OUTSIDE nodes
+* so that every contour is a closed loop. Each cell emits segments from the edge where a region
+* is exited to the edge where it's entered (walking counter-clockwise), which keeps the region on
+* the left of every loop. Saddles are resolved by separating the two diagonal corners.
+*/
+class ContourBuilder {
+    int nx, ny;
+    std::array<std::unordered_map<uint64_t, uint64_t>, OR_COUNT> next_edge;
+
+    // edge from node (x,y) to (x+1,y) (horizontal) or (x,y+1) (vertical), nodes may be in the padding
+    uint64_t EdgeId(int x, int y, bool vertical) const
+    {
+        return ((uint64_t)(y + 1) * (uint64_t)(nx + 2) + (uint64_t)(x + 1)) * 2 + vertical;
+    }
+
+public:
+    ContourBuilder(int nx, int ny) : nx{nx}, ny{ny} {}
+
+    struct EdgeNodes {
+        int x0, y0, x1, y1;
+    };
+
+    EdgeNodes EdgeFromId(uint64_t id) const
+    {
+        bool vertical = id & 1;
+        id >>= 1;
+        int x = (int)(id % (uint64_t)(nx + 2)) - 1;
+        int y = (int)(id / (uint64_t)(nx + 2)) - 1;
+        return {x, y, x + !vertical, y + vertical};
+    }
+
+    // corners are the regions of nodes (x,y), (x+1,y), (x+1,y+1), (x,y+1) - cell coords can be -1 for the padding
+    void AddCell(int x, int y, const std::array<OverlayRegion, 4>& corners)
+    {
+        if (corners[0] == corners[1] && corners[1] == corners[2] && corners[2] == corners[3])
+            return;
+        const uint64_t edges[4]{
+            EdgeId(x, y, false),
+            EdgeId(x + 1, y, true),
+            EdgeId(x, y + 1, false),
+            EdgeId(x, y, true),
+        };
+        for (int region = 0; region < OR_COUNT; region++) {
+            bool in[4];
+            for (int i = 0; i < 4; i++)
+                in[i] = corners[i] == region;
+            for (int k = 0; k < 4; k++) {
+                if (!in[k] || in[(k + 1) % 4])
+                    continue;
+                // edge k exits the region, walk backwards to the first edge that enters it
+                for (int j = 3; j > 0; j--) {
+                    int e = (k + j) % 4;
+                    if (!in[e] && in[(e + 1) % 4]) {
+                        next_edge[region][edges[k]] = edges[e];
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    // calls fn(region, edge_id) for every boundary crossing
+    template <typename EdgeFn>
+    void ForEachEdge(EdgeFn&& fn) const
+    {
+        for (int region = 0; region < OR_COUNT; region++)
+            for (auto& [e, _] : next_edge[region])
+                fn((OverlayRegion)region, e);
+    }
+
+    /*
+    * edge_pt(region, edge_id) returns the portal-local point for an edge crossing, the segments are
+    * consumed. Loops that don't close (only possible if the cells weren't added consistently) are
+    * dropped and counted in n_open.
+    */
+    template <typename EdgePtFn>
+    std::vector<RegionContour> Build(EdgePtFn&& edge_pt, size_t& n_open)
+    {
+        std::vector<RegionContour> contours;
+        for (int region = 0; region < OR_COUNT; region++) {
+            auto& nexts = next_edge[region];
+            while (!nexts.empty()) {
+                RegionContour c{.region = (OverlayRegion)region};
+                uint64_t start = nexts.begin()->first;
+                bool closed = false;
+                for (uint64_t e = start;;) {
+                    c.pts.push_back(edge_pt((OverlayRegion)region, e));
+                    auto it = nexts.find(e);
+                    if (it == nexts.end())
+                        break;
+                    e = it->second;
+                    nexts.erase(it);
+                    if (e == start) {
+                        closed = true;
+                        break;
+                    }
+                }
+                if (closed && c.pts.size() >= 3)
+                    contours.push_back(std::move(c));
+                else
+                    n_open++;
+            }
+        }
+        return contours;
+    }
+};
+
+// node (x,y) of a grid with nx*ny nodes to portal-local coordinates, clamped to the portal face
+inline std::pair<float, float> ContourNodeToFace(float x, float y, int nx, int ny)
+{
+    auto [r, u] = OverlayPixelToFaceOffset(x, y, (size_t)nx, (size_t)ny);
+    return {
+        std::clamp(r, -PORTAL_HALF_WIDTH, PORTAL_HALF_WIDTH),
+        std::clamp(u, -PORTAL_HALF_HEIGHT, PORTAL_HALF_HEIGHT),
+    };
+}
+
+// contours of an existing raster with the same orientation as the overlay images, pixel centers are the grid nodes
+inline RegionContours ExtractRasterContours(const OutcomeRaster& raster)
+{
+    int nx = (int)raster.Width(), ny = (int)raster.Height();
+    auto region_at = [&](int x, int y) -> OverlayRegion {
+        if (x < 0 || y < 0 || x >= nx || y >= ny)
+            return OR_OUTSIDE;
+        return ClassifyOutcome(raster.At(x, y));
+    };
+    ContourBuilder builder{nx, ny};
+    for (int y = -1; y < ny; y++)
+        for (int x = -1; x < nx; x++)
+            builder.AddCell(x, y, {region_at(x, y), region_at(x + 1, y), region_at(x + 1, y + 1), region_at(x, y + 1)});
+    RegionContours out;
+    out.contours = builder.Build(
+        [&](OverlayRegion, uint64_t e) {
+            auto [x0, y0, x1, y1] = builder.EdgeFromId(e);
+            return ContourNodeToFace((x0 + x1) * .5f, (y0 + y1) * .5f, nx, ny);
+        },
+        out.n_open_contours);
+    return out;
+}
+
+struct AdaptiveContourParams {
+    // number of cells in the initial grid, regions smaller than a coarse cell may be missed
+    int coarse_x = 16, coarse_y = 27;
+    // each level halves the cell size along boundaries
+    int n_levels = 6;
+    // after refinement, each boundary crossing is bisected this many times along its grid edge
+    int n_edge_bisections = 0;
+};
+
+/*
+* Finds the outlines of the overlay regions without rendering the whole face. A coarse grid is
+* sampled first, then only cells whose edges disagree are subdivided, so the number of chains
+* scales with the length of the region boundaries instead of the area.
+*
+* The lines of the coarse grid are sampled at the finest resolution, so any region that crosses
+* one is found even if it slips between the corners of a cell. A cell is only left alone once
+* every sampled node along its edges agrees with its corners. That check is repeated whenever new
+* nodes are sampled, so the neighbours of a split cell get split too if the boundary continues
+* into them, and a refined cell never meets an unrefined one with a crossing on the shared edge.
+* Regions that fit entirely inside a coarse cell without touching its edges can still be missed.
+*
+* eval_batch(pts) returns the region at each portal-local point of a vector.
+*/
+template <typename EvalBatchFn>
+inline RegionContours ExtractAdaptiveRegionContours(EvalBatchFn&& eval_batch, const AdaptiveContourParams& acp)
+{
+    MON_ASSERT(acp.coarse_x > 0 && acp.coarse_y > 0 && acp.n_levels >= 0 && acp.n_levels < 16);
+    const int step0 = 1 << acp.n_levels;
+    const int nx = acp.coarse_x * step0 + 1;
+    const int ny = acp.coarse_y * step0 + 1;
+
+    RegionContours out;
+    auto eval = [&](const std::vector<std::pair<float, float>>& pts) {
+        out.n_chain_evals += pts.size();
+        std::vector<OverlayRegion> regions = eval_batch(pts);
+        MON_ASSERT(regions.size() == pts.size());
+        return regions;
+    };
+
+    std::unordered_map<uint64_t, OverlayRegion> nodes;
+    auto node_key = [](int x, int y) { return (uint64_t)(uint32_t)y << 32 | (uint32_t)x; };
+    auto region_at = [&](int x, int y) -> OverlayRegion {
+        if (x < 0 || y < 0 || x >= nx || y >= ny)
+            return OR_OUTSIDE;
+        auto it = nodes.find(node_key(x, y));
+        MON_ASSERT(it != nodes.end());
+        return it->second;
+    };
+
+    // requested nodes only go into the map once they're evaluated so that they can't be mistaken for real ones
+    std::vector<std::pair<int, int>> to_eval;
+    std::unordered_set<uint64_t> requested;
+    auto eval_pending = [&]() {
+        std::vector<std::pair<float, float>> pts;
+        pts.reserve(to_eval.size());
+        for (auto [x, y] : to_eval)
+            pts.push_back(ContourNodeToFace((float)x, (float)y, nx, ny));
+        std::vector<OverlayRegion> regions = eval(pts);
+        for (size_t i = 0; i < to_eval.size(); i++)
+            nodes[node_key(to_eval[i].first, to_eval[i].second)] = regions[i];
+        to_eval.clear();
+        requested.clear();
+    };
+    auto request_node = [&](int x, int y) {
+        uint64_t key = node_key(x, y);
+        if (!nodes.contains(key) && requested.insert(key).second)
+            to_eval.emplace_back(x, y);
+    };
+
+    // the coarse grid lines at full resolution
+    for (int y = 0; y < ny; y += step0)
+        for (int x = 0; x < nx; x++)
+            request_node(x, y);
+    for (int x = 0; x < nx; x += step0)
+        for (int y = 0; y < ny; y++)
+            request_node(x, y);
+    eval_pending();
+
+    struct Cell {
+        int x, y, step;
+    };
+    // true if every node that has been sampled along the edges of the cell is in the same region
+    auto is_uniform = [&](Cell c) {
+        OverlayRegion r0 = region_at(c.x, c.y);
+        for (int i = 0; i < c.step; i++) {
+            const std::pair<int, int> edge_nodes[4]{
+                {c.x + i, c.y},
+                {c.x + c.step, c.y + i},
+                {c.x + c.step - i, c.y + c.step},
+                {c.x, c.y + c.step - i},
+            };
+            for (auto [x, y] : edge_nodes) {
+                auto it = nodes.find(node_key(x, y));
+                if (it != nodes.end() && it->second != r0)
+                    return false;
+            }
+        }
+        return true;
+    };
+
+    std::vector<Cell> cells, next_cells, quiet, leaves;
+    for (int y = 0; y < ny - 1; y += step0)
+        for (int x = 0; x < nx - 1; x += step0)
+            cells.push_back({x, y, step0});
+
+    while (!cells.empty()) {
+        next_cells.clear();
+        for (Cell c : cells) {
+            if (is_uniform(c)) {
+                quiet.push_back(c);
+                continue;
+            }
+            if (c.step == 1) {
+                leaves.push_back(c);
+                continue;
+            }
+            int h = c.step / 2;
+            request_node(c.x + h, c.y);
+            request_node(c.x, c.y + h);
+            request_node(c.x + h, c.y + h);
+            request_node(c.x + c.step, c.y + h);
+            request_node(c.x + h, c.y + c.step);
+            next_cells.push_back({c.x, c.y, h});
+            next_cells.push_back({c.x + h, c.y, h});
+            next_cells.push_back({c.x, c.y + h, h});
+            next_cells.push_back({c.x + h, c.y + h, h});
+        }
+        eval_pending();
+        // the new nodes may show that the boundary continues into cells that looked uniform before
+        std::erase_if(quiet, [&](Cell c) {
+            if (is_uniform(c))
+                return false;
+            next_cells.push_back(c);
+            return true;
+        });
+        std::swap(cells, next_cells);
+    }
+
+    ContourBuilder builder{nx, ny};
+    auto add_cell = [&](int x, int y) {
+        builder.AddCell(x, y, {region_at(x, y), region_at(x + 1, y), region_at(x + 1, y + 1), region_at(x, y + 1)});
+    };
+    for (Cell c : leaves)
+        add_cell(c.x, c.y);
+    // the padding ring, only cells along the border can have crossings
+    for (int x = -1; x < nx; x++) {
+        add_cell(x, -1);
+        add_cell(x, ny - 1);
+    }
+    for (int y = 0; y < ny - 1; y++) {
+        add_cell(-1, y);
+        add_cell(nx - 1, y);
+    }
+
+    // optionally move each crossing closer to the true boundary by bisecting along its edge
+    struct Crossing {
+        std::pair<float, float> in, out; // portal-local points on either side of the boundary
+    };
+    std::unordered_map<uint64_t, Crossing> crossings[OR_COUNT];
+    if (acp.n_edge_bisections > 0) {
+        std::vector<std::pair<OverlayRegion, uint64_t>> keys;
+        std::vector<std::pair<float, float>> pts;
+        builder.ForEachEdge([&](OverlayRegion region, uint64_t e) {
+            auto [x0, y0, x1, y1] = builder.EdgeFromId(e);
+            // crossings into the padding are on the portal edge and don't need refining
+            if (region_at(x0, y0) != OR_OUTSIDE && region_at(x1, y1) != OR_OUTSIDE) {
+                auto a = ContourNodeToFace((float)x0, (float)y0, nx, ny);
+                auto b = ContourNodeToFace((float)x1, (float)y1, nx, ny);
+                bool a_in = region_at(x0, y0) == region;
+                crossings[region][e] = {a_in ? a : b, a_in ? b : a};
+                keys.emplace_back(region, e);
+            }
+        });
+        for (int i = 0; i < acp.n_edge_bisections; i++) {
+            pts.clear();
+            for (auto [region, e] : keys) {
+                const Crossing& c = crossings[region][e];
+                pts.emplace_back((c.in.first + c.out.first) * .5f, (c.in.second + c.out.second) * .5f);
+            }
+            std::vector<OverlayRegion> regions = eval(pts);
+            for (size_t j = 0; j < keys.size(); j++) {
+                Crossing& c = crossings[keys[j].first][keys[j].second];
+                (regions[j] == keys[j].first ? c.in : c.out) = pts[j];
+            }
+        }
+    }
+
+    out.contours = builder.Build(
+        [&](OverlayRegion region, uint64_t e) {
+            auto it = crossings[region].find(e);
+            if (it != crossings[region].end())
+                return std::pair{(it->second.in.first + it->second.out.first) * .5f,
+                                 (it->second.in.second + it->second.out.second) * .5f};
+            auto [x0, y0, x1, y1] = builder.EdgeFromId(e);
+            return ContourNodeToFace((x0 + x1) * .5f, (y0 + y1) * .5f, nx, ny);
+        },
+        out.n_open_contours);
+    return out;
+}
+
+// the overlay regions of the chains from paramsTemplate with the entity moved around on the entry portal
+inline RegionContours ExtractAdaptiveContours(const TeleportChainParams& paramsTemplate,
+                                              const AdaptiveContourParams& acp)
+{
+    const Portal& p = paramsTemplate.EntryPortal();
+    int n_threads = std::thread::hardware_concurrency();
+    ctpl::thread_pool pool{n_threads ? n_threads : 4};
+
+    // evaluates the region at each portal-local point in parallel
+    auto eval_batch = [&](const std::vector<std::pair<float, float>>& pts) {
+        std::vector<OverlayRegion> regions(pts.size());
+        std::vector<std::future<void>> futures;
+        const size_t chunk_size = 256;
+        for (size_t start = 0; start < pts.size(); start += chunk_size) {
+            futures.push_back(pool.push([&, start](int) -> void {
+                TeleportChainParams params = paramsTemplate;
+                params.record_flags = TCRF_NONE;
+                TeleportChainResult result;
+                for (size_t i = start; i < std::min(start + chunk_size, pts.size()); i++) {
+                    params.ent = paramsTemplate.ent.WithNewCenter(p.pos + p.r * pts[i].first + p.u * pts[i].second);
+                    GenerateTeleportChain(params, result);
+                    regions[i] = ClassifyOutcome(ChainOutcome::FromResult(result));
+                }
+            }));
+        }
+        for (auto& f : futures)
+            f.get();
+        return regions;
+    };
+    return ExtractAdaptiveRegionContours(eval_batch, acp);
+}
+
+} // namespace mon
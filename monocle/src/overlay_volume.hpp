@@ -0,0 +1,305 @@
+#pragma once
+
+#include "game/source_math.hpp"
+#include "teleport_chain/generate.hpp"
+#include "ctpl_stl.h"
+#include "outcome_raster.hpp"
+#include "overlay.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace mon {
+
+// a run of identical outcomes along the x axis of a volume
+struct OutcomeRun {
+    ChainOutcome outcome;
+    uint8_t len_minus_one;
+};
+static_assert(sizeof(OutcomeRun) == 2);
+
+/*
+* Appends a row of outcomes to a run list, runs longer than 256 are split. Overlay rows are mostly
+* made of a few large regions so this is usually a couple of runs per row.
+*/
+inline void AppendOutcomeRuns(std::vector<OutcomeRun>& runs, const ChainOutcome* outcomes, size_t n)
+{
+    for (size_t i = 0; i < n;) {
+        size_t j = i + 1;
+        while (j < n && j - i < 256 && outcomes[j] == outcomes[i])
+            j++;
+        runs.push_back({outcomes[i], (uint8_t)(j - i - 1)});
+        i = j;
+    }
+}
+
+/*
+* On-disk layout of an outcome volume (all little endian):
+* - OutcomeVolumeFileHeader
+* - uint64_t row_offsets[height * depth + 1], index of the first run of each row, rows are ordered
+*   by z then y
+* - OutcomeRun runs[n_runs]
+*/
+struct OutcomeVolumeFileHeader {
+    static constexpr char MAGIC[4] = {'M', 'O', 'V', 'L'};
+    static constexpr uint32_t VERSION = 1;
+
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+    // distance along the portal's forward vector of the first and last slice
+    float f_min, f_max;
+    uint32_t _reserved[9];
+};
+static_assert(sizeof(OutcomeVolumeFileHeader) == 64);
+
+/*
+* A run-length encoded 3D grid of chain outcomes. Slice z is an overlay image (same orientation
+* as OutcomeRaster) of the entity placed at a fixed distance in front of or behind the portal.
+*/
+class OutcomeVolume {
+    uint32_t width = 0, height = 0, depth = 0;
+    float f_min = 0, f_max = 0;
+    std::vector<uint64_t> row_offsets{0};
+    std::vector<OutcomeRun> runs;
+
+public:
+    OutcomeVolume() = default;
+
+    OutcomeVolume(uint32_t width, uint32_t height, uint32_t depth, float f_min, float f_max)
+        : width{width}, height{height}, depth{depth}, f_min{f_min}, f_max{f_max}
+    {
+        row_offsets.reserve((size_t)height * depth + 1);
+    }
+
+    uint32_t Width() const
+    {
+        return width;
+    }
+
+    uint32_t Height() const
+    {
+        return height;
+    }
+
+    uint32_t Depth() const
+    {
+        return depth;
+    }
+
+    // distance of slice z along the portal's forward vector
+    float SliceOffset(uint32_t z) const
+    {
+        return depth > 1 ? f_min + (f_max - f_min) * ((float)z / (float)(depth - 1)) : f_min;
+    }
+
+    size_t NumRows() const
+    {
+        return row_offsets.size() - 1;
+    }
+
+    bool IsComplete() const
+    {
+        return NumRows() == (size_t)height * depth;
+    }
+
+    size_t NumRuns() const
+    {
+        return runs.size();
+    }
+
+    // in bytes, not including the header
+    size_t CompressedSize() const
+    {
+        return row_offsets.size() * sizeof(uint64_t) + runs.size() * sizeof(OutcomeRun);
+    }
+
+    // rows must be added in order, z then y
+    void AppendRow(const ChainOutcome* outcomes, size_t n)
+    {
+        MON_ASSERT(n == width && !IsComplete());
+        AppendOutcomeRuns(runs, outcomes, n);
+        row_offsets.push_back(runs.size());
+    }
+
+    void DecodeRow(uint32_t y, uint32_t z, ChainOutcome* out) const
+    {
+        MON_ASSERT(y < height && z < depth);
+        size_t row = (size_t)z * height + y;
+        MON_ASSERT(row < NumRows());
+        for (uint64_t i = row_offsets[row]; i < row_offsets[row + 1]; i++) {
+            memset(out, runs[i].outcome.bits, runs[i].len_minus_one + 1);
+            out += runs[i].len_minus_one + 1;
+        }
+    }
+
+    ChainOutcome At(uint32_t x, uint32_t y, uint32_t z) const
+    {
+        MON_ASSERT(x < width && y < height && z < depth);
+        size_t row = (size_t)z * height + y;
+        MON_ASSERT(row < NumRows());
+        for (uint64_t i = row_offsets[row]; i < row_offsets[row + 1]; i++) {
+            if (x <= runs[i].len_minus_one)
+                return runs[i].outcome;
+            x -= runs[i].len_minus_one + 1;
+        }
+        MON_ASSERT(false);
+        return {};
+    }
+
+    // decompresses a single slice
+    OutcomeRaster Slice(uint32_t z) const
+    {
+        OutcomeRaster raster{width, height};
+        for (uint32_t y = 0; y < height; y++)
+            DecodeRow(y, z, &raster.At(0, y));
+        return raster;
+    }
+
+    // number of times each outcome byte appears in a slice
+    std::array<size_t, 256> Histogram(uint32_t z) const
+    {
+        MON_ASSERT(z < depth && (size_t)(z + 1) * height <= NumRows());
+        std::array<size_t, 256> hist{};
+        for (uint64_t i = row_offsets[(size_t)z * height]; i < row_offsets[(size_t)(z + 1) * height]; i++)
+            hist[runs[i].outcome.bits] += runs[i].len_minus_one + 1;
+        return hist;
+    }
+
+    bool Save(const std::filesystem::path& path) const
+    {
+        MON_ASSERT(IsComplete());
+        OutcomeVolumeFileHeader hdr{};
+        memcpy(hdr.magic, OutcomeVolumeFileHeader::MAGIC, sizeof hdr.magic);
+        hdr.version = OutcomeVolumeFileHeader::VERSION;
+        hdr.width = width;
+        hdr.height = height;
+        hdr.depth = depth;
+        hdr.f_min = f_min;
+        hdr.f_max = f_max;
+        if (!path.parent_path().empty())
+            std::filesystem::create_directories(path.parent_path());
+        std::ofstream file{path, std::ios::binary};
+        file.write((const char*)&hdr, sizeof hdr);
+        file.write((const char*)row_offsets.data(), row_offsets.size() * sizeof(uint64_t));
+        file.write((const char*)runs.data(), runs.size() * sizeof(OutcomeRun));
+        return !!file;
+    }
+
+    static std::optional<OutcomeVolume> Load(const std::filesystem::path& path)
+    {
+        std::ifstream file{path, std::ios::binary};
+        OutcomeVolumeFileHeader hdr;
+        if (!file.read((char*)&hdr, sizeof hdr) || memcmp(hdr.magic, OutcomeVolumeFileHeader::MAGIC, 4) ||
+            hdr.version != OutcomeVolumeFileHeader::VERSION)
+            return {};
+        OutcomeVolume vol{hdr.width, hdr.height, hdr.depth, hdr.f_min, hdr.f_max};
+        vol.row_offsets.resize((size_t)hdr.height * hdr.depth + 1);
+        if (!file.read((char*)vol.row_offsets.data(), vol.row_offsets.size() * sizeof(uint64_t)))
+            return {};
+        // validate the offsets so that a corrupt file can't make us read out of bounds
+        if (vol.row_offsets[0] != 0)
+            return {};
+        for (size_t i = 1; i < vol.row_offsets.size(); i++)
+            if (vol.row_offsets[i] < vol.row_offsets[i - 1])
+                return {};
+        vol.runs.resize(vol.row_offsets.back());
+        if (!file.read((char*)vol.runs.data(), vol.runs.size() * sizeof(OutcomeRun)))
+            return {};
+        for (size_t r = 0; r + 1 < vol.row_offsets.size(); r++) {
+            size_t n = 0;
+            for (uint64_t i = vol.row_offsets[r]; i < vol.row_offsets[r + 1]; i++)
+                n += vol.runs[i].len_minus_one + 1;
+            if (n != hdr.width)
+                return {};
+        }
+        return vol;
+    }
+};
+
+struct VolumeSweepParams {
+    // the resolution of each slice, the width is determined from the portal aspect ratio
+    size_t y_res = 300;
+    // number of slices and their distance along the entry portal's forward vector (negative is behind the portal)
+    uint32_t n_slices = 64;
+    float f_min = -1.f, f_max = 1.f;
+    // number of rows per task, rows are delivered in order so only finished chunks are kept in memory
+    size_t rows_per_chunk = 16;
+};
+
+/*
+* A 3D version of the overlay images. Instead of projecting the entity onto the entry portal plane,
+* the entity is also moved along the portal's forward vector and project_to_first_portal_plane is
+* turned off. Each slice is rendered like an overlay image.
+*
+* Dense volumes get very big, so slices are split into row chunks that run in parallel and are
+* compressed as soon as they finish. row_sink is called as row_sink(uint32_t y, uint32_t z,
+* const ChainOutcome* outcomes, size_t n) in z-major order and never concurrently.
+*/
+template <typename RowSink>
+void SweepOverlayVolume(const TeleportChainParams& paramsTemplate, const VolumeSweepParams& vsp, RowSink&& row_sink)
+{
+    const size_t x_res = OverlayXRes(vsp.y_res);
+    const size_t y_res = vsp.y_res;
+    const size_t rows_per_chunk = vsp.rows_per_chunk ? vsp.rows_per_chunk : 1;
+    const size_t chunks_per_slice = (y_res + rows_per_chunk - 1) / rows_per_chunk;
+    const size_t n_chunks = chunks_per_slice * vsp.n_slices;
+
+    auto slice_offset = [&vsp](size_t z) {
+        return vsp.n_slices > 1 ? vsp.f_min + (vsp.f_max - vsp.f_min) * ((float)z / (float)(vsp.n_slices - 1))
+                                : vsp.f_min;
+    };
+
+    RunOrderedChunks(
+        n_chunks,
+        [&](size_t chunk) {
+            TeleportChainParams params = paramsTemplate;
+            params.project_to_first_portal_plane = false;
+            params.record_flags = TCRF_NONE;
+            TeleportChainResult result;
+
+            const Portal& p = paramsTemplate.EntryPortal();
+            size_t z = chunk / chunks_per_slice;
+            size_t y_begin = (chunk % chunks_per_slice) * rows_per_chunk;
+            size_t y_end = std::min(y_begin + rows_per_chunk, y_res);
+            Vector slice_pos = p.pos + p.f * slice_offset(z);
+
+            std::vector<ChainOutcome> outcomes((y_end - y_begin) * x_res);
+            for (size_t y = y_begin; y < y_end; y++) {
+                for (size_t x = 0; x < x_res; x++) {
+                    auto [mx, my] = OverlayPixelToFaceOffset((float)x, (float)y, x_res, y_res);
+                    params.ent = paramsTemplate.ent.WithNewCenter(slice_pos + p.r * mx + p.u * my);
+                    GenerateTeleportChain(params, result);
+                    outcomes[(y - y_begin) * x_res + x] = ChainOutcome::FromResult(result);
+                }
+            }
+            return outcomes;
+        },
+        [&](size_t chunk, const std::vector<ChainOutcome>& outcomes) {
+            size_t z = chunk / chunks_per_slice;
+            size_t y = (chunk % chunks_per_slice) * rows_per_chunk;
+            for (size_t r = 0; r < outcomes.size() / x_res; r++)
+                row_sink((uint32_t)(y + r), (uint32_t)z, outcomes.data() + r * x_res, x_res);
+        });
+}
+
+// convenience wrapper, sweeps the whole volume into a run-length encoded volume
+inline OutcomeVolume RenderOverlayVolume(const TeleportChainParams& paramsTemplate, const VolumeSweepParams& vsp)
+{
+    OutcomeVolume vol{(uint32_t)OverlayXRes(vsp.y_res), (uint32_t)vsp.y_res, vsp.n_slices, vsp.f_min, vsp.f_max};
+    SweepOverlayVolume(paramsTemplate, vsp, [&vol](uint32_t, uint32_t, const ChainOutcome* outcomes, size_t n) {
+        vol.AppendRow(outcomes, n);
+    });
+    MON_ASSERT(vol.IsComplete());
+    return vol;
+}
+
+} // namespace mon
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "game/source_math.hpp"
+
+#include <math.h>
+
+namespace mon {
+
+// portals are placed this far in front of the surface they're on
+constexpr float PORTAL_SURFACE_OFFSET = 0.03125f;
+
+/*
+* VectorAngles(forward, pseudoup, angles) from mathlib with the same float operations in the same
+* order. The pitch & yaw of a sloped surface (and its roll, left.z is 0 there) come out bit for bit
+* the same as the game's. The game normalizes left with an approximate reciprocal square root, so
+* the yaw from a level surface may differ in the last bit.
+*/
+inline QAngle VectorAnglesWithUp(const Vector& forward, const Vector& pseudo_up)
+{
+    Vector left{
+        pseudo_up.y * forward.z - pseudo_up.z * forward.y,
+        pseudo_up.z * forward.x - pseudo_up.x * forward.z,
+        pseudo_up.x * forward.y - pseudo_up.y * forward.x,
+    };
+    float left_len = sqrtf(left.Dot(left));
+    if (left_len > 0)
+        left = left * (1.f / left_len);
+    constexpr float rad2deg = 180.f / 3.14159265358979323846f;
+    float xy_dist = sqrtf(forward.x * forward.x + forward.y * forward.y);
+    if (xy_dist > 0.001f) {
+        float up_z = left.y * forward.x - left.x * forward.y;
+        return {
+            atan2f(-forward.z, xy_dist) * rad2deg,
+            atan2f(forward.y, forward.x) * rad2deg,
+            atan2f(left.z, up_z) * rad2deg,
+        };
+    }
+    // forward is mostly z, the yaw comes from left & there's no roll
+    return {
+        atan2f(-forward.z, xy_dist) * rad2deg,
+        atan2f(-left.x, left.y) * rad2deg,
+        0.f,
+    };
+}
+
+/*
+* How the portal gun places a portal on a surface with the given plane (see TraceFirePortal). The
+* portal faces along the plane normal, level floors & ceilings use the shot direction as the
+* portal's up vector and everything else uses the world up. The position is the point on the plane
+* moved PORTAL_SURFACE_OFFSET along the normal. This doesn't check if the portal fits or bump it
+* away from edges. The plane normal has to be a unit vector (like the game's plane normals).
+*
+* The angles only depend on the plane (and the yaw for level surfaces), so they're calculated
+* once here and placing a batch of portals on the same surface only has to move each point onto
+* the plane & construct the portal.
+*/
+struct PortalPlacement {
+    VPlane plane;
+    // the angles for any shot on a sloped surface, level surfaces use AnglesForYaw instead
+    QAngle ang;
+    bool level;
+
+    PortalPlacement(const VPlane& plane) : plane{plane}
+    {
+        level = fabsf(plane.n.x) < 0.001f && fabsf(plane.n.y) < 0.001f;
+        ang = VectorAnglesWithUp(plane.n, Vector{0, 0, 1});
+        if (level)
+            ang = AnglesForYaw(0.f);
+    }
+
+    PortalPlacement(const Vector& normal, float dist) : PortalPlacement{VPlane{normal, dist}} {}
+
+    // the angles for a level surface where the shot gave the portal this yaw, same as ang otherwise
+    QAngle AnglesForYaw(float yaw) const
+    {
+        if (!level)
+            return ang;
+        // VectorAngles with the shot direction as up makes the portal's up point along the shot
+        return {plane.n.z > 0 ? -90.f : 90.f, yaw, 0.f};
+    }
+
+    QAngle AnglesForShot(const Vector& shot_dir) const
+    {
+        return VectorAnglesWithUp(plane.n, level ? shot_dir : Vector{0, 0, 1});
+    }
+
+    /*
+    * The closest point on the plane to pt, moved off of the surface by the portal offset. This is
+    * done in floats in two steps like the game: the point is moved onto the surface (where the
+    * shot's trace would end) and then pushed out along the normal.
+    */
+    Vector Snap(const Vector& pt) const
+    {
+        float dist = plane.n.x * pt.x + plane.n.y * pt.y + plane.n.z * pt.z - plane.d;
+        Vector end = pt - plane.n * dist;
+        return end + plane.n * PORTAL_SURFACE_OFFSET;
+    }
+
+    Portal Place(const Vector& pt, GameVersion gv, float level_yaw = 0.f) const
+    {
+        return Portal{Snap(pt), level ? AnglesForYaw(level_yaw) : ang, gv};
+    }
+
+    Portal Place(const Vector& pt, const Vector& shot_dir, GameVersion gv) const
+    {
+        return Portal{Snap(pt), level ? AnglesForShot(shot_dir) : ang, gv};
+    }
+};
+
+} // namespace mon
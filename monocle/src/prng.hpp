@@ -2,8 +2,14 @@
 
 #include "monocle_config.hpp"
 
+#include <stddef.h>
 #include <stdint.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MON_PRNG_SSE2
+#include <emmintrin.h>
+#endif
+
 /*! \class small_prng
 \brief From http://burtleburtle.net/bob/rand/smallprng.html, a not awful fast random number source.
 */
@@ -65,3 +71,272 @@ public:
         return container[next_int(0, container.size())];
     }
 };
+
+/*
+* xoshiro128++ from https://prng.di.unimi.it/, 128 bits of state & 32 bit outputs. Compared to
+* small_prng it:
+* - can jump ahead by 2^64 or 2^96 outputs, so streams taken with jump() never overlap
+* - has counter-based streams (stream(seed, i)) for workers that only know their index
+* - maps to bounded ints (Lemire's method) & floats without dividing
+* - doesn't need warming up after seeding
+* See xoshiro_prng_x4 for generating arrays of values.
+*/
+class xoshiro_prng {
+    friend class xoshiro_prng_x4;
+
+protected:
+    uint32_t s[4];
+
+    static inline uint32_t rotl(uint32_t x, int k) noexcept
+    {
+        return (x << k) | (x >> (32 - k));
+    }
+
+    static inline uint64_t splitmix64(uint64_t& x) noexcept
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    void do_jump(const uint32_t (&poly)[4]) noexcept
+    {
+        uint32_t j[4]{};
+        for (uint32_t word : poly) {
+            for (int b = 0; b < 32; b++) {
+                if (word & (1u << b))
+                    for (int i = 0; i < 4; i++)
+                        j[i] ^= s[i];
+                (*this)();
+            }
+        }
+        for (int i = 0; i < 4; i++)
+            s[i] = j[i];
+    }
+
+public:
+    using value_type = uint32_t;
+
+    explicit xoshiro_prng(uint64_t seed = 0xdeadbeef) noexcept
+    {
+        uint64_t a = splitmix64(seed), b = splitmix64(seed);
+        s[0] = (uint32_t)a;
+        s[1] = (uint32_t)(a >> 32);
+        s[2] = (uint32_t)b;
+        s[3] = (uint32_t)(b >> 32) | 1; // the state can't be all 0
+    }
+
+    static xoshiro_prng from_state(uint32_t s0, uint32_t s1, uint32_t s2, uint32_t s3) noexcept
+    {
+        MON_ASSERT(s0 | s1 | s2 | s3);
+        xoshiro_prng rng;
+        rng.s[0] = s0;
+        rng.s[1] = s1;
+        rng.s[2] = s2;
+        rng.s[3] = s3;
+        return rng;
+    }
+
+    /*
+    * Stream i of a seed, seeded from a hash of both so a worker only needs its index. Streams
+    * are very unlikely to overlap, use jump() instead if that has to be guaranteed.
+    */
+    static xoshiro_prng stream(uint64_t seed, uint64_t stream_idx) noexcept
+    {
+        uint64_t x = seed;
+        return xoshiro_prng{splitmix64(x) ^ stream_idx};
+    }
+
+    inline uint32_t operator()() noexcept
+    {
+        const uint32_t result = rotl(s[0] + s[3], 7) + s[0];
+        const uint32_t t = s[1] << 9;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 11);
+        return result;
+    }
+
+    // equivalent to 2^64 calls, gives 2^64 non-overlapping streams
+    void jump() noexcept
+    {
+        static constexpr uint32_t JUMP[4]{0x8764000b, 0xf542d2d3, 0x6fa035c3, 0x77f2db5b};
+        do_jump(JUMP);
+    }
+
+    // equivalent to 2^96 calls, gives 2^32 starting points that can each be split with jump()
+    void long_jump() noexcept
+    {
+        static constexpr uint32_t LONG_JUMP[4]{0xb523952e, 0x0b6f099f, 0xccf5a0ef, 0x1c580662};
+        do_jump(LONG_JUMP);
+    }
+
+    inline bool next_bool() noexcept
+    {
+        return (*this)() >> 31;
+    }
+
+    // [a, b), Lemire's method, only divides with a probability of (high - low) / 2^32
+    int next_int(int low, int high) noexcept
+    {
+        MON_ASSERT(high > low);
+        const uint32_t range = (uint32_t)high - (uint32_t)low;
+        uint64_t m = (uint64_t)(*this)() * range;
+        if ((uint32_t)m < range) {
+            const uint32_t threshold = (0u - range) % range;
+            while ((uint32_t)m < threshold)
+                m = (uint64_t)(*this)() * range;
+        }
+        return (int)((uint32_t)low + (uint32_t)(m >> 32));
+    }
+
+    // [0, 1) with 24 bits of precision
+    inline float next_float01() noexcept
+    {
+        return ((*this)() >> 8) * 0x1p-24f;
+    }
+
+    // [a, b]
+    float next_float(float low, float high) noexcept
+    {
+        MON_ASSERT(high > low);
+        return next_float01() * (high - low) + low;
+    }
+
+    template <typename Container>
+    auto& next_elem(const Container& container)
+    {
+        return container[next_int(0, (int)container.size())];
+    }
+};
+
+/*
+* Four interleaved xoshiro128++ streams advanced together with SSE2 (or the same math without it,
+* the output is identical). Lane i starts as the seed's xoshiro_prng jumped i times, and the
+* arrays are filled lane by lane: out[4 * k + i] is the k-th output of lane i. If n isn't a
+* multiple of 4 the leftover outputs of the last step are dropped.
+*
+* Bounded ints skip the rejection step of xoshiro_prng::next_int, so values are biased by at most
+* (high - low) / 2^32 which is negligible for anything the searches pick from.
+*/
+class xoshiro_prng_x4 {
+#ifdef MON_PRNG_SSE2
+    __m128i s0, s1, s2, s3;
+
+    static inline __m128i rotl(__m128i x, int k) noexcept
+    {
+        return _mm_or_si128(_mm_slli_epi32(x, k), _mm_srli_epi32(x, 32 - k));
+    }
+
+    inline __m128i next() noexcept
+    {
+        __m128i result = _mm_add_epi32(rotl(_mm_add_epi32(s0, s3), 7), s0);
+        __m128i t = _mm_slli_epi32(s1, 9);
+        s2 = _mm_xor_si128(s2, s0);
+        s3 = _mm_xor_si128(s3, s1);
+        s1 = _mm_xor_si128(s1, s2);
+        s0 = _mm_xor_si128(s0, s3);
+        s2 = _mm_xor_si128(s2, t);
+        s3 = rotl(s3, 11);
+        return result;
+    }
+
+    // the high 32 bits of x * range for each lane
+    static inline __m128i mul_hi(__m128i x, __m128i range) noexcept
+    {
+        __m128i even = _mm_srli_epi64(_mm_mul_epu32(x, range), 32);
+        __m128i odd = _mm_mul_epu32(_mm_srli_epi64(x, 32), range);
+        return _mm_or_si128(even, _mm_and_si128(odd, _mm_set_epi32(-1, 0, -1, 0)));
+    }
+#else
+    xoshiro_prng lanes[4];
+#endif
+
+    template <typename T, typename F>
+    void fill(T* out, size_t n, F&& map) noexcept
+    {
+        alignas(16) uint32_t raw[4];
+        for (size_t i = 0; i < n; i += 4) {
+            next4(raw);
+            for (size_t j = 0; j < 4 && i + j < n; j++)
+                out[i + j] = map(raw[j]);
+        }
+    }
+
+public:
+    explicit xoshiro_prng_x4(uint64_t seed = 0xdeadbeef) noexcept : xoshiro_prng_x4{xoshiro_prng{seed}} {}
+
+    explicit xoshiro_prng_x4(xoshiro_prng rng) noexcept
+    {
+#ifdef MON_PRNG_SSE2
+        alignas(16) uint32_t words[4][4];
+        for (int lane = 0; lane < 4; lane++, rng.jump())
+            for (int w = 0; w < 4; w++)
+                words[w][lane] = rng.s[w];
+        s0 = _mm_load_si128((const __m128i*)words[0]);
+        s1 = _mm_load_si128((const __m128i*)words[1]);
+        s2 = _mm_load_si128((const __m128i*)words[2]);
+        s3 = _mm_load_si128((const __m128i*)words[3]);
+#else
+        for (int lane = 0; lane < 4; lane++, rng.jump())
+            lanes[lane] = rng;
+#endif
+    }
+
+    // the next output of every lane
+    inline void next4(uint32_t* out) noexcept
+    {
+#ifdef MON_PRNG_SSE2
+        _mm_storeu_si128((__m128i*)out, next());
+#else
+        for (int lane = 0; lane < 4; lane++)
+            out[lane] = lanes[lane]();
+#endif
+    }
+
+    void fill_u32(uint32_t* out, size_t n) noexcept
+    {
+        fill(out, n, [](uint32_t x) { return x; });
+    }
+
+    void fill_bools(bool* out, size_t n) noexcept
+    {
+        fill(out, n, [](uint32_t x) { return (x >> 31) != 0; });
+    }
+
+    // [low, high] with 24 bits of precision, same mapping as xoshiro_prng::next_float
+    void fill_floats(float* out, size_t n, float low, float high) noexcept
+    {
+        MON_ASSERT(high > low);
+        const float scale = high - low;
+        size_t i = 0;
+#ifdef MON_PRNG_SSE2
+        const __m128 v_scale = _mm_set1_ps(scale), v_low = _mm_set1_ps(low), v_unit = _mm_set1_ps(0x1p-24f);
+        for (; i + 4 <= n; i += 4) {
+            __m128 u = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(next(), 8)), v_unit);
+            _mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(u, v_scale), v_low));
+        }
+#endif
+        fill(out + i, n - i, [=](uint32_t x) { return (x >> 8) * 0x1p-24f * scale + low; });
+    }
+
+    // [low, high), see the class comment about the bias
+    void fill_ints(int* out, size_t n, int low, int high) noexcept
+    {
+        MON_ASSERT(high > low);
+        const uint32_t range = (uint32_t)high - (uint32_t)low;
+        size_t i = 0;
+#ifdef MON_PRNG_SSE2
+        const __m128i v_range = _mm_set1_epi32((int)range), v_low = _mm_set1_epi32(low);
+        for (; i + 4 <= n; i += 4)
+            _mm_storeu_si128((__m128i*)(out + i), _mm_add_epi32(mul_hi(next(), v_range), v_low));
+#endif
+        fill(out + i, n - i, [=](uint32_t x) {
+            return (int)((uint32_t)low + (uint32_t)(((uint64_t)x * range) >> 32));
+        });
+    }
+};
@@ -0,0 +1,734 @@
+#pragma once
+
+#include "vag_search.hpp"
+#include "low_discrepancy.hpp"
+#include "json.hpp"
+#include "bsp.hpp"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/*
+* Search jobs describe a SearchSpace and how to search it so that searches don't have to be
+* compiled into main. A job file has either a single job object or an array of them:
+*
+* {
+*     "name": "11",                          // used in the output
+*     "game_version": "5135",                // or "9862575"
+*     "blue": {
+*         "type": "ZN",                      // XP, XN, YP, YN, ZP, ZN, plane
+*         "lock_opts": [383.96875],
+*         "pos_spaces": [[[-860, 280, 450], [-551, -43, 380]]]
+*     },
+*     "orange": {"locked": true, "pos": [-64.03125, -900, 300], "ang": [0, 180, 0]},
+*     "target_space": [[-106, -1427, 1597], [-273, -1282, 1729]], // a box or an array of boxes
+*     "entry_pos": "lower",                  // lower, upper, any, or an array of RP, RN, UP, UN
+*     "placement_orders": ["ORANGE_OPEN_BLUE_NEW_LOCATION", "BLUE_OPEN_ORANGE_NEW_LOCATION"],
+*     "tp_from_blue": false,
+*     "tp_player": true,
+*     "iterations": 1000000,
+*     "seed": 0,
+*     "sampler": "prng",                     // prng, sobol, halton
+*     "enumerate": false,                    // see SearchSpace::EnumeratedCandidates
+*     "entry_scan_per_side": 1,
+*     "prefilter_margin": 1,
+*     "mode": "find",                        // find or collect
+*     "max_hits": 100,                       // collect only
+*     "checkpoint": "checkpoints/11.ckpt"    // optional
+* }
+*
+* A portal on a sloped surface has the type "plane" and the surface normal, its lock options are
+* the distances of the planes (see SearchPortal::plane_normal):
+*
+*     "blue": {"type": "plane", "normal": [0.7071, 0.7071, 0], "lock_opts": [-650.5], "pos_spaces": [...]}
+*
+* Everything except the portals, target space, and placement orders has a default. Numbers are
+* parsed directly as floats so lock options are exact.
+*
+* Instead of a single portal, blue and/or orange can be every portalable surface of a map (see
+* FindPortalSurfaces), in which case the job is split into a job for every pair of surfaces:
+*
+*     "orange": {
+*         "bsp": "maps/testchmb_a_11.bsp",   // relative to the working directory
+*         "types": ["XN", "ZN"],              // optional, all types by default
+*         "within": [[-100, -1200, 0], [0, -700, 600]],  // optional, only faces overlapping this box
+*         "exclude_materials": ["glass"]      // optional, case insensitive substrings
+*     }
+*/
+
+namespace mon {
+
+enum SearchJobSampler {
+    SJS_PRNG,
+    SJS_SOBOL,
+    SJS_HALTON,
+};
+
+enum SearchJobMode {
+    SJM_FIND,
+    SJM_COLLECT,
+};
+
+struct SearchJob {
+    std::string name;
+    SearchSpace ss;
+    int n_iterations = 1000000;
+    uint32_t seed = 0;
+    SearchJobSampler sampler = SJS_PRNG;
+    bool enumerate = false;
+    SearchJobMode mode = SJM_FIND;
+    VagCollectParams collect;
+    std::filesystem::path checkpoint_path;
+
+    // the number of iterations that a search over the job runs, enumerated jobs round down to whole samples
+    int NumIterations() const
+    {
+        if (!enumerate)
+            return n_iterations;
+        int n_combos = (int)ss.NumDiscreteCombos();
+        return std::max(1, n_iterations / n_combos) * n_combos;
+    }
+
+    /*
+    * A search over part of the job has to start at a multiple of this, PRNG candidates are generated
+    * per block and enumerated candidates per sample.
+    */
+    int ShardAlignment() const
+    {
+        if (enumerate)
+            return (int)ss.NumDiscreteCombos();
+        return sampler == SJS_PRNG ? SearchSpace::PARALLEL_BLOCK_SIZE : 1;
+    }
+
+    // find jobs stop at the first hit, so their checkpoints can't be resumed by a collect job
+    SearchCheckpointKind CheckpointKind() const
+    {
+        return mode == SJM_FIND ? SCK_FIND : SCK_COLLECT;
+    }
+
+    /*
+    * A hash of everything that affects which candidates are generated and which of them are hits,
+    * used as the checkpoint user key so that editing a job doesn't resume from a stale checkpoint.
+    */
+    uint64_t Key() const
+    {
+        uint64_t h = 0xcbf29ce484222325ull;
+        auto mix_bytes = [&h](const void* data, size_t n) {
+            for (size_t i = 0; i < n; i++)
+                h = (h ^ ((const uint8_t*)data)[i]) * 0x100000001b3ull;
+        };
+        auto mix = [&mix_bytes](const auto& v) { mix_bytes(&v, sizeof v); };
+        auto mix_box = [&mix](const AABB& box) {
+            for (int i = 0; i < 3; i++) {
+                mix(box.mins[i]);
+                mix(box.maxs[i]);
+            }
+        };
+        for (const SearchPortal* sp : {&ss.blue_search, &ss.orange_search}) {
+            mix(sp->locked);
+            if (sp->locked) {
+                for (int i = 0; i < 3; i++) {
+                    mix(sp->locked_pos[i]);
+                    mix((&sp->locked_ang.x)[i]);
+                }
+                continue;
+            }
+            mix(sp->type);
+            if (sp->type == SPT_PLANE)
+                for (int i = 0; i < 3; i++)
+                    mix(sp->plane_normal[i]);
+            for (float f : sp->lock_opts)
+                mix(f);
+            for (const AABB& box : sp->pos_spaces)
+                mix_box(box);
+        }
+        for (const AABB& box : ss.target_space)
+            mix_box(box);
+        mix(ss.entry_pos_search);
+        for (PlacementOrder order : ss.valid_placement_orders)
+            mix(order);
+        mix(ss.tp_from_blue);
+        mix(ss.tp_player);
+        mix(ss.gv);
+        mix(ss.entry_scan_per_side);
+        mix(ss.prefilter_margin);
+        mix(seed);
+        mix(sampler);
+        mix(enumerate);
+        mix(mode);
+        return h;
+    }
+};
+
+// the PlacementOrder enumerator names, and BLUE_UPTM & ORANGE_UPTM for the two distinct orders
+inline std::optional<PlacementOrder> PlacementOrderFromName(std::string_view name)
+{
+    using enum PlacementOrder;
+#define MON_PO_NAME(x) {#x, x}
+    static constexpr std::pair<const char*, PlacementOrder> names[]{
+        MON_PO_NAME(ORANGE_OPEN_BLUE_NEW_LOCATION),
+        MON_PO_NAME(BLUE_OPEN_ORANGE_NEW_LOCATION),
+        MON_PO_NAME(ORANGE_OPEN_BLUE_NEW_LOCATION_NO_MOVE),
+        MON_PO_NAME(BLUE_OPEN_ORANGE_NEW_LOCATION_NO_MOVE),
+        MON_PO_NAME(ORANGE_WAS_CLOSED_BLUE_MOVED),
+        MON_PO_NAME(BLUE_WAS_CLOSED_ORANGE_MOVED),
+        MON_PO_NAME(ORANGE_WAS_CLOSED_BLUE_CREATED),
+        MON_PO_NAME(BLUE_WAS_CLOSED_ORANGE_CREATED),
+        MON_PO_NAME(ORANGE_WAS_CLOSED_BLUE_OPENED),
+        MON_PO_NAME(BLUE_WAS_CLOSED_ORANGE_OPENED),
+        MON_PO_NAME(AFTER_LOAD_BLUE_HAS_HIGHER_INDEX),
+        MON_PO_NAME(AFTER_LOAD_ORANGE_HAS_HIGHER_INDEX),
+        {"BLUE_UPTM", _BLUE_UPTM},
+        {"ORANGE_UPTM", _ORANGE_UPTM},
+    };
+#undef MON_PO_NAME
+    for (auto& [n, order] : names)
+        if (name == n)
+            return order;
+    return {};
+}
+
+class SearchJobReader {
+    std::string err;
+    // maps are only loaded once per reader
+    std::map<std::string, BspMap> maps;
+
+    static constexpr std::pair<const char*, SearchPortalType> PORTAL_TYPES[]{
+        {"XP", SPT_WALL_XP},
+        {"XN", SPT_WALL_XN},
+        {"YP", SPT_WALL_YP},
+        {"YN", SPT_WALL_YN},
+        {"ZP", SPT_WALL_ZP},
+        {"ZN", SPT_WALL_ZN},
+        {"plane", SPT_PLANE},
+    };
+
+    bool Fail(std::string_view where, std::string_view msg)
+    {
+        if (err.empty())
+            err = std::string{where} + ": " + std::string{msg};
+        return false;
+    }
+
+    bool ReadFloat(const JsonValue* v, std::string_view where, float& out)
+    {
+        auto f = v ? v->AsNumber<float>() : std::nullopt;
+        if (!f)
+            return Fail(where, "expected a number");
+        out = *f;
+        return true;
+    }
+
+    bool ReadBool(const JsonValue* v, std::string_view where, bool& out)
+    {
+        auto b = v ? v->AsBool() : std::nullopt;
+        if (!b)
+            return Fail(where, "expected true or false");
+        out = *b;
+        return true;
+    }
+
+    bool ReadVec3(const JsonValue* v, std::string_view where, float* out)
+    {
+        if (!v || !v->IsArray() || v->Items().size() != 3)
+            return Fail(where, "expected an array of 3 numbers");
+        for (int i = 0; i < 3; i++)
+            if (!ReadFloat(&v->Items()[i], where, out[i]))
+                return false;
+        return true;
+    }
+
+    bool ReadAABB(const JsonValue* v, std::string_view where, AABB& out)
+    {
+        Vector p1, p2;
+        if (!v || !v->IsArray() || v->Items().size() != 2)
+            return Fail(where, "expected a pair of corners");
+        if (!ReadVec3(&v->Items()[0], where, &p1.x) || !ReadVec3(&v->Items()[1], where, &p2.x))
+            return false;
+        out = AABB{p1, p2};
+        return true;
+    }
+
+    // an array of boxes, or a single box if allow_single is set
+    bool ReadBoxes(const JsonValue* v, std::string_view where, bool allow_single, BoxRegion& out)
+    {
+        if (!v || v->Items().empty())
+            return Fail(where, "expected a non-empty array of boxes");
+        std::vector<AABB> boxes(v->Items().size());
+        if (allow_single && v->Items()[0].Items().size() == 3) {
+            boxes.resize(1);
+            if (!ReadAABB(v, where, boxes[0]))
+                return false;
+        } else {
+            for (size_t i = 0; i < boxes.size(); i++)
+                if (!ReadAABB(&v->Items()[i], where, boxes[i]))
+                    return false;
+        }
+        out = BoxRegion{std::move(boxes)};
+        return true;
+    }
+
+    bool ReadPortalType(const JsonValue* v, std::string_view where, SearchPortalType& out)
+    {
+        auto type = v ? v->AsString() : std::nullopt;
+        auto it = std::find_if(std::begin(PORTAL_TYPES), std::end(PORTAL_TYPES), [&](auto& t) {
+            return type && *type == t.first;
+        });
+        if (it == std::end(PORTAL_TYPES))
+            return Fail(where, "type must be one of XP, XN, YP, YN, ZP, ZN, plane");
+        out = it->second;
+        return true;
+    }
+
+    bool ReadPortal(const JsonValue* v, std::string_view where, SearchPortal& out)
+    {
+        if (!v || !v->IsObject())
+            return Fail(where, "expected an object");
+        out.locked = false;
+        if (const JsonValue* locked = v->Find("locked"); locked && !ReadBool(locked, where, out.locked))
+            return false;
+        if (out.locked)
+            return ReadVec3(v->Find("pos"), where, &out.locked_pos.x) &&
+                   ReadVec3(v->Find("ang"), where, &out.locked_ang.x);
+
+        if (!ReadPortalType(v->Find("type"), where, out.type))
+            return false;
+        if (out.type == SPT_PLANE) {
+            Vector& n = out.plane_normal;
+            if (!ReadVec3(v->Find("normal"), where, &n.x))
+                return false;
+            float len = sqrtf(n.Dot(n));
+            if (!(len > 0))
+                return Fail(where, "the plane normal can't be 0");
+            n = n * (1.f / len);
+        }
+
+        const JsonValue* lock_opts = v->Find("lock_opts");
+        if (!lock_opts || lock_opts->Items().empty())
+            return Fail(where, "expected a non-empty lock_opts array");
+        out.lock_opts.resize(lock_opts->Items().size());
+        for (size_t i = 0; i < out.lock_opts.size(); i++)
+            if (!ReadFloat(&lock_opts->Items()[i], where, out.lock_opts[i]))
+                return false;
+
+        return ReadBoxes(v->Find("pos_spaces"), where, false, out.pos_spaces);
+    }
+
+    // a single portal, or every portalable surface from a map (see FindPortalSurfaces)
+    bool ReadPortals(const JsonValue* v, std::string_view where, std::vector<SearchPortal>& out)
+    {
+        const JsonValue* bsp = v ? v->Find("bsp") : nullptr;
+        if (!bsp)
+            return ReadPortal(v, where, out.emplace_back());
+        if (!bsp->AsString())
+            return Fail(where, "expected a bsp path");
+        std::string path{*bsp->AsString()};
+        auto map_it = maps.find(path);
+        if (map_it == maps.end()) {
+            BspMap map;
+            if (!map.Load(path))
+                return Fail(where, map.Error());
+            map_it = maps.emplace(path, std::move(map)).first;
+        }
+
+        PortalSurfaceParams params;
+        if (const JsonValue* types = v->Find("types")) {
+            params.types = 0;
+            for (const JsonValue& t : types->Items()) {
+                SearchPortalType type;
+                if (!ReadPortalType(&t, where, type))
+                    return false;
+                params.types |= 1u << type;
+            }
+        }
+        if (const JsonValue* within = v->Find("within")) {
+            AABB box;
+            if (!ReadAABB(within, where, box))
+                return false;
+            params.within = box;
+        }
+        if (const JsonValue* excluded = v->Find("exclude_materials")) {
+            auto lower = [](std::string_view sv) {
+                std::string str{sv};
+                std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return (char)tolower(c); });
+                return str;
+            };
+            std::vector<std::string> subs;
+            for (const JsonValue& m : excluded->Items()) {
+                if (!m.AsString())
+                    return Fail(where, "expected an array of material names");
+                subs.push_back(lower(*m.AsString()));
+            }
+            params.material_filter = [subs, lower](std::string_view material) {
+                std::string name = lower(material);
+                return std::none_of(subs.begin(), subs.end(), [&](auto& sub) { return name.find(sub) != name.npos; });
+            };
+        }
+        out = FindPortalSurfaces(map_it->second, params);
+        if (out.empty())
+            return Fail(where, "no portalable surfaces in " + path);
+        return true;
+    }
+
+    bool ReadEntryPos(const JsonValue* v, SearchEntryPosFlags& out)
+    {
+        if (!v) {
+            out = SEPF_ANY;
+            return true;
+        }
+        if (auto str = v->AsString()) {
+            if (*str == "lower")
+                out = SEPF_LOWER;
+            else if (*str == "upper")
+                out = SEPF_UPPER;
+            else if (*str == "any")
+                out = SEPF_ANY;
+            else
+                return Fail("entry_pos", "expected lower, upper, any, or an array of flags");
+            return true;
+        }
+        int flags = 0;
+        for (const JsonValue& item : v->Items()) {
+            auto str = item.AsString();
+            if (str == "RP")
+                flags |= SEPF_RP;
+            else if (str == "RN")
+                flags |= SEPF_RN;
+            else if (str == "UP")
+                flags |= SEPF_UP;
+            else if (str == "UN")
+                flags |= SEPF_UN;
+            else
+                return Fail("entry_pos", "flags must be RP, RN, UP, or UN");
+        }
+        if (!flags)
+            return Fail("entry_pos", "no flags set");
+        out = (SearchEntryPosFlags)flags;
+        return true;
+    }
+
+    bool ReadPlacementOrders(const JsonValue* v, std::vector<PlacementOrder>& out)
+    {
+        if (!v || v->Items().empty())
+            return Fail("placement_orders", "expected a non-empty array");
+        for (const JsonValue& item : v->Items()) {
+            auto order = PlacementOrderFromName(item.AsString().value_or(""));
+            if (!order)
+                return Fail("placement_orders", "unknown placement order");
+            out.push_back(*order);
+        }
+        return true;
+    }
+
+    template <typename T>
+    bool ReadOptionalNumber(const JsonValue& job, const char* key, T& out)
+    {
+        const JsonValue* v = job.Find(key);
+        if (!v)
+            return true;
+        auto n = v->AsNumber<T>();
+        if (!n)
+            return Fail(key, "expected a number");
+        out = *n;
+        return true;
+    }
+
+    template <typename E, size_t N>
+    bool ReadOptionalEnum(const JsonValue& job,
+                          const char* key,
+                          const std::pair<const char*, E> (&names)[N],
+                          E& out)
+    {
+        const JsonValue* v = job.Find(key);
+        if (!v)
+            return true;
+        auto str = v->AsString();
+        for (auto& [name, value] : names) {
+            if (str == name) {
+                out = value;
+                return true;
+            }
+        }
+        return Fail(key, "unknown value");
+    }
+
+    // everything but the portals is read into job
+    bool ReadJob(const JsonValue& v,
+                 SearchJob& job,
+                 std::vector<SearchPortal>& blue_opts,
+                 std::vector<SearchPortal>& orange_opts)
+    {
+        if (!v.IsObject())
+            return Fail("job", "expected an object");
+        if (const JsonValue* name = v.Find("name"); name && name->AsString())
+            job.name = *name->AsString();
+        SearchSpace& ss = job.ss;
+        if (!ReadPortals(v.Find("blue"), "blue", blue_opts) || !ReadPortals(v.Find("orange"), "orange", orange_opts) ||
+            !ReadBoxes(v.Find("target_space"), "target_space", true, ss.target_space) ||
+            !ReadEntryPos(v.Find("entry_pos"), ss.entry_pos_search) ||
+            !ReadPlacementOrders(v.Find("placement_orders"), ss.valid_placement_orders))
+            return false;
+        ss.tp_from_blue = false;
+        ss.tp_player = true;
+        if (const JsonValue* b = v.Find("tp_from_blue"); b && !ReadBool(b, "tp_from_blue", ss.tp_from_blue))
+            return false;
+        if (const JsonValue* b = v.Find("tp_player"); b && !ReadBool(b, "tp_player", ss.tp_player))
+            return false;
+        if (const JsonValue* b = v.Find("enumerate"); b && !ReadBool(b, "enumerate", job.enumerate))
+            return false;
+
+        static constexpr std::pair<const char*, GameVersion> gvs[]{{"5135", GV_5135}, {"9862575", GV_9862575}};
+        static constexpr std::pair<const char*, SearchJobSampler> samplers[]{
+            {"prng", SJS_PRNG},
+            {"sobol", SJS_SOBOL},
+            {"halton", SJS_HALTON},
+        };
+        static constexpr std::pair<const char*, SearchJobMode> modes[]{{"find", SJM_FIND}, {"collect", SJM_COLLECT}};
+        if (!ReadOptionalEnum(v, "game_version", gvs, ss.gv) ||
+            !ReadOptionalEnum(v, "sampler", samplers, job.sampler) || !ReadOptionalEnum(v, "mode", modes, job.mode) ||
+            !ReadOptionalNumber(v, "iterations", job.n_iterations) || !ReadOptionalNumber(v, "seed", job.seed) ||
+            !ReadOptionalNumber(v, "entry_scan_per_side", ss.entry_scan_per_side) ||
+            !ReadOptionalNumber(v, "prefilter_margin", ss.prefilter_margin) ||
+            !ReadOptionalNumber(v, "max_hits", job.collect.max_hits))
+            return false;
+        if (job.n_iterations <= 0)
+            return Fail("iterations", "must be positive");
+        if (const JsonValue* ckpt = v.Find("checkpoint")) {
+            if (!ckpt->AsString())
+                return Fail("checkpoint", "expected a path");
+            job.checkpoint_path = *ckpt->AsString();
+        }
+        return true;
+    }
+
+public:
+    const std::string& Error() const
+    {
+        return err;
+    }
+
+    // parses a job file's contents, on failure Error() describes the first problem
+    std::optional<std::vector<SearchJob>> Parse(std::string_view text)
+    {
+        err.clear();
+        std::string json_err;
+        auto root = JsonParser::Parse(text, &json_err);
+        if (!root) {
+            Fail("json", json_err);
+            return {};
+        }
+        return Read(*root);
+    }
+
+    // reads a job object or an array of them that was already parsed, e.g. as part of another message
+    std::optional<std::vector<SearchJob>> Read(const JsonValue& root)
+    {
+        err.clear();
+        std::vector<SearchJob> jobs;
+        auto read_one = [&](const JsonValue& v) {
+            SearchJob job;
+            std::vector<SearchPortal> blue_opts, orange_opts;
+            if (!ReadJob(v, job, blue_opts, orange_opts))
+                return false;
+            if (job.name.empty())
+                job.name = "job " + std::to_string(jobs.size());
+            // a job with a map for a portal turns into a job for every pair of surfaces
+            bool expanded = blue_opts.size() > 1 || orange_opts.size() > 1;
+            for (size_t b = 0; b < blue_opts.size(); b++) {
+                for (size_t o = 0; o < orange_opts.size(); o++) {
+                    SearchJob& pair_job = jobs.emplace_back(job);
+                    pair_job.ss.blue_search = blue_opts[b];
+                    pair_job.ss.orange_search = orange_opts[o];
+                    if (!expanded)
+                        continue;
+                    pair_job.name += " b" + std::to_string(b) + " o" + std::to_string(o);
+                    if (!pair_job.checkpoint_path.empty())
+                        pair_job.checkpoint_path += ".b" + std::to_string(b) + "_o" + std::to_string(o);
+                }
+            }
+            return true;
+        };
+        if (root.IsArray()) {
+            for (const JsonValue& v : root.Items())
+                if (!read_one(v))
+                    return {};
+        } else if (!read_one(root)) {
+            return {};
+        }
+        return jobs;
+    }
+
+    std::optional<std::vector<SearchJob>> Load(const std::filesystem::path& path)
+    {
+        std::ifstream file{path, std::ios::binary};
+        if (!file) {
+            Fail(path.string(), "could not open file");
+            return {};
+        }
+        std::stringstream ss;
+        ss << file.rdbuf();
+        auto jobs = Parse(ss.str());
+        if (!jobs)
+            err = path.string() + ": " + err;
+        return jobs;
+    }
+};
+
+struct SearchJobResult {
+    size_t job_idx;
+    SearchStats stats;
+    // set in find mode
+    std::optional<SearchResult> found;
+    // set in collect mode
+    std::vector<RankedVagHit> hits;
+    double seconds;
+};
+
+/*
+* Calls f(source) with the candidate source (see SearchSpace::PrngCandidates) for the job's
+* iterations starting at first. The first iteration has to be a multiple of SearchJob::ShardAlignment()
+* so that iteration first + i of the source is iteration i of a search over the whole job.
+*/
+template <typename F>
+void WithJobCandidates(const SearchJob& job, int first, F&& f)
+{
+    MON_ASSERT(first % job.ShardAlignment() == 0);
+    const SearchSpace& ss = job.ss;
+    auto with_sampler = [&](const auto& sampler) {
+        using Sampler = std::decay_t<decltype(sampler)>;
+        if (job.enumerate) {
+            uint64_t first_sample = (uint64_t)first / ss.NumDiscreteCombos();
+            f(SearchSpace::EnumeratedCandidates<Sampler>{ss, sampler, first_sample});
+        } else {
+            f(SearchSpace::SampledCandidates<Sampler>{ss, sampler, (uint64_t)first});
+        }
+    };
+    switch (job.sampler) {
+        case SJS_PRNG:
+            if (job.enumerate)
+                with_sampler(PrngSampler{job.seed});
+            else
+                f(SearchSpace::PrngCandidates{ss, job.seed, (uint32_t)(first / SearchSpace::PARALLEL_BLOCK_SIZE)});
+            break;
+        case SJS_SOBOL:
+            with_sampler(SobolSampler{true, job.seed});
+            break;
+        case SJS_HALTON:
+            with_sampler(HaltonSampler{true, job.seed});
+            break;
+    }
+}
+
+/*
+* Runs iterations [first, first + count) of a job on pool, the iterations of the results are
+* relative to the whole job. The job's own checkpoint path is not used.
+*/
+inline SearchJobResult RunSearchJobRange(const SearchJob& job,
+                                         int first,
+                                         int count,
+                                         ctpl::thread_pool& pool,
+                                         const SearchCheckpointParams* checkpoint = nullptr,
+                                         const SearchProgressParams* progress = nullptr)
+{
+    SearchJobResult res{};
+    const SearchSpace& ss = job.ss;
+    auto start = std::chrono::steady_clock::now();
+    WithJobCandidates(job, first, [&](const auto& source) {
+        if (job.mode == SJM_FIND)
+            res.found = ss.FindVagFrom(source, count, pool, &res.stats, checkpoint, progress);
+        else
+            res.hits = ss.CollectVagsFrom(source, count, job.collect, pool, &res.stats, checkpoint, progress);
+    });
+    if (res.found)
+        res.found->n_iterations += first;
+    for (RankedVagHit& rh : res.hits)
+        rh.hit.n_iterations += first;
+    res.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return res;
+}
+
+// same as above, but on a new pool with n_threads threads (0 uses all cores)
+inline SearchJobResult RunSearchJobRange(const SearchJob& job,
+                                         int first,
+                                         int count,
+                                         int n_threads,
+                                         const SearchCheckpointParams* checkpoint = nullptr,
+                                         const SearchProgressParams* progress = nullptr)
+{
+    if (n_threads <= 0)
+        n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    ctpl::thread_pool pool{n_threads};
+    return RunSearchJobRange(job, first, count, pool, checkpoint, progress);
+}
+
+inline SearchJobResult RunSearchJob(const SearchJob& job,
+                                    size_t job_idx,
+                                    int n_threads,
+                                    const SearchProgressParams* progress = nullptr)
+{
+    SearchCheckpointParams ckpt{.path = job.checkpoint_path, .user_key = job.Key()};
+    const SearchCheckpointParams* ckpt_ptr = job.checkpoint_path.empty() ? nullptr : &ckpt;
+    SearchJobResult res = RunSearchJobRange(job, 0, job.NumIterations(), n_threads, ckpt_ptr, progress);
+    res.job_idx = job_idx;
+    return res;
+}
+
+struct BatchRunParams {
+    // total number of threads, 0 uses all cores
+    int n_threads = 0;
+    /*
+    * How many jobs run at the same time, the threads are split evenly between them. Each job is
+    * already parallel, but running a couple at once keeps the cores busy while a job is finishing
+    * its last blocks.
+    */
+    int n_concurrent_jobs = 1;
+    // progress reporting for every job, the label is set to the job name
+    std::optional<SearchProgressParams> progress;
+};
+
+/*
+* Runs all jobs in one process and calls on_done(const SearchJob&, SearchJobResult&&) as each one
+* finishes (from a worker thread, but never concurrently). Jobs are started in order.
+*/
+template <typename OnDone>
+void RunSearchJobs(const std::vector<SearchJob>& jobs, const BatchRunParams& bp, OnDone&& on_done)
+{
+    int n_threads = bp.n_threads > 0 ? bp.n_threads : std::max(1, (int)std::thread::hardware_concurrency());
+    int n_runners = std::clamp(bp.n_concurrent_jobs, 1, std::max(1, (int)jobs.size()));
+    int threads_per_job = std::max(1, n_threads / n_runners);
+
+    std::atomic_size_t next_job{0};
+    std::mutex done_mtx;
+    std::vector<std::thread> runners;
+    for (int r = 0; r < n_runners; r++) {
+        runners.emplace_back([&] {
+            MonocleFloatingPointScope scope{};
+            for (size_t i; (i = next_job.fetch_add(1)) < jobs.size();) {
+                std::optional<SearchProgressParams> progress = bp.progress;
+                if (progress)
+                    progress->label = jobs[i].name;
+                SearchJobResult res = RunSearchJob(jobs[i], i, threads_per_job, progress ? &*progress : nullptr);
+                std::lock_guard lock{done_mtx};
+                on_done(jobs[i], std::move(res));
+            }
+        });
+    }
+    for (std::thread& t : runners)
+        t.join();
+}
+
+} // namespace mon
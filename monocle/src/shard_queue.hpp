@@ -0,0 +1,582 @@
+#pragma once
+
+#include "search_job.hpp"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/*
+* Splits search jobs into shards (iteration ranges) and runs them on several worker processes,
+* possibly on different machines. Everything goes through a queue directory on a shared
+* filesystem, there are no sockets and no locks:
+*
+* <dir>/jobs.json                  the job file, written by the coordinator
+* <dir>/pending/<shard>            shards that are waiting for a worker
+* <dir>/claimed/<shard>.<worker>   shards that are being searched, the worker touches the file every so often
+* <dir>/done/<shard>               finished shards
+* <dir>/checkpoints/<shard>.ckpt   the shard's checkpoint, once the shard is done this is its result
+* <dir>/stop                       written by the coordinator once it has every result it needs
+*
+* A worker claims a shard by renaming it from pending/ to claimed/, only one rename can succeed. If
+* the coordinator doesn't see a claim's modification time change for a while, the worker is
+* assumed to be dead and the shard is moved back to pending/. The next worker resumes it from its
+* checkpoint. A worker that was only slow may finish the shard anyways, that's harmless since the
+* shard gives the same result no matter who runs it. The coordinator only compares modification
+* times with earlier ones it read, so the clocks of the machines don't have to agree.
+*
+* Shards of a job give the same candidates as searching the whole job in one process, so the
+* gathered results are the same as RunSearchJob's (except that collected hits are deduplicated
+* against hits from other shards in a different order).
+*/
+
+namespace mon {
+
+struct ShardQueueParams {
+    std::filesystem::path dir;
+    // rounded up to a multiple of the block size & the job's shard alignment
+    int shard_iterations = 1 << 22;
+    // how often workers touch their claims
+    std::chrono::milliseconds heartbeat_interval{std::chrono::seconds{10}};
+    // a claim that hasn't been touched for this long is handed out again, should be a few heartbeats
+    std::chrono::milliseconds dead_timeout{std::chrono::seconds{120}};
+    // how often the coordinator scans the queue & how often idle workers look for work
+    std::chrono::milliseconds poll_interval{std::chrono::seconds{1}};
+    // how often workers checkpoint their shard, this is how much work is lost when a worker dies
+    std::chrono::milliseconds checkpoint_interval{std::chrono::seconds{60}};
+};
+
+// iterations [first, first + count) of one of the queue's jobs
+struct SearchShard {
+    int job;
+    int first;
+    int count;
+
+    auto operator<=>(const SearchShard&) const = default;
+
+    // also the shard's file name in the queue, sorts by job & first iteration
+    std::string Name() const
+    {
+        char buf[48];
+        snprintf(buf, sizeof buf, "%04d_%010d_%d", job, first, count);
+        return buf;
+    }
+
+    static std::optional<SearchShard> FromName(std::string_view name)
+    {
+        SearchShard shard;
+        const char* end = name.data() + name.size();
+        const char* ptr = name.data();
+        int* fields[]{&shard.job, &shard.first, &shard.count};
+        for (int i = 0; i < 3; i++) {
+            if (i > 0 && (ptr == end || *ptr++ != '_'))
+                return {};
+            auto [next, ec] = std::from_chars(ptr, end, *fields[i]);
+            if (ec != std::errc{})
+                return {};
+            ptr = next;
+        }
+        if (ptr != end || shard.job < 0 || shard.first < 0 || shard.count <= 0)
+            return {};
+        return shard;
+    }
+};
+
+// the paths & file operations of a queue directory
+class ShardQueue {
+    std::filesystem::path dir;
+
+public:
+    static constexpr const char* PENDING = "pending";
+    static constexpr const char* CLAIMED = "claimed";
+    static constexpr const char* DONE = "done";
+
+    explicit ShardQueue(std::filesystem::path dir) : dir{std::move(dir)} {}
+
+    std::filesystem::path JobsFile() const
+    {
+        return dir / "jobs.json";
+    }
+
+    std::filesystem::path StopFile() const
+    {
+        return dir / "stop";
+    }
+
+    std::filesystem::path Pending(const SearchShard& shard) const
+    {
+        return dir / PENDING / shard.Name();
+    }
+
+    std::filesystem::path Claimed(const SearchShard& shard, std::string_view worker) const
+    {
+        return dir / CLAIMED / (shard.Name() + "." + std::string{worker});
+    }
+
+    std::filesystem::path Done(const SearchShard& shard) const
+    {
+        return dir / DONE / shard.Name();
+    }
+
+    std::filesystem::path Checkpoint(const SearchShard& shard) const
+    {
+        return dir / "checkpoints" / (shard.Name() + ".ckpt");
+    }
+
+    bool CreateDirs() const
+    {
+        std::error_code ec;
+        for (const char* sub : {PENDING, CLAIMED, DONE, "checkpoints"})
+            if (std::filesystem::create_directories(dir / sub, ec); ec)
+                return false;
+        return true;
+    }
+
+    // the shards in one of the subdirectories & their files sorted by shard, files that aren't shards are ignored
+    std::vector<std::pair<SearchShard, std::filesystem::path>> List(const char* subdir) const
+    {
+        std::vector<std::pair<SearchShard, std::filesystem::path>> out;
+        std::error_code ec;
+        for (auto it = std::filesystem::directory_iterator{dir / subdir, ec};
+             !ec && it != std::filesystem::directory_iterator{};
+             it.increment(ec)) {
+            std::string name = it->path().filename().string();
+            // claims have the worker after the shard
+            auto shard = SearchShard::FromName(std::string_view{name}.substr(0, name.find('.')));
+            if (shard)
+                out.emplace_back(*shard, it->path());
+        }
+        std::sort(out.begin(), out.end());
+        return out;
+    }
+
+    // returns false if the shard isn't pending (e.g. another worker claimed it first)
+    bool Claim(const SearchShard& shard, std::string_view worker) const
+    {
+        std::error_code ec;
+        std::filesystem::rename(Pending(shard), Claimed(shard, worker), ec);
+        return !ec;
+    }
+
+    bool Requeue(const SearchShard& shard, const std::filesystem::path& claim) const
+    {
+        std::error_code ec;
+        std::filesystem::rename(claim, Pending(shard), ec);
+        return !ec;
+    }
+
+    bool MarkDone(const SearchShard& shard) const
+    {
+        std::ofstream file{Done(shard)};
+        file.close();
+        return std::filesystem::exists(Done(shard));
+    }
+
+    static bool Touch(const std::filesystem::path& path)
+    {
+        if (!std::filesystem::exists(path))
+            std::ofstream file{path};
+        std::error_code ec;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+        return !ec;
+    }
+};
+
+/*
+* Creates the queue, hands out shards, requeues shards from dead workers, and gathers the results.
+* Restarting the coordinator with the same jobs picks up where the last one left off. In find
+* mode, pending shards after the first hit of a job are dropped, the job is done once every shard
+* before the hit is done.
+*/
+class SearchCoordinator {
+    struct JobState {
+        std::vector<SearchShard> shards;
+        std::set<SearchShard> gathered;
+        SearchStats stats;
+        // hits by shard, the iterations are relative to the shard
+        std::map<SearchShard, std::vector<int>> hits;
+        // find mode only
+        int first_hit = INT_MAX;
+    };
+
+    ShardQueueParams params;
+    ShardQueue queue;
+    std::vector<SearchJob> jobs;
+    std::string jobs_text;
+    std::vector<JobState> states;
+    // claim file -> last modification time seen & when it was first seen
+    std::map<std::filesystem::path,
+             std::pair<std::filesystem::file_time_type, std::chrono::steady_clock::time_point>>
+        heartbeats;
+    std::string err;
+
+    bool Fail(std::string msg)
+    {
+        err = std::move(msg);
+        return false;
+    }
+
+    // loads a finished shard's checkpoint, false if it isn't a complete result for the shard
+    bool Gather(const SearchShard& shard)
+    {
+        const SearchJob& job = jobs[shard.job];
+        JobState& state = states[shard.job];
+        SearchCheckpointParams ckpt_params{.path = queue.Checkpoint(shard), .user_key = job.Key()};
+        SearchCheckpoint ckpt;
+        WithJobCandidates(job, shard.first, [&](const auto& source) {
+            ckpt = SearchSpace::LoadCheckpoint(&ckpt_params, source, shard.count, job.CheckpointKind());
+        });
+        const int n_blocks = (shard.count + SearchSpace::PARALLEL_BLOCK_SIZE - 1) / SearchSpace::PARALLEL_BLOCK_SIZE;
+        if (ckpt.next_block != n_blocks)
+            return false;
+        state.stats += ckpt.stats;
+        if (!ckpt.hit_iterations.empty()) {
+            int shard_first_hit = *std::min_element(ckpt.hit_iterations.begin(), ckpt.hit_iterations.end());
+            state.first_hit = std::min(state.first_hit, shard.first + shard_first_hit);
+            state.hits.emplace(shard, std::move(ckpt.hit_iterations));
+        }
+        state.gathered.insert(shard);
+        return true;
+    }
+
+    bool JobDone(size_t job_idx) const
+    {
+        const JobState& state = states[job_idx];
+        int last = jobs[job_idx].mode == SJM_FIND ? state.first_hit : INT_MAX;
+        for (const SearchShard& shard : state.shards)
+            if (shard.first <= last && !state.gathered.contains(shard))
+                return false;
+        return true;
+    }
+
+    SearchJobResult JobResult(size_t job_idx) const
+    {
+        const SearchJob& job = jobs[job_idx];
+        const JobState& state = states[job_idx];
+        SearchJobResult res{.job_idx = job_idx, .stats = state.stats};
+        MonocleFloatingPointScope scope{};
+        TeleportChainParams replay_params = job.ss.params, scratch_params = job.ss.params;
+        TeleportChainResult chain_result, scratch_result;
+        VagHitTopK top_k{job.collect};
+        for (auto& [shard, hit_iterations] : state.hits) {
+            WithJobCandidates(job, shard.first, [&](const auto& source) {
+                for (int it : hit_iterations) {
+                    if (job.mode == SJM_FIND && shard.first + it != state.first_hit)
+                        continue;
+                    SearchResult st = job.ss.ReplayHit(source, it, replay_params, chain_result);
+                    st.n_iterations += shard.first;
+                    if (job.mode == SJM_FIND)
+                        res.found = std::move(st);
+                    else if (!top_k.Holds(st))
+                        top_k.Push(job.ss.RankHit(std::move(st),
+                                                  job.collect.face_samples_per_side,
+                                                  scratch_params,
+                                                  scratch_result,
+                                                  &res.stats));
+                }
+            });
+        }
+        res.hits = top_k.TakeSorted();
+        return res;
+    }
+
+public:
+    // jobs_text is the job file that jobs were read from, workers read the jobs from the copy in the queue
+    SearchCoordinator(const ShardQueueParams& params, std::vector<SearchJob> jobs, std::string jobs_text)
+        : params{params}, queue{params.dir}, jobs{std::move(jobs)}, jobs_text{std::move(jobs_text)}
+    {
+        for (const SearchJob& job : this->jobs) {
+            JobState& state = states.emplace_back();
+            int total = job.NumIterations();
+            int align = std::lcm(job.ShardAlignment(), SearchSpace::PARALLEL_BLOCK_SIZE);
+            int shard_size = std::max(1, (params.shard_iterations + align - 1) / align) * align;
+            for (int first = 0; first < total; first += shard_size)
+                state.shards.push_back({(int)states.size() - 1, first, std::min(shard_size, total - first)});
+        }
+    }
+
+    const std::string& Error() const
+    {
+        return err;
+    }
+
+    // creates the queue, or checks that an existing one has the same jobs
+    bool Init()
+    {
+        if (!queue.CreateDirs())
+            return Fail("could not create the queue directory");
+        std::error_code ec;
+        std::filesystem::remove(queue.StopFile(), ec);
+        if (std::filesystem::exists(queue.JobsFile())) {
+            std::ifstream file{queue.JobsFile(), std::ios::binary};
+            std::stringstream existing;
+            existing << file.rdbuf();
+            if (existing.str() != jobs_text)
+                return Fail("the queue already has different jobs");
+            return true;
+        }
+        std::set<SearchShard> queued;
+        for (const char* sub : {ShardQueue::PENDING, ShardQueue::CLAIMED, ShardQueue::DONE})
+            for (auto& [shard, _] : queue.List(sub))
+                queued.insert(shard);
+        for (const JobState& state : states)
+            for (const SearchShard& shard : state.shards)
+                if (!queued.contains(shard) && !ShardQueue::Touch(queue.Pending(shard)))
+                    return Fail("could not create " + queue.Pending(shard).string());
+        // written last, workers don't start until it exists
+        std::filesystem::path tmp_path = queue.JobsFile();
+        tmp_path += ".tmp";
+        {
+            std::ofstream file{tmp_path, std::ios::binary | std::ios::trunc};
+            if (!file.write(jobs_text.data(), jobs_text.size()).flush())
+                return Fail("could not write " + tmp_path.string());
+        }
+        std::filesystem::rename(tmp_path, queue.JobsFile(), ec);
+        return ec ? Fail("could not write " + queue.JobsFile().string()) : true;
+    }
+
+    /*
+    * Scans the queue once, returns true once every job is done. Also returns false if the queue
+    * couldn't be updated, Error() is set then.
+    */
+    bool Poll()
+    {
+        for (auto& [shard, path] : queue.List(ShardQueue::DONE)) {
+            if (shard.job >= (int)jobs.size() || states[shard.job].gathered.contains(shard))
+                continue;
+            if (!Gather(shard)) {
+                // shouldn't happen unless the checkpoint was lost, search it again
+                std::error_code ec;
+                std::filesystem::remove(path, ec);
+                if (!ShardQueue::Touch(queue.Pending(shard)))
+                    return Fail("could not requeue " + queue.Pending(shard).string());
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        std::set<std::filesystem::path> claims;
+        for (auto& [shard, path] : queue.List(ShardQueue::CLAIMED)) {
+            claims.insert(path);
+            if (shard.job >= (int)jobs.size() || states[shard.job].gathered.contains(shard))
+                continue;
+            std::error_code ec;
+            auto mtime = std::filesystem::last_write_time(path, ec);
+            if (ec)
+                continue;
+            auto [it, inserted] = heartbeats.try_emplace(path, mtime, now);
+            if (!inserted && it->second.first != mtime)
+                it->second = {mtime, now};
+            else if (now - it->second.second >= params.dead_timeout && queue.Requeue(shard, path))
+                heartbeats.erase(it);
+        }
+        std::erase_if(heartbeats, [&claims](const auto& kv) { return !claims.contains(kv.first); });
+
+        for (auto& [shard, path] : queue.List(ShardQueue::PENDING)) {
+            if (shard.job >= (int)jobs.size())
+                continue;
+            const JobState& state = states[shard.job];
+            bool past_hit = jobs[shard.job].mode == SJM_FIND && shard.first > state.first_hit;
+            if (past_hit || state.gathered.contains(shard)) {
+                std::error_code ec;
+                std::filesystem::remove(path, ec);
+            }
+        }
+
+        for (size_t i = 0; i < jobs.size(); i++)
+            if (!JobDone(i))
+                return false;
+        if (!ShardQueue::Touch(queue.StopFile()))
+            return Fail("could not create " + queue.StopFile().string());
+        return true;
+    }
+
+    /*
+    * Polls until every job is done and returns the results in the same order as the jobs. Returns
+    * nothing if a poll failed, see Error().
+    */
+    std::vector<SearchJobResult> Run()
+    {
+        auto start = std::chrono::steady_clock::now();
+        while (!Poll()) {
+            if (!err.empty())
+                return {};
+            std::this_thread::sleep_for(params.poll_interval);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::vector<SearchJobResult> results;
+        for (size_t i = 0; i < jobs.size(); i++) {
+            results.push_back(JobResult(i));
+            results.back().seconds = seconds;
+        }
+        return results;
+    }
+
+    // the number of shards that are done & the total, for progress output
+    std::pair<size_t, size_t> ShardCounts() const
+    {
+        size_t n_done = 0, n_total = 0;
+        for (const JobState& state : states) {
+            n_done += state.gathered.size();
+            n_total += state.shards.size();
+        }
+        return {n_done, n_total};
+    }
+};
+
+/*
+* Claims shards from a queue and searches them until the coordinator writes the stop file. Waits
+* for the queue if it doesn't exist yet, so workers can be started before the coordinator.
+*/
+class SearchWorker {
+    ShardQueueParams params;
+    ShardQueue queue;
+    std::string id;
+    int n_threads;
+    const SearchProgressParams* progress;
+    std::vector<SearchJob> jobs;
+    std::string err;
+
+    bool LoadJobs()
+    {
+        if (!jobs.empty())
+            return true;
+        if (!std::filesystem::exists(queue.JobsFile()))
+            return false;
+        SearchJobReader reader;
+        auto loaded = reader.Load(queue.JobsFile());
+        if (!loaded) {
+            err = reader.Error();
+            return false;
+        }
+        jobs = std::move(*loaded);
+        return true;
+    }
+
+    // false if the shard couldn't be marked as done
+    bool RunShard(const SearchShard& shard, const std::filesystem::path& claim)
+    {
+        const SearchJob& job = jobs[shard.job];
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool finished = false;
+        std::thread heartbeat{[&] {
+            std::unique_lock lock{mtx};
+            while (!cv.wait_for(lock, params.heartbeat_interval, [&] { return finished; })) {
+                // the claim is gone if the coordinator gave up on us, keep going since the result is still valid
+                std::error_code ec;
+                std::filesystem::last_write_time(claim, std::filesystem::file_time_type::clock::now(), ec);
+            }
+        }};
+
+        SearchCheckpointParams ckpt{
+            .path = queue.Checkpoint(shard),
+            .interval = params.checkpoint_interval,
+            .user_key = job.Key(),
+        };
+        std::optional<SearchProgressParams> shard_progress;
+        if (progress) {
+            shard_progress = *progress;
+            shard_progress->label = job.name + " " + shard.Name();
+        }
+        RunSearchJobRange(job, shard.first, shard.count, n_threads, &ckpt, shard_progress ? &*shard_progress : nullptr);
+
+        {
+            std::lock_guard lock{mtx};
+            finished = true;
+        }
+        cv.notify_one();
+        heartbeat.join();
+        // the checkpoint was written when the search finished, the shard can be marked as done
+        if (!queue.MarkDone(shard)) {
+            // keep the claim, the coordinator hands the shard out again once it stops getting heartbeats
+            err = "could not create " + queue.Done(shard).string();
+            return false;
+        }
+        std::error_code ec;
+        std::filesystem::remove(claim, ec);
+        return true;
+    }
+
+public:
+    // id identifies the worker in claim file names, a random one is used if it's empty
+    SearchWorker(const ShardQueueParams& params,
+                 std::string id = {},
+                 int n_threads = 0,
+                 const SearchProgressParams* progress = nullptr)
+        : params{params}, queue{params.dir}, id{std::move(id)}, n_threads{n_threads}, progress{progress}
+    {
+        for (char& c : this->id)
+            if (!isalnum((unsigned char)c) && c != '-')
+                c = '-';
+        if (this->id.empty()) {
+            char buf[16];
+            snprintf(buf, sizeof buf, "w%08x", std::random_device{}());
+            this->id = buf;
+        }
+    }
+
+    const std::string& Id() const
+    {
+        return id;
+    }
+
+    // empty unless the job file in the queue couldn't be read or a shard couldn't be marked as done
+    const std::string& Error() const
+    {
+        return err;
+    }
+
+    // claims & searches one shard, returns false if there wasn't anything to claim or it failed (see Error())
+    bool RunOne()
+    {
+        if (!LoadJobs())
+            return false;
+        for (auto& [shard, _] : queue.List(ShardQueue::PENDING)) {
+            if (shard.job >= (int)jobs.size() || !queue.Claim(shard, id))
+                continue;
+            std::filesystem::path claim = queue.Claimed(shard, id);
+            if (std::filesystem::exists(queue.Done(shard))) {
+                // requeued while the first worker was finishing it
+                std::error_code ec;
+                std::filesystem::remove(claim, ec);
+                continue;
+            }
+            return RunShard(shard, claim);
+        }
+        return false;
+    }
+
+    // returns the number of shards searched
+    int Run()
+    {
+        int n_shards = 0;
+        for (;;) {
+            if (RunOne()) {
+                n_shards++;
+                continue;
+            }
+            if (!err.empty() || std::filesystem::exists(queue.StopFile()))
+                return n_shards;
+            std::this_thread::sleep_for(params.poll_interval);
+        }
+    }
+};
+
+} // namespace mon
@@ -0,0 +1,213 @@
+#pragma once
+
+#include "monocle_config.hpp"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "Ws2_32.lib")
+#endif
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace mon {
+
+/*
+* A minimal blocking TCP socket for talking to SPT (or a stand-in for it) on the local machine,
+* WinSock on Windows and BSD sockets everywhere else. Nothing here throws, failures leave the
+* socket closed or return -1 like the underlying calls.
+*/
+class TcpSocket {
+#ifdef _WIN32
+    using Handle = SOCKET;
+    static constexpr Handle INVALID = INVALID_SOCKET;
+#else
+    using Handle = int;
+    static constexpr Handle INVALID = -1;
+#endif
+
+    Handle sock = INVALID;
+
+    explicit TcpSocket(Handle sock) : sock{sock} {}
+
+    static bool MakeAddr(const char* ip, uint16_t port, sockaddr_in& addr)
+    {
+        addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        return inet_pton(AF_INET, ip, &addr.sin_addr) == 1;
+    }
+
+    static void CloseHandle(Handle h)
+    {
+#ifdef _WIN32
+        closesocket(h);
+#else
+        close(h);
+#endif
+    }
+
+public:
+    // starts WinSock once for the whole process, does nothing on other platforms
+    static bool Init()
+    {
+#ifdef _WIN32
+        static const bool ok = [] {
+            WSADATA wsadata;
+            return WSAStartup(MAKEWORD(2, 2), &wsadata) == 0;
+        }();
+        return ok;
+#else
+        return true;
+#endif
+    }
+
+    TcpSocket() = default;
+    TcpSocket(const TcpSocket&) = delete;
+    TcpSocket& operator=(const TcpSocket&) = delete;
+
+    TcpSocket(TcpSocket&& o) noexcept
+    {
+        *this = std::move(o);
+    }
+
+    TcpSocket& operator=(TcpSocket&& o) noexcept
+    {
+        if (this != &o) {
+            Close();
+            std::swap(sock, o.sock);
+        }
+        return *this;
+    }
+
+    ~TcpSocket()
+    {
+        Close();
+    }
+
+    bool IsOpen() const
+    {
+        return sock != INVALID;
+    }
+
+    void Close()
+    {
+        if (sock != INVALID)
+            CloseHandle(sock);
+        sock = INVALID;
+    }
+
+    // disables Nagle's algorithm, the SPT protocol is lots of tiny messages that each wait for a reply
+    static TcpSocket Connect(const char* ip, uint16_t port)
+    {
+        sockaddr_in addr;
+        if (!Init() || !MakeAddr(ip, port, addr))
+            return {};
+        TcpSocket s{socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)};
+        if (!s.IsOpen() || connect(s.sock, (sockaddr*)&addr, sizeof addr) != 0)
+            return {};
+        s.SetNoDelay();
+        return s;
+    }
+
+    // port 0 picks a free port, see LocalPort()
+    static TcpSocket Listen(const char* ip, uint16_t port, int backlog = 4)
+    {
+        sockaddr_in addr;
+        if (!Init() || !MakeAddr(ip, port, addr))
+            return {};
+        TcpSocket s{socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)};
+        if (!s.IsOpen())
+            return {};
+#ifndef _WIN32
+        // so that a restarted server doesn't have to wait for the old connections to time out
+        int reuse = 1;
+        setsockopt(s.sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof reuse);
+#endif
+        if (bind(s.sock, (sockaddr*)&addr, sizeof addr) != 0 || listen(s.sock, backlog) != 0)
+            return {};
+        return s;
+    }
+
+    TcpSocket Accept() const
+    {
+        TcpSocket s{accept(sock, nullptr, nullptr)};
+        if (s.IsOpen())
+            s.SetNoDelay();
+        return s;
+    }
+
+    uint16_t LocalPort() const
+    {
+        sockaddr_in addr{};
+        socklen_t len = sizeof addr;
+        if (getsockname(sock, (sockaddr*)&addr, &len) != 0)
+            return 0;
+        return ntohs(addr.sin_port);
+    }
+
+    void SetNoDelay() const
+    {
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof one);
+    }
+
+    /*
+    * True once Recv (or Accept for a listening socket) won't block, false if the timeout passed
+    * first. Servers poll with this instead of closing a socket that another thread is blocked on.
+    */
+    bool WaitReadable(std::chrono::microseconds timeout) const
+    {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        timeval tv{(long)(timeout.count() / 1000000), (long)(timeout.count() % 1000000)};
+        return select((int)sock + 1, &fds, nullptr, nullptr, &tv) > 0;
+    }
+
+    // sends everything, returns false if the connection broke
+    bool SendAll(const void* data, size_t len) const
+    {
+#ifdef MSG_NOSIGNAL
+        constexpr int flags = MSG_NOSIGNAL;
+#else
+        constexpr int flags = 0;
+#endif
+        const char* p = (const char*)data;
+        while (len > 0) {
+            int n = (int)send(sock, p, (int)std::min(len, (size_t)1 << 30), flags);
+            if (n <= 0)
+                return false;
+            p += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    // the number of bytes received, 0 if the peer closed the connection, and -1 on errors
+    int Recv(void* buf, size_t len) const
+    {
+        return (int)recv(sock, (char*)buf, (int)std::min(len, (size_t)1 << 30), 0);
+    }
+};
+
+} // namespace mon
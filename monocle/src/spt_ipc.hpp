@@ -0,0 +1,1005 @@
+#pragma once
+
+#include "socket.hpp"
+#include "json.hpp"
+#include "teleport_chain/generate.hpp"
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/*
+* SPT's IPC protocol (spt_ipc 1) and a stand-in for the game that speaks it. Messages are JSON
+* objects followed by a null terminator in both directions. The client sends
+* {"type":"cmd","cmd":"..."}, the game replies with {"type":"ack"} once the command ran and
+* spt_ipc_properties additionally replies with an "ent" message.
+*
+* The stand-in either answers with monocle's own teleport logic (SptIpcEngine), replays a recorded
+* session, or sits in front of the real game and records everything that goes through it. That
+* makes it possible to work on the verification loop without the game, and sessions recorded
+* against the game can be replayed through SptIpcEngine as a regression corpus.
+*/
+
+namespace mon {
+
+constexpr uint16_t SPT_IPC_PORT = 27182;
+
+// sends msg and the null terminator
+inline bool SptIpcSend(const TcpSocket& sock, std::string_view msg)
+{
+    std::string buf{msg};
+    return sock.SendAll(buf.c_str(), buf.size() + 1);
+}
+
+/*
+* Splits the stream from a socket into messages. TCP doesn't keep message boundaries, a recv can
+* have several messages or end partway through one, so the incomplete tail is kept for the next
+* recv.
+*/
+class SptIpcMsgBuffer {
+    std::string buf;
+    size_t start = 0;
+
+public:
+    static constexpr size_t RECV_SIZE = 4096;
+
+    // same return value as TcpSocket::Recv, invalidates the views returned by Next
+    int RecvFrom(const TcpSocket& sock)
+    {
+        if (start > 0) {
+            buf.erase(0, start);
+            start = 0;
+        }
+        size_t old_size = buf.size();
+        buf.resize(old_size + RECV_SIZE);
+        int n = sock.Recv(buf.data() + old_size, RECV_SIZE);
+        buf.resize(old_size + (n > 0 ? n : 0));
+        return n;
+    }
+
+    // the next complete message without its terminator
+    std::optional<std::string_view> Next()
+    {
+        size_t end = buf.find('\0', start);
+        if (end == std::string::npos)
+            return {};
+        std::string_view msg{buf.data() + start, end - start};
+        start = end + 1;
+        return msg;
+    }
+
+    // the bytes of an incomplete message
+    size_t Pending() const
+    {
+        return buf.size() - start;
+    }
+};
+
+struct SptIpcEngineParams {
+    GameVersion gv = GV_5135;
+    // the player's state before the first +duck/-duck
+    bool crouched = true;
+    bool map_origin_empty = false;
+    // the game would keep going, but the tests run with spt_prevent_vag_crash
+    size_t n_max_teleports = 10;
+    /*
+    * The number of commands the game runs per frame, the player only touches portals at the end of
+    * a frame. 0 ends a frame whenever the stand-in has handled everything it received so far, like
+    * the game running all of the messages that arrived since the last frame.
+    */
+    size_t cmds_per_frame = 1;
+};
+
+/*
+* Plays the game's side of an IPC session. Only understands what the tests send:
+*
+* ent_fire "blue" newlocation "x y z pitch yaw roll"   (or "orange")
+* setpos x y z
+* +duck / -duck
+* spt_ipc_properties 1 <props>                         (m_fFlags, m_nTickBase & m_vecOrigin of the player)
+*
+* Anything else is acknowledged and ignored. The portal that was placed last decides the placement
+* order, same as in CommandCorpus. Like in the game, a setpos doesn't teleport right away. The
+* player is run through a teleport chain (without projecting onto the portal plane) on the tick at
+* the end of the frame, so a setpos in front of a portal does nothing and a setpos onto the
+* boundary teleports the player like it would in an empty map.
+*/
+class SptIpcEngine {
+    SptIpcEngineParams params;
+    std::optional<Portal> blue, orange;
+    bool blue_last = false;
+    // rebuilt after newlocation
+    std::optional<PortalPair> pp;
+    Entity player;
+    TeleportChainResult result;
+    uint64_t n_teleports = 0;
+    uint64_t tick = 0;
+    size_t n_frame_cmds = 0;
+    bool setpos_since_tick = false;
+
+    static bool ParseFloats(std::string_view sv, float* out, int n)
+    {
+        const char* p = sv.data();
+        const char* end = p + sv.size();
+        for (int i = 0; i < n; i++) {
+            while (p < end && (*p == ' ' || *p == '\t'))
+                ++p;
+            auto [ptr, ec] = std::from_chars(p, end, out[i]);
+            if (ec != std::errc{})
+                return false;
+            p = ptr;
+        }
+        return true;
+    }
+
+    // console style: whitespace separated, quotes group
+    static std::vector<std::string_view> Tokenize(std::string_view st)
+    {
+        std::vector<std::string_view> toks;
+        size_t i = 0;
+        while (true) {
+            while (i < st.size() && (st[i] == ' ' || st[i] == '\t' || st[i] == '\r'))
+                i++;
+            if (i == st.size())
+                return toks;
+            size_t end;
+            if (st[i] == '"') {
+                end = st.find('"', ++i);
+                if (end == std::string_view::npos)
+                    end = st.size();
+                toks.push_back(st.substr(i, end - i));
+                i = std::min(end + 1, st.size());
+            } else {
+                end = std::min(st.find_first_of(" \t\r", i), st.size());
+                toks.push_back(st.substr(i, end - i));
+                i = end;
+            }
+        }
+    }
+
+    void NewLocation(std::string_view name, std::string_view loc)
+    {
+        if (name != "blue" && name != "orange")
+            return;
+        float v[6];
+        if (!ParseFloats(loc, v, 6))
+            return;
+        Portal p{Vector{v[0], v[1], v[2]}, QAngle{v[3], v[4], v[5]}, params.gv};
+        blue_last = name == "blue";
+        (blue_last ? blue : orange).emplace(p);
+        pp.reset();
+    }
+
+    void SetPos(const Vector& origin)
+    {
+        player = Entity::CreatePlayerFromOrigin(origin, player.player.crouched);
+        setpos_since_tick = true;
+    }
+
+    std::string Properties(std::span<const std::string_view> args) const
+    {
+        int index = -1;
+        if (!args.empty())
+            std::from_chars(args[0].data(), args[0].data() + args[0].size(), index);
+        if (index != 1)
+            return R"({"exists":false,"type":"ent"})";
+        auto wants = [&](std::string_view prop) {
+            return args.size() < 2 || std::find(args.begin() + 1, args.end(), prop) != args.end();
+        };
+        // the game's JSON library sorts keys
+        std::string props;
+        if (wants("m_fFlags"))
+            props += std::format("\"m_fFlags\":{}", player.player.crouched ? 2 : 0);
+        if (wants("m_nTickBase"))
+            props += std::format("{}\"m_nTickBase\":{}", props.empty() ? "" : ",", tick);
+        if (wants("m_vecOrigin")) {
+            const Vector& o = player.player.origin;
+            props += std::format("{}\"m_vecOrigin[0]\":{},\"m_vecOrigin[1]\":{},\"m_vecOrigin[2]\":{}",
+                                 props.empty() ? "" : ",",
+                                 o.x,
+                                 o.y,
+                                 o.z);
+        }
+        return std::format(R"({{"entity":{{{}}},"exists":true,"type":"ent"}})", props);
+    }
+
+    void ExecStatement(std::string_view st, std::vector<std::string>& replies)
+    {
+        std::vector<std::string_view> toks = Tokenize(st);
+        if (toks.empty())
+            return;
+        if (toks[0] == "ent_fire" && toks.size() >= 4 && toks[2] == "newlocation") {
+            NewLocation(toks[1], toks[3]);
+        } else if (toks[0] == "setpos" && toks.size() >= 4) {
+            float v[3];
+            bool ok = true;
+            for (int i = 0; i < 3 && ok; i++)
+                ok = ParseFloats(toks[i + 1], &v[i], 1);
+            if (ok)
+                SetPos(Vector{v[0], v[1], v[2]});
+        } else if (toks[0] == "+duck" || toks[0] == "-duck") {
+            player = Entity::CreatePlayerFromOrigin(player.player.origin, toks[0][0] == '+');
+        } else if (toks[0] == "spt_ipc_properties") {
+            replies.push_back(Properties(std::span{toks}.subspan(1)));
+        }
+    }
+
+public:
+    SptIpcEngine(const SptIpcEngineParams& params = {})
+        : params{params}, player{Entity::CreatePlayerFromOrigin(Vector{}, params.crouched)}
+    {}
+
+    const Entity& Player() const
+    {
+        return player;
+    }
+
+    uint64_t NumTeleports() const
+    {
+        return n_teleports;
+    }
+
+    // the end of a frame, a player that was moved touches the portals now
+    void Tick()
+    {
+        tick++;
+        if (!std::exchange(setpos_since_tick, false) || !blue || !orange)
+            return;
+        if (!pp)
+            pp.emplace(*blue, *orange, blue_last ? PlacementOrder::_BLUE_UPTM : PlacementOrder::_ORANGE_UPTM);
+        TeleportChainParams tp{&*pp, player};
+        tp.project_to_first_portal_plane = false;
+        tp.map_origin_empty = params.map_origin_empty;
+        tp.record_flags = TCRF_NONE;
+        tp.n_max_teleports = params.n_max_teleports;
+        GenerateTeleportChain(tp, result);
+        player = result.ent;
+        n_teleports += result.total_n_teleports;
+    }
+
+    // runs a console command, the replies other than the ack are appended to replies
+    void Exec(std::string_view cmd, std::vector<std::string>& replies)
+    {
+        size_t st_start = 0;
+        bool in_quotes = false;
+        for (size_t i = 0; i <= cmd.size(); i++) {
+            if (i < cmd.size() && cmd[i] == '"')
+                in_quotes = !in_quotes;
+            if (i == cmd.size() || (!in_quotes && (cmd[i] == ';' || cmd[i] == '\n'))) {
+                ExecStatement(cmd.substr(st_start, i - st_start), replies);
+                st_start = i + 1;
+            }
+        }
+    }
+
+    // replies to a message from the client, messages that aren't commands are ignored
+    void HandleMsg(std::string_view msg, std::vector<std::string>& replies)
+    {
+        std::optional<JsonValue> v = JsonParser::Parse(msg);
+        if (!v || !v->IsObject())
+            return;
+        const JsonValue* type = v->Find("type");
+        const JsonValue* cmd = v->Find("cmd");
+        if (!type || type->AsString() != "cmd" || !cmd || !cmd->IsString())
+            return;
+        replies.push_back(R"({"type":"ack"})");
+        Exec(*cmd->AsString(), replies);
+        if (params.cmds_per_frame && ++n_frame_cmds >= params.cmds_per_frame) {
+            n_frame_cmds = 0;
+            Tick();
+        }
+    }
+};
+
+/*
+* A session as JSON lines, one message per line: {"from":"client","msg":"..."} or "server". The
+* messages are kept as strings so that replays send exactly what was recorded.
+*/
+struct SptIpcRecording {
+    struct Msg {
+        bool from_client;
+        std::string msg;
+    };
+
+    std::vector<Msg> msgs;
+
+    bool Save(const std::filesystem::path& path) const
+    {
+        std::ofstream file{path, std::ios::binary | std::ios::trunc};
+        for (const Msg& m : msgs)
+            file << std::format("{{\"from\":\"{}\",\"msg\":{}}}\n",
+                                m.from_client ? "client" : "server",
+                                JsonQuote(m.msg));
+        return !!file.flush();
+    }
+
+    // on failure, err (if given) is set to a description of the problem
+    static std::optional<SptIpcRecording> Load(const std::filesystem::path& path, std::string* err = nullptr)
+    {
+        std::ifstream file{path, std::ios::binary};
+        if (!file) {
+            if (err)
+                *err = "failed to open file";
+            return {};
+        }
+        SptIpcRecording rec;
+        int line_no = 0;
+        for (std::string line; std::getline(file, line);) {
+            line_no++;
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+                continue;
+            std::string parse_err;
+            std::optional<JsonValue> v = JsonParser::Parse(line, &parse_err);
+            const JsonValue* from = v && v->IsObject() ? v->Find("from") : nullptr;
+            const JsonValue* msg = v && v->IsObject() ? v->Find("msg") : nullptr;
+            if (!from || !msg || !msg->IsString() || (from->AsString() != "client" && from->AsString() != "server")) {
+                if (err)
+                    *err = std::format("line {}: {}", line_no, v ? "expected \"from\" and \"msg\"" : parse_err);
+                return {};
+            }
+            rec.msgs.push_back({.from_client = from->AsString() == "client", .msg = std::string{*msg->AsString()}});
+        }
+        return rec;
+    }
+};
+
+struct SptIpcStandInParams {
+    // 0 picks a free port, see SptIpcStandIn::Port()
+    uint16_t port = SPT_IPC_PORT;
+    SptIpcEngineParams engine;
+    /*
+    * If set, client messages that match the next client message in the recording get the recorded
+    * replies. The engine still runs every command so that it can take over after a mismatch.
+    */
+    const SptIpcRecording* replay = nullptr;
+    /*
+    * If set, everything is forwarded to the game on this port instead of going through the
+    * engine. Combined with Recording() this records sessions against the real game.
+    */
+    std::optional<uint16_t> upstream_port;
+};
+
+struct SptIpcStandInStats {
+    uint64_t n_clients = 0;
+    uint64_t n_client_msgs = 0;
+    uint64_t n_replayed = 0;
+    uint64_t n_replay_mismatches = 0;
+};
+
+/*
+* Serves one client at a time on 127.0.0.1 from a background thread, the engine state carries
+* over between clients like the game's would. Listening happens in the constructor, check
+* IsListening().
+*/
+class SptIpcStandIn {
+    static constexpr std::chrono::milliseconds POLL_INTERVAL{20};
+
+    SptIpcStandInParams sp;
+    TcpSocket listener;
+    std::thread thread;
+    std::atomic_bool stop{false};
+    SptIpcEngine engine;
+    size_t replay_cursor = 0;
+
+    mutable std::mutex mtx;
+    SptIpcRecording recording;
+    SptIpcStandInStats stats;
+
+    void Record(bool from_client, std::string_view msg)
+    {
+        std::lock_guard lk{mtx};
+        recording.msgs.push_back({.from_client = from_client, .msg = std::string{msg}});
+    }
+
+    bool Replay(std::string_view msg, std::vector<std::string>& replies)
+    {
+        const auto& msgs = sp.replay->msgs;
+        while (replay_cursor < msgs.size() && !msgs[replay_cursor].from_client)
+            replay_cursor++;
+        if (replay_cursor == msgs.size() || msgs[replay_cursor].msg != msg)
+            return false;
+        for (replay_cursor++; replay_cursor < msgs.size() && !msgs[replay_cursor].from_client; replay_cursor++)
+            replies.push_back(msgs[replay_cursor].msg);
+        return true;
+    }
+
+    void ServeFromEngine(const TcpSocket& client)
+    {
+        SptIpcMsgBuffer buf;
+        std::vector<std::string> replies, recorded_replies;
+        while (!stop) {
+            if (!client.WaitReadable(POLL_INTERVAL))
+                continue;
+            if (buf.RecvFrom(client) <= 0)
+                return;
+            while (std::optional<std::string_view> msg = buf.Next()) {
+                Record(true, *msg);
+                replies.clear();
+                engine.HandleMsg(*msg, replies);
+                if (sp.replay) {
+                    recorded_replies.clear();
+                    bool replayed = Replay(*msg, recorded_replies);
+                    if (replayed)
+                        replies.swap(recorded_replies);
+                    std::lock_guard lk{mtx};
+                    (replayed ? stats.n_replayed : stats.n_replay_mismatches)++;
+                }
+                {
+                    std::lock_guard lk{mtx};
+                    stats.n_client_msgs++;
+                }
+                for (const std::string& reply : replies) {
+                    Record(false, reply);
+                    if (!SptIpcSend(client, reply))
+                        return;
+                }
+            }
+            if (sp.engine.cmds_per_frame == 0)
+                engine.Tick();
+        }
+    }
+
+    // forwards in one direction, returns once either side closes or done is set
+    void Forward(const TcpSocket& from, const TcpSocket& to, bool from_client, std::atomic_bool& done)
+    {
+        SptIpcMsgBuffer buf;
+        while (!stop && !done) {
+            if (!from.WaitReadable(POLL_INTERVAL))
+                continue;
+            if (buf.RecvFrom(from) <= 0)
+                break;
+            while (std::optional<std::string_view> msg = buf.Next()) {
+                Record(from_client, *msg);
+                if (from_client) {
+                    std::lock_guard lk{mtx};
+                    stats.n_client_msgs++;
+                }
+                if (!SptIpcSend(to, *msg)) {
+                    done = true;
+                    return;
+                }
+            }
+        }
+        done = true;
+    }
+
+    void ServeFromUpstream(const TcpSocket& client)
+    {
+        TcpSocket game = TcpSocket::Connect("127.0.0.1", *sp.upstream_port);
+        if (!game.IsOpen())
+            return;
+        std::atomic_bool done{false};
+        std::thread to_client{[&] { Forward(game, client, false, done); }};
+        Forward(client, game, true, done);
+        to_client.join();
+    }
+
+    void Serve()
+    {
+        while (!stop) {
+            if (!listener.WaitReadable(POLL_INTERVAL))
+                continue;
+            TcpSocket client = listener.Accept();
+            if (!client.IsOpen())
+                continue;
+            {
+                std::lock_guard lk{mtx};
+                stats.n_clients++;
+            }
+            if (sp.upstream_port)
+                ServeFromUpstream(client);
+            else
+                ServeFromEngine(client);
+        }
+    }
+
+public:
+    SptIpcStandIn(const SptIpcStandInParams& sp) : sp{sp}, engine{sp.engine}
+    {
+        listener = TcpSocket::Listen("127.0.0.1", sp.port);
+        if (listener.IsOpen())
+            thread = std::thread{&SptIpcStandIn::Serve, this};
+    }
+
+    SptIpcStandIn(const SptIpcStandIn&) = delete;
+    SptIpcStandIn& operator=(const SptIpcStandIn&) = delete;
+
+    ~SptIpcStandIn()
+    {
+        Stop();
+    }
+
+    bool IsListening() const
+    {
+        return listener.IsOpen();
+    }
+
+    uint16_t Port() const
+    {
+        return listener.LocalPort();
+    }
+
+    // disconnects the current client and stops listening
+    void Stop()
+    {
+        stop = true;
+        if (thread.joinable())
+            thread.join();
+        listener.Close();
+    }
+
+    // every message so far from all clients
+    SptIpcRecording Recording() const
+    {
+        std::lock_guard lk{mtx};
+        return recording;
+    }
+
+    SptIpcStandInStats Stats() const
+    {
+        std::lock_guard lk{mtx};
+        return stats;
+    }
+};
+
+struct SptIpcReplayParams {
+    SptIpcEngineParams engine;
+    // the game's positions won't match monocle's bit for bit
+    double tolerance = 1.0;
+    // the number of mismatches to keep in the report
+    size_t max_diffs = 16;
+};
+
+struct SptIpcReplayReport {
+    struct Diff {
+        // the index of the recorded client message
+        size_t msg_idx;
+        // empty if there was no such reply
+        std::string expected, actual;
+    };
+
+    size_t n_client_msgs = 0;
+    size_t n_replies_compared = 0;
+    size_t n_mismatches = 0;
+    std::vector<Diff> diffs;
+};
+
+namespace detail {
+
+inline bool JsonNearlyEqual(const JsonValue& a, const JsonValue& b, double tolerance)
+{
+    if (a.GetType() != b.GetType())
+        return false;
+    switch (a.GetType()) {
+        case JsonValue::J_NULL:
+            return true;
+        case JsonValue::J_BOOL:
+            return a.AsBool() == b.AsBool();
+        case JsonValue::J_NUMBER:
+        {
+            std::optional<double> x = a.AsNumber<double>(), y = b.AsNumber<double>();
+            return x && y && fabs(*x - *y) <= tolerance;
+        }
+        case JsonValue::J_STRING:
+            return a.AsString() == b.AsString();
+        case JsonValue::J_ARRAY:
+            if (a.Items().size() != b.Items().size())
+                return false;
+            for (size_t i = 0; i < a.Items().size(); i++)
+                if (!JsonNearlyEqual(a.Items()[i], b.Items()[i], tolerance))
+                    return false;
+            return true;
+        case JsonValue::J_OBJECT:
+            if (a.Members().size() != b.Members().size())
+                return false;
+            for (auto& [key, val] : a.Members()) {
+                const JsonValue* other = b.Find(key);
+                if (!other || !JsonNearlyEqual(val, *other, tolerance))
+                    return false;
+            }
+            return true;
+    }
+    return false;
+}
+
+} // namespace detail
+
+/*
+* Runs the client messages of a recording through a fresh SptIpcEngine and compares its replies
+* with the recorded ones. Numbers only have to be within the tolerance, everything else has to
+* match exactly.
+*/
+inline SptIpcReplayReport ReplayRecording(const SptIpcRecording& rec, const SptIpcReplayParams& rp = {})
+{
+    SptIpcReplayReport report;
+    SptIpcEngine engine{rp.engine};
+    std::vector<std::string> replies;
+    for (size_t i = 0; i < rec.msgs.size(); i++) {
+        if (!rec.msgs[i].from_client)
+            continue;
+        report.n_client_msgs++;
+        replies.clear();
+        engine.HandleMsg(rec.msgs[i].msg, replies);
+        size_t n_recorded = 0;
+        while (i + 1 + n_recorded < rec.msgs.size() && !rec.msgs[i + 1 + n_recorded].from_client)
+            n_recorded++;
+        for (size_t r = 0; r < std::max(n_recorded, replies.size()); r++) {
+            std::string_view expected, actual;
+            if (r < n_recorded)
+                expected = rec.msgs[i + 1 + r].msg;
+            if (r < replies.size())
+                actual = replies[r];
+            report.n_replies_compared++;
+            std::optional<JsonValue> ev = JsonParser::Parse(expected), av = JsonParser::Parse(actual);
+            if (ev && av ? detail::JsonNearlyEqual(*ev, *av, rp.tolerance) : expected == actual)
+                continue;
+            if (report.n_mismatches++ < rp.max_diffs)
+                report.diffs.push_back({
+                    .msg_idx = i,
+                    .expected = std::string{expected},
+                    .actual = std::string{actual},
+                });
+        }
+        i += n_recorded;
+    }
+    return report;
+}
+
+/*
+* The client side of the protocol with any number of commands in flight. The game runs commands
+* in the order they arrive and replies to each with an ack (and then an ent message for
+* spt_ipc_properties), so replies are matched to commands by their position in the queue.
+*
+* The time between acks is also the best measure of how quickly the game gets through commands,
+* FrameTime() is a running average of the time each command took after the previous one was done.
+*/
+class SptIpcClient {
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct Completion {
+        uint64_t seq;
+        // the whole ent message for commands that asked for one, null otherwise
+        JsonValue ent;
+    };
+
+private:
+    struct Cmd {
+        uint64_t seq;
+        bool wants_ent;
+        bool acked;
+        clock::time_point sent;
+    };
+
+    TcpSocket sock;
+    SptIpcMsgBuffer buf;
+    std::deque<Cmd> in_flight;
+    uint64_t next_seq = 1;
+    clock::time_point last_ack{};
+    clock::duration frame_time = std::chrono::milliseconds{15};
+    std::string err;
+
+    bool HandleMsg(std::string_view msg, std::vector<Completion>& done)
+    {
+        std::optional<JsonValue> v = JsonParser::Parse(msg);
+        const JsonValue* type = v ? v->Find("type") : nullptr;
+        if (!type || in_flight.empty())
+            return Fail(std::format("unexpected message: {}", msg));
+        Cmd& cmd = in_flight.front();
+        if (type->AsString() == "ack" && !cmd.acked) {
+            clock::time_point now = clock::now();
+            frame_time += (now - std::max(last_ack, cmd.sent) - frame_time) / 8;
+            last_ack = now;
+            cmd.acked = true;
+            if (cmd.wants_ent)
+                return true;
+            done.push_back({.seq = cmd.seq, .ent{}});
+        } else if (type->AsString() == "ent" && cmd.acked && cmd.wants_ent) {
+            done.push_back({.seq = cmd.seq, .ent = std::move(*v)});
+        } else {
+            return Fail(std::format("unexpected message for command {}: {}", cmd.seq, msg));
+        }
+        in_flight.pop_front();
+        return true;
+    }
+
+public:
+    explicit SptIpcClient(uint16_t port = SPT_IPC_PORT) : sock{TcpSocket::Connect("127.0.0.1", port)}
+    {
+        if (!sock.IsOpen())
+            err = std::format("failed to connect to port {}", port);
+    }
+
+    bool IsConnected() const
+    {
+        return sock.IsOpen();
+    }
+
+    const std::string& Error() const
+    {
+        return err;
+    }
+
+    size_t NumInFlight() const
+    {
+        return in_flight.size();
+    }
+
+    clock::duration FrameTime() const
+    {
+        return frame_time;
+    }
+
+    // closes the connection, always returns false
+    bool Fail(std::string reason)
+    {
+        err = std::move(reason);
+        sock.Close();
+        return false;
+    }
+
+    // returns the command's sequence number, or 0 if the connection is broken
+    uint64_t Send(std::string_view cmd, bool wants_ent = false)
+    {
+        if (!sock.IsOpen())
+            return 0;
+        if (!SptIpcSend(sock, std::format("{{\"type\":\"cmd\",\"cmd\":{}}}", JsonQuote(cmd)))) {
+            Fail("send failed");
+            return 0;
+        }
+        in_flight.push_back({.seq = next_seq, .wants_ent = wants_ent, .acked = false, .sent = clock::now()});
+        return next_seq++;
+    }
+
+    /*
+    * Appends the commands that finished to done. Waits up to timeout for the first one and then
+    * only takes what has already arrived. Returns false if the connection broke or the game
+    * replied with something unexpected, see Error().
+    */
+    bool Poll(clock::duration timeout, std::vector<Completion>& done)
+    {
+        size_t n_done = done.size();
+        clock::time_point deadline = clock::now() + timeout;
+        while (true) {
+            while (std::optional<std::string_view> msg = buf.Next())
+                if (!HandleMsg(*msg, done))
+                    return false;
+            if (!sock.IsOpen())
+                return Fail("not connected");
+            clock::duration wait = done.size() > n_done ? clock::duration{} : deadline - clock::now();
+            if (!sock.WaitReadable(std::chrono::ceil<std::chrono::microseconds>(std::max(wait, clock::duration{}))))
+                return true;
+            if (buf.RecvFrom(sock) <= 0)
+                return Fail("connection closed");
+        }
+    }
+};
+
+// the position from a reply to spt_ipc_properties with m_vecOrigin
+inline std::optional<Vector> SptIpcEntOrigin(const JsonValue& ent_msg)
+{
+    const JsonValue* ent = ent_msg.Find("entity");
+    if (!ent)
+        return {};
+    Vector v;
+    for (int i = 0; i < 3; i++) {
+        const JsonValue* coord = ent->Find(std::format("m_vecOrigin[{}]", i));
+        std::optional<float> f = coord ? coord->AsNumber<float>() : std::nullopt;
+        if (!f)
+            return {};
+        v[i] = *f;
+    }
+    return v;
+}
+
+// the player's tick from a reply to spt_ipc_properties with m_nTickBase, goes up once per game tick
+inline std::optional<int64_t> SptIpcEntTickBase(const JsonValue& ent_msg)
+{
+    const JsonValue* ent = ent_msg.Find("entity");
+    const JsonValue* tick = ent ? ent->Find("m_nTickBase") : nullptr;
+    return tick ? tick->AsNumber<int64_t>() : std::nullopt;
+}
+
+struct SptIpcVerifyGroup {
+    // newlocation for both portals & a setpos in front of the entry portal
+    std::string setup_cmd;
+    // the player on the portal boundary, the setpos that's supposed to teleport
+    Entity boundary;
+};
+
+struct SptIpcVerifyParams {
+    // the number of groups sent before the position of the oldest one came back
+    size_t max_groups_in_flight = 8;
+    /*
+    * The number of frames (see SptIpcClient::FrameTime) between the ack for the boundary setpos
+    * and asking for the position, 0 sends the query right behind the setpos. A group that is sent
+    * again waits one more frame for each retry, up to max_settle_frames.
+    */
+    int settle_frames = 1;
+    int max_settle_frames = 8;
+    // how often a group is sent again after the game didn't get to its teleport, the run fails after that
+    int max_retries = 3;
+    std::chrono::milliseconds reply_timeout{2000};
+};
+
+struct SptIpcVerifyStats {
+    size_t n_groups = 0;
+    size_t n_retries = 0;
+    size_t max_groups_in_flight = 0;
+    // the most settle frames that a group needed
+    int settle_frames = 0;
+    SptIpcClient::clock::duration frame_time{};
+};
+
+/*
+* Runs each group (setup, boundary setpos, position query) and calls on_result(group_idx, origin)
+* with the player's position from after the teleport. Results come in the order of the groups,
+* except for groups that had to be sent again.
+*
+* All groups share the game's one player and one pair of portals, so a group can only start once
+* the previous group asked for its position. Nothing else waits on replies: the setup & the
+* boundary setpos go out back to back, and the next group goes out right behind the query. The
+* replies for all of that are handled as they arrive. With settle_frames = 0 the query doesn't
+* wait either and up to max_groups_in_flight groups are queued in the game.
+*
+* The setup and the boundary setpos also ask for the player's tick. The boundary setpos only
+* triggers the teleport if it ran on a later frame than the setpos in the setup, and the position
+* is only from after the teleport if the tick moved on since the boundary setpos. Otherwise the
+* group is sent again later, and a group that is sent again waits a frame after the setup before
+* the boundary setpos and one more settle frame before the query. Any position from after the
+* teleport is a result, even one that's still on the boundary. Returns false if the connection
+* broke, a reply took longer than the timeout, or a group ran out of retries, see client.Error().
+*/
+template <typename F>
+bool VerifyOverIpc(SptIpcClient& client,
+                   std::span<const SptIpcVerifyGroup> groups,
+                   const SptIpcVerifyParams& vp,
+                   F&& on_result,
+                   SptIpcVerifyStats* stats_out = nullptr)
+{
+    using clock = SptIpcClient::clock;
+
+    struct Pending {
+        size_t idx;
+        int attempt;
+        int settle_frames;
+        uint64_t setup_seq;
+        // 0 until the boundary setpos/query is sent
+        uint64_t teleport_seq = 0;
+        uint64_t query_seq = 0;
+        std::optional<clock::time_point> setup_acked, teleport_acked;
+        // the player's tick right after the setup & right after the boundary setpos
+        std::optional<int64_t> setup_tick, teleport_tick;
+    };
+
+    auto send_teleport = [&client, &groups](Pending& p) {
+        std::string cmd = std::format("{}; spt_ipc_properties 1 m_nTickBase", groups[p.idx].boundary.SetPosCmd());
+        p.teleport_seq = client.Send(cmd, true);
+        return p.teleport_seq != 0;
+    };
+
+    SptIpcVerifyStats stats;
+    std::deque<Pending> pending;
+    std::deque<std::pair<size_t, int>> retries;
+    std::vector<SptIpcClient::Completion> done;
+    size_t next = 0;
+    clock::time_point last_progress = clock::now();
+
+    while (next < groups.size() || !retries.empty() || !pending.empty()) {
+        clock::time_point now = clock::now();
+        clock::duration wait = vp.reply_timeout;
+        Pending* newest = pending.empty() ? nullptr : &pending.back();
+
+        if (newest && newest->teleport_seq == 0) {
+            // only retries get here, the boundary setpos waits a frame so it can't land in the same frame as the setup
+            if (newest->setup_acked) {
+                clock::time_point teleport_time = *newest->setup_acked + client.FrameTime();
+                if (now >= teleport_time) {
+                    if (!send_teleport(*newest))
+                        return false;
+                    continue;
+                }
+                wait = teleport_time - now;
+            }
+        } else if (newest && newest->query_seq == 0) {
+            bool settled = newest->settle_frames == 0;
+            if (!settled && newest->teleport_acked) {
+                clock::time_point query_time = *newest->teleport_acked + client.FrameTime() * newest->settle_frames;
+                settled = now >= query_time;
+                wait = query_time - now;
+            }
+            if (settled) {
+                newest->query_seq = client.Send("spt_ipc_properties 1 m_vecOrigin m_nTickBase", true);
+                if (!newest->query_seq)
+                    return false;
+                continue;
+            }
+        } else if (pending.size() < vp.max_groups_in_flight && (next < groups.size() || !retries.empty())) {
+            Pending p{.idx = next, .attempt = 0};
+            if (!retries.empty()) {
+                std::tie(p.idx, p.attempt) = retries.front();
+                retries.pop_front();
+            } else {
+                next++;
+            }
+            p.settle_frames = std::min(vp.settle_frames + p.attempt, vp.max_settle_frames);
+            std::string setup_cmd = std::format("{}; spt_ipc_properties 1 m_nTickBase", groups[p.idx].setup_cmd);
+            p.setup_seq = client.Send(setup_cmd, true);
+            if (!p.setup_seq || (p.attempt == 0 && !send_teleport(p)))
+                return false;
+            pending.push_back(p);
+            stats.max_groups_in_flight = std::max(stats.max_groups_in_flight, pending.size());
+            continue;
+        }
+
+        done.clear();
+        if (!client.Poll(wait, done))
+            return false;
+        now = clock::now();
+        if (!done.empty())
+            last_progress = now;
+        else if (now - last_progress > vp.reply_timeout && client.NumInFlight() > 0)
+            return client.Fail("timed out waiting for a reply");
+
+        for (SptIpcClient::Completion& c : done) {
+            for (Pending& p : pending) {
+                if (p.setup_seq == c.seq) {
+                    p.setup_acked = now;
+                    p.setup_tick = SptIpcEntTickBase(c.ent);
+                    if (!p.setup_tick)
+                        return client.Fail("no m_nTickBase in the reply to spt_ipc_properties");
+                } else if (p.teleport_seq == c.seq) {
+                    p.teleport_acked = now;
+                    p.teleport_tick = SptIpcEntTickBase(c.ent);
+                    if (!p.teleport_tick)
+                        return client.Fail("no m_nTickBase in the reply to spt_ipc_properties");
+                }
+            }
+            if (pending.empty() || c.seq != pending.front().query_seq)
+                continue;
+            Pending p = pending.front();
+            pending.pop_front();
+            std::optional<Vector> origin = SptIpcEntOrigin(c.ent);
+            std::optional<int64_t> tick = SptIpcEntTickBase(c.ent);
+            if (!origin || !tick)
+                return client.Fail("no m_vecOrigin or m_nTickBase in the reply to spt_ipc_properties");
+            const char* not_run = nullptr;
+            if (*p.teleport_tick <= *p.setup_tick)
+                not_run = "its boundary setpos ran in the same frame as the setup";
+            else if (*tick == *p.teleport_tick)
+                not_run = "its position was queried before the teleport tick";
+            if (not_run) {
+                if (p.attempt >= vp.max_retries)
+                    return client.Fail(std::format("group {} never got past the teleport tick, {}", p.idx, not_run));
+                retries.emplace_back(p.idx, p.attempt + 1);
+                stats.n_retries++;
+                continue;
+            }
+            stats.n_groups++;
+            stats.settle_frames = std::max(stats.settle_frames, p.settle_frames);
+            on_result(p.idx, *origin);
+        }
+    }
+    stats.frame_time = client.FrameTime();
+    if (stats_out)
+        *stats_out = stats;
+    return true;
+}
+
+} // namespace mon
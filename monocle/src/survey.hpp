@@ -0,0 +1,342 @@
+#pragma once
+
+#include "vag_search.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <format>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*
+* Surveys every pair of portal surfaces on a map (e.g. from FindPortalSurfaces) for VAGs into a
+* target space. The pairs are ordered, blue goes on the first surface and orange on the second.
+*
+* Most pairs can't possibly land in the target. A simple VAG (entry, exit, exit) puts the entity
+* where the exit -> entry teleport maps the entry point, so the landing point is as far from the
+* entry portal as the entry point is from the exit portal. Pairs where the distance from the entry
+* surface to the target space can't match the distance between the two surfaces are skipped
+* without running a single chain. The remaining pairs are sampled like CollectVags with the entry
+* scan batch, and the pairs with hits are ranked by their best hit.
+*
+* The pair matrix is split into square tiles that are handed out to the threads, each thread only
+* keeps the best max_pairs pairs it has seen, so memory doesn't grow with the number of surfaces.
+*/
+
+namespace mon {
+
+struct SurveyParams {
+    // placements sampled for every pair that isn't pruned
+    int samples_per_pair = 4096;
+    // the entry scan of each sample (see SearchSpace::entry_scan_per_side), 1 to disable
+    int entry_scan_per_side = 2;
+    // threads take tile_size x tile_size blocks of pairs at a time
+    int tile_size = 32;
+    /*
+    * Extra room for the distance prune on top of the prefilter margin, covers the crouch offset of
+    * player teleports and chains that don't end up exactly where the double precision teleport says.
+    */
+    float prune_slack = 32.f;
+    // only the best max_pairs pairs with hits are kept
+    size_t max_pairs = 100;
+    // the hits kept for each pair, max_hits is per pair
+    VagCollectParams collect{.max_hits = 4};
+    // for both portals on the same surface
+    bool allow_same_surface = false;
+    uint32_t seed = 0;
+    int n_threads = 0;
+};
+
+struct SurveyPairResult {
+    // indices into the surveyed surfaces
+    uint32_t blue, orange;
+    SearchStats stats;
+    // best first
+    std::vector<RankedVagHit> hits;
+
+    // better pairs compare greater, pairs are ranked by their best hit and then by the number of hits
+    bool operator<(const SurveyPairResult& o) const
+    {
+        if (hits.empty() || o.hits.empty())
+            return hits.empty() && !o.hits.empty();
+        if (hits[0] < o.hits[0] || o.hits[0] < hits[0])
+            return hits[0] < o.hits[0];
+        if (stats.n_hits != o.stats.n_hits)
+            return stats.n_hits < o.stats.n_hits;
+        // the lower pair wins ties so that the report doesn't depend on the threads
+        return std::pair{blue, orange} > std::pair{o.blue, o.orange};
+    }
+};
+
+struct SurveyStats {
+    uint64_t n_pairs = 0;
+    uint64_t n_pruned = 0;
+    // the pairs that had at least one hit (including the ones that didn't make it into the report)
+    uint64_t n_pairs_with_hits = 0;
+    SearchStats search;
+    double seconds = 0;
+};
+
+class VagSurvey {
+    const SearchSpace& base;
+    const std::vector<SearchPortal>& surfaces;
+    SurveyParams sp;
+    // where each surface can put its portal
+    std::vector<AABB> bounds;
+
+    // the smallest & largest distance between a point in a and a point in b
+    static std::pair<float, float> BoxDistanceRange(const AABB& a, const AABB& b)
+    {
+        float lo = 0, hi = 0;
+        for (int i = 0; i < 3; i++) {
+            float gap = std::max({0.f, a.mins[i] - b.maxs[i], b.mins[i] - a.maxs[i]});
+            float span = std::max(a.maxs[i] - b.mins[i], b.maxs[i] - a.mins[i]);
+            lo += gap * gap;
+            hi += span * span;
+        }
+        return {std::sqrt(lo), std::sqrt(hi)};
+    }
+
+    // keeps the best max_pairs results, the worst one is at the front of the heap
+    struct PairTopK {
+        size_t max_pairs;
+        std::vector<SurveyPairResult> heap;
+
+        static bool HeapCmp(const SurveyPairResult& a, const SurveyPairResult& b)
+        {
+            return b < a;
+        }
+
+        void Push(SurveyPairResult&& res)
+        {
+            if (max_pairs == 0)
+                return;
+            if (heap.size() >= max_pairs) {
+                if (!(heap.front() < res))
+                    return;
+                std::pop_heap(heap.begin(), heap.end(), HeapCmp);
+                heap.pop_back();
+            }
+            heap.push_back(std::move(res));
+            std::push_heap(heap.begin(), heap.end(), HeapCmp);
+        }
+    };
+
+public:
+    // the surfaces & base space must outlive the survey, the portals of the base space are ignored
+    VagSurvey(const SearchSpace& base, const std::vector<SearchPortal>& surfaces, const SurveyParams& sp = {})
+        : base{base}, surfaces{surfaces}, sp{sp}
+    {
+        MON_ASSERT(surfaces.size() < 65536); // pair indices are used as prng blocks
+        for (const SearchPortal& s : surfaces)
+            bounds.push_back(PositionBounds(s));
+    }
+
+    // the box that every portal generated by the search portal is in
+    static AABB PositionBounds(const SearchPortal& s)
+    {
+        if (s.locked)
+            return AABB{s.locked_pos, s.locked_pos};
+        MON_ASSERT(!s.pos_spaces.empty() && !s.lock_opts.empty());
+        AABB box = s.pos_spaces.Bounds();
+        int lock_axis = s.LockAxis();
+        if (s.type != SPT_PLANE) {
+            auto [lo, hi] = std::minmax_element(s.lock_opts.begin(), s.lock_opts.end());
+            box.mins[lock_axis] = *lo;
+            box.maxs[lock_axis] = *hi;
+            return box;
+        }
+        // the locked coordinate is linear in the others, so it's extreme at the corners of the bounds
+        AABB plane_box = box;
+        plane_box.mins[lock_axis] = INFINITY;
+        plane_box.maxs[lock_axis] = -INFINITY;
+        for (float dist : s.lock_opts) {
+            for (int corner = 0; corner < 8; corner++) {
+                Vector pt;
+                for (int i = 0; i < 3; i++)
+                    pt[i] = i == lock_axis ? 0.f : ((corner >> i) & 1 ? box.maxs[i] : box.mins[i]);
+                float c = (dist - s.plane_normal.Dot(pt)) / s.plane_normal[lock_axis];
+                plane_box.mins[lock_axis] = std::min(plane_box.mins[lock_axis], c - PORTAL_SURFACE_OFFSET);
+                plane_box.maxs[lock_axis] = std::max(plane_box.maxs[lock_axis], c + PORTAL_SURFACE_OFFSET);
+            }
+        }
+        return plane_box;
+    }
+
+    size_t NumPairs() const
+    {
+        size_t n = surfaces.size();
+        return sp.allow_same_surface ? n * n : n * (n - std::min<size_t>(n, 1));
+    }
+
+    /*
+    * False if no placement on the two surfaces can land a simple VAG in the target space (see the
+    * top of the file). With the entry point e, the exit portal x, and the landing point l,
+    * |l - e| = |entry point - x| which is within the entry portal's half diagonal of |e - x|.
+    */
+    bool PairCanReachTarget(size_t blue, size_t orange) const
+    {
+        const AABB& entry = bounds[base.tp_from_blue ? blue : orange];
+        const AABB& exit = bounds[base.tp_from_blue ? orange : blue];
+        float slack =
+            sp.prune_slack + std::max(base.prefilter_margin, 0.f) + std::hypot(PORTAL_HALF_WIDTH, PORTAL_HALF_HEIGHT);
+        auto [portal_lo, portal_hi] = BoxDistanceRange(entry, exit);
+        for (const AABB& target : base.target_space) {
+            auto [target_lo, target_hi] = BoxDistanceRange(entry, target);
+            if (target_lo <= portal_hi + slack && portal_lo <= target_hi + slack)
+                return true;
+        }
+        return false;
+    }
+
+    /*
+    * Samples one pair, space is scratch space that's a copy of the base space. Pair p = blue *
+    * n_surfaces + orange always uses BlockPrng(seed, p), so the result doesn't depend on the
+    * threads.
+    */
+    SurveyPairResult SurveyPair(size_t blue,
+                                size_t orange,
+                                SearchSpace& space,
+                                TeleportChainParams& scratch_params,
+                                TeleportChainResult& chain_result,
+                                TeleportChainResult& scratch_result) const
+    {
+        space.blue_search = surfaces[blue];
+        space.orange_search = surfaces[orange];
+        space.entry_scan_per_side = sp.entry_scan_per_side;
+        SurveyPairResult res{.blue = (uint32_t)blue, .orange = (uint32_t)orange};
+        TeleportChainParams& params = space.params;
+        small_prng rng = SearchSpace::BlockPrng(sp.seed, (uint32_t)(blue * surfaces.size() + orange));
+        VagHitTopK top_k{sp.collect};
+        for (int i = 0; i < sp.samples_per_pair; i++) {
+            auto gen_start = std::chrono::steady_clock::now();
+            SearchResult st = space.GenerateCandidate(rng, i, params);
+            res.stats.gen_ns += SearchSpace::NsSince(gen_start);
+            if (!space.EvaluateCandidate(st, params, chain_result, res.stats) || top_k.Holds(st))
+                continue;
+            top_k.Push(space.RankHit(
+                std::move(st), sp.collect.face_samples_per_side, scratch_params, scratch_result, &res.stats));
+        }
+        res.hits = top_k.TakeSorted();
+        return res;
+    }
+
+    // the pairs with hits, best first
+    std::vector<SurveyPairResult> Run(SurveyStats* stats = nullptr) const
+    {
+        auto start = std::chrono::steady_clock::now();
+        const size_t n = surfaces.size();
+        const size_t tile = (size_t)std::max(sp.tile_size, 1);
+        const size_t tiles_per_side = (n + tile - 1) / tile;
+        const size_t n_tiles = tiles_per_side * tiles_per_side;
+        int n_threads = sp.n_threads > 0 ? sp.n_threads : std::max(1, (int)std::thread::hardware_concurrency());
+
+        std::atomic_size_t next_tile{0};
+        std::mutex mtx;
+        PairTopK all{sp.max_pairs};
+        SurveyStats total;
+
+        ctpl::thread_pool pool{n_threads};
+        for (int t = 0; t < n_threads; t++) {
+            pool.push([&](int) -> void {
+                MonocleFloatingPointScope scope{};
+                SearchSpace space = base;
+                TeleportChainParams scratch_params = base.params;
+                TeleportChainResult chain_result, scratch_result;
+                PairTopK top_k{sp.max_pairs};
+                SurveyStats thread_stats;
+
+                for (size_t ti; (ti = next_tile.fetch_add(1, std::memory_order_relaxed)) < n_tiles;) {
+                    size_t blue_begin = ti / tiles_per_side * tile, orange_begin = ti % tiles_per_side * tile;
+                    for (size_t blue = blue_begin; blue < std::min(blue_begin + tile, n); blue++) {
+                        for (size_t orange = orange_begin; orange < std::min(orange_begin + tile, n); orange++) {
+                            if (blue == orange && !sp.allow_same_surface)
+                                continue;
+                            thread_stats.n_pairs++;
+                            if (!PairCanReachTarget(blue, orange)) {
+                                thread_stats.n_pruned++;
+                                continue;
+                            }
+                            SurveyPairResult res =
+                                SurveyPair(blue, orange, space, scratch_params, chain_result, scratch_result);
+                            thread_stats.search += res.stats;
+                            if (res.hits.empty())
+                                continue;
+                            thread_stats.n_pairs_with_hits++;
+                            top_k.Push(std::move(res));
+                        }
+                    }
+                }
+                std::lock_guard lock{mtx};
+                for (SurveyPairResult& res : top_k.heap)
+                    all.Push(std::move(res));
+                total.n_pairs += thread_stats.n_pairs;
+                total.n_pruned += thread_stats.n_pruned;
+                total.n_pairs_with_hits += thread_stats.n_pairs_with_hits;
+                total.search += thread_stats.search;
+            });
+        }
+        pool.stop(true);
+
+        std::vector<SurveyPairResult> out = std::move(all.heap);
+        std::sort(out.begin(), out.end(), [](const SurveyPairResult& a, const SurveyPairResult& b) { return b < a; });
+        total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (stats)
+            *stats = total;
+        return out;
+    }
+
+    // a human readable ranking of the pairs
+    void PrintReport(FILE* f, const std::vector<SurveyPairResult>& results, const SurveyStats& stats) const
+    {
+        static constexpr const char* TYPE_STRS[]{"XP", "XN", "YP", "YN", "ZP", "ZN", "plane"};
+        fprintf(f,
+                "surveyed %zu surfaces in %.1fs: %llu pairs, %llu pruned, %llu with hits\n",
+                surfaces.size(),
+                stats.seconds,
+                (unsigned long long)stats.n_pairs,
+                (unsigned long long)stats.n_pruned,
+                (unsigned long long)stats.n_pairs_with_hits);
+        auto surface_str = [&](uint32_t idx) {
+            const SearchPortal& s = surfaces[idx];
+            const AABB& b = bounds[idx];
+            return std::format("{} ({} at [{:.1f} {:.1f} {:.1f}] - [{:.1f} {:.1f} {:.1f}])",
+                               idx,
+                               s.locked ? "locked" : TYPE_STRS[s.type],
+                               b.mins.x,
+                               b.mins.y,
+                               b.mins.z,
+                               b.maxs.x,
+                               b.maxs.y,
+                               b.maxs.z);
+        };
+        for (size_t i = 0; i < results.size(); i++) {
+            const SurveyPairResult& res = results[i];
+            fprintf(f,
+                    "\n#%zu: blue %s, orange %s\n%llu hits in %llu samples\n",
+                    i + 1,
+                    surface_str(res.blue).c_str(),
+                    surface_str(res.orange).c_str(),
+                    (unsigned long long)res.stats.n_hits,
+                    (unsigned long long)res.stats.n_pairs);
+            for (const RankedVagHit& rh : res.hits) {
+                fprintf(f,
+                        "%.1f%% of the entry face VAGs, %.1f units from the target edge (%s)\n%s\n%s\n",
+                        rh.face_vag_fraction * 100.f,
+                        rh.target_margin,
+                        PlacementOrderStrs[(int)rh.hit.pp.order],
+                        rh.hit.pp.NewLocationCmd().c_str(),
+                        rh.hit.ent.SetPosCmd().c_str());
+            }
+        }
+        fflush(f);
+    }
+};
+
+} // namespace mon
@@ -9,22 +9,29 @@
 #include "teleport_chain/tp_ring_queue.hpp"
 #include "teleport_chain/ulp_diff.hpp"
 #include "prng.hpp"
+#include "low_discrepancy.hpp"
+#include "outcome_raster.hpp"
+#include "vag_search.hpp"
+#include "overlay_contour.hpp"
+#include "overlay_volume.hpp"
+#include "json.hpp"
+#include "search_job.hpp"
+#include "shard_queue.hpp"
+#include "bsp.hpp"
+#include "survey.hpp"
+#include "command_corpus.hpp"
+#include "daemon.hpp"
+#include "spt_ipc.hpp"
 
-#define WIN32_LEAN_AND_MEAN
-#define NOMINMAX
-
-#include <windows.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
 #include <stdlib.h>
 #include <chrono>
 #include <thread>
 #include <format>
+#include <map>
 #include <queue>
-
-#pragma comment(lib, "Ws2_32.lib")
-#pragma comment(lib, "Mswsock.lib")
-#pragma comment(lib, "AdvApi32.lib")
+#include <sstream>
+#include <set>
+#include <tuple>
 
 #define CATCH_SEED ((uint32_t)42069)
 
@@ -180,6 +187,12 @@ TEST_CASE("Teleport queue move constructor")
     size_t i = n_elemspop;
     for (auto it = tpq2.begin(); it != tpq2.end(); ++it, ++i)
         REQUIRE(*it == (int)(i * 69420));
+
+    // the moved from queue is empty and can be used again
+    REQUIRE(tpq.empty());
+    for (size_t j = 0; j < n_elemspush; j++)
+        tpq.push_back((int)j);
+    REQUIRE(tpq.size() == n_elemspush);
 }
 
 TEST_CASE("Teleport queue move assignment")
@@ -206,6 +219,12 @@ TEST_CASE("Teleport queue move assignment")
     size_t i = n_elemspop;
     for (auto it = tpq2.begin(); it != tpq2.end(); ++it, ++i)
         REQUIRE(*it == (int)(i * 69420));
+
+    // the moved from queue is empty and can be used again
+    REQUIRE(tpq.empty());
+    for (size_t j = 0; j < n_elemspush; j++)
+        tpq.push_back((int)j);
+    REQUIRE(tpq.size() == n_elemspush);
 }
 
 TEST_CASE("ShouldTeleport (no portal hole check)")
@@ -874,52 +893,1589 @@ TEST_CASE("00 AAG")
                  Catch::Matchers::WithinAbs(0, 2.f));
 }
 
-class SptIpcConn {
-
-    const USHORT spt_port = 27182;
-    const char* ip_addr = "127.0.0.1";
+TEST_CASE("Stepping floats by ulps")
+{
+    REPEAT_TEST(1000);
+    static small_prng rng;
+    // also test stepping across zero with denormals
+    float f = rng.next_bool() ? rng.next_float(-3000.f, 3000.f)
+                              : rng.next_int(-50, 50) * std::numeric_limits<float>::denorm_min();
+    int32_t n = rng.next_int(-100, 100);
+    float ref = f;
+    for (int32_t i = 0; i < std::abs(n); i++)
+        ref = std::nextafterf(ref, n < 0 ? -INFINITY : INFINITY);
+    INFO("f: " << std::format(MON_F_FMT, f) << ", n: " << n);
+    REQUIRE(mon::ulp::StepUlpsF(f, n) == ref);
+}
 
-    // clang-format off
-    struct _WinSock {
-        int _ret;
-        WSADATA wsadata;
-        _WinSock() { _ret = WSAStartup(MAKEWORD(2, 2), &wsadata); if (_ret != 0) SKIP("WSAStartup failed");}
-        ~_WinSock() { if (_ret == 0) WSACleanup(); }
-    } winsock{};
-    // clang-format on
+TEST_CASE("Chain outcome packing")
+{
+    for (int exceeded = 0; exceeded < 2; exceeded++) {
+        for (int cum = -100; cum <= 100; cum++) {
+            mon::ChainOutcome o = mon::ChainOutcome::Pack(exceeded, cum);
+            INFO("cum: " << cum << ", exceeded: " << exceeded);
+            REQUIRE(o.MaxTpsExceeded() == !!exceeded);
+            REQUIRE(o.CumTeleports() == std::clamp(cum, mon::ChainOutcome::CUM_MIN, mon::ChainOutcome::CUM_MAX));
+            REQUIRE(o.IsVag() == (!exceeded && cum == -1));
+        }
+    }
+}
 
-    SOCKET sock = INVALID_SOCKET;
-    bool _cleanup_sock = false;
-    char recv_buf[1024]{};
-    int off = 0;
-    int recvLen = 0;
+TEST_CASE("Outcome raster file round trip")
+{
+    // every combination of side channels, the layout of each channel depends on the ones before it
+    uint32_t channels = GENERATE(range(0u, (uint32_t)mon::ORC_ALL + 1));
+    small_prng rng{1234 + channels};
+    uint32_t layers = (uint32_t)rng.next_int(1, 4);
+    INFO("channels: " << channels << ", layers: " << layers);
+    mon::OutcomeRaster raster{37, 23, channels, layers};
 
-    // TODO there's seems to be a bug in Catch2 when skipping from a class fixture ctor, update Catch2 and see if that's fixed!
-    std::optional<std::string> defer_skip_message;
+    mon::TeleportChainResult result;
+    for (size_t i = 0; i < raster.Size() * layers; i++) {
+        result.max_tps_exceeded = rng.next_bool();
+        result.cum_teleports = rng.next_int(-80, 80);
+        result.total_n_teleports = (size_t)rng.next_int(0, 1000);
+        mon::Vector pos{rng.next_float(-1, 1), rng.next_float(-1, 1), rng.next_float(-1, 1)};
+        result.ent = mon::Entity::CreateBall(pos, 1.f);
+        raster.Set(i % raster.Size(), result, (uint32_t)(i / raster.Size()));
+    }
 
-public:
-    SptIpcConn()
+    auto path = std::filesystem::temp_directory_path() / "monocle_test_raster.mor";
+    REQUIRE(raster.Save(path));
     {
-        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (sock == INVALID_SOCKET) {
-            defer_skip_message = "Socket creation failed";
-            return;
+        auto mapped = mon::OutcomeRaster::Open(path);
+        REQUIRE(mapped.has_value());
+        REQUIRE(mapped->Width() == raster.Width());
+        REQUIRE(mapped->Height() == raster.Height());
+        REQUIRE(mapped->Channels() == raster.Channels());
+        REQUIRE(mapped->Layers() == raster.Layers());
+        for (uint32_t l = 0; l < layers; l++) {
+            REQUIRE(mapped->CountDiffs(raster, l, l) == 0);
+            REQUIRE(mapped->Histogram(l) == raster.Histogram(l));
+            for (size_t i = 0; i < raster.Size(); i++) {
+                if (channels & mon::ORC_TOTAL_TELEPORTS)
+                    REQUIRE(mapped->TotalTeleports(l)[i] == raster.TotalTeleports(l)[i]);
+                if (channels & mon::ORC_EXACT_CUM)
+                    REQUIRE(mapped->ExactCum(l)[i] == raster.ExactCum(l)[i]);
+                if (channels & mon::ORC_FINAL_POS)
+                    REQUIRE(mapped->FinalPos(l)[i] == raster.FinalPos(l)[i]);
+            }
         }
+    }
+    std::filesystem::remove(path);
+}
 
-        sockaddr_in server_addr{};
-        server_addr.sin_family = AF_INET;
-        inet_pton(AF_INET, ip_addr, &server_addr.sin_addr.s_addr);
-        server_addr.sin_port = htons(spt_port);
+TEST_CASE("Region contours from raster")
+{
+    // a VAG disk inside a normal region, the normal region should have an outer loop and a hole
+    mon::OutcomeRaster raster{40, 60};
+    for (int y = 0; y < 60; y++)
+        for (int x = 0; x < 40; x++)
+            raster.At(x, y) = mon::ChainOutcome::Pack(false, (x - 20) * (x - 20) + (y - 30) * (y - 30) < 100 ? -1 : 1);
+
+    mon::RegionContours rc = mon::ExtractRasterContours(raster);
+    auto signed_area = [](const mon::RegionContour& c) {
+        float a = 0;
+        for (size_t i = 0; i < c.pts.size(); i++) {
+            auto [x0, y0] = c.pts[i];
+            auto [x1, y1] = c.pts[(i + 1) % c.pts.size()];
+            a += x0 * y1 - x1 * y0;
+        }
+        return a / 2;
+    };
+    int n_outer = 0, n_holes = 0, n_vag = 0;
+    float vag_area = 0, hole_area = 0;
+    for (const mon::RegionContour& c : rc.contours) {
+        float a = signed_area(c);
+        if (c.region == mon::OR_VAG) {
+            n_vag++;
+            vag_area = a;
+        } else {
+            REQUIRE(c.region == mon::OR_NORMAL);
+            (a > 0 ? n_outer : n_holes)++;
+            if (a < 0)
+                hole_area = a;
+        }
+    }
+    REQUIRE(n_outer == 1);
+    REQUIRE(n_holes == 1);
+    REQUIRE(n_vag == 1);
+    // regions are on the left of their loops, so the shared boundary is traversed in opposite directions
+    REQUIRE_THAT(vag_area, Catch::Matchers::WithinAbs(-hole_area, 1e-3));
+    REQUIRE(vag_area > 0);
+}
 
-        _cleanup_sock = true;
-        if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR)
-            defer_skip_message = "Failed to connect to SPT";
+TEST_CASE("Adaptive region contours match a full raster")
+{
+    const mon::AdaptiveContourParams acp{.coarse_x = 4, .coarse_y = 7, .n_levels = 4};
+    const int nx = acp.coarse_x * (1 << acp.n_levels) + 1, ny = acp.coarse_y * (1 << acp.n_levels) + 1;
+
+    // a small island centered on a coarse grid line but between the coarse nodes
+    const auto [island_r, island_u] = mon::ContourNodeToFace(32, 48, nx, ny);
+    auto region_at = [&](float r, float u) {
+        if ((r - island_r) * (r - island_r) + (u - island_u) * (u - island_u) < .8f * .8f)
+            return mon::OR_OTHER;
+        if (std::abs(r - u * .3f - 2) < .6f) // a thin stripe that crosses many cells
+            return mon::OR_BACK_TO_ENTRY;
+        if ((r - 3) * (r - 3) + (u - 10) * (u - 10) < 64)
+            return mon::OR_VAG;
+        return mon::OR_NORMAL;
+    };
+    mon::RegionContours adaptive = mon::ExtractAdaptiveRegionContours(
+        [&](const std::vector<std::pair<float, float>>& pts) {
+            std::vector<mon::OverlayRegion> regions;
+            for (auto [r, u] : pts)
+                regions.push_back(region_at(r, u));
+            return regions;
+        },
+        acp);
+
+    mon::OutcomeRaster raster{(uint32_t)nx, (uint32_t)ny};
+    for (int y = 0; y < ny; y++) {
+        for (int x = 0; x < nx; x++) {
+            auto [r, u] = mon::ContourNodeToFace((float)x, (float)y, nx, ny);
+            const int cums[]{1, -1, 0, 2};
+            raster.At(x, y) = mon::ChainOutcome::Pack(false, cums[region_at(r, u)]);
+        }
+    }
+    mon::RegionContours full = mon::ExtractRasterContours(raster);
+
+    // loops can start anywhere, rotate each one to its smallest point before comparing
+    auto canonical = [](const mon::RegionContours& rc) {
+        std::vector<std::pair<mon::OverlayRegion, std::vector<std::pair<float, float>>>> loops;
+        for (const mon::RegionContour& c : rc.contours) {
+            auto pts = c.pts;
+            std::rotate(pts.begin(), std::min_element(pts.begin(), pts.end()), pts.end());
+            loops.emplace_back(c.region, std::move(pts));
+        }
+        std::ranges::sort(loops);
+        return loops;
+    };
+    REQUIRE(adaptive.n_open_contours == 0);
+    REQUIRE(full.n_open_contours == 0);
+    REQUIRE(std::ranges::count(adaptive.contours, mon::OR_OTHER, &mon::RegionContour::region) == 1);
+    REQUIRE(canonical(adaptive) == canonical(full));
+    REQUIRE(adaptive.n_chain_evals < (size_t)(nx * ny));
+}
+
+TEST_CASE("Outcome volume round trip")
+{
+    small_prng rng{4321};
+    const uint32_t w = 700, h = 5, d = 3;
+    mon::OutcomeVolume vol{w, h, d, -2.f, 2.f};
+    std::vector<mon::ChainOutcome> dense(w * h * d);
+    for (size_t i = 0; i < dense.size(); i++) {
+        // mostly long runs (including ones longer than a single run can hold) with some noise
+        if (i % w == 0 || rng.next_int(0, 300) == 0)
+            dense[i] = mon::ChainOutcome::Pack(rng.next_bool(), rng.next_int(-3, 3));
+        else
+            dense[i] = dense[i - 1];
+    }
+    for (size_t row = 0; row < h * d; row++)
+        vol.AppendRow(dense.data() + row * w, w);
+    REQUIRE(vol.IsComplete());
+    REQUIRE(vol.NumRuns() < dense.size() / 10);
+
+    auto path = std::filesystem::temp_directory_path() / "monocle_test_volume.mov";
+    REQUIRE(vol.Save(path));
+    auto loaded = mon::OutcomeVolume::Load(path);
+    std::filesystem::remove(path);
+    REQUIRE(loaded.has_value());
+    REQUIRE(loaded->SliceOffset(d - 1) == 2.f);
+    for (uint32_t z = 0; z < d; z++) {
+        mon::OutcomeRaster slice = loaded->Slice(z);
+        for (uint32_t y = 0; y < h; y++) {
+            for (uint32_t x = 0; x < w; x++) {
+                mon::ChainOutcome expected = dense[((size_t)z * h + y) * w + x];
+                REQUIRE(slice.At(x, y) == expected);
+                REQUIRE(loaded->At(x, y, z) == expected);
+            }
+        }
+        REQUIRE(loaded->Histogram(z) == slice.Histogram());
     }
+}
+
+// the portals from the README
+static mon::PortalPair ReadmePortalPair()
+{
+    return mon::PortalPair{
+        {1189.75232f, 1036.28369f, 923.913574f},
+        {-58.4471817f, -44.0751495f, 0.f},
+        {874.779541f, 1159.03931f, 891.764954f},
+        {37.8783722f, 129.905914f, 0.f},
+        mon::PlacementOrder::ORANGE_OPEN_BLUE_NEW_LOCATION,
+        mon::GV_5135,
+    };
+}
+
+TEST_CASE("All order overlays match single order overlays")
+{
+    mon::PortalPair pp = ReadmePortalPair();
+    mon::TeleportChainParams params{&pp, mon::Entity::CreatePlayerFromCenter(pp.orange.pos, true)};
+    params.n_max_teleports = 10;
+    const size_t y_res = 24;
+
+    auto read_file = [](const std::filesystem::path& path) {
+        std::ifstream file{path, std::ios::binary};
+        return std::string{std::istreambuf_iterator<char>{file}, {}};
+    };
+    auto dir = std::filesystem::temp_directory_path();
+    auto prefix = (dir / "monocle_test_overlay").string();
+
+    for (int rand_nudge = 0; rand_nudge < 2; rand_nudge++) {
+        mon::OutcomeRaster all = mon::RenderOverlayOutcomesAllOrders(params, y_res, rand_nudge, mon::ORC_ALL);
+        mon::CreateOverlayPortalImagesAllOrders(params, prefix.c_str(), y_res, rand_nudge);
+        REQUIRE(all.Layers() == (uint32_t)mon::PlacementOrder::COUNT);
+        for (uint32_t order = 0; order < all.Layers(); order++) {
+            INFO("rand_nudge: " << rand_nudge << ", order: " << mon::PlacementOrderStrs[order]);
+            mon::PortalPair single_pp{pp.blue, pp.orange, (mon::PlacementOrder)order};
+            mon::TeleportChainParams single_params = params;
+            single_params.pp = &single_pp;
+
+            mon::OutcomeRaster single = mon::RenderOverlayOutcomes(single_params, y_res, rand_nudge, mon::ORC_ALL);
+            REQUIRE(all.CountDiffs(single, order, 0) == 0);
+            for (size_t i = 0; i < single.Size(); i++) {
+                REQUIRE(all.TotalTeleports(order)[i] == single.TotalTeleports()[i]);
+                REQUIRE(all.ExactCum(order)[i] == single.ExactCum()[i]);
+                REQUIRE(all.FinalPos(order)[i] == single.FinalPos()[i]);
+            }
+
+            auto single_path = dir / "monocle_test_overlay_single.tga";
+            mon::CreateOverlayPortalImage(single_params, single_path.string().c_str(), y_res, rand_nudge);
+            auto all_path = std::format("{}_{}.tga", prefix, mon::PlacementOrderStrs[order]);
+            std::string single_tga = read_file(single_path);
+            REQUIRE(!single_tga.empty());
+            REQUIRE(read_file(all_path) == single_tga);
+            std::filesystem::remove(single_path);
+            std::filesystem::remove(all_path);
+        }
+    }
+}
+
+TEST_CASE("Ulp lattice matches single chains")
+{
+    mon::PortalPair pp = ReadmePortalPair();
+    mon::TeleportChainParams params{&pp, mon::Entity::CreatePlayerFromCenter(pp.orange.pos, true)};
+    params.n_max_teleports = 10;
+
+    // small chunks so that they finish out of order
+    const mon::UlpLatticeParams lattice{
+        .r_off = 3.f,
+        .u_off = -5.f,
+        .half_ulps_x = 4,
+        .half_ulps_y = 6,
+        .rows_per_chunk = 2,
+    };
+    auto [raster, stats] = mon::RenderUlpLatticeRaster(params, lattice);
+    REQUIRE(stats.n_total == raster.Size());
+    REQUIRE(stats.histogram == raster.Histogram());
+
+    // the window center is the pixel in the middle of the raster
+    mon::TeleportChainParams center_params = params;
+    center_params.project_to_first_portal_plane = true;
+    const mon::Portal& p = pp.orange;
+    center_params.ent = params.ent.WithNewCenter(p.pos + p.r * lattice.r_off + p.u * lattice.u_off);
+    mon::TeleportChainResult result;
+    mon::GenerateTeleportChain(center_params, result);
+    REQUIRE(raster.At(lattice.half_ulps_x, lattice.half_ulps_y) == mon::ChainOutcome::FromResult(result));
+
+    // one ulp to the right along the column axis
+    int a0 = stats.free_axes[0];
+    center_params.ent.GetPosRef()[a0] = mon::ulp::StepUlpsF(center_params.ent.GetPosRef()[a0], 1);
+    mon::GenerateTeleportChain(center_params, result);
+    REQUIRE(raster.At(lattice.half_ulps_x + 1, lattice.half_ulps_y) == mon::ChainOutcome::FromResult(result));
+}
+
+TEST_CASE("Overlay volume matches single chains")
+{
+    mon::PortalPair pp = ReadmePortalPair();
+    mon::TeleportChainParams params{&pp, mon::Entity::CreatePlayerFromCenter(pp.orange.pos, true)};
+    params.n_max_teleports = 10;
+
+    const mon::VolumeSweepParams vsp{.y_res = 9, .n_slices = 3, .f_min = -1.f, .f_max = 1.f, .rows_per_chunk = 2};
+    mon::OutcomeVolume vol = mon::RenderOverlayVolume(params, vsp);
+    REQUIRE(vol.IsComplete());
 
-    ~SptIpcConn()
+    mon::TeleportChainParams voxel_params = params;
+    voxel_params.project_to_first_portal_plane = false;
+    mon::TeleportChainResult result;
+    const mon::Portal& p = pp.orange;
+    for (uint32_t z = 0; z < vol.Depth(); z++) {
+        for (uint32_t y = 0; y < vol.Height(); y++) {
+            for (uint32_t x = 0; x < vol.Width(); x++) {
+                auto [mx, my] = mon::OverlayPixelToFaceOffset((float)x, (float)y, vol.Width(), vol.Height());
+                voxel_params.ent = params.ent.WithNewCenter(p.pos + p.f * vol.SliceOffset(z) + p.r * mx + p.u * my);
+                mon::GenerateTeleportChain(voxel_params, result);
+                INFO("x: " << x << ", y: " << y << ", z: " << z);
+                REQUIRE(vol.At(x, y, z) == mon::ChainOutcome::FromResult(result));
+            }
+        }
+    }
+
+    auto path = std::filesystem::temp_directory_path() / "monocle_test_overlay_volume.mov";
+    REQUIRE(vol.Save(path));
+    auto loaded = mon::OutcomeVolume::Load(path);
+    std::filesystem::remove(path);
+    REQUIRE(loaded.has_value());
+    REQUIRE(loaded->Width() == vol.Width());
+    REQUIRE(loaded->Height() == vol.Height());
+    REQUIRE(loaded->Depth() == vol.Depth());
+    REQUIRE(loaded->NumRuns() == vol.NumRuns());
+    for (uint32_t z = 0; z < vol.Depth(); z++) {
+        REQUIRE(loaded->Slice(z).CountDiffs(vol.Slice(z)) == 0);
+        REQUIRE(loaded->Histogram(z) == vol.Histogram(z));
+    }
+}
+
+// same as FindKnownVagIn11 in main.cpp
+static mon::SearchSpace KnownVagIn11SearchSpace()
+{
+    return mon::SearchSpace{
+        .blue_search{
+            .lock_opts{383.96875f},
+            .type = mon::SPT_WALL_ZN,
+            .pos_spaces = {mon::AABB{{-860, 280, 450}, {-551, -43, 380}}},
+        },
+        .orange_search{
+            .lock_opts{-64.03125f, -64.0312653f},
+            .type = mon::SPT_WALL_XN,
+            .pos_spaces = {mon::AABB{{-80, -816, 284}, {-40, -1154, 509}}},
+        },
+        .target_space = mon::AABB{{-106, -1427, 1597}, {-273, -1282, 1729}},
+        .entry_pos_search = mon::SEPF_LOWER,
+        .valid_placement_orders{
+            mon::PlacementOrder::ORANGE_OPEN_BLUE_NEW_LOCATION,
+            mon::PlacementOrder::BLUE_OPEN_ORANGE_NEW_LOCATION,
+        },
+        .tp_from_blue = false,
+        .tp_player = true,
+    };
+}
+
+/*
+* The seeds & iteration counts of the search tests below are picked so that KnownVagIn11SearchSpace
+* has plenty of hits (roughly one every couple thousand iterations), a search that comes up empty
+* is a failure.
+*/
+static const mon::SearchResult& RequireHit(const mon::SearchSpace& ss, const std::optional<mon::SearchResult>& sr)
+{
+    REQUIRE(sr.has_value());
+    REQUIRE(ss.IsHit(sr->chain_result));
+    REQUIRE(sr->chain_result.cum_teleports == -1);
+    REQUIRE(ss.target_space.VectorInRegion(sr->chain_result.ents.back().GetCenter()));
+    return *sr;
+}
+
+// for two searches over the same candidates that should stop at the same one
+static void RequireSameHit(const mon::SearchSpace& ss,
+                           const std::optional<mon::SearchResult>& sr1,
+                           const std::optional<mon::SearchResult>& sr2)
+{
+    const mon::SearchResult& hit1 = RequireHit(ss, sr1);
+    const mon::SearchResult& hit2 = RequireHit(ss, sr2);
+    REQUIRE(hit1.n_iterations == hit2.n_iterations);
+    REQUIRE(hit1.pp.blue.pos == hit2.pp.blue.pos);
+    REQUIRE(hit1.pp.orange.pos == hit2.pp.orange.pos);
+    REQUIRE(hit1.pp.order == hit2.pp.order);
+}
+
+TEST_CASE("Parallel VAG search is independent of thread count")
+{
+    mon::SearchSpace ss = KnownVagIn11SearchSpace();
+    const int n_iterations = mon::SearchSpace::PARALLEL_BLOCK_SIZE * 16;
+    auto sr1 = ss.FindVagParallel(1, n_iterations, 1);
+    auto sr2 = ss.FindVagParallel(1, n_iterations, 5);
+    RequireSameHit(ss, sr1, sr2);
+}
+
+TEST_CASE("Enumerated VAG search covers every combination")
+{
+    mon::SearchSpace ss = KnownVagIn11SearchSpace();
+    // an alias of an order that's already there
+    ss.valid_placement_orders.push_back(mon::PlacementOrder::ORANGE_WAS_CLOSED_BLUE_MOVED);
+    ss.orange_search.pos_spaces.Add(mon::AABB{{-80, -700, 284}, {-40, -800, 509}});
+    REQUIRE(ss.DistinctPlacementOrders().size() == 2);
+    const int n_combos = (int)ss.NumDiscreteCombos();
+    REQUIRE(n_combos == 1 * 4 * 2);
+
+    mon::SobolSampler sampler{true, 3};
+    mon::SearchSpace::EnumeratedCandidates<mon::SobolSampler> source{ss, sampler, 0};
+    auto gen = source.Block(0);
+    mon::TeleportChainParams params = ss.params;
+    for (int sample = 0; sample < 3; sample++) {
+        std::set<std::tuple<float, bool, mon::PlacementOrder>> seen;
+        std::optional<mon::Vector> blue_pos;
+        for (int i = sample * n_combos; i < (sample + 1) * n_combos; i++) {
+            mon::SearchResult st = gen(i, params);
+            REQUIRE(st.n_iterations == i);
+            seen.emplace(st.pp.orange.pos.x, st.pp.orange.pos.y > -808, st.pp.order);
+            // the continuous dimensions only change between samples
+            if (blue_pos)
+                REQUIRE(st.pp.blue.pos == *blue_pos);
+            blue_pos = st.pp.blue.pos;
+            // the portals are cached, a fresh generator should make the same candidate
+            mon::TeleportChainParams fresh_params = ss.params;
+            mon::SearchResult fresh = source.Block(0)(i, fresh_params);
+            REQUIRE(fresh.pp.orange.pos == st.pp.orange.pos);
+            REQUIRE(fresh.pp.order == st.pp.order);
+            REQUIRE(fresh_params.ent.GetCenter() == params.ent.GetCenter());
+        }
+        REQUIRE(seen.size() == (size_t)n_combos);
+    }
+
+    const int n_samples = mon::SearchSpace::PARALLEL_BLOCK_SIZE * 2;
+    auto sr1 = ss.FindVagEnumerated(sampler, n_samples, 0, 1);
+    auto sr2 = ss.FindVagEnumerated(sampler, n_samples, 0, 4);
+    RequireSameHit(ss, sr1, sr2);
+}
+
+TEST_CASE("VAG search prefilter")
+{
+    mon::SearchSpace ss = KnownVagIn11SearchSpace();
+    const int n_iterations = mon::SearchSpace::PARALLEL_BLOCK_SIZE * 16;
+    mon::SearchStats filtered_stats, unfiltered_stats;
+    auto sr1 = ss.FindVagParallel(2, n_iterations, 0, &filtered_stats);
+    ss.prefilter_margin = -1;
+    auto sr2 = ss.FindVagParallel(2, n_iterations, 0, &unfiltered_stats);
+
+    // the prefilter shouldn't change which hit is found
+    RequireSameHit(ss, sr1, sr2);
+    REQUIRE(unfiltered_stats.n_prefilter_rejected == 0);
+    REQUIRE(filtered_stats.n_chains < unfiltered_stats.n_chains);
+    for (const mon::SearchStats& st : {filtered_stats, unfiltered_stats}) {
+        REQUIRE(st.n_candidates == st.n_prefilter_rejected + st.n_chains);
+        REQUIRE(st.n_chains == st.n_not_vag + st.n_missed_target + st.n_hits);
+    }
+}
+
+TEST_CASE("VAG search with an entry face scan")
+{
+    mon::SearchSpace ss = KnownVagIn11SearchSpace();
+    const int n_iterations = mon::SearchSpace::PARALLEL_BLOCK_SIZE * 4;
+    mon::SearchStats single_stats, scan_stats;
+    auto sr1 = ss.FindVagParallel(3, n_iterations, 0, &single_stats);
+    ss.entry_scan_per_side = 4;
+    auto sr2 = ss.FindVagParallel(3, n_iterations, 0, &scan_stats);
+
+    // the generated entry point is always part of the scan, so the scan can't find a hit any later
+    const mon::SearchResult& hit1 = RequireHit(ss, sr1);
+    const mon::SearchResult& hit2 = RequireHit(ss, sr2);
+    REQUIRE(hit2.n_iterations <= hit1.n_iterations);
+    REQUIRE(single_stats.n_candidates == single_stats.n_pairs);
+    REQUIRE(scan_stats.n_candidates > scan_stats.n_pairs);
+    for (const mon::SearchStats& st : {single_stats, scan_stats}) {
+        REQUIRE(st.n_candidates == st.n_prefilter_rejected + st.n_chains);
+        REQUIRE(st.n_chains == st.n_not_vag + st.n_missed_target + st.n_hits);
+    }
+}
+
+TEST_CASE("Resuming a VAG search from a checkpoint")
+{
+    mon::SearchSpace ss = KnownVagIn11SearchSpace();
+    const int n_blocks = 6;
+    const int n_iterations = mon::SearchSpace::PARALLEL_BLOCK_SIZE * n_blocks;
+    mon::SearchCheckpointParams ckpt_params{
+        .path = std::filesystem::temp_directory_path() / "monocle_test_search.ckpt",
+        .interval = std::chrono::milliseconds{0},
+    };
+    std::filesystem::remove(ckpt_params.path);
+    mon::VagCollectParams cp{.max_hits = 0, .face_samples_per_side = 0};
+
+    mon::SearchStats full_stats;
+    auto full = ss.CollectVags(5, n_iterations, cp, 3, &full_stats, &ckpt_params);
+    REQUIRE(!full.empty());
+    auto ckpt = mon::SearchCheckpoint::Load(ckpt_params.path);
+    REQUIRE(ckpt.has_value());
+    REQUIRE(ckpt->next_block == n_blocks);
+    REQUIRE(ckpt->stats.n_pairs == (uint64_t)n_iterations);
+    REQUIRE(ckpt->hit_iterations.size() >= full.size());
+
+    /*
+    * Pretend the search was interrupted after the first 2 blocks. The blocks don't depend on the
+    * number of iterations, so a search of just those blocks gives the stats the checkpoint would
+    * have had at that point.
+    */
+    const int cut = mon::SearchSpace::PARALLEL_BLOCK_SIZE * 2;
+    mon::SearchStats cut_stats;
+    ss.CollectVags(5, cut, cp, 2, &cut_stats);
+    ckpt->next_block = 2;
+    ckpt->stats = cut_stats;
+    std::erase_if(ckpt->hit_iterations, [cut](int it) { return it >= cut; });
+    REQUIRE(ckpt->Save(ckpt_params.path));
+    mon::SearchStats resumed_stats;
+    auto resumed = ss.CollectVags(5, n_iterations, cp, 2, &resumed_stats, &ckpt_params);
+
+    // the blocks from before the interruption are counted once
+    auto counts = [](const mon::SearchStats& st) {
+        return std::tuple{st.n_pairs,
+                          st.n_candidates,
+                          st.n_prefilter_rejected,
+                          st.n_chains,
+                          st.n_not_vag,
+                          st.n_max_tps_exceeded,
+                          st.n_missed_target,
+                          st.n_hits,
+                          st.n_teleports};
+    };
+    REQUIRE(counts(resumed_stats) == counts(full_stats));
+    REQUIRE(resumed.size() == full.size());
+    for (size_t i = 0; i < full.size(); i++) {
+        REQUIRE(resumed[i].hit.n_iterations == full[i].hit.n_iterations);
+        REQUIRE(resumed[i].hit.pp.blue.pos == full[i].hit.pp.blue.pos);
+        REQUIRE(resumed[i].hit.chain_result.ent.GetCenter() == full[i].hit.chain_result.ent.GetCenter());
+    }
+
+    // a checkpoint for a different search is ignored
+    mon::SearchStats other_stats;
+    ss.CollectVags(6, n_iterations, cp, 2, &other_stats, &ckpt_params);
+    REQUIRE(other_stats.n_pairs == (uint64_t)n_iterations);
+
+    // a find search that stopped at its first hit leaves a finished checkpoint, collecting starts over
+    std::filesystem::remove(ckpt_params.path);
+    REQUIRE(ss.FindVagParallel(5, n_iterations, 2, nullptr, &ckpt_params).has_value());
+    REQUIRE(mon::SearchCheckpoint::Load(ckpt_params.path)->kind == mon::SCK_FIND);
+    mon::SearchStats after_find_stats;
+    auto after_find = ss.CollectVags(5, n_iterations, cp, 2, &after_find_stats, &ckpt_params);
+    REQUIRE(counts(after_find_stats) == counts(full_stats));
+    REQUIRE(after_find.size() == full.size());
+    std::filesystem::remove(ckpt_params.path);
+}
+
+TEST_CASE("JSON parsing")
+{
+    auto v = mon::JsonParser::Parse(R"( {"a": [1, -2.5e3, true, null], "b": "x\"\u0041\n", "c": {}} )");
+    REQUIRE(v.has_value());
+    REQUIRE(v->IsObject());
+    const mon::JsonValue* a = v->Find("a");
+    REQUIRE(a);
+    REQUIRE(a->Items().size() == 4);
+    REQUIRE(a->Items()[0].AsNumber<int>() == 1);
+    REQUIRE(a->Items()[1].AsNumber<double>() == -2500.0);
+    REQUIRE(a->Items()[2].AsBool() == true);
+    REQUIRE(a->Items()[3].IsNull());
+    REQUIRE(v->Find("b")->AsString() == "x\"A\n");
+    REQUIRE(v->Find("c")->IsObject());
+    REQUIRE(v->Find("d") == nullptr);
+    // lock options need to be parsed exactly as floats
+    REQUIRE(mon::JsonParser::Parse("0.0312499776")->AsNumber<float>() == 0.0312499776f);
+
+    std::string err;
+    for (const char* bad : {"", "[1,]", "{\"a\" 1}", "\"abc", "01x", "[1] 2", "tru"}) {
+        err.clear();
+        REQUIRE_FALSE(mon::JsonParser::Parse(bad, &err).has_value());
+        REQUIRE_FALSE(err.empty());
+    }
+}
+
+TEST_CASE("Search job files")
+{
+    const char* text = R"([
+        {
+            "name": "11",
+            "blue": {"type": "ZN", "lock_opts": [383.96875], "pos_spaces": [[[-860, 280, 450], [-551, -43, 380]]]},
+            "orange": {
+                "type": "XN",
+                "lock_opts": [-64.03125, -64.0312653],
+                "pos_spaces": [[[-80, -816, 284], [-40, -1154, 509]]]
+            },
+            "target_space": [[-106, -1427, 1597], [-273, -1282, 1729]],
+            "entry_pos": "lower",
+            "placement_orders": ["ORANGE_OPEN_BLUE_NEW_LOCATION", "BLUE_OPEN_ORANGE_NEW_LOCATION"],
+            "tp_from_blue": false,
+            "iterations": 4096,
+            "mode": "collect",
+            "max_hits": 3
+        },
+        {
+            "blue": {"locked": true, "pos": [1, 2, 3], "ang": [0, 90, 0]},
+            "orange": {"type": "ZP", "lock_opts": [0.03125], "pos_spaces": [[[0, 0, 0], [10, 10, 0]]]},
+            "target_space": [[0, 0, 0], [1, 1, 1]],
+            "entry_pos": ["RP", "UN"],
+            "placement_orders": ["AFTER_LOAD_ORANGE_HAS_HIGHER_INDEX"],
+            "sampler": "sobol",
+            "enumerate": true
+        }
+    ])";
+    mon::SearchJobReader reader;
+    auto jobs = reader.Parse(text);
+    INFO(reader.Error());
+    REQUIRE(jobs.has_value());
+    REQUIRE(jobs->size() == 2);
+
+    const mon::SearchJob& j0 = (*jobs)[0];
+    mon::SearchSpace expected = KnownVagIn11SearchSpace();
+    REQUIRE(j0.name == "11");
+    REQUIRE(j0.mode == mon::SJM_COLLECT);
+    REQUIRE(j0.collect.max_hits == 3);
+    REQUIRE(j0.n_iterations == 4096);
+    REQUIRE(j0.ss.orange_search.lock_opts == expected.orange_search.lock_opts);
+    REQUIRE(j0.ss.orange_search.pos_spaces[0].mins == expected.orange_search.pos_spaces[0].mins);
+    REQUIRE(j0.ss.target_space[0].maxs == expected.target_space[0].maxs);
+    REQUIRE(j0.ss.entry_pos_search == mon::SEPF_LOWER);
+    REQUIRE(j0.ss.valid_placement_orders == expected.valid_placement_orders);
+    REQUIRE_FALSE(j0.ss.tp_from_blue);
+    REQUIRE(j0.ss.tp_player);
+
+    const mon::SearchJob& j1 = (*jobs)[1];
+    REQUIRE(j1.name == "job 1");
+    REQUIRE(j1.ss.blue_search.locked);
+    REQUIRE(j1.ss.blue_search.locked_ang.y == 90.f);
+    REQUIRE(j1.ss.entry_pos_search == (mon::SEPF_RP | mon::SEPF_UN));
+    REQUIRE(j1.sampler == mon::SJS_SOBOL);
+    REQUIRE(j1.enumerate);
+    REQUIRE(j0.Key() != j1.Key());
+
+    // every sampler picks different candidates with a different seed
+    mon::SearchJob reseeded = j1;
+    reseeded.seed++;
+    REQUIRE(reseeded.Key() != j1.Key());
+    reseeded = j0;
+    reseeded.seed++;
+    REQUIRE(reseeded.Key() != j0.Key());
+    // a find checkpoint stops at the first hit, and the margin decides which candidates are hits
+    mon::SearchJob edited = j0;
+    edited.mode = mon::SJM_FIND;
+    REQUIRE(edited.Key() != j0.Key());
+    REQUIRE(edited.CheckpointKind() != j0.CheckpointKind());
+    edited = j0;
+    edited.ss.prefilter_margin += 1;
+    REQUIRE(edited.Key() != j0.Key());
+
+    REQUIRE_FALSE(reader.Parse(R"({"blue": {"type": "QQ"}})").has_value());
+    REQUIRE(reader.Error().starts_with("blue"));
+}
+
+TEST_CASE("VAG search progress reporting")
+{
+    mon::SearchSpace ss = KnownVagIn11SearchSpace();
+    const int n_iterations = mon::SearchSpace::PARALLEL_BLOCK_SIZE * 4;
+    std::stringstream jsonl;
+    mon::SearchProgressParams progress{
+        .interval = std::chrono::milliseconds{0},
+        .text_out = nullptr,
+        .jsonl_out = &jsonl,
+        .label = "test \"11\"",
+    };
+    mon::SearchStats stats;
+    ss.CollectVags(4, n_iterations, {.face_samples_per_side = 0}, 2, &stats, nullptr, &progress);
+
+    REQUIRE(stats.n_hits > 0);
+    REQUIRE(stats.n_max_tps_exceeded <= stats.n_not_vag);
+    REQUIRE(stats.n_teleports >= stats.n_chains);
+    REQUIRE(stats.chain_ns > 0);
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(jsonl, line);)
+        lines.push_back(line);
+    // one line per block and a final one
+    REQUIRE(lines.size() == 5);
+    for (const std::string& line : lines) {
+        std::string err;
+        auto rec = mon::JsonParser::Parse(line, &err);
+        INFO(line << ": " << err);
+        REQUIRE(rec.has_value());
+        REQUIRE(rec->Find("label")->AsString() == "test 11");
+        REQUIRE(rec->Find("n_iterations")->AsNumber<int>() == n_iterations);
+    }
+    auto last = mon::JsonParser::Parse(lines.back());
+    REQUIRE(last->Find("done")->AsBool() == true);
+    REQUIRE(last->Find("iterations")->AsNumber<int>() == n_iterations);
+    REQUIRE(last->Find("hits")->AsNumber<uint64_t>() == stats.n_hits);
+}
+
+TEST_CASE("Sharded search over a queue directory")
+{
+    const char* text = R"([
+        {
+            "name": "collect",
+            "blue": {"type": "ZN", "lock_opts": [383.96875], "pos_spaces": [[[-860, 280, 450], [-551, -43, 380]]]},
+            "orange": {
+                "type": "XN",
+                "lock_opts": [-64.03125, -64.0312653],
+                "pos_spaces": [[[-80, -816, 284], [-40, -1154, 509]]]
+            },
+            "target_space": [[-106, -1427, 1597], [-273, -1282, 1729]],
+            "entry_pos": "lower",
+            "placement_orders": ["ORANGE_OPEN_BLUE_NEW_LOCATION", "BLUE_OPEN_ORANGE_NEW_LOCATION"],
+            "tp_from_blue": false,
+            "iterations": 20000,
+            "seed": 5,
+            "mode": "collect",
+            "max_hits": 0
+        },
+        {
+            "name": "find",
+            "blue": {"type": "ZN", "lock_opts": [383.96875], "pos_spaces": [[[-860, 280, 450], [-551, -43, 380]]]},
+            "orange": {
+                "type": "XN",
+                "lock_opts": [-64.03125, -64.0312653],
+                "pos_spaces": [[[-80, -816, 284], [-40, -1154, 509]]]
+            },
+            "target_space": [[-106, -1427, 1597], [-273, -1282, 1729]],
+            "entry_pos": "lower",
+            "placement_orders": ["ORANGE_OPEN_BLUE_NEW_LOCATION", "BLUE_OPEN_ORANGE_NEW_LOCATION"],
+            "tp_from_blue": false,
+            "iterations": 40000,
+            "sampler": "sobol",
+            "enumerate": true
+        }
+    ])";
+    mon::SearchJobReader reader;
+    auto jobs = reader.Parse(text);
+    REQUIRE(jobs.has_value());
+    for (mon::SearchJob& job : *jobs)
+        job.collect.face_samples_per_side = 0;
+
+    mon::ShardQueueParams qp{
+        .dir = std::filesystem::temp_directory_path() / "monocle_test_queue",
+        .shard_iterations = mon::SearchSpace::PARALLEL_BLOCK_SIZE,
+        .heartbeat_interval = std::chrono::milliseconds{10},
+        .dead_timeout = std::chrono::milliseconds{200},
+        .poll_interval = std::chrono::milliseconds{5},
+        .checkpoint_interval = std::chrono::milliseconds{0},
+    };
+    std::filesystem::remove_all(qp.dir);
+    mon::SearchCoordinator coordinator{qp, *jobs, text};
+    REQUIRE(coordinator.Init());
+    REQUIRE(coordinator.ShardCounts().second > 2);
+
+    // a worker that claimed the first shard and died, the shard is handed out again
+    mon::ShardQueue queue{qp.dir};
+    auto pending = queue.List(mon::ShardQueue::PENDING);
+    REQUIRE(pending.size() == coordinator.ShardCounts().second);
+    REQUIRE(queue.Claim(pending[0].first, "dead"));
+    REQUIRE_FALSE(queue.Claim(pending[0].first, "late"));
+
+    std::vector<std::thread> workers;
+    std::atomic_int n_shards_searched{0};
+    for (const char* id : {"a", "b"}) {
+        workers.emplace_back([&qp, &n_shards_searched, id] {
+            mon::SearchWorker worker{qp, id, 2};
+            n_shards_searched += worker.Run();
+        });
+    }
+    auto sharded = coordinator.Run();
+    for (std::thread& t : workers)
+        t.join();
+    REQUIRE(std::filesystem::exists(queue.StopFile()));
+    REQUIRE(n_shards_searched > 0);
+
+    REQUIRE(sharded.size() == 2);
+    for (size_t i = 0; i < jobs->size(); i++) {
+        const mon::SearchJob& job = (*jobs)[i];
+        mon::SearchJobResult single = mon::RunSearchJob(job, i, 2);
+        INFO(job.name);
+        REQUIRE(sharded[i].job_idx == i);
+        REQUIRE(sharded[i].found.has_value() == single.found.has_value());
+        if (single.found) {
+            REQUIRE(sharded[i].found->n_iterations == single.found->n_iterations);
+            REQUIRE(sharded[i].found->pp.orange.pos == single.found->pp.orange.pos);
+        } else {
+            REQUIRE(sharded[i].stats.n_pairs == single.stats.n_pairs);
+        }
+        REQUIRE(sharded[i].hits.size() == single.hits.size());
+        for (size_t h = 0; h < single.hits.size(); h++) {
+            REQUIRE(sharded[i].hits[h].hit.n_iterations == single.hits[h].hit.n_iterations);
+            REQUIRE(sharded[i].hits[h].hit.pp.blue.pos == single.hits[h].hit.pp.blue.pos);
+        }
+    }
+
+    // a worker that can't mark its shard as done stops with an error and keeps the claim
+    std::filesystem::remove_all(qp.dir);
+    mon::SearchCoordinator failing{qp, *jobs, text};
+    REQUIRE(failing.Init());
+    mon::SearchShard lost = queue.List(mon::ShardQueue::PENDING).back().first;
+    std::filesystem::remove_all(qp.dir / mon::ShardQueue::DONE);
+    std::ofstream{qp.dir / mon::ShardQueue::DONE};
+    mon::SearchWorker worker{qp, "c", 2};
+    REQUIRE(worker.Run() == 0);
+    REQUIRE(worker.Error().starts_with("could not create"));
+    REQUIRE(queue.List(mon::ShardQueue::CLAIMED).size() == 1);
+    // a done shard without a checkpoint is searched again, which fails if it can't be made pending
+    std::filesystem::remove(qp.dir / mon::ShardQueue::DONE);
+    std::filesystem::remove_all(qp.dir / mon::ShardQueue::PENDING);
+    std::ofstream{qp.dir / mon::ShardQueue::PENDING};
+    std::filesystem::create_directory(qp.dir / mon::ShardQueue::DONE);
+    REQUIRE(queue.MarkDone(lost));
+    REQUIRE_FALSE(failing.Poll());
+    REQUIRE(failing.Error().starts_with("could not requeue"));
+    REQUIRE(failing.Run().empty());
+    std::filesystem::remove_all(qp.dir);
+}
+
+TEST_CASE("Box regions")
+{
+    small_prng rng{11};
+    std::vector<mon::AABB> boxes;
+    for (int i = 0; i < 300; i++) {
+        mon::Vector p = mon::AABB{{-1000, -1000, -1000}, {1000, 1000, 1000}}.RandomPtInBox(rng);
+        mon::Vector size{rng.next_float(1, 50), rng.next_float(1, 50), rng.next_float(1, 50)};
+        boxes.emplace_back(p, p + size);
+    }
+    mon::BoxRegion region{boxes};
+    REQUIRE(region.size() == boxes.size());
+
+    mon::AABB query_space{{-1050, -1050, -1050}, {1050, 1050, 1050}};
+    for (int i = 0; i < 2000; i++) {
+        // half of the points are next to a box so that some of them are inside
+        mon::Vector pt = i % 2 ? query_space.RandomPtInBox(rng)
+                          : rng.next_elem(boxes).mins + mon::Vector{rng.next_float(-5, 40), 0, rng.next_float(-5, 40)};
+        bool inside = false, near = false;
+        float margin = -INFINITY;
+        for (const mon::AABB& box : boxes) {
+            inside |= box.VectorInBox(pt);
+            near |= box.NearBox(pt, 3.f);
+            margin = std::max(margin, box.Margin(pt));
+        }
+        REQUIRE(region.VectorInRegion(pt) == inside);
+        REQUIRE(region.NearRegion(pt, 3.f) == near);
+        REQUIRE(region.Margin(pt) == margin);
+    }
+
+    // the second box has 3 times the area of the first along x & y, but the same volume
+    mon::BoxRegion spaces{
+        mon::AABB{{0, 0, 0}, {10, 10, 30}},
+        mon::AABB{{100, 0, 0}, {130, 10, 10}},
+        mon::AABB{{200, 0, 0}, {200, 0, 0}},
+    };
+    int counts[2][3]{};
+    const int n_samples = 40000;
+    for (int i = 0; i < n_samples; i++) {
+        counts[0][spaces.SampleIndex(rng, 2)]++;
+        counts[1][spaces.SampleIndex(rng)]++;
+    }
+    REQUIRE(counts[0][2] == 0);
+    REQUIRE(counts[1][2] == 0);
+    REQUIRE(counts[0][1] / (double)n_samples == Catch::Approx(0.75).margin(0.02));
+    REQUIRE(counts[1][1] / (double)n_samples == Catch::Approx(0.5).margin(0.02));
+    // every weight is 0, so the boxes are picked uniformly
+    mon::BoxRegion flat{mon::AABB{{0, 0, 0}, {0, 5, 5}}, mon::AABB{{1, 0, 0}, {1, 5, 5}}};
+    int n_first = 0;
+    for (int i = 0; i < 1000; i++)
+        n_first += flat.SampleIndex(rng) == 0;
+    REQUIRE(n_first > 400);
+    REQUIRE(n_first < 600);
+}
+
+struct TestBspFace {
+    std::vector<mon::Vector> verts;
+    mon::Vector normal;
+    float dist;
+    int32_t flags;
+    const char* material;
+};
+
+/*
+* A room with a floor split into two faces, a noportal ceiling, a black wall, and a triangle.
+* extra_faces are added after those.
+*/
+static std::vector<uint8_t> MakeTestBsp(const std::vector<TestBspFace>& extra_faces = {})
+{
+    std::vector<TestBspFace> test_faces{
+        {{{0, 0, 0}, {0, 512, 0}, {256, 512, 0}, {256, 0, 0}}, {0, 0, 1}, 0, 0, "concrete/floor"},
+        {{{256, 0, 0}, {256, 512, 0}, {512, 512, 0}, {512, 0, 0}}, {0, 0, 1}, 0, 0, "concrete/floor"},
+        {{{0, 0, 256}, {512, 0, 256}, {512, 512, 256}, {0, 512, 256}}, {0, 0, -1}, -256, 0x20, "concrete/ceiling"},
+        {{{512, 0, 0}, {512, 512, 0}, {512, 512, 256}, {512, 0, 256}}, {-1, 0, 0}, -512, 0, "METAL/BLACK_WALL"},
+        {{{0, 0, 0}, {0, 512, 0}, {0, 0, 256}}, {1, 0, 0}, 0, 0, "concrete/wall"},
+    };
+    test_faces.insert(test_faces.end(), extra_faces.begin(), extra_faces.end());
+
+    std::vector<uint8_t> lumps[64];
+    auto put = [&](int lump, const auto& v) {
+        const uint8_t* p = (const uint8_t*)&v;
+        lumps[lump].insert(lumps[lump].end(), p, p + sizeof v);
+    };
+    put(12, std::array<uint16_t, 2>{0, 0}); // edge 0 isn't used
+    for (size_t f = 0; f < test_faces.size(); f++) {
+        const TestBspFace& tf = test_faces[f];
+        put(1, tf.normal);
+        put(1, tf.dist);
+        put(1, (int32_t)0);
+        int32_t name_ofs = (int32_t)lumps[43].size();
+        lumps[43].insert(lumps[43].end(), tf.material, tf.material + strlen(tf.material) + 1);
+        put(44, name_ofs);
+        put(2, mon::Vector{});
+        put(2, (int32_t)f);
+        put(2, std::array<int32_t, 4>{});
+        put(6, std::array<float, 16>{});
+        put(6, tf.flags);
+        put(6, (int32_t)f);
+
+        int32_t first_vert = (int32_t)(lumps[3].size() / sizeof(mon::Vector));
+        int32_t first_edge = (int32_t)(lumps[13].size() / 4);
+        for (size_t i = 0; i < tf.verts.size(); i++) {
+            put(3, tf.verts[i]);
+            put(13, (int32_t)(lumps[12].size() / 4));
+            put(12,
+                std::array<uint16_t, 2>{(uint16_t)(first_vert + i),
+                                        (uint16_t)(first_vert + (i + 1) % tf.verts.size())});
+        }
+        put(7, (uint16_t)f);
+        put(7, (uint16_t)0); // side & on node
+        put(7, first_edge);
+        put(7, std::array<int16_t, 4>{(int16_t)tf.verts.size(), (int16_t)f, -1, -1});
+        put(7, std::array<uint8_t, 40>{});
+    }
+    put(14, std::array<float, 9>{});
+    put(14, std::array<int32_t, 3>{0, 0, (int32_t)test_faces.size()});
+
+    std::vector<uint8_t> file(1036);
+    memcpy(file.data(), "VBSP", 4);
+    int32_t version = 20;
+    memcpy(file.data() + 4, &version, 4);
+    for (int i = 0; i < 64; i++) {
+        int32_t lump_hdr[4]{(int32_t)file.size(), (int32_t)lumps[i].size(), 0, 0};
+        memcpy(file.data() + 8 + i * 16, lump_hdr, sizeof lump_hdr);
+        file.insert(file.end(), lumps[i].begin(), lumps[i].end());
+    }
+    return file;
+}
+
+TEST_CASE("Portalable surfaces from a BSP")
+{
+    std::vector<uint8_t> bsp_data = MakeTestBsp();
+    mon::BspMap map;
+    INFO(map.Error());
+    REQUIRE(map.Parse(bsp_data.data(), bsp_data.size()));
+    REQUIRE(map.Faces().size() == 5);
+    REQUIRE(map.Faces()[3].material == "METAL/BLACK_WALL");
+    REQUIRE(map.Faces()[4].Area() == 512 * 256 / 2);
+    int n_near = 0;
+    map.ForEachFaceIn(mon::AABB{{500, 100, 100}, {600, 200, 200}}, [&](const mon::BspFace& face) {
+        REQUIRE(face.index == 3);
+        n_near++;
+    });
+    REQUIRE(n_near == 1);
+
+    auto surfaces = mon::FindPortalSurfaces(map);
+    REQUIRE(surfaces.size() == 2);
+    // sorted by type, the floor has both halves merged into one space
+    const mon::SearchPortal& wall = surfaces[0];
+    REQUIRE(wall.type == mon::SPT_WALL_XN);
+    REQUIRE(wall.lock_opts == std::vector{511.96875f});
+    REQUIRE(wall.pos_spaces.size() == 1);
+    REQUIRE(wall.pos_spaces[0].mins == mon::Vector{511.96875f, 32, 54});
+    REQUIRE(wall.pos_spaces[0].maxs == mon::Vector{511.96875f, 480, 202});
+    const mon::SearchPortal& floor = surfaces[1];
+    REQUIRE(floor.type == mon::SPT_WALL_ZP);
+    REQUIRE(floor.lock_opts == std::vector{0.03125f});
+    REQUIRE(floor.pos_spaces.size() == 1);
+    float diag = std::hypot(mon::PORTAL_HALF_WIDTH, mon::PORTAL_HALF_HEIGHT);
+    REQUIRE(floor.pos_spaces[0].mins.x == 0 + diag);
+    REQUIRE(floor.pos_spaces[0].maxs.y == 512 - diag);
+
+    small_prng rng{2};
+    for (int i = 0; i < 100; i++)
+        REQUIRE(wall.Generate(rng, mon::GV_5135).pos.x == 511.96875f);
+
+    auto bsp_path = std::filesystem::temp_directory_path() / "monocle_test_map.bsp";
+    std::ofstream{bsp_path, std::ios::binary}.write((const char*)bsp_data.data(), bsp_data.size());
+    std::string text = R"({
+        "name": "map",
+        "blue": {"locked": true, "pos": [100, 100, 0.03125], "ang": [-90, 0, 0]},
+        "orange": {"bsp": ")" + bsp_path.generic_string() + R"(", "exclude_materials": ["black"]},
+        "target_space": [[0, 0, 0], [10, 10, 10]],
+        "placement_orders": ["ORANGE_OPEN_BLUE_NEW_LOCATION"]
+    })";
+    mon::SearchJobReader reader;
+    auto jobs = reader.Parse(text);
+    INFO(reader.Error());
+    REQUIRE(jobs.has_value());
+    REQUIRE(jobs->size() == 1);
+    REQUIRE((*jobs)[0].ss.orange_search.type == mon::SPT_WALL_ZP);
+    REQUIRE((*jobs)[0].name == "map");
+    text.replace(text.find("\"black\""), 7, "\"none\"");
+    jobs = reader.Parse(text);
+    REQUIRE(jobs->size() == 2);
+    REQUIRE((*jobs)[1].name == "map b0 o1");
+    std::filesystem::remove(bsp_path);
+
+    REQUIRE_FALSE(map.Parse(bsp_data.data(), 500));
+    bsp_data[0] = 'X';
+    REQUIRE_FALSE(map.Parse(bsp_data.data(), bsp_data.size()));
+}
+
+TEST_CASE("Portal surfaces at the size limit")
+{
+    // a wall exactly as wide as a portal and one a little wider, both tall enough
+    std::vector<uint8_t> bsp_data = MakeTestBsp({
+        {{{100, 600, 0}, {164, 600, 0}, {164, 600, 300}, {100, 600, 300}}, {0, 1, 0}, 600, 0, "concrete/wall"},
+        {{{100, 700, 0}, {100, 700, 300}, {166, 700, 300}, {166, 700, 0}}, {0, -1, 0}, -700, 0, "concrete/wall"},
+    });
+    mon::BspMap map;
+    INFO(map.Error());
+    REQUIRE(map.Parse(bsp_data.data(), bsp_data.size()));
+    auto surfaces = mon::FindPortalSurfaces(map);
+    REQUIRE(surfaces.size() == 3);
+    REQUIRE(std::ranges::count(surfaces, mon::SPT_WALL_YP, &mon::SearchPortal::type) == 0);
+    const mon::SearchPortal& wide = surfaces[1];
+    REQUIRE(wide.type == mon::SPT_WALL_YN);
+    REQUIRE(wide.pos_spaces.size() == 1);
+    REQUIRE(wide.pos_spaces[0].mins.x == 132);
+    REQUIRE(wide.pos_spaces[0].maxs.x == 134);
+    small_prng rng{3};
+    for (int i = 0; i < 100; i++) {
+        mon::Vector pos = wide.Generate(rng, mon::GV_5135).pos;
+        REQUIRE(pos.x >= 132);
+        REQUIRE(pos.x <= 134);
+    }
+}
+
+TEST_CASE("Portal surfaces on sloped faces")
+{
+    // a ramp going up 30 degrees along x and a sloped triangle that can't be used
+    const float tan30 = 0.577350269f;
+    const mon::Vector ramp_normal{-0.5f, 0, 0.866025404f};
+    std::vector<uint8_t> bsp_data = MakeTestBsp({
+        {{{0, 0, 0}, {0, 256, 0}, {256, 256, 256 * tan30}, {256, 0, 256 * tan30}}, ramp_normal, 0, 0, "concrete/ramp"},
+        {{{0, 300, 0}, {0, 556, 0}, {256, 300, 256 * tan30}}, ramp_normal, 0, 0, "concrete/ramp"},
+    });
+    mon::BspMap map;
+    INFO(map.Error());
+    REQUIRE(map.Parse(bsp_data.data(), bsp_data.size()));
+    auto surfaces = mon::FindPortalSurfaces(map);
+    REQUIRE(surfaces.size() == 3);
+    const mon::SearchPortal& ramp = surfaces[2];
+    REQUIRE(ramp.type == mon::SPT_PLANE);
+    REQUIRE(ramp.plane_normal == ramp_normal);
+    REQUIRE(ramp.lock_opts == std::vector{0.f});
+    REQUIRE(ramp.LockAxis() == 2);
+    // only the ramp is used, shrunk by the portal's up (which goes up the slope) & right
+    REQUIRE(ramp.pos_spaces.size() == 1);
+    REQUIRE_THAT(ramp.pos_spaces[0].mins.x, Catch::Matchers::WithinAbs(0.866025404f * mon::PORTAL_HALF_HEIGHT, .001f));
+    REQUIRE(ramp.pos_spaces[0].mins.y == mon::PORTAL_HALF_WIDTH);
+    REQUIRE(ramp.pos_spaces[0].maxs.y == 256 - mon::PORTAL_HALF_WIDTH);
+
+    small_prng rng{4};
+    for (int i = 0; i < 100; i++) {
+        mon::Portal p = ramp.Generate(rng, mon::GV_5135);
+        REQUIRE_THAT(ramp_normal.Dot(p.pos), Catch::Matchers::WithinAbs(mon::PORTAL_SURFACE_OFFSET, .001f));
+        for (float sr : {-1.f, 1.f}) {
+            for (float su : {-1.f, 1.f}) {
+                mon::Vector corner = p.pos + p.r * (sr * mon::PORTAL_HALF_WIDTH) + p.u * (su * mon::PORTAL_HALF_HEIGHT);
+                REQUIRE(corner.x > -.01f);
+                REQUIRE(corner.x < 256.01f);
+                REQUIRE(corner.y > -.01f);
+                REQUIRE(corner.y < 256.01f);
+            }
+        }
+    }
+
+    // sloped faces can be turned off like any other type
+    mon::PortalSurfaceParams params;
+    params.types &= ~(1u << mon::SPT_PLANE);
+    REQUIRE(mon::FindPortalSurfaces(map, params).size() == 2);
+}
+
+TEST_CASE("Surveying surface pairs")
+{
+    mon::SearchSpace ss = KnownVagIn11SearchSpace();
+    std::vector<mon::SearchPortal> surfaces{
+        ss.blue_search,
+        ss.orange_search,
+        // far away from everything, every pair with one of these can be pruned
+        {.lock_opts{-20000.f}, .type = mon::SPT_WALL_ZP, .pos_spaces = mon::AABB{{-10, -10, 0}, {10, 10, 0}}},
+        {.lock_opts{20000.f}, .type = mon::SPT_WALL_XN, .pos_spaces = mon::AABB{{0, -10, -10}, {0, 10, 10}}},
+    };
+    mon::SurveyParams sp{.samples_per_pair = 16384, .tile_size = 1, .n_threads = 1};
+    mon::VagSurvey survey{ss, surfaces, sp};
+    REQUIRE(survey.NumPairs() == 12);
+    REQUIRE(survey.PairCanReachTarget(0, 1));
+    for (size_t i = 0; i < surfaces.size(); i++) {
+        for (size_t j = 2; j < surfaces.size(); j++) {
+            REQUIRE_FALSE(survey.PairCanReachTarget(i, j));
+            REQUIRE_FALSE(survey.PairCanReachTarget(j, i));
+        }
+    }
+    mon::AABB bounds = mon::VagSurvey::PositionBounds(surfaces[2]);
+    REQUIRE(bounds.mins == mon::Vector{-10, -10, -20000});
+    REQUIRE(bounds.maxs == mon::Vector{10, 10, -20000});
+
+    mon::SurveyStats stats1, stats4;
+    auto res1 = survey.Run(&stats1);
+    sp.n_threads = 4;
+    sp.tile_size = 3;
+    auto res4 = mon::VagSurvey{ss, surfaces, sp}.Run(&stats4);
+    REQUIRE(stats1.n_pairs == 12);
+    REQUIRE(stats1.n_pruned >= 10);
+    REQUIRE(stats1.search.n_pairs == (stats1.n_pairs - stats1.n_pruned) * sp.samples_per_pair);
+    REQUIRE(stats1.search.n_hits == stats4.search.n_hits);
+    REQUIRE(stats1.n_pairs_with_hits == res1.size());
+    REQUIRE(!res1.empty());
+
+    // the result doesn't depend on the threads or tiles
+    REQUIRE(res1.size() == res4.size());
+    for (size_t i = 0; i < res1.size(); i++) {
+        REQUIRE(res1[i].blue == res4[i].blue);
+        REQUIRE(res1[i].orange == res4[i].orange);
+        REQUIRE(!res1[i].hits.empty());
+        REQUIRE(res1[i].hits.size() == res4[i].hits.size());
+        for (size_t j = 0; j < res1[i].hits.size(); j++) {
+            REQUIRE(res1[i].hits[j].hit.n_iterations == res4[i].hits[j].hit.n_iterations);
+            REQUIRE(ss.IsHit(res1[i].hits[j].hit.chain_result));
+        }
+        if (i > 0)
+            REQUIRE_FALSE(res1[i - 1] < res1[i]);
+    }
+}
+
+TEST_CASE("Placing portals on a surface")
+{
+    // the axis aligned surfaces give the same angles as the axis aligned search portal types
+    const std::pair<mon::Vector, mon::QAngle> axis_planes[]{
+        {{1, 0, 0}, {-0.f, 0.f, 0.f}},
+        {{-1, 0, 0}, {-0.f, 180.f, 0.f}},
+        {{0, 1, 0}, {-0.f, 90.f, 0.f}},
+        {{0, -1, 0}, {-0.f, -90.f, 0.f}},
+        {{0, 0, 1}, {-90.f, 25.f, 0.f}},
+        {{0, 0, -1}, {90.f, 25.f, 0.f}},
+    };
+    for (auto& [normal, ang] : axis_planes) {
+        mon::PortalPlacement placement{normal, 100};
+        REQUIRE(placement.level == (normal.z != 0));
+        mon::QAngle placed = placement.AnglesForYaw(25.f);
+        REQUIRE(placed.x == ang.x);
+        REQUIRE(placed.y == ang.y);
+        REQUIRE(placed.z == ang.z);
+        // the shot direction is the portal's up vector on floors & ceilings
+        const float deg = 3.14159265f / 180;
+        mon::Vector shot_dir{cosf(70 * deg), sinf(70 * deg), 0};
+        mon::QAngle shot = placement.AnglesForShot(shot_dir);
+        REQUIRE_THAT(shot.x, Catch::Matchers::WithinAbs(ang.x, .001f));
+        REQUIRE(shot.z == 0);
+        if (placement.level) {
+            float sp = sinf(shot.x * deg), cp = cosf(shot.x * deg);
+            mon::Vector up{sp * cosf(shot.y * deg), sp * sinf(shot.y * deg), cp};
+            REQUIRE_THAT(up.Dot(shot_dir), Catch::Matchers::WithinAbs(1, .001f));
+        } else {
+            REQUIRE(shot.y == ang.y);
+        }
+    }
+    mon::PortalPlacement wall{{-1, 0, 0}, -512};
+    REQUIRE(wall.Snap({600, 10, 20}) == mon::Vector{511.96875f, 10, 20});
+    REQUIRE(wall.Snap({511.96875f, 10, 20}) == mon::Vector{511.96875f, 10, 20});
+
+    // the surface of the 00 AAG, placing on it gives the same newlocation as the game
+    const mon::QAngle aag_ang{0.00538991531f, 135.f, 0.f};
+    const mon::Vector aag_pos{-474.710541f, -1082.65906f, 182.03125f};
+    const mon::Vector aag_normal{-0.707106769f, 0.707106769f, -9.40717655e-05f};
+    mon::PortalPlacement aag{aag_normal, aag_normal.Dot(aag_pos) - mon::PORTAL_SURFACE_OFFSET};
+    REQUIRE_FALSE(aag.level);
+    REQUIRE(aag.ang.x == aag_ang.x);
+    REQUIRE(aag.ang.y == aag_ang.y);
+    REQUIRE(aag.ang.z == aag_ang.z);
+    // the portal itself & the point on the surface that a shot would hit
+    for (float behind : {0.f, -mon::PORTAL_SURFACE_OFFSET})
+        REQUIRE(aag.Snap(aag_pos + aag_normal * behind) == aag_pos);
+    // further away the point itself has already been rounded
+    for (float behind : {-20.f, 30.f})
+        REQUIRE(aag.Snap(aag_pos + aag_normal * behind).DistTo(aag_pos) < .001f);
+
+    // the same surface as a search portal, the box is a part of the surface
+    const mon::AABB aag_box{{-520, -1128, 130}, {-430, -1038, 200}};
+    mon::SearchPortal sp{
+        .lock_opts{aag.plane.d},
+        .type = mon::SPT_PLANE,
+        .pos_spaces = aag_box,
+        .locked = false,
+        .plane_normal = aag_normal,
+    };
+    REQUIRE(sp.LockAxis() != 2);
+    small_prng rng{7};
+    float unit[mon::SearchPortal::N_UNIT_DIMS];
+    for (int i = 0; i < 200; i++) {
+        for (float& u : unit)
+            u = rng.next_float(0, mon::LD_ONE_MINUS_EPS);
+        for (const mon::Portal& p : {sp.Generate(rng, mon::GV_5135), sp.FromUnit(unit, mon::GV_5135)}) {
+            REQUIRE_THAT(aag_normal.Dot(p.pos) - aag.plane.d,
+                         Catch::Matchers::WithinAbs(mon::PORTAL_SURFACE_OFFSET, .001f));
+            REQUIRE(aag_box.NearBox(p.pos, 1.f));
+            REQUIRE(p.ang.x == aag.ang.x);
+            REQUIRE(p.ang.y == aag.ang.y);
+            mon::Portal perturbed = sp.Perturb(p, rng, 4.f, 4.f, mon::GV_5135);
+            REQUIRE_THAT(aag_normal.Dot(perturbed.pos) - aag.plane.d,
+                         Catch::Matchers::WithinAbs(mon::PORTAL_SURFACE_OFFSET, .001f));
+            // a portal that has drifted off the surface is put back onto it
+            mon::Portal drifted{p.pos + aag_normal * .5f, p.ang, mon::GV_5135};
+            perturbed = sp.Perturb(drifted, rng, 4.f, 4.f, mon::GV_5135);
+            REQUIRE_THAT(aag_normal.Dot(perturbed.pos) - aag.plane.d,
+                         Catch::Matchers::WithinAbs(mon::PORTAL_SURFACE_OFFSET, .001f));
+        }
+    }
+    mon::AABB bounds = mon::VagSurvey::PositionBounds(sp);
+    REQUIRE(bounds.mins.z == 130);
+    REQUIRE(bounds.maxs.z == 200);
+    REQUIRE(bounds.mins.y < bounds.maxs.y);
+
+    mon::SearchJobReader reader;
+    auto jobs = reader.Parse(R"({
+        "blue": {"type": "plane", "normal": [0, 0, 2], "lock_opts": [64], "pos_spaces": [[[0, 0, 0], [100, 100, 0]]]},
+        "orange": {"locked": true, "pos": [0, 0, 0], "ang": [0, 0, 0]},
+        "target_space": [[0, 0, 0], [10, 10, 10]],
+        "placement_orders": ["ORANGE_OPEN_BLUE_NEW_LOCATION"]
+    })");
+    INFO(reader.Error());
+    REQUIRE(jobs.has_value());
+    const mon::SearchPortal& floor = (*jobs)[0].ss.blue_search;
+    REQUIRE(floor.type == mon::SPT_PLANE);
+    REQUIRE(floor.plane_normal == mon::Vector{0, 0, 1});
+    mon::Portal floor_portal = floor.Generate(rng, mon::GV_5135);
+    REQUIRE(floor_portal.pos.z == 64.03125f);
+    REQUIRE(floor_portal.ang.x == -90.f);
+}
+
+TEST_CASE("xoshiro prng")
+{
+    // reference outputs of xoshiro128++
+    xoshiro_prng ref = xoshiro_prng::from_state(1, 2, 3, 4);
+    for (uint32_t expected : {641u, 1573767u, 3222811527u, 3517856514u})
+        REQUIRE(ref() == expected);
+    xoshiro_prng jumped = xoshiro_prng::from_state(1, 2, 3, 4);
+    jumped.jump();
+    REQUIRE(jumped() == 3129740764u);
+    REQUIRE(jumped() == 111290574u);
+
+    xoshiro_prng rng{5};
+    int counts[7]{};
+    for (int i = 0; i < 70000; i++) {
+        int v = rng.next_int(-3, 4);
+        REQUIRE(v >= -3);
+        REQUIRE(v < 4);
+        counts[v + 3]++;
+        float f = rng.next_float(-2.f, 6.f);
+        REQUIRE(f >= -2.f);
+        REQUIRE(f <= 6.f);
+    }
+    for (int c : counts)
+        REQUIRE_THAT(c, Catch::Matchers::WithinAbs(10000, 500));
+    REQUIRE(rng.next_int(INT_MIN, INT_MAX) < INT_MAX);
+    REQUIRE(xoshiro_prng::stream(1, 0)() != xoshiro_prng::stream(1, 1)());
+    REQUIRE(xoshiro_prng::stream(1, 0)() != xoshiro_prng::stream(2, 0)());
+
+    // lane i of the bulk generator is the scalar stream jumped i times
+    std::vector<xoshiro_prng> lanes{xoshiro_prng{9}};
+    while (lanes.size() < 4) {
+        lanes.push_back(lanes.back());
+        lanes.back().jump();
+    }
+    xoshiro_prng_x4 bulk{9};
+    std::vector<uint32_t> raw(103);
+    bulk.fill_u32(raw.data(), raw.size());
+    for (size_t i = 0; i < raw.size(); i++)
+        REQUIRE(raw[i] == lanes[i % 4]());
+
+    // the simd & scalar mappings match
+    std::vector<float> floats(103);
+    std::vector<int> ints(103);
+    xoshiro_prng_x4{9}.fill_floats(floats.data(), floats.size(), -.1f, .1f);
+    xoshiro_prng_x4{9}.fill_ints(ints.data(), ints.size(), 10, 17);
+    bool bools[103];
+    xoshiro_prng_x4{9}.fill_bools(bools, 103);
+    for (size_t i = 0; i < raw.size(); i++) {
+        REQUIRE(floats[i] == (raw[i] >> 8) * 0x1p-24f * (.1f - -.1f) + -.1f);
+        REQUIRE(ints[i] == 10 + (int)(((uint64_t)raw[i] * 7) >> 32));
+        REQUIRE(bools[i] == (raw[i] >> 31 != 0));
+    }
+}
+
+TEST_CASE("Parsing & verifying a command corpus")
+{
+    mon::PortalPair lochness{
+        {-416.247498f, 735.368835f, 255.96875f},
+        {90.f, -90.2385559f, 0.f},
+        {-394.776428f, -56.0312462f, 38.8377686f},
+        {-44.9994202f, 180.f, 0.f},
+        mon::PlacementOrder::ORANGE_OPEN_BLUE_NEW_LOCATION,
+        mon::GV_5135,
+    };
+    mon::PortalPair aag{
+        {-474.710541f, -1082.65906f, 182.03125f},
+        {0.00538991531f, 135.f, 0.f},
+        {-735.139282f, -923.540344f, 128.03125f},
+        {-90.f, 55.0390396f, 0.f},
+        mon::PlacementOrder::BLUE_OPEN_ORANGE_NEW_LOCATION,
+        mon::GV_5135,
+    };
+    auto lochness_ent = mon::Entity::CreatePlayerFromOrigin({-416.247498f, 735.368835f, 219.97f}, false);
+    auto aag_ent = mon::Entity::CreatePlayerFromOrigin({-473.604370f, -1082.235498f, 128.031250f}, false);
+
+    std::string text = std::format("] sv_cheats 1\n"
+                                   "setpos 0 0 0\n"
+                                   "{}\n"
+                                   "{}\r\n"
+                                   "setpos 1 2\n"
+                                   "ent_fire \"box\" newlocation \"1 2 3 0 0 0\"\n"
+                                   "{}; {}\n"
+                                   "{}\n"
+                                   "echo done",
+                                   lochness.NewLocationCmd(),
+                                   lochness_ent.SetPosCmd(),
+                                   aag.NewLocationCmd("; ", true),
+                                   aag_ent.SetPosCmd(),
+                                   aag_ent.SetPosCmd());
+
+    // tiny chunks so that records are linked to placements from earlier chunks
+    mon::CorpusParams params{.crouched = false, .n_threads = 3, .min_chunk_size = 16};
+    mon::CommandCorpus corpus;
+    corpus.Parse(text, params);
+    mon::CommandCorpus single;
+    single.Parse(text, mon::CorpusParams{.crouched = false});
+
+    for (const mon::CommandCorpus* c : {&corpus, &single}) {
+        const mon::CorpusStats& stats = c->Stats();
+        REQUIRE(stats.n_lines == 10);
+        REQUIRE(stats.n_newlocations == 5);
+        REQUIRE(stats.n_setpos == 5);
+        REQUIRE(stats.n_malformed == 1);
+        REQUIRE(stats.n_other_ents == 1);
+        REQUIRE(stats.n_orphans == 1);
+        REQUIRE(c->NumRecords() == 3);
+        REQUIRE(c->Pairs().size() == 2);
+        REQUIRE(c->LineOf(0) == 5);
+        REQUIRE(c->LineOf(1) == 8);
+        REQUIRE(c->LineOf(2) == 9);
+        REQUIRE(&c->PairOf(1) == &c->PairOf(2));
+        REQUIRE(c->Ents()[0] == lochness_ent);
+        REQUIRE(c->Ents()[2] == aag_ent);
+        for (int i = 0; i < 2; i++) {
+            const mon::PortalPair& expected = i ? aag : lochness;
+            const mon::PortalPair& pp = c->Pairs()[i];
+            REQUIRE(pp.order == expected.order);
+            REQUIRE(pp.NewLocationCmd() == expected.NewLocationCmd());
+            REQUIRE(!memcmp(&pp.b_to_o, &expected.b_to_o, sizeof pp.b_to_o));
+        }
+    }
+
+    mon::CorpusVerifyParams vp{.project_to_first_portal_plane = false, .n_threads = 3, .block_size = 1};
+    std::vector<mon::CorpusVerdict> verdicts;
+    mon::VerifyCorpus(corpus, vp, [&](const mon::CorpusVerdict& v) { verdicts.push_back(v); });
+    REQUIRE(verdicts.size() == 3);
+    for (size_t i = 0; i < verdicts.size(); i++) {
+        mon::TeleportChainParams chain_params{&corpus.PairOf(i), corpus.Ents()[i]};
+        chain_params.project_to_first_portal_plane = false;
+        mon::TeleportChainResult result;
+        mon::GenerateTeleportChain(chain_params, result);
+        REQUIRE(verdicts[i].line == corpus.LineOf(i));
+        REQUIRE(verdicts[i].tp_from_blue == chain_params.first_tp_from_blue);
+        REQUIRE(verdicts[i].total_n_teleports == result.total_n_teleports);
+        REQUIRE(verdicts[i].cum_teleports == result.cum_teleports);
+        REQUIRE(verdicts[i].final_center == result.ent.GetCenter());
+    }
+    REQUIRE(verdicts[0].cum_teleports == -1);
+    REQUIRE(verdicts[0].total_n_teleports == 3);
+}
+
+TEST_CASE("Query daemon")
+{
+    // the daemon writes from its worker threads, the lines are only parsed & checked on this one
+    std::mutex mtx;
+    std::vector<std::string> lines;
+    mon::QueryDaemon daemon{mon::DaemonParams{.n_threads = 2, .search_slice = 1 << 12}, [&](std::string_view line) {
+                                std::lock_guard lock{mtx};
+                                lines.emplace_back(line);
+                            }};
+    auto response = [&](std::optional<int64_t> id) {
+        std::vector<std::string> copy;
+        {
+            std::lock_guard lock{mtx};
+            copy = lines;
+        }
+        for (const std::string& line : copy) {
+            auto v = mon::JsonParser::Parse(line);
+            REQUIRE(v.has_value());
+            if (v->Find("id")->AsNumber<int64_t>() == id)
+                return std::move(*v);
+        }
+        FAIL("no response with that id");
+        return mon::JsonValue{};
+    };
+    auto type_of = [&](std::optional<int64_t> id) { return std::string{*response(id).Find("type")->AsString()}; };
+
+    // 19 Lochness
+    std::string chain = R"("blue":{"pos":[-416.247498,735.368835,255.96875],"ang":[90,-90.2385559,0]},)"
+                        R"("orange":{"pos":[-394.776428,-56.0312462,38.8377686],"ang":[-44.9994202,180,0]},)"
+                        R"("order":"ORANGE_OPEN_BLUE_NEW_LOCATION","project":false,)"
+                        R"("ent":{"origin":[-416.247498,735.368835,219.97],"crouched":false})";
+    REQUIRE(daemon.Submit(std::format(R"({{"id":1,"type":"chain",{}}})", chain)));
+    daemon.Wait();
+    REQUIRE(daemon.Submit(std::format(R"({{"id":2,"type":"chain",{}}})", chain)));
+    REQUIRE(daemon.Submit(std::format(R"({{"id":3,"type":"overlay",{},"y_res":16}})", chain)));
+    REQUIRE(daemon.Submit("not json"));
+    REQUIRE(daemon.Submit(R"({"id":4,"type":"teleport"})"));
+    REQUIRE(daemon.Submit(R"({"id":5,"type":"chain","blue":{}})"));
+    daemon.Wait();
+    REQUIRE(daemon.Submit(R"({"id":6,"type":"stats"})"));
+
+    for (int64_t id : {1, 2}) {
+        mon::JsonValue res = response(id);
+        REQUIRE(type_of(id) == "chain");
+        REQUIRE(res.Find("vag")->AsBool() == true);
+        REQUIRE(res.Find("cum_teleports")->AsNumber<int>() == -1);
+        REQUIRE(res.Find("total_teleports")->AsNumber<int>() == 3);
+    }
+    mon::JsonValue overlay = response(3);
+    REQUIRE(overlay.Find("height")->AsNumber<size_t>() == 16);
+    REQUIRE(overlay.Find("width")->AsNumber<size_t>() == mon::OverlayXRes(16));
+    REQUIRE(overlay.Find("vags")->AsNumber<size_t>() <= 16 * mon::OverlayXRes(16));
+    REQUIRE(type_of({}) == "error");
+    REQUIRE(type_of(4) == "error");
+    REQUIRE(type_of(5) == "error");
+    // the portals & the pair were made once for the first request and reused after that
+    mon::JsonValue stats = response(6);
+    REQUIRE(stats.Find("handled")->AsNumber<int>() == 4);
+    REQUIRE(stats.Find("pair_cache")->Find("misses")->AsNumber<int>() == 1);
+    REQUIRE(stats.Find("pair_cache")->Find("hits")->AsNumber<int>() == 2);
+    REQUIRE(stats.Find("portal_cache")->Find("misses")->AsNumber<int>() == 2);
+
+    std::string job = R"("job":{"blue":{"type":"ZN","lock_opts":[383.96875],)"
+                      R"("pos_spaces":[[[-860,280,450],[-551,-43,380]]]},)"
+                      R"("orange":{"type":"XN","lock_opts":[-64.03125],)"
+                      R"("pos_spaces":[[[-80,-816,284],[-40,-1154,509]]]},)"
+                      R"("target_space":[[-106,-1427,1597],[-273,-1282,1729]],)"
+                      R"("placement_orders":["ORANGE_OPEN_BLUE_NEW_LOCATION"],"mode":"collect",)";
+    REQUIRE(daemon.Submit(std::format(R"({{"id":7,"type":"search",{}"iterations":8192}}}})", job)));
+    REQUIRE(daemon.Submit(std::format(R"({{"id":8,"type":"search",{}"iterations":1000000000}}}})", job)));
+    REQUIRE(daemon.Submit(R"({"id":9,"type":"cancel","target":8})"));
+    REQUIRE(daemon.Submit(R"({"id":10,"type":"cancel","target":11})"));
+    daemon.Wait();
+    mon::JsonValue search = response(7);
+    REQUIRE(search.Find("results")->Items().size() == 1);
+    REQUIRE(search.Find("results")->Items()[0].Find("iterations")->AsNumber<int>() == 8192);
+    REQUIRE(type_of(8) == "cancelled");
+    REQUIRE(type_of(9) == "ack");
+    REQUIRE(type_of(10) == "error");
+    // the search already got its reply, too late to cancel
+    REQUIRE(daemon.Submit(R"({"id":11,"type":"cancel","target":7})"));
+    REQUIRE(type_of(11) == "error");
+    REQUIRE_FALSE(daemon.Submit(R"({"type":"quit"})"));
+}
+
+TEST_CASE("Refining a VAG hit")
+{
+    mon::SearchSpace ss = KnownVagIn11SearchSpace();
+    mon::VagCollectParams cp{.max_hits = 1, .face_samples_per_side = 4};
+    mon::SearchStats stats;
+    auto hits = ss.CollectVags(1, mon::SearchSpace::PARALLEL_BLOCK_SIZE * 16, cp, 0, &stats);
+    REQUIRE(!hits.empty());
+    // every ranked hit runs 4*4 chains, hits in a cell that's already taken aren't ranked
+    REQUIRE(stats.n_rank_chains > 0);
+    REQUIRE(stats.n_rank_chains % 16 == 0);
+    REQUIRE(stats.n_rank_chains <= 16 * stats.n_hits);
+    mon::VagRefineParams rp{.n_rounds = 4, .batch_size = 8, .face_samples_per_side = 4, .n_threads = 3};
+    mon::RankedVagHit refined = ss.RefineHit(hits[0], 7, rp);
+    REQUIRE_FALSE(refined < hits[0]);
+    REQUIRE(ss.IsHit(refined.hit.chain_result));
+    // same seed, same result
+    mon::RankedVagHit refined2 = ss.RefineHit(hits[0], 7, rp);
+    REQUIRE(refined.hit.pp.blue.pos == refined2.hit.pp.blue.pos);
+    REQUIRE(refined.hit.pp.orange.pos == refined2.hit.pp.orange.pos);
+    REQUIRE(refined.face_vag_fraction == refined2.face_vag_fraction);
+}
+
+TEST_CASE("VAG hit top-k with deduplication")
+{
+    mon::VagCollectParams cp{.max_hits = 3, .dedup_dist = 1.f, .dedup_ang = 1.f};
+    mon::VagHitTopK top_k{cp};
+    auto make_hit = [](int iteration, float x, float frac) {
+        return mon::RankedVagHit{
+            .hit{
+                .n_iterations = iteration,
+                .pp{
+                    mon::Portal{{x, 0, 0}, {0, 0, 0}, mon::GV_5135},
+                    mon::Portal{{100, 0, 0}, {0, 180, 0}, mon::GV_5135},
+                    mon::PlacementOrder::ORANGE_OPEN_BLUE_NEW_LOCATION,
+                },
+            },
+            .face_vag_fraction = frac,
+            .target_margin = 1.f,
+        };
+    };
+    REQUIRE(top_k.Push(make_hit(0, 0.f, .1f)));
+    REQUIRE(top_k.Push(make_hit(1, 10.f, .2f)));
+    // same cell as the first hit, the earlier iteration stays even though this one is better
+    REQUIRE(top_k.Holds(make_hit(2, .5f, .3f).hit));
+    REQUIRE_FALSE(top_k.Push(make_hit(2, .5f, .3f)));
+    REQUIRE(top_k.Size() == 2);
+    // a later iteration that was pushed first is replaced by an earlier one in the same cell
+    REQUIRE(top_k.Push(make_hit(5, 20.f, .4f)));
+    REQUIRE_FALSE(top_k.Holds(make_hit(4, 20.5f, .3f).hit));
+    REQUIRE(top_k.Push(make_hit(4, 20.5f, .3f)));
+    REQUIRE(top_k.Size() == 3);
+    REQUIRE(top_k.Push(make_hit(6, 30.f, .5f)));
+    REQUIRE(top_k.Size() == 3);
+    // worse than everything in a full queue
+    REQUIRE_FALSE(top_k.Push(make_hit(7, 40.f, .01f)));
+    // the cell of the evicted first hit is free again, this pushes out the second hit
+    REQUIRE_FALSE(top_k.Holds(make_hit(8, .25f, .6f).hit));
+    REQUIRE(top_k.Push(make_hit(8, .25f, .6f)));
+    REQUIRE(top_k.Size() == 3);
+
+    std::vector<mon::RankedVagHit> hits = top_k.TakeSorted();
+    REQUIRE(hits.size() == 3);
+    REQUIRE(hits[0].hit.n_iterations == 8);
+    REQUIRE(hits[1].hit.n_iterations == 6);
+    REQUIRE(hits[2].hit.n_iterations == 4);
+}
+
+TEST_CASE("Sobol sampler stratification")
+{
+    // the first 2^m points of every dimension have exactly one point in each interval of size 2^-m
+    for (int scrambled = 0; scrambled < 2; scrambled++) {
+        mon::SobolSampler sampler{!!scrambled, 123};
+        const int n = 1024;
+        std::vector<std::array<int, mon::SobolSampler::MAX_DIMS>> counts(n);
+        for (int i = 0; i < n; i++) {
+            float pt[mon::SobolSampler::MAX_DIMS];
+            sampler.Point(i, pt);
+            for (int d = 0; d < mon::SobolSampler::MAX_DIMS; d++) {
+                REQUIRE(pt[d] >= 0.f);
+                REQUIRE(pt[d] < 1.f);
+                counts[(int)(pt[d] * n)][d]++;
+            }
+        }
+        for (int i = 0; i < n; i++)
+            for (int d = 0; d < mon::SobolSampler::MAX_DIMS; d++)
+                REQUIRE(counts[i][d] == 1);
+    }
+}
+
+TEST_CASE("Halton sampler")
+{
+    mon::HaltonSampler sampler;
+    float pt[mon::HaltonSampler::MAX_DIMS];
+    sampler.Point(5, pt);
+    // 5 = 101 (base 2) = 12 (base 3) = 10 (base 5)
+    REQUIRE(pt[0] == .625f);
+    REQUIRE_THAT(pt[1], Catch::Matchers::WithinAbs(2 / 3.f + 1 / 9.f, 1e-6));
+    REQUIRE_THAT(pt[2], Catch::Matchers::WithinAbs(1 / 25.f, 1e-6));
+
+    // scrambling permutes the digits (keeping 0 fixed), so the first b points in base b are still 0, 1/b, ..., (b-1)/b
+    mon::HaltonSampler scrambled{true, 42};
+    for (int d = 0; d < mon::HaltonSampler::MAX_DIMS; d++) {
+        const int base = (int)std::round(1 / sampler.RadicalInverse(1, d));
+        std::vector<int> counts(base);
+        for (int i = 0; i < base; i++)
+            counts[(int)std::round(scrambled.RadicalInverse(i, d) * base)]++;
+        for (int i = 0; i < base; i++)
+            REQUIRE(counts[i] == 1);
+    }
+}
+
+class SptIpcConn {
+
+    mon::TcpSocket sock;
+    mon::SptIpcMsgBuffer recv_buf;
+    // the current message, the buffer's views don't survive the next recv
+    std::string msg;
+
+    // TODO there's seems to be a bug in Catch2 when skipping from a class fixture ctor, update Catch2 and see if that's fixed!
+    std::optional<std::string> defer_skip_message;
+
+public:
+    SptIpcConn(uint16_t port = mon::SPT_IPC_PORT)
     {
-        if (_cleanup_sock)
-            closesocket(sock);
+        sock = mon::TcpSocket::Connect("127.0.0.1", port);
+        if (!sock.IsOpen())
+            defer_skip_message = "Failed to connect to SPT";
     }
 
     void SendCmd(const std::string& s)
@@ -927,39 +2483,46 @@ public:
         if (defer_skip_message.has_value())
             SKIP(*defer_skip_message);
 
-        recvLen = -1;
         std::string send_str = std::format("{{\"type\":\"cmd\",\"cmd\":\"{}\"}}", s);
-        int ret = send(sock, send_str.c_str(), send_str.size() + 1, 0);
-        if (ret == SOCKET_ERROR)
-            SKIP("send failed (" << ret << ")");
-    }
-
-    const char* BufPtr() const
-    {
-        return recv_buf + off;
+        if (!mon::SptIpcSend(sock, send_str))
+            SKIP("send failed");
     }
 
-    int BufLen() const
+    const std::string& Msg() const
     {
-        return recvLen - off;
+        return msg;
     }
 
     void NextRecvMsg()
     {
-        if (BufLen() > 0)
-            off += strnlen(BufPtr(), BufLen()) + 1;
-        if (BufLen() <= 0) {
-            off = 0;
-            recvLen = recv(sock, recv_buf, sizeof recv_buf, 0);
-            if (recvLen < 0 || recvLen >= sizeof recv_buf)
-                SKIP("recv failed (" << recvLen << ")");
+        std::optional<std::string_view> next;
+        while (!(next = recv_buf.Next())) {
+            int ret = recv_buf.RecvFrom(sock);
+            if (ret <= 0)
+                SKIP("recv failed (" << ret << ")");
         }
+        msg = *next;
     }
 
     void RecvAck()
     {
         NextRecvMsg();
-        REQUIRE_FALSE(!!strcmp(BufPtr(), "{\"type\":\"ack\"}"));
+        REQUIRE(msg == "{\"type\":\"ack\"}");
+    }
+
+    // the "entity" object of the next message, which must be an ent message for an existing entity
+    mon::JsonValue RecvEnt()
+    {
+        NextRecvMsg();
+        INFO(msg);
+        std::optional<mon::JsonValue> v = mon::JsonParser::Parse(msg);
+        REQUIRE(v.has_value());
+        REQUIRE(v->Find("type"));
+        REQUIRE(v->Find("type")->AsString() == "ent");
+        REQUIRE(v->Find("exists"));
+        REQUIRE(v->Find("exists")->AsBool() == true);
+        REQUIRE(v->Find("entity"));
+        return *v->Find("entity");
     }
 };
 
@@ -967,43 +2530,40 @@ struct SptIpcConnFixture {
     mutable SptIpcConn conn;
 };
 
-/*
-* To use:
-* - open the game and load a sufficiently recent version of SPT (anything after 03-2025 work)
-* - run `spt_ipc 1`
-* - create an orange and blue portal and set their name using `picker` & `ent_setname` to 'blue'/'orange'
-* - noclip and crouch (with toggle duck)
-* - run the tests
-* 
-* TODO: figure out how to handle the standing case. It's possible for us to end up with portals
-* that give us exit velocity and teleport us back into the entry portal. Now that I think about it,
-* this is probably possible for the crouched case as well.
-*/
-TEST_CASE_PERSISTENT_FIXTURE(SptIpcConnFixture, "SPT with IPC")
-{
-    conn.SendCmd(
-        "sv_cheats 1; spt_prevent_vag_crash 1; spt_focus_nosleep 1; spt_noclip_noslowfly 1; host_timescale 20; "
-        "spt_ipc_properties 1 m_fFlags");
-    conn.RecvAck();
-    conn.NextRecvMsg();
-
-    int player_flags;
-    int n_args = _snscanf_s(conn.BufPtr(),
-                            conn.BufLen(),
-                            "{\"entity\":{\"m_fFlags\":%d},\"exists\":true,\"type\":\"ent\"}",
-                            &player_flags);
-    REQUIRE(n_args == 1);
+// a random portal pair that gives a normal teleport or a simple VAG to a player on the blue portal
+struct IpcChainCheck {
+    mon::PortalPair pp;
+    // the player on the blue portal boundary, right before the teleport
+    mon::Entity boundary;
+    mon::Vector expected_origin;
+    bool vag;
 
-    bool player_crouched = player_flags & 2;
-
-    std::this_thread::sleep_for(std::chrono::milliseconds(25));
+    /*
+    * For some reason, some portals don't trigger the StartTouch/Touch call when we setpos on
+    * the portal boundary. The solution is to setpos right in front of it first, then setpos
+    * on the boundary. Using a single string with two setpos commands doesn't work (not sure
+    * how that works under the hood), but sending two separate setpos commands works.
+    * 
+    * This is probably because SPT will process the two separate message on different frames,
+    * and that will allow time for the first setpos to go through. The setpos on the boundary
+    * probably fails to work on maps where the map origin is inbounds due to a portal
+    * ownership bug.
+    * 
+    * Update: the reason some portals don't trigger StartTouch is probably because of the
+    * origin of the map being inbounds in some cases.
+    */
+    std::string SetupCmd(bool escape_quotes) const
+    {
+        mon::Entity tmp_player = mon::Entity::CreatePlayerFromCenter(pp.blue.pos + pp.blue.f, boundary.player.crouched);
+        return std::format("{}; {}", pp.NewLocationCmd("; ", escape_quotes), tmp_player.SetPosCmd());
+    }
+};
 
-    small_prng rng;
+static IpcChainCheck NextIpcChainCheck(small_prng& rng, bool player_crouched)
+{
     mon::TeleportChainParams params;
     mon::TeleportChainResult result;
-
-    int iteration = 0;
-    while (iteration < 1000) {
+    while (true) {
         mon::Portal blue = RandomPortal(rng, mon::GV_5135);
         mon::Portal orange = RandomPortal(rng, mon::GV_5135);
         /*
@@ -1025,55 +2585,333 @@ TEST_CASE_PERSISTENT_FIXTURE(SptIpcConnFixture, "SPT with IPC")
         if (result.max_tps_exceeded || (result.cum_teleports != 1 && result.cum_teleports != -1))
             continue;
 
-        /*
-        * For some reason, some portals don't trigger the StartTouch/Touch call when we setpos on
-        * the portal boundary. The solution is to setpos right in front of it first, then setpos
-        * on the boundary. Using a single string with two setpos commands doesn't work (not sure
-        * how that works under the hood), but sending two separate setpos commands works.
-        * 
-        * This is probably because SPT will process the two separate message on different frames,
-        * and that will allow time for the first setpos to go through. The setpos on the boundary
-        * probably fails to work on maps where the map origin is inbounds due to a portal
-        * ownership bug.
-        * 
-        * Update: the reason some portals don't trigger StartTouch is probably because of the
-        * origin of the map being inbounds in some cases.
-        */
+        mon::Vector expected_origin = result.ent.player.origin;
+        // the AG force crouched the player and the above estimate may be off
+        if (!player_crouched && result.ent.player.crouched)
+            expected_origin = mon::Entity::CreatePlayerFromCenter(result.ent.GetCenter(), false).player.origin;
+
+        return IpcChainCheck{
+            .pp = pp,
+            .boundary = result.ents[0],
+            .expected_origin = expected_origin,
+            .vag = result.cum_teleports == -1,
+        };
+    }
+}
+
+static const char* const IPC_SESSION_SETUP_CMD =
+    "sv_cheats 1; spt_prevent_vag_crash 1; spt_focus_nosleep 1; spt_noclip_noslowfly 1; host_timescale 20; "
+    "spt_ipc_properties 1 m_fFlags";
 
-        mon::Entity tmp_player = mon::Entity::CreatePlayerFromCenter(blue.pos + blue.f, player_crouched);
-        conn.SendCmd(std::format("{}; {}", pp.NewLocationCmd("; ", true), tmp_player.SetPosCmd()));
+/*
+* Places random portals & checks that a setpos onto the blue portal puts the player where
+* GenerateTeleportChain says it should, one command at a time. frame_wait is how long the game
+* needs to process the teleport before the position can be read.
+*/
+static void VerifyChainsOverIpc(SptIpcConn& conn, int n_iterations, std::chrono::milliseconds frame_wait)
+{
+    conn.SendCmd(IPC_SESSION_SETUP_CMD);
+    conn.RecvAck();
+    mon::JsonValue flags_ent = conn.RecvEnt();
+    REQUIRE(flags_ent.Find("m_fFlags"));
+    std::optional<int> player_flags = flags_ent.Find("m_fFlags")->AsNumber<int>();
+    REQUIRE(player_flags.has_value());
+
+    bool player_crouched = *player_flags & 2;
+
+    std::this_thread::sleep_for(frame_wait * 5 / 2);
+
+    small_prng rng;
+
+    for (int iteration = 0; iteration < n_iterations; iteration++) {
+        IpcChainCheck check = NextIpcChainCheck(rng, player_crouched);
+
+        conn.SendCmd(check.SetupCmd(true));
         conn.RecvAck();
-        conn.SendCmd(result.ents[0].SetPosCmd());
+        conn.SendCmd(check.boundary.SetPosCmd());
         conn.RecvAck();
 
         // timescale 1: sleep for 350ms, timescale 20: sleep for 10ms
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::this_thread::sleep_for(frame_wait);
 
         conn.SendCmd("spt_ipc_properties 1 m_vecOrigin");
         conn.RecvAck();
-        conn.NextRecvMsg();
+        mon::JsonValue pos_ent = conn.RecvEnt();
         mon::Vector actual_player_pos{};
-        n_args = _snscanf_s(conn.BufPtr(),
-                            conn.BufLen(),
-                            "{\"entity\":{"
-                            "\"m_vecOrigin[0]\":%f,\"m_vecOrigin[1]\":%f,\"m_vecOrigin[2]\":%f"
-                            "},\"exists\":true,\"type\":\"ent\"}",
-                            &actual_player_pos.x,
-                            &actual_player_pos.y,
-                            &actual_player_pos.z);
-        REQUIRE(n_args == 3);
+        for (int i = 0; i < 3; i++) {
+            const mon::JsonValue* coord = pos_ent.Find(std::format("m_vecOrigin[{}]", i));
+            REQUIRE(coord);
+            REQUIRE(coord->AsNumber<float>().has_value());
+            actual_player_pos[i] = *coord->AsNumber<float>();
+        }
 
         INFO("iteration " << iteration);
-        INFO("expected " << (result.cum_teleports == -1 ? "VAG" : "normal teleport"));
-        if (player_crouched || !result.ent.player.crouched) {
-            REQUIRE(actual_player_pos.DistToSqr(result.ent.player.origin) < 100 * 100);
-        } else {
-            // the AG force crouched the player and the above estimate may be off
-            mon::Entity better_ent_estimate = mon::Entity::CreatePlayerFromCenter(result.ent.GetCenter(), false);
-            REQUIRE(actual_player_pos.DistToSqr(better_ent_estimate.player.origin) < 100 * 100);
+        INFO("expected " << (check.vag ? "VAG" : "normal teleport"));
+        REQUIRE(actual_player_pos.DistToSqr(check.expected_origin) < 100 * 100);
+        printf("iteration %d: %s", iteration, check.vag ? "VAG\n" : "Normal teleport\n");
+    }
+}
+
+// same as VerifyChainsOverIpc, but with the commands for several portal pairs in flight
+static mon::SptIpcVerifyStats VerifyChainsPipelined(uint16_t port, int n_groups, const mon::SptIpcVerifyParams& vp)
+{
+    mon::SptIpcClient client{port};
+    if (!client.IsConnected())
+        SKIP("Failed to connect to SPT");
+
+    std::vector<mon::SptIpcClient::Completion> done;
+    REQUIRE(client.Send(IPC_SESSION_SETUP_CMD, true));
+    INFO(client.Error());
+    REQUIRE(client.Poll(vp.reply_timeout, done));
+    REQUIRE(done.size() == 1);
+    const mon::JsonValue* ent = done[0].ent.Find("entity");
+    REQUIRE(ent);
+    REQUIRE(ent->Find("m_fFlags"));
+    std::optional<int> player_flags = ent->Find("m_fFlags")->AsNumber<int>();
+    REQUIRE(player_flags.has_value());
+
+    bool player_crouched = *player_flags & 2;
+
+    small_prng rng;
+    std::vector<IpcChainCheck> checks;
+    std::vector<mon::SptIpcVerifyGroup> groups;
+    for (int i = 0; i < n_groups; i++) {
+        checks.push_back(NextIpcChainCheck(rng, player_crouched));
+        groups.push_back({.setup_cmd = checks.back().SetupCmd(false), .boundary = checks.back().boundary});
+    }
+
+    int n_verified = 0;
+    mon::SptIpcVerifyStats stats;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = mon::VerifyOverIpc(
+        client,
+        groups,
+        vp,
+        [&](size_t i, const mon::Vector& actual_player_pos) {
+            INFO("group " << i);
+            INFO("expected " << (checks[i].vag ? "VAG" : "normal teleport"));
+            REQUIRE(actual_player_pos.DistToSqr(checks[i].expected_origin) < 100 * 100);
+            n_verified++;
+        },
+        &stats);
+    REQUIRE(ok);
+    REQUIRE(n_verified == n_groups);
+    printf("verified %d portal pairs in %.2fs (%zu retries, %d settle frames, %.2fms frame time)\n",
+           n_groups,
+           std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+           stats.n_retries,
+           stats.settle_frames,
+           std::chrono::duration<double, std::milli>(stats.frame_time).count());
+    return stats;
+}
+
+/*
+* To use:
+* - open the game and load a sufficiently recent version of SPT (anything after 03-2025 work)
+* - run `spt_ipc 1`
+* - create an orange and blue portal and set their name using `picker` & `ent_setname` to 'blue'/'orange'
+* - noclip and crouch (with toggle duck)
+* - run the tests
+* 
+* TODO: figure out how to handle the standing case. It's possible for us to end up with portals
+* that give us exit velocity and teleport us back into the entry portal. Now that I think about it,
+* this is probably possible for the crouched case as well.
+*/
+TEST_CASE_PERSISTENT_FIXTURE(SptIpcConnFixture, "SPT with IPC")
+{
+    VerifyChainsOverIpc(conn, 1000, std::chrono::milliseconds{10});
+}
+
+// same setup as above
+TEST_CASE("SPT with IPC, pipelined")
+{
+    VerifyChainsPipelined(mon::SPT_IPC_PORT, 1000, {});
+}
+
+TEST_CASE("SPT IPC messages split across recv calls")
+{
+    mon::TcpSocket listener = mon::TcpSocket::Listen("127.0.0.1", 0);
+    REQUIRE(listener.IsOpen());
+    mon::TcpSocket client = mon::TcpSocket::Connect("127.0.0.1", listener.LocalPort());
+    REQUIRE(client.IsOpen());
+    mon::TcpSocket server = listener.Accept();
+    REQUIRE(server.IsOpen());
+
+    std::vector<std::string> sent;
+    std::string stream;
+    for (int i = 0; i < 200; i++) {
+        sent.push_back(std::format("{{\"i\":{},\"pad\":\"{}\",\"type\":\"ent\"}}", i, std::string(i * 37 % 5000, 'x')));
+        stream += sent.back();
+        stream += '\0';
+    }
+    // odd sized writes so that messages get split in all sorts of places
+    std::jthread writer{[&] {
+        for (size_t off = 0, n = 1; off < stream.size(); off += n, n = n * 7 % 1013 + 1)
+            if (!server.SendAll(stream.data() + off, std::min(n, stream.size() - off)))
+                return;
+    }};
+    mon::SptIpcMsgBuffer buf;
+    std::vector<std::string> received;
+    while (received.size() < sent.size()) {
+        REQUIRE(buf.RecvFrom(client) > 0);
+        while (std::optional<std::string_view> msg = buf.Next())
+            received.emplace_back(*msg);
+    }
+    REQUIRE(received == sent);
+    REQUIRE(buf.Pending() == 0);
+}
+
+TEST_CASE("SPT IPC stand-in")
+{
+    mon::SptIpcStandInParams sp{.port = 0};
+    std::optional<mon::SptIpcRecording> recording;
+    {
+        mon::SptIpcStandIn standin{sp};
+        REQUIRE(standin.IsListening());
+        SptIpcConn conn{standin.Port()};
+        VerifyChainsOverIpc(conn, 50, std::chrono::milliseconds{0});
+        recording = standin.Recording();
+        mon::SptIpcStandInStats stats = standin.Stats();
+        CHECK(stats.n_clients == 1);
+        CHECK(stats.n_client_msgs == 1 + 50 * 3);
+    }
+    REQUIRE(recording->msgs.size() == (1 + 50 * 3) * 2 + 1 + 50);
+
+    SECTION("Recordings round trip through a file")
+    {
+        auto path = std::filesystem::temp_directory_path() / "monocle_test_spt_ipc.jsonl";
+        REQUIRE(recording->Save(path));
+        std::string err;
+        std::optional<mon::SptIpcRecording> loaded = mon::SptIpcRecording::Load(path, &err);
+        std::filesystem::remove(path);
+        INFO(err);
+        REQUIRE(loaded.has_value());
+        REQUIRE(loaded->msgs.size() == recording->msgs.size());
+        for (size_t i = 0; i < loaded->msgs.size(); i++) {
+            REQUIRE(loaded->msgs[i].from_client == recording->msgs[i].from_client);
+            REQUIRE(loaded->msgs[i].msg == recording->msgs[i].msg);
+        }
+    }
+
+    SECTION("Replaying a recording through the engine")
+    {
+        mon::SptIpcReplayReport report = mon::ReplayRecording(*recording);
+        CHECK(report.n_client_msgs == 1 + 50 * 3);
+        CHECK(report.n_mismatches == 0);
+
+        // a recording from a game where one of the positions came out differently
+        mon::SptIpcRecording tampered = *recording;
+        auto it = std::find_if(tampered.msgs.rbegin(), tampered.msgs.rend(), [](auto& m) {
+            return m.msg.find("m_vecOrigin") != std::string::npos && !m.from_client;
+        });
+        REQUIRE(it != tampered.msgs.rend());
+        mon::JsonValue ent = *mon::JsonParser::Parse(it->msg)->Find("entity");
+        float x = *ent.Find("m_vecOrigin[0]")->AsNumber<float>();
+        size_t x_pos = it->msg.find("m_vecOrigin[0]");
+        it->msg.replace(x_pos, it->msg.find(',', x_pos) - x_pos, std::format("m_vecOrigin[0]\":{}", x + 50));
+        report = mon::ReplayRecording(tampered);
+        CHECK(report.n_mismatches == 1);
+        REQUIRE(report.diffs.size() == 1);
+        CHECK(report.diffs[0].expected == it->msg);
+        report = mon::ReplayRecording(tampered, {.tolerance = 100});
+        CHECK(report.n_mismatches == 0);
+    }
+
+    SECTION("Serving a recorded session")
+    {
+        sp.replay = &*recording;
+        mon::SptIpcStandIn standin{sp};
+        REQUIRE(standin.IsListening());
+        SptIpcConn conn{standin.Port()};
+        VerifyChainsOverIpc(conn, 50, std::chrono::milliseconds{0});
+        mon::SptIpcStandInStats stats = standin.Stats();
+        CHECK(stats.n_replayed == 1 + 50 * 3);
+        CHECK(stats.n_replay_mismatches == 0);
+    }
+
+    SECTION("Pipelined verification")
+    {
+        mon::SptIpcStandIn standin{sp};
+        REQUIRE(standin.IsListening());
+        mon::SptIpcVerifyStats stats = VerifyChainsPipelined(standin.Port(), 200, {.settle_frames = 0});
+        CHECK(stats.max_groups_in_flight == 8);
+        CHECK(stats.n_retries == 0);
+        stats = VerifyChainsPipelined(standin.Port(), 50, {.max_groups_in_flight = 4, .settle_frames = 1});
+        CHECK(stats.max_groups_in_flight <= 2);
+        CHECK(stats.n_retries == 0);
+        CHECK(standin.Stats().n_client_msgs == 2 + (200 + 50) * 3);
+    }
+
+    SECTION("Positions from before the teleport are queried again")
+    {
+        // frames end whenever the stand-in runs out of messages, retries wait for their frames to end
+        mon::SptIpcStandInParams slow_sp = sp;
+        slow_sp.engine.cmds_per_frame = 0;
+        mon::SptIpcStandIn standin{slow_sp};
+        REQUIRE(standin.IsListening());
+        mon::SptIpcClient client{standin.Port()};
+        small_prng rng;
+        IpcChainCheck check = NextIpcChainCheck(rng, true);
+        // the player in front of the portal doesn't teleport, that's a result and not a retry
+        mon::Entity in_front = mon::Entity::CreatePlayerFromCenter(check.pp.blue.pos + check.pp.blue.f, true);
+        std::vector<mon::SptIpcVerifyGroup> groups{
+            {.setup_cmd = check.SetupCmd(false), .boundary = in_front},
+            {.setup_cmd = check.SetupCmd(false), .boundary = check.boundary},
+        };
+        std::map<size_t, mon::Vector> results;
+        mon::SptIpcVerifyStats stats;
+        bool ok = mon::VerifyOverIpc(
+            client,
+            groups,
+            {.settle_frames = 0, .max_retries = 1},
+            [&](size_t i, const mon::Vector& origin) { results.emplace(i, origin); },
+            &stats);
+        INFO(client.Error());
+        REQUIRE(ok);
+        REQUIRE(results.size() == 2);
+        CHECK(results[0].DistToSqr(in_front.player.origin) < .01f);
+        CHECK(results[1].DistToSqr(check.expected_origin) < 100 * 100);
+        CHECK(stats.n_groups == 2);
+        CHECK(stats.n_retries <= 2);
+    }
+
+    SECTION("Groups that never get past the teleport tick fail the run")
+    {
+        // the setup, the boundary setpos, and the query all run in the same frame
+        mon::SptIpcStandInParams slow_sp = sp;
+        slow_sp.engine.cmds_per_frame = 3;
+        mon::SptIpcStandIn standin{slow_sp};
+        REQUIRE(standin.IsListening());
+        mon::SptIpcClient client{standin.Port()};
+        small_prng rng;
+        IpcChainCheck check = NextIpcChainCheck(rng, true);
+        std::vector<mon::SptIpcVerifyGroup> groups{{.setup_cmd = check.SetupCmd(false), .boundary = check.boundary}};
+        int n_results = 0;
+        bool ok = mon::VerifyOverIpc(
+            client,
+            groups,
+            {.settle_frames = 0, .max_retries = 0},
+            [&](size_t, const mon::Vector&) { n_results++; });
+        REQUIRE_FALSE(ok);
+        CHECK(n_results == 0);
+        CHECK(client.Error().find("never got past the teleport tick") != std::string::npos);
+    }
+
+    SECTION("Recording through a proxy")
+    {
+        mon::SptIpcStandIn game{sp};
+        REQUIRE(game.IsListening());
+        mon::SptIpcStandInParams proxy_params{.port = 0, .upstream_port = game.Port()};
+        mon::SptIpcStandIn proxy{proxy_params};
+        REQUIRE(proxy.IsListening());
+        {
+            SptIpcConn conn{proxy.Port()};
+            VerifyChainsOverIpc(conn, 10, std::chrono::milliseconds{0});
         }
-        printf("iteration %d: %s", iteration, result.cum_teleports == -1 ? "VAG\n" : "Normal teleport\n");
-        iteration++;
+        mon::SptIpcRecording proxied = proxy.Recording();
+        REQUIRE(proxied.msgs.size() == (1 + 10 * 3) * 2 + 1 + 10);
+        for (size_t i = 0; i < proxied.msgs.size(); i++)
+            REQUIRE(proxied.msgs[i].msg == recording->msgs[i].msg);
     }
 }
 
@@ -1,33 +1,36 @@
 #pragma once
 
 #include "game/source_math.hpp"
+#include "game/source_math_double.hpp"
+#include "teleport_chain/generate.hpp"
 #include "prng.hpp"
+#include "box_region.hpp"
+#include "portal_placement.hpp"
+#include "low_discrepancy.hpp"
+#include "ctpl_stl.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <future>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string.h>
+#include <string>
+#include <thread>
 #include <vector>
 #include <optional>
 
 namespace mon {
 
-struct AABB {
-    Vector mins, maxs;
-
-    AABB() {}
-    AABB(const Vector& p1, const Vector& p2)
-        : mins{fminf(p1[0], p2[0]), fminf(p1[1], p2[1]), fminf(p1[2], p2[2])},
-          maxs{fmaxf(p1[0], p2[0]), fmaxf(p1[1], p2[1]), fmaxf(p1[2], p2[2])}
-    {}
-
-    bool VectorInBox(const Vector& pt) const
-    {
-        return pt.x > mins.x && pt.y > mins.y && pt.z > mins.z && pt.x < maxs.x && pt.y < maxs.y && pt.z < maxs.z;
-    }
-
-    Vector RandomPtInBox(small_prng& rng) const
-    {
-        return {rng.next_float(mins[0], maxs[0]), rng.next_float(mins[1], maxs[1]), rng.next_float(mins[2], maxs[2])};
-    }
-};
-
 enum SearchPortalType {
     SPT_WALL_XP,
     SPT_WALL_XN,
@@ -35,22 +38,46 @@ enum SearchPortalType {
     SPT_WALL_YN,
     SPT_WALL_ZP,
     SPT_WALL_ZN,
+    // any plane given by SearchPortal::plane_normal, see PortalPlacement
+    SPT_PLANE,
 };
 
 struct SearchPortal {
     std::vector<float> lock_opts;
     SearchPortalType type;
-    std::vector<AABB> pos_spaces;
+    // position spaces are picked weighted by their area (ignoring the locked axis)
+    BoxRegion pos_spaces;
 
     // if the portal is fixed in place
     bool locked;
     Vector locked_pos;
     QAngle locked_ang;
 
+    /*
+    * SPT_PLANE only, the unit normal of the surface. The lock options are then the distances of
+    * the surface planes (dot(plane_normal, pt) == dist) instead of a coordinate, and the portal is
+    * placed on the plane like the game would (including the PORTAL_SURFACE_OFFSET). The locked
+    * axis is the normal's largest component. Position spaces are sampled along the other two axes
+    * and the point is moved along the locked axis onto the plane, so a box covers the part of the
+    * plane that's in front of or behind it.
+    */
+    Vector plane_normal{0, 0, 1};
+
     Portal Generate(small_prng& rng, GameVersion gv) const
     {
         if (locked)
             return Portal{locked_pos, locked_ang, gv};
+        if (type == SPT_PLANE) {
+            float yaw = rng.next_float(-180.f, 180.f);
+            float dist = rng.next_elem(lock_opts);
+            int lock_axis = LockAxis();
+            const AABB& pos_space = pos_spaces[pos_spaces.SampleIndex(rng, lock_axis)];
+            Vector pos{0.f};
+            for (int i = 0; i < 3; i++)
+                if (i != lock_axis)
+                    pos[i] = rng.next_float(pos_space.mins[i], pos_space.maxs[i]);
+            return PlaceOnPlane(dist, pos, yaw, gv);
+        }
         QAngle ang;
         int lock_axis;
         switch (type) {
@@ -83,7 +110,7 @@ struct SearchPortal {
                 MON_ASSERT(0);
         }
         float lock_ax_val = rng.next_elem(lock_opts);
-        const AABB& pos_space = rng.next_elem(pos_spaces);
+        const AABB& pos_space = pos_spaces[pos_spaces.SampleIndex(rng, lock_axis)];
         Vector pos{
             lock_axis == 0 ? lock_ax_val : rng.next_float(pos_space.mins[0], pos_space.maxs[0]),
             lock_axis == 1 ? lock_ax_val : rng.next_float(pos_space.mins[1], pos_space.maxs[1]),
@@ -91,6 +118,157 @@ struct SearchPortal {
         };
         return Portal{pos, ang, gv};
     }
+
+    // the number of unit cube dimensions used by FromUnit
+    static constexpr int N_UNIT_DIMS = 4;
+
+    /*
+    * The same distribution as Generate, but driven by a point in the unit cube instead of a prng
+    * so that the search can use low discrepancy samples. The first coordinate picks the lock
+    * option & position space, then two for the free position axes, and the last for the yaw.
+    */
+    Portal FromUnit(const float* unit, GameVersion gv) const
+    {
+        if (locked)
+            return FromUnit(unit, 0, gv);
+        // the high part of unit[0] picks the lock option, the rest picks the position space
+        uint64_t x = (uint64_t)(unit[0] * 0x1p32) * lock_opts.size();
+        size_t lock_idx = (size_t)(x >> 32);
+        size_t space_idx = pos_spaces.SampleIndex((uint32_t)x, LockAxis());
+        return FromUnit(unit, lock_idx + space_idx * lock_opts.size(), gv);
+    }
+
+    // the number of lock option & position space combinations, these are the discrete dimensions of FromUnit
+    size_t NumDiscrete() const
+    {
+        return locked ? 1 : lock_opts.size() * pos_spaces.size();
+    }
+
+    /*
+    * Same as above, but the lock option & position space are given by an index in
+    * [0, NumDiscrete()) and unit[0] is unused.
+    */
+    Portal FromUnit(const float* unit, size_t discrete, GameVersion gv) const
+    {
+        if (locked)
+            return Portal{locked_pos, locked_ang, gv};
+        MON_ASSERT(discrete < NumDiscrete());
+        int lock_axis = LockAxis();
+        QAngle ang;
+        switch (type) {
+            case SPT_WALL_XP:
+                ang = {-0.f, 0.f, 0.f};
+                break;
+            case SPT_WALL_XN:
+                ang = {-0.f, 180.f, 0.f};
+                break;
+            case SPT_WALL_YP:
+                ang = {-0.f, 90.f, 0.f};
+                break;
+            case SPT_WALL_YN:
+                ang = {-0.f, -90.f, 0.f};
+                break;
+            case SPT_WALL_ZP:
+                ang = {-90.f, -180.f + 360.f * unit[3], 0.f};
+                break;
+            case SPT_WALL_ZN:
+                ang = {90.f, -180.f + 360.f * unit[3], 0.f};
+                break;
+            case SPT_PLANE:
+                break;
+            default:
+                MON_ASSERT(0);
+        }
+        float lock_ax_val = lock_opts[discrete % lock_opts.size()];
+        const AABB& pos_space = pos_spaces[discrete / lock_opts.size()];
+        float box_unit[3];
+        for (int i = 0, j = 1; i < 3; i++)
+            box_unit[i] = i == lock_axis ? 0.f : unit[j++];
+        Vector pos = pos_space.PtInBox(box_unit);
+        if (type == SPT_PLANE)
+            return PlaceOnPlane(lock_ax_val, pos, -180.f + 360.f * unit[3], gv);
+        pos[lock_axis] = lock_ax_val;
+        return Portal{pos, ang, gv};
+    }
+
+    /*
+    * SPT_PLANE: moves pt along the locked axis onto the plane with the given distance & places the
+    * portal there, the yaw is only used if the plane is level.
+    */
+    Portal PlaceOnPlane(float dist, Vector pt, float level_yaw, GameVersion gv) const
+    {
+        int axis = LockAxis();
+        pt[axis] = 0.f;
+        pt[axis] = (dist - plane_normal.Dot(pt)) / plane_normal[axis];
+        return PortalPlacement{plane_normal, dist}.Place(pt, gv, level_yaw);
+    }
+
+    // the world axis that the portal position is locked to (from lock_opts)
+    int LockAxis() const
+    {
+        switch (type) {
+            case SPT_WALL_XP:
+            case SPT_WALL_XN:
+                return 0;
+            case SPT_WALL_YP:
+            case SPT_WALL_YN:
+                return 1;
+            case SPT_WALL_ZP:
+            case SPT_WALL_ZN:
+                return 2;
+            case SPT_PLANE: {
+                Vector n{fabsf(plane_normal.x), fabsf(plane_normal.y), fabsf(plane_normal.z)};
+                return n.x >= n.y && n.x >= n.z ? 0 : (n.y >= n.z ? 1 : 2);
+            }
+            default:
+                MON_ASSERT(0);
+                return -1;
+        }
+    }
+
+    /*
+    * A random portal near an existing one that could have come from Generate(), i.e. the locked
+    * axis is kept and the position stays in the same pos_space. Only floor & ceiling portals have
+    * a free yaw (including level SPT_PLANE surfaces).
+    */
+    Portal Perturb(const Portal& p, small_prng& rng, float pos_step, float ang_step, GameVersion gv) const
+    {
+        if (locked)
+            return p;
+        int lock_axis = LockAxis();
+        const AABB* space = nullptr;
+        for (const AABB& box : pos_spaces) {
+            bool inside = true;
+            for (int i = 0; i < 3; i++)
+                inside &= i == lock_axis || (p.pos[i] >= box.mins[i] && p.pos[i] <= box.maxs[i]);
+            if (inside) {
+                space = &box;
+                break;
+            }
+        }
+        Vector pos = p.pos;
+        for (int i = 0; i < 3; i++) {
+            if (i == lock_axis)
+                continue;
+            pos[i] += rng.next_float(-pos_step, pos_step);
+            if (space)
+                pos[i] = std::clamp(pos[i], space->mins[i], space->maxs[i]);
+        }
+        QAngle ang = p.ang;
+        bool free_yaw = type == SPT_WALL_ZP || type == SPT_WALL_ZN;
+        free_yaw |= type == SPT_PLANE && PortalPlacement{plane_normal, 0}.level;
+        if (free_yaw)
+            ang.y = std::remainder(ang.y + rng.next_float(-ang_step, ang_step), 360.f);
+        if (type == SPT_PLANE) {
+            // snap to the closest plane from lock_opts so that the error from placing doesn't build up
+            float dist = plane_normal.Dot(p.pos) - PORTAL_SURFACE_OFFSET;
+            float lock_ax_val = *std::min_element(lock_opts.begin(), lock_opts.end(), [dist](float a, float b) {
+                return fabsf(a - dist) < fabsf(b - dist);
+            });
+            return PlaceOnPlane(lock_ax_val, pos, ang.y, gv);
+        }
+        return Portal{pos, ang, gv};
+    }
 };
 
 enum SearchEntryPosFlags {
@@ -120,10 +298,530 @@ struct SearchResult {
     }
 };
 
+// a hit with some measures of how robust it is, used to rank hits
+struct RankedVagHit {
+    SearchResult hit;
+    // the fraction of the sampled entry points on the entry portal that are also hits
+    float face_vag_fraction;
+    // distance from the landing point to the nearest face of the target space
+    float target_margin;
+
+    // better hits compare greater
+    bool operator<(const RankedVagHit& o) const
+    {
+        if (face_vag_fraction != o.face_vag_fraction)
+            return face_vag_fraction < o.face_vag_fraction;
+        return target_margin < o.target_margin;
+    }
+};
+
+struct VagCollectParams {
+    // keep at most this many hits, 0 keeps all of them
+    size_t max_hits = 100;
+    // hits are scored by sampling an n*n grid of entry points on the entry portal, 0 disables this
+    int face_samples_per_side = 8;
+    // hits with the same placement order and portals within this distance/angle are the same, the earliest one is kept
+    float dedup_dist = 1.f;
+    float dedup_ang = 1.f;
+};
+
+/*
+* A bounded collection of the best hits. Near-identical placements are merged by quantizing the
+* portal positions & angles, so two hits on opposite sides of a quantization cell boundary won't be
+* merged. The hit from the earliest iteration represents its cell, so later hits in an occupied
+* cell don't have to be ranked (see Holds). Not thread safe, each worker should have its own and
+* they can be merged afterwards.
+*/
+class VagHitTopK {
+    using Key = std::array<int32_t, 13>;
+
+    struct Entry {
+        RankedVagHit hit;
+        Key key;
+    };
+
+    // worst first, ties go to the later iteration (and then the key) so that no two entries compare equal
+    struct WorseCmp {
+        bool operator()(const Entry& a, const Entry& b) const
+        {
+            if (a.hit < b.hit || b.hit < a.hit)
+                return a.hit < b.hit;
+            if (a.hit.hit.n_iterations != b.hit.hit.n_iterations)
+                return a.hit.hit.n_iterations > b.hit.hit.n_iterations;
+            return a.key < b.key;
+        }
+    };
+
+    using Ranked = std::set<Entry, WorseCmp>;
+
+    VagCollectParams cp;
+    Ranked ranked;
+    // the same hits looked up by their quantized placement, so a push doesn't have to scan for duplicates
+    std::map<Key, Ranked::iterator> by_key;
+
+    Key MakeKey(const PortalPair& pp) const
+    {
+        auto q = [](float v, float cell) { return (int32_t)std::floor(v / cell); };
+        Key key;
+        int i = 0;
+        key[i++] = (int32_t)pp.order;
+        for (const Portal* p : {&pp.blue, &pp.orange}) {
+            for (int j = 0; j < 3; j++)
+                key[i++] = q(p->pos[j], cp.dedup_dist);
+            for (int j = 0; j < 3; j++)
+                key[i++] = q((&p->ang.x)[j], cp.dedup_ang);
+        }
+        return key;
+    }
+
+public:
+    explicit VagHitTopK(const VagCollectParams& cp) : cp{cp} {}
+
+    // the worst hit that would currently be accepted, or nullptr if there's still room
+    const RankedVagHit* Threshold() const
+    {
+        return cp.max_hits && ranked.size() >= cp.max_hits ? &ranked.begin()->hit : nullptr;
+    }
+
+    // true if a hit from the same or an earlier iteration holds this hit's cell, Push would drop it
+    bool Holds(const SearchResult& hit) const
+    {
+        auto key_it = by_key.find(MakeKey(hit.pp));
+        return key_it != by_key.end() && key_it->second->hit.hit.n_iterations <= hit.n_iterations;
+    }
+
+    // returns true if the hit was kept
+    bool Push(RankedVagHit&& hit)
+    {
+        Key key = MakeKey(hit.hit.pp);
+        Entry entry{std::move(hit), key};
+        auto key_it = by_key.find(key);
+        if (key_it != by_key.end()) {
+            // same placement, keep the earlier iteration
+            if (key_it->second->hit.hit.n_iterations <= entry.hit.hit.n_iterations)
+                return false;
+            ranked.erase(key_it->second);
+            key_it->second = ranked.insert(std::move(entry)).first;
+            return true;
+        }
+        if (Threshold()) {
+            if (!(ranked.begin()->hit < entry.hit))
+                return false;
+            by_key.erase(ranked.begin()->key);
+            ranked.erase(ranked.begin());
+        }
+        by_key.emplace(key, ranked.insert(std::move(entry)).first);
+        return true;
+    }
+
+    void Merge(VagHitTopK&& o)
+    {
+        while (!o.ranked.empty())
+            Push(std::move(o.ranked.extract(o.ranked.begin()).value().hit));
+        o.by_key.clear();
+    }
+
+    size_t Size() const
+    {
+        return ranked.size();
+    }
+
+    // best first, ties are broken by the iteration so that the order is deterministic
+    std::vector<RankedVagHit> TakeSorted()
+    {
+        std::vector<RankedVagHit> out;
+        out.reserve(ranked.size());
+        while (!ranked.empty())
+            out.push_back(std::move(ranked.extract(std::prev(ranked.end())).value().hit));
+        by_key.clear();
+        return out;
+    }
+};
+
+struct VagRefineParams {
+    // the maximum number of rounds, each round evaluates a batch of candidates around the current best
+    int n_rounds = 40;
+    int batch_size = 32;
+    // the initial maximum perturbation of the portal positions, yaws, and entry point
+    float pos_step = 2.f;
+    float ang_step = 2.f;
+    float entry_step = 4.f;
+    // the steps grow after a round that improved and shrink otherwise, stop once they get this small
+    float min_step_scale = 1 / 256.f;
+    // for scoring, see VagCollectParams
+    int face_samples_per_side = 8;
+    int n_threads = 0;
+};
+
+// how many candidates were rejected at each stage of a search
+struct SearchStats {
+    // portal pairs, with an entry scan each pair has several candidates (entry points)
+    uint64_t n_pairs = 0;
+    // candidates that were either rejected by the prefilter or ran a chain
+    uint64_t n_candidates = 0;
+    // rejected by the double precision landing point check, these never ran a chain
+    uint64_t n_prefilter_rejected = 0;
+    uint64_t n_chains = 0;
+    // the chain was not a VAG, either because it hit the teleport limit or had the wrong cum teleports
+    uint64_t n_not_vag = 0;
+    uint64_t n_max_tps_exceeded = 0;
+    // the chain was a VAG but didn't land in the target space
+    uint64_t n_missed_target = 0;
+    uint64_t n_hits = 0;
+    // the sum of total_n_teleports over all chains
+    uint64_t n_teleports = 0;
+    // chains run to score hits (see RankHit), these aren't candidates and aren't included above
+    uint64_t n_rank_chains = 0;
+    // wall time spent by all threads generating candidates (mostly portal construction) & running chains
+    uint64_t gen_ns = 0;
+    uint64_t chain_ns = 0;
+
+    SearchStats& operator+=(const SearchStats& o)
+    {
+        n_pairs += o.n_pairs;
+        n_candidates += o.n_candidates;
+        n_prefilter_rejected += o.n_prefilter_rejected;
+        n_chains += o.n_chains;
+        n_not_vag += o.n_not_vag;
+        n_max_tps_exceeded += o.n_max_tps_exceeded;
+        n_missed_target += o.n_missed_target;
+        n_hits += o.n_hits;
+        n_teleports += o.n_teleports;
+        n_rank_chains += o.n_rank_chains;
+        gen_ns += o.gen_ns;
+        chain_ns += o.chain_ns;
+        return *this;
+    }
+
+    SearchStats operator-(const SearchStats& o) const
+    {
+        return {
+            .n_pairs = n_pairs - o.n_pairs,
+            .n_candidates = n_candidates - o.n_candidates,
+            .n_prefilter_rejected = n_prefilter_rejected - o.n_prefilter_rejected,
+            .n_chains = n_chains - o.n_chains,
+            .n_not_vag = n_not_vag - o.n_not_vag,
+            .n_max_tps_exceeded = n_max_tps_exceeded - o.n_max_tps_exceeded,
+            .n_missed_target = n_missed_target - o.n_missed_target,
+            .n_hits = n_hits - o.n_hits,
+            .n_teleports = n_teleports - o.n_teleports,
+            .n_rank_chains = n_rank_chains - o.n_rank_chains,
+            .gen_ns = gen_ns - o.gen_ns,
+            .chain_ns = chain_ns - o.chain_ns,
+        };
+    }
+
+    void print() const
+    {
+        printf("%llu pairs, %llu candidates: %llu rejected by prefilter, %llu chains, %llu not VAG, "
+               "%llu missed target, %llu hits\n",
+               (unsigned long long)n_pairs,
+               (unsigned long long)n_candidates,
+               (unsigned long long)n_prefilter_rejected,
+               (unsigned long long)n_chains,
+               (unsigned long long)n_not_vag,
+               (unsigned long long)n_missed_target,
+               (unsigned long long)n_hits);
+        printf("%llu exceeded the teleport limit, %llu teleports, %llu chains ranking hits, %.2fs generating "
+               "candidates, %.2fs in chains\n",
+               (unsigned long long)n_max_tps_exceeded,
+               (unsigned long long)n_teleports,
+               (unsigned long long)n_rank_chains,
+               gen_ns * 1e-9,
+               chain_ns * 1e-9);
+    }
+};
+
+static_assert(sizeof(SearchStats) == 12 * sizeof(uint64_t));
+
+struct SearchProgressParams {
+    std::chrono::milliseconds interval{std::chrono::seconds{5}};
+    // human readable progress lines, can be null
+    FILE* text_out = stderr;
+    // one JSON object per line (see SearchProgressReporter), can be null
+    std::ostream* jsonl_out = nullptr;
+    // included in the output to tell searches apart
+    std::string label;
+};
+
+/*
+* Collects the stats of finished blocks and periodically reports the progress & rates of a search.
+* The JSONL records have: label, elapsed_s, done, iterations, n_iterations, iterations_per_s,
+* chains_per_s, teleports_per_s, the SearchStats counters, gen_s, and chain_s. Rates are for
+* this run only, the counters include the stats from a resumed checkpoint. Does nothing if
+* params is null.
+*/
+class SearchProgressReporter {
+    const SearchProgressParams* params;
+    int n_iterations;
+    std::mutex mtx;
+    SearchStats start_stats, total;
+    std::chrono::steady_clock::time_point start, last_report;
+
+    void Report(bool done)
+    {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        SearchStats run = total - start_stats;
+        double inv_t = elapsed > 0 ? 1. / elapsed : 0.;
+        if (params->text_out) {
+            fprintf(params->text_out,
+                    "%s%s%5.1f%% %.0f it/s, %.0f chains/s, %.0f tps/s, %llu hits (%.0f%% of thread time in chains)\n",
+                    params->label.c_str(),
+                    params->label.empty() ? "" : ": ",
+                    n_iterations ? 100. * total.n_pairs / n_iterations : 100.,
+                    run.n_pairs * inv_t,
+                    run.n_chains * inv_t,
+                    run.n_teleports * inv_t,
+                    (unsigned long long)total.n_hits,
+                    run.gen_ns + run.chain_ns ? 100. * run.chain_ns / (run.gen_ns + run.chain_ns) : 0.);
+            fflush(params->text_out);
+        }
+        if (params->jsonl_out) {
+            std::string label;
+            for (char c : params->label)
+                if (c != '"' && c != '\\' && (unsigned char)c >= 0x20)
+                    label += c;
+            *params->jsonl_out << std::format(
+                "{{\"label\":\"{}\",\"elapsed_s\":{:.3f},\"done\":{},\"iterations\":{},\"n_iterations\":{},"
+                "\"iterations_per_s\":{:.1f},\"chains_per_s\":{:.1f},\"teleports_per_s\":{:.1f},"
+                "\"candidates\":{},\"prefilter_rejected\":{},\"chains\":{},\"not_vag\":{},"
+                "\"max_tps_exceeded\":{},\"missed_target\":{},\"hits\":{},\"teleports\":{},\"rank_chains\":{},"
+                "\"gen_s\":{:.3f},\"chain_s\":{:.3f}}}\n",
+                label,
+                elapsed,
+                done,
+                total.n_pairs,
+                n_iterations,
+                run.n_pairs * inv_t,
+                run.n_chains * inv_t,
+                run.n_teleports * inv_t,
+                total.n_candidates,
+                total.n_prefilter_rejected,
+                total.n_chains,
+                total.n_not_vag,
+                total.n_max_tps_exceeded,
+                total.n_missed_target,
+                total.n_hits,
+                total.n_teleports,
+                total.n_rank_chains,
+                total.gen_ns * 1e-9,
+                total.chain_ns * 1e-9);
+            params->jsonl_out->flush();
+        }
+    }
+
+public:
+    SearchProgressReporter(const SearchProgressParams* params, int n_iterations, const SearchStats& start_stats)
+        : params{params},
+          n_iterations{n_iterations},
+          start_stats{start_stats},
+          total{start_stats},
+          start{std::chrono::steady_clock::now()},
+          last_report{start}
+    {}
+
+    void BlockDone(const SearchStats& block_stats)
+    {
+        if (!params)
+            return;
+        std::lock_guard lock{mtx};
+        total += block_stats;
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_report >= params->interval) {
+            Report(false);
+            last_report = now;
+        }
+    }
+
+    void Finish()
+    {
+        if (!params)
+            return;
+        std::lock_guard lock{mtx};
+        Report(true);
+    }
+};
+
+struct SearchCheckpointParams {
+    std::filesystem::path path;
+    // the checkpoint is written when a block finishes and at least this long has passed since the last write
+    std::chrono::milliseconds interval{std::chrono::seconds{60}};
+    /*
+    * Mixed into the key that's stored in the checkpoint, a checkpoint with a different key is
+    * ignored. The seed/first index & iteration count are already part of the key, this should
+    * identify everything else about the search (e.g. the search space).
+    */
+    uint64_t user_key = 0;
+};
+
+// which search wrote a checkpoint, a find search stops at the first hit & a collect search keeps going
+enum SearchCheckpointKind : uint32_t {
+    SCK_FIND,
+    SCK_COLLECT,
+};
+
+/*
+* On-disk layout of a search checkpoint (all little endian):
+* - SearchCheckpointFileHeader
+* - int32_t hit_iterations[n_hits]
+*/
+struct SearchCheckpointFileHeader {
+    static constexpr char MAGIC[4] = {'M', 'S', 'C', 'P'};
+    static constexpr uint32_t VERSION = 5;
+
+    char magic[4];
+    uint32_t version;
+    uint64_t search_key;
+    int32_t n_iterations;
+    int32_t next_block;
+    SearchStats stats;
+    uint32_t n_hits;
+    SearchCheckpointKind kind;
+};
+static_assert(sizeof(SearchCheckpointFileHeader) == 128);
+
+/*
+* The state of a parallel search. Every candidate is derived from the seed & iteration index (see
+* SearchSpace::PARALLEL_BLOCK_SIZE) so there's no prng state to save, only which blocks are done.
+* Blocks can finish out of order, the checkpoint only includes the blocks before the first
+* unfinished one. Hits are saved by iteration and are evaluated again when resuming.
+*/
+struct SearchCheckpoint {
+    uint64_t search_key = 0;
+    SearchCheckpointKind kind = SCK_FIND;
+    int n_iterations = 0;
+    // every block before this one has been searched
+    int next_block = 0;
+    SearchStats stats;
+    std::vector<int> hit_iterations;
+
+    // writes to a temporary file first and renames it, so a crash never leaves a partial checkpoint
+    bool Save(const std::filesystem::path& path) const
+    {
+        SearchCheckpointFileHeader hdr{};
+        memcpy(hdr.magic, SearchCheckpointFileHeader::MAGIC, sizeof hdr.magic);
+        hdr.version = SearchCheckpointFileHeader::VERSION;
+        hdr.search_key = search_key;
+        hdr.n_iterations = n_iterations;
+        hdr.next_block = next_block;
+        hdr.stats = stats;
+        hdr.n_hits = (uint32_t)hit_iterations.size();
+        hdr.kind = kind;
+        if (!path.parent_path().empty())
+            std::filesystem::create_directories(path.parent_path());
+        /*
+        * The temporary file name is unique per process, two processes can end up writing the same
+        * checkpoint if a shard was handed out twice (see shard_queue.hpp).
+        */
+        static const uint32_t tmp_tag = std::random_device{}();
+        std::filesystem::path tmp_path = path;
+        tmp_path += "." + std::to_string(tmp_tag) + ".tmp";
+        {
+            std::ofstream file{tmp_path, std::ios::binary | std::ios::trunc};
+            file.write((const char*)&hdr, sizeof hdr);
+            file.write((const char*)hit_iterations.data(), hit_iterations.size() * sizeof(int32_t));
+            if (!file.flush())
+                return false;
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmp_path, path, ec);
+        return !ec;
+    }
+
+    static std::optional<SearchCheckpoint> Load(const std::filesystem::path& path)
+    {
+        std::ifstream file{path, std::ios::binary};
+        SearchCheckpointFileHeader hdr;
+        if (!file.read((char*)&hdr, sizeof hdr) || memcmp(hdr.magic, SearchCheckpointFileHeader::MAGIC, 4) ||
+            hdr.version != SearchCheckpointFileHeader::VERSION || hdr.n_iterations < 0 || hdr.next_block < 0 ||
+            hdr.kind > SCK_COLLECT)
+            return {};
+        SearchCheckpoint ckpt{
+            .search_key = hdr.search_key,
+            .kind = hdr.kind,
+            .n_iterations = hdr.n_iterations,
+            .next_block = hdr.next_block,
+            .stats = hdr.stats,
+        };
+        ckpt.hit_iterations.resize(hdr.n_hits);
+        if (!file.read((char*)ckpt.hit_iterations.data(), ckpt.hit_iterations.size() * sizeof(int32_t)))
+            return {};
+        for (int it : ckpt.hit_iterations)
+            if (it < 0 || it >= ckpt.n_iterations)
+                return {};
+        return ckpt;
+    }
+};
+
+/*
+* Collects finished blocks from the search threads and writes a checkpoint every so often. Does
+* nothing if params is null.
+*/
+class SearchCheckpointTracker {
+    struct FinishedBlock {
+        SearchStats stats;
+        std::vector<int> hit_iterations;
+    };
+
+    const SearchCheckpointParams* params;
+    std::mutex mtx;
+    SearchCheckpoint ckpt;
+    // blocks that finished while an earlier block was still running
+    std::map<int, FinishedBlock> pending;
+    std::chrono::steady_clock::time_point last_save;
+
+public:
+    SearchCheckpointTracker(const SearchCheckpointParams* params, SearchCheckpoint start)
+        : params{params}, ckpt{std::move(start)}, last_save{std::chrono::steady_clock::now()}
+    {}
+
+    void BlockDone(int block, const SearchStats& stats, std::vector<int>& hit_iterations)
+    {
+        if (!params)
+            return;
+        std::lock_guard lock{mtx};
+        pending.emplace(block, FinishedBlock{stats, std::move(hit_iterations)});
+        hit_iterations.clear();
+        for (auto it = pending.begin(); it != pending.end() && it->first == ckpt.next_block;) {
+            ckpt.stats += it->second.stats;
+            ckpt.hit_iterations.insert(ckpt.hit_iterations.end(),
+                                       it->second.hit_iterations.begin(),
+                                       it->second.hit_iterations.end());
+            ckpt.next_block++;
+            it = pending.erase(it);
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_save >= params->interval) {
+            ckpt.Save(params->path);
+            last_save = now;
+        }
+    }
+
+    // call once the search is finished
+    void Finish(int n_blocks)
+    {
+        if (!params)
+            return;
+        std::lock_guard lock{mtx};
+        /*
+        * If the search stopped early at a hit, the blocks after it were skipped. They can be
+        * considered done since a resumed search would skip them too.
+        */
+        for (auto& [block, fb] : pending) {
+            ckpt.stats += fb.stats;
+            ckpt.hit_iterations.insert(ckpt.hit_iterations.end(), fb.hit_iterations.begin(), fb.hit_iterations.end());
+        }
+        pending.clear();
+        std::sort(ckpt.hit_iterations.begin(), ckpt.hit_iterations.end());
+        ckpt.next_block = n_blocks;
+        ckpt.Save(params->path);
+    }
+};
+
 struct SearchSpace {
     SearchPortal blue_search;
     SearchPortal orange_search;
-    AABB target_space;
+    BoxRegion target_space;
     SearchEntryPosFlags entry_pos_search;
     std::vector<PlacementOrder> valid_placement_orders;
     bool tp_from_blue;
@@ -132,32 +830,248 @@ struct SearchSpace {
 
     TeleportChainParams params; // initialized here, NOTE: pp will point to garbag
 
+    /*
+    * Before running the chain, the parallel searches predict where a simple VAG (entry, exit, exit)
+    * would land using double precision math and skip candidates where that point is further than
+    * this from the target space. Set to a negative value to disable the prefilter.
+    */
+    float prefilter_margin = 1.f;
+
+    /*
+    * If greater than 1, the parallel searches test each portal pair with an n*n stratified grid of
+    * entry points instead of the single generated one and stop at the first hit. The generated
+    * point is tested first and sets the offset within every cell of the grid. Pairs that only VAG
+    * on a small part of the entry face are much more likely to be found this way.
+    */
+    int entry_scan_per_side = 1;
+    static constexpr int MAX_ENTRY_SCAN_PER_SIDE = 8;
+
+    // generates a random placement & entity, params.pp must be pointed at the placement before generating a chain
+    SearchResult GenerateCandidate(small_prng& rng, int iteration, TeleportChainParams& params_out) const
+    {
+        SearchResult st{
+            .n_iterations = iteration,
+            .pp{
+                blue_search.Generate(rng, gv),
+                orange_search.Generate(rng, gv),
+                rng.next_elem(valid_placement_orders),
+            },
+        };
+
+        const Portal& p = tp_from_blue ? st.pp.blue : st.pp.orange;
+        MON_ASSERT((entry_pos_search & SEPF_ANY) != 0);
+        float rm = rng.next_float((entry_pos_search & SEPF_RN) ? -PORTAL_HALF_WIDTH : 0,
+                                  (entry_pos_search & SEPF_RP) ? PORTAL_HALF_WIDTH : 0);
+        float um = rng.next_float((entry_pos_search & SEPF_UN) ? -PORTAL_HALF_HEIGHT : 0,
+                                  (entry_pos_search & SEPF_UP) ? PORTAL_HALF_HEIGHT : 0);
+        Vector ent_pos = p.pos + (p.r * rm + p.u * um) * .5f;
+
+        params_out.ent = tp_player ? Entity::CreatePlayerFromCenter(ent_pos, true) : Entity::CreateBall(ent_pos, 1.f);
+        params_out.n_max_teleports = 3;
+        params_out.first_tp_from_blue = tp_from_blue;
+        return st;
+    }
+
+    // blue, orange, placement order, entry point r & u
+    static constexpr int N_UNIT_DIMS = SearchPortal::N_UNIT_DIMS * 2 + 3;
+
+    // same as above, but uses a point in the unit cube (with N_UNIT_DIMS dimensions) instead of a prng
+    SearchResult GenerateCandidate(const float* unit, int iteration, TeleportChainParams& params_out) const
+    {
+        size_t n_orders = valid_placement_orders.size();
+        const float* order_unit = unit + SearchPortal::N_UNIT_DIMS * 2;
+        SearchResult st{
+            .n_iterations = iteration,
+            .pp{
+                blue_search.FromUnit(unit, gv),
+                orange_search.FromUnit(unit + SearchPortal::N_UNIT_DIMS, gv),
+                valid_placement_orders[std::min((size_t)(order_unit[0] * n_orders), n_orders - 1)],
+            },
+        };
+
+        SetEntryFromUnit(st.pp, order_unit + 1, params_out);
+        return st;
+    }
+
+    // puts the entity at the point on the entry portal given by unit[0] (r) & unit[1] (u)
+    void SetEntryFromUnit(const PortalPair& pp, const float* unit, TeleportChainParams& params_out) const
+    {
+        auto [r_lo, r_hi, u_lo, u_hi] = EntryRange();
+        float rm = r_lo + unit[0] * (r_hi - r_lo);
+        float um = u_lo + unit[1] * (u_hi - u_lo);
+        params_out.ent = EntryEntity(tp_from_blue ? pp.blue : pp.orange, rm, um);
+        params_out.n_max_teleports = 3;
+        params_out.first_tp_from_blue = tp_from_blue;
+    }
+
+    // the offsets along the entry portal's r & u vectors allowed by entry_pos_search: r_lo, r_hi, u_lo, u_hi
+    std::array<float, 4> EntryRange() const
+    {
+        MON_ASSERT((entry_pos_search & SEPF_ANY) != 0);
+        return {
+            (entry_pos_search & SEPF_RN) ? -PORTAL_HALF_WIDTH : 0,
+            (entry_pos_search & SEPF_RP) ? PORTAL_HALF_WIDTH : 0,
+            (entry_pos_search & SEPF_UN) ? -PORTAL_HALF_HEIGHT : 0,
+            (entry_pos_search & SEPF_UP) ? PORTAL_HALF_HEIGHT : 0,
+        };
+    }
+
+    Entity EntryEntity(const Portal& entry_portal, float rm, float um) const
+    {
+        Vector ent_pos = entry_portal.pos + (entry_portal.r * rm + entry_portal.u * um) * .5f;
+        return tp_player ? Entity::CreatePlayerFromCenter(ent_pos, true) : Entity::CreateBall(ent_pos, 1.f);
+    }
+
+    /*
+    * valid_placement_orders without repeats. Most of the PlacementOrder names are aliases for the
+    * same two values, so listing several of them would otherwise evaluate the same chain twice.
+    */
+    std::vector<PlacementOrder> DistinctPlacementOrders() const
+    {
+        std::vector<PlacementOrder> orders;
+        for (PlacementOrder order : valid_placement_orders)
+            if (std::find(orders.begin(), orders.end(), order) == orders.end())
+                orders.push_back(order);
+        return orders;
+    }
+
+    // the size of the cartesian product of the discrete dimensions (blue & orange lock options/spaces, placement order)
+    size_t NumDiscreteCombos() const
+    {
+        return blue_search.NumDiscrete() * orange_search.NumDiscrete() * DistinctPlacementOrders().size();
+    }
+
+    /*
+    * Searches only allow 3 teleports, so the only way to get cum_teleports == -1 is entry, exit,
+    * exit. The entity ends up roughly where the exit portal would teleport the entry point to. This
+    * is much cheaper than the float chain and is only used to reject candidates.
+    */
+    bool PrefilterAccepts(const PortalPair& pp, const Entity& ent) const
+    {
+        if (prefilter_margin < 0)
+            return true;
+        PortalPairD ppd{pp};
+        VectorD landing = ppd.Teleport(EntityD{ent}, !tp_from_blue).GetCenter();
+        return target_space.NearRegion(landing, prefilter_margin);
+    }
+
+    /*
+    * Runs a candidate through the prefilter and the chain, counting where it was rejected. For a
+    * hit, the chain result is moved into the candidate.
+    */
+    bool EvaluateCandidate(SearchResult& st,
+                           TeleportChainParams& candidate_params,
+                           TeleportChainResult& chain_result,
+                           SearchStats& stats) const
+    {
+        stats.n_pairs++;
+        if (entry_scan_per_side > 1)
+            return EvaluateEntryScan(st, candidate_params, chain_result, stats);
+        stats.n_candidates++;
+        if (!PrefilterAccepts(st.pp, candidate_params.ent)) {
+            stats.n_prefilter_rejected++;
+            return false;
+        }
+        candidate_params.pp = &st.pp;
+        auto chain_start = std::chrono::steady_clock::now();
+        GenerateTeleportChain(candidate_params, chain_result);
+        stats.chain_ns += NsSince(chain_start);
+        if (!CountChain(chain_result, stats))
+            return false;
+        st.chain_result = std::move(chain_result);
+        st.ent = st.chain_result.ent;
+        return true;
+    }
+
+    static uint64_t NsSince(std::chrono::steady_clock::time_point t)
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t)
+            .count();
+    }
+
+    // same as IsHit, but counts the outcome in stats
+    bool CountChain(const TeleportChainResult& chain_result, SearchStats& stats) const
+    {
+        stats.n_chains++;
+        stats.n_teleports += chain_result.total_n_teleports;
+        if (chain_result.max_tps_exceeded || chain_result.cum_teleports != -1) {
+            stats.n_not_vag++;
+            stats.n_max_tps_exceeded += chain_result.max_tps_exceeded;
+            return false;
+        }
+        if (!target_space.VectorInRegion(chain_result.ents.back().GetCenter())) {
+            stats.n_missed_target++;
+            return false;
+        }
+        stats.n_hits++;
+        return true;
+    }
+
+    /*
+    * EvaluateCandidate for entry_scan_per_side > 1. The grid is shifted so that the candidate's
+    * entry point is at the same spot within its cell as every other point is within theirs. The
+    * candidate's own entry point goes first and the scan stops at the first hit.
+    */
+    bool EvaluateEntryScan(SearchResult& st,
+                           TeleportChainParams& candidate_params,
+                           TeleportChainResult& chain_result,
+                           SearchStats& stats) const
+    {
+        const int n = std::min(entry_scan_per_side, MAX_ENTRY_SCAN_PER_SIDE);
+        const Portal& p = tp_from_blue ? st.pp.blue : st.pp.orange;
+        auto [r_lo, r_hi, u_lo, u_hi] = EntryRange();
+        Vector d = candidate_params.ent.GetCenter() - p.pos;
+        auto to_unit = [](float v, float lo, float hi) {
+            return hi > lo ? std::clamp((v - lo) / (hi - lo), 0.f, LD_ONE_MINUS_EPS) : 0.f;
+        };
+        float fr = to_unit(d.Dot(p.r) * 2.f, r_lo, r_hi) * n;
+        float fu = to_unit(d.Dot(p.u) * 2.f, u_lo, u_hi) * n;
+        int cell_r = (int)fr, cell_u = (int)fu;
+        float off_r = fr - cell_r, off_u = fu - cell_u;
+
+        candidate_params.pp = &st.pp;
+        for (int k = -1; k < n * n; k++) {
+            if (k >= 0) {
+                int x = k % n, y = k / n;
+                if (x == cell_r && y == cell_u)
+                    continue;
+                float rm = r_lo + (r_hi - r_lo) * ((x + off_r) / n);
+                float um = u_lo + (u_hi - u_lo) * ((y + off_u) / n);
+                candidate_params.ent = EntryEntity(p, rm, um);
+            }
+            stats.n_candidates++;
+            if (!PrefilterAccepts(st.pp, candidate_params.ent)) {
+                stats.n_prefilter_rejected++;
+                continue;
+            }
+            auto chain_start = std::chrono::steady_clock::now();
+            GenerateTeleportChain(candidate_params, chain_result);
+            stats.chain_ns += NsSince(chain_start);
+            if (CountChain(chain_result, stats)) {
+                st.chain_result = std::move(chain_result);
+                st.ent = st.chain_result.ent;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool IsHit(const TeleportChainResult& chain_result) const
+    {
+        if (chain_result.max_tps_exceeded)
+            return false;
+        if (chain_result.cum_teleports != -1)
+            return false;
+        return target_space.VectorInRegion(chain_result.ents.back().GetCenter());
+    }
+
     std::optional<SearchResult> FindVag(small_prng& rng, int n_iterations)
     {
         TeleportChainResult chain_result;
 
         for (int i = 0; i < n_iterations; i++) {
-            SearchResult st{
-                .n_iterations = i,
-                .pp{
-                    blue_search.Generate(rng, gv),
-                    orange_search.Generate(rng, gv),
-                    rng.next_elem(valid_placement_orders),
-                },
-            };
-
-            const Portal& p = tp_from_blue ? st.pp.blue : st.pp.orange;
-            MON_ASSERT((entry_pos_search & SEPF_ANY) != 0);
-            float rm = rng.next_float((entry_pos_search & SEPF_RN) ? -PORTAL_HALF_WIDTH : 0,
-                                      (entry_pos_search & SEPF_RP) ? PORTAL_HALF_WIDTH : 0);
-            float um = rng.next_float((entry_pos_search & SEPF_UN) ? -PORTAL_HALF_HEIGHT : 0,
-                                      (entry_pos_search & SEPF_UP) ? PORTAL_HALF_HEIGHT : 0);
-            Vector ent_pos = p.pos + (p.r * rm + p.u * um) * .5f;
-
+            SearchResult st = GenerateCandidate(rng, i, params);
             params.pp = &st.pp;
-            params.ent = tp_player ? Entity::CreatePlayerFromCenter(ent_pos, true) : Entity::CreateBall(ent_pos, 1.f);
-            params.n_max_teleports = 3;
-            params.first_tp_from_blue = tp_from_blue;
 
             GenerateTeleportChain(params, chain_result);
 
@@ -172,11 +1086,7 @@ struct SearchSpace {
                     printf("%d cum teleports\n\n", chain_result.cum_teleports);
             }
 
-            if (chain_result.max_tps_exceeded)
-                continue;
-            if (chain_result.cum_teleports != -1)
-                continue;
-            if (!target_space.VectorInBox(chain_result.ents.back().GetCenter()))
+            if (!IsHit(chain_result))
                 continue;
             st.chain_result = std::move(chain_result);
             st.ent = st.chain_result.ent;
@@ -184,6 +1094,665 @@ struct SearchSpace {
         }
         return {};
     }
+
+    // iterations in the parallel search are split into blocks, each with its own prng stream
+    static constexpr int PARALLEL_BLOCK_SIZE = 4096;
+
+    // the prng for a block of the parallel search, derived from the seed & block index
+    static small_prng BlockPrng(uint32_t seed, uint32_t block)
+    {
+        // splitmix64 finalizer so that neighboring blocks get unrelated seeds
+        uint64_t z = ((uint64_t)seed << 32 | block) + 0x9e3779b97f4a7c15ull;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        z ^= z >> 31;
+        return small_prng{(uint32_t)(z ^ (z >> 32))};
+    }
+
+    /*
+    * Candidate sources for the parallel searches. Block(b) returns a generator that's called as
+    * gen(i, params) for every iteration i in block b in order.
+    */
+    struct PrngCandidates {
+        const SearchSpace& ss;
+        uint32_t seed;
+        // block b uses the prng of block b + first_block, lets a search be split into shards
+        uint32_t first_block = 0;
+
+        auto Block(int block) const
+        {
+            return [this, rng = BlockPrng(seed, first_block + (uint32_t)block)](int i, TeleportChainParams& p) mutable {
+                return ss.GenerateCandidate(rng, i, p);
+            };
+        }
+
+        uint64_t CheckpointKey() const
+        {
+            return (uint64_t)seed | (uint64_t)first_block << 32;
+        }
+    };
+
+    // iteration i uses point i + first_index of the sampler
+    template <typename Sampler>
+    struct SampledCandidates {
+        const SearchSpace& ss;
+        const Sampler& sampler;
+        uint64_t first_index;
+
+        static_assert(Sampler::MAX_DIMS >= N_UNIT_DIMS);
+
+        auto Block(int) const
+        {
+            return [this](int i, TeleportChainParams& p) {
+                float unit[Sampler::MAX_DIMS];
+                sampler.Point(first_index + (uint64_t)i, unit);
+                return ss.GenerateCandidate(unit, i, p);
+            };
+        }
+
+        // doesn't include the sampler's scramble seed, use SearchCheckpointParams::user_key for that
+        uint64_t CheckpointKey() const
+        {
+            return first_index ^ (1ull << 63);
+        }
+    };
+
+    /*
+    * Enumerates every combination of the discrete dimensions for each sample of the continuous
+    * ones. Iteration i uses sample i / NumDiscreteCombos() (offset by first_index) with the
+    * combination i % NumDiscreteCombos(). The placement order changes fastest, then the orange
+    * lock option & space, then blue's, so the portals are only constructed when one of those
+    * changes and each order just recalculates the teleport matrices. Unlike the sampled searches,
+    * every position space gets the same number of samples no matter how big it is.
+    */
+    template <typename Sampler>
+    struct EnumeratedCandidates {
+        const SearchSpace& ss;
+        const Sampler& sampler;
+        uint64_t first_index;
+        std::vector<PlacementOrder> orders;
+        size_t n_blue, n_orange, n_combos;
+
+        static_assert(Sampler::MAX_DIMS >= N_UNIT_DIMS);
+
+        EnumeratedCandidates(const SearchSpace& ss, const Sampler& sampler, uint64_t first_index)
+            : ss{ss},
+              sampler{sampler},
+              first_index{first_index},
+              orders{ss.DistinctPlacementOrders()},
+              n_blue{ss.blue_search.NumDiscrete()},
+              n_orange{ss.orange_search.NumDiscrete()},
+              n_combos{n_blue * n_orange * orders.size()}
+        {
+            MON_ASSERT(n_combos > 0);
+        }
+
+        class Generator {
+            const EnumeratedCandidates& src;
+            float unit[Sampler::MAX_DIMS];
+            uint64_t cur_sample = UINT64_MAX;
+            size_t cur_blue = SIZE_MAX, cur_orange = SIZE_MAX;
+            std::optional<Portal> blue, orange;
+
+        public:
+            explicit Generator(const EnumeratedCandidates& src) : src{src} {}
+
+            SearchResult operator()(int i, TeleportChainParams& p)
+            {
+                uint64_t sample = (uint64_t)i / src.n_combos;
+                size_t combo = (size_t)((uint64_t)i % src.n_combos);
+                size_t order_idx = combo % src.orders.size();
+                combo /= src.orders.size();
+                size_t orange_idx = combo % src.n_orange;
+                size_t blue_idx = combo / src.n_orange;
+
+                if (sample != cur_sample) {
+                    src.sampler.Point(src.first_index + sample, unit);
+                    cur_sample = sample;
+                    cur_blue = cur_orange = SIZE_MAX;
+                }
+                if (blue_idx != cur_blue) {
+                    blue.emplace(src.ss.blue_search.FromUnit(unit, blue_idx, src.ss.gv));
+                    cur_blue = blue_idx;
+                }
+                if (orange_idx != cur_orange) {
+                    orange.emplace(
+                        src.ss.orange_search.FromUnit(unit + SearchPortal::N_UNIT_DIMS, orange_idx, src.ss.gv));
+                    cur_orange = orange_idx;
+                }
+                SearchResult st{
+                    .n_iterations = i,
+                    .pp{*blue, *orange, src.orders[order_idx]},
+                };
+                src.ss.SetEntryFromUnit(st.pp, unit + SearchPortal::N_UNIT_DIMS * 2 + 1, p);
+                return st;
+            }
+        };
+
+        Generator Block(int) const
+        {
+            return Generator{*this};
+        }
+
+        uint64_t CheckpointKey() const
+        {
+            return (first_index ^ (3ull << 62)) + n_combos * 0x9e3779b97f4a7c15ull;
+        }
+    };
+
+    // loads the checkpoint for a search, or returns an empty one if there isn't one or it's for a different search
+    template <typename CandidateSource>
+    static SearchCheckpoint LoadCheckpoint(const SearchCheckpointParams* checkpoint,
+                                           const CandidateSource& source,
+                                           int n_iterations,
+                                           SearchCheckpointKind kind)
+    {
+        // splitmix64 finalizer over the key parts
+        uint64_t key = source.CheckpointKey();
+        for (uint64_t part : {checkpoint ? checkpoint->user_key : 0, (uint64_t)n_iterations}) {
+            key = (key ^ part) + 0x9e3779b97f4a7c15ull;
+            key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+            key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+            key ^= key >> 31;
+        }
+        SearchCheckpoint empty{.search_key = key, .kind = kind, .n_iterations = n_iterations};
+        if (!checkpoint)
+            return empty;
+        auto ckpt = SearchCheckpoint::Load(checkpoint->path);
+        if (!ckpt || ckpt->search_key != key || ckpt->kind != kind || ckpt->n_iterations != n_iterations)
+            return empty;
+        return std::move(*ckpt);
+    }
+
+    /*
+    * Generates & evaluates the candidate for an iteration that was recorded as a hit. Generators
+    * are only ever run in order from the start of a block, so this runs the block up to the hit.
+    */
+    template <typename CandidateSource>
+    SearchResult ReplayHit(const CandidateSource& source,
+                           int iteration,
+                           TeleportChainParams& replay_params,
+                           TeleportChainResult& chain_result) const
+    {
+        int block = iteration / PARALLEL_BLOCK_SIZE;
+        auto gen = source.Block(block);
+        for (int i = block * PARALLEL_BLOCK_SIZE; i < iteration; i++)
+            gen(i, replay_params);
+        SearchResult st = gen(iteration, replay_params);
+        SearchStats unused;
+        [[maybe_unused]] bool hit = EvaluateCandidate(st, replay_params, chain_result, unused);
+        MON_ASSERT(hit);
+        return st;
+    }
+
+    /*
+    * A multithreaded version of FindVag. Iterations are split into fixed size blocks and block b
+    * always uses BlockPrng(seed, b), so iteration i generates the same candidate no matter how
+    * many threads there are or which thread runs it. Once a hit is found, threads stop working on
+    * anything past it, but blocks before it still finish and the hit with the lowest iteration
+    * index is returned. The result only depends on the seed (but is not the same as FindVag).
+    */
+    std::optional<SearchResult> FindVagParallel(uint32_t seed,
+                                                int n_iterations,
+                                                int n_threads = 0,
+                                                SearchStats* stats = nullptr,
+                                                const SearchCheckpointParams* checkpoint = nullptr,
+                                                const SearchProgressParams* progress = nullptr) const
+    {
+        return FindVagFrom(PrngCandidates{*this, seed}, n_iterations, n_threads, stats, checkpoint, progress);
+    }
+
+    /*
+    * Same as above, but the candidates come from a low discrepancy sequence (see
+    * low_discrepancy.hpp) which covers the search space more evenly than random samples. Use
+    * first_index to continue a previous search.
+    */
+    template <typename Sampler>
+    std::optional<SearchResult> FindVagSampled(const Sampler& sampler,
+                                               int n_iterations,
+                                               uint64_t first_index = 0,
+                                               int n_threads = 0,
+                                               SearchStats* stats = nullptr,
+                                               const SearchCheckpointParams* checkpoint = nullptr,
+                                               const SearchProgressParams* progress = nullptr) const
+    {
+        return FindVagFrom(SampledCandidates<Sampler>{*this, sampler, first_index},
+                           n_iterations,
+                           n_threads,
+                           stats,
+                           checkpoint,
+                           progress);
+    }
+
+    /*
+    * Same as above, but every combination of lock options, position spaces, and placement orders
+    * is tried for each of the n_samples samples (see EnumeratedCandidates). The iteration of a
+    * result is the combined index.
+    */
+    template <typename Sampler>
+    std::optional<SearchResult> FindVagEnumerated(const Sampler& sampler,
+                                                  int n_samples,
+                                                  uint64_t first_index = 0,
+                                                  int n_threads = 0,
+                                                  SearchStats* stats = nullptr,
+                                                  const SearchCheckpointParams* checkpoint = nullptr,
+                                                  const SearchProgressParams* progress = nullptr) const
+    {
+        EnumeratedCandidates<Sampler> source{*this, sampler, first_index};
+        MON_ASSERT((uint64_t)n_samples * source.n_combos <= INT_MAX);
+        return FindVagFrom(source, n_samples * (int)source.n_combos, n_threads, stats, checkpoint, progress);
+    }
+
+    template <typename CandidateSource>
+    std::optional<SearchResult> FindVagFrom(const CandidateSource& source,
+                                            int n_iterations,
+                                            int n_threads,
+                                            SearchStats* stats = nullptr,
+                                            const SearchCheckpointParams* checkpoint = nullptr,
+                                            const SearchProgressParams* progress = nullptr) const
+    {
+        if (n_threads <= 0)
+            n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+        ctpl::thread_pool pool{n_threads};
+        return FindVagFrom(source, n_iterations, pool, stats, checkpoint, progress);
+    }
+
+    /*
+    * Same as above, but runs on an existing pool (with one task per pool thread) so that long
+    * running processes don't start new threads for every search.
+    */
+    template <typename CandidateSource>
+    std::optional<SearchResult> FindVagFrom(const CandidateSource& source,
+                                            int n_iterations,
+                                            ctpl::thread_pool& pool,
+                                            SearchStats* stats = nullptr,
+                                            const SearchCheckpointParams* checkpoint = nullptr,
+                                            const SearchProgressParams* progress = nullptr) const
+    {
+        const int n_threads = pool.size();
+        const int n_blocks = (n_iterations + PARALLEL_BLOCK_SIZE - 1) / PARALLEL_BLOCK_SIZE;
+        SearchCheckpoint start = LoadCheckpoint(checkpoint, source, n_iterations, SCK_FIND);
+
+        std::atomic_int next_block{start.next_block};
+        // the lowest iteration with a hit so far, also acts as the cancellation flag
+        std::atomic_int best_iteration{INT_MAX};
+        std::mutex mtx;
+        std::map<int, SearchResult> hits;
+        SearchStats total_stats = start.stats;
+        SearchProgressReporter reporter{progress, n_iterations, start.stats};
+        if (!start.hit_iterations.empty()) {
+            MonocleFloatingPointScope scope{};
+            TeleportChainParams replay_params = params;
+            TeleportChainResult chain_result;
+            int first_hit = *std::min_element(start.hit_iterations.begin(), start.hit_iterations.end());
+            hits.emplace(first_hit, ReplayHit(source, first_hit, replay_params, chain_result));
+            best_iteration = first_hit;
+        }
+        SearchCheckpointTracker tracker{checkpoint, std::move(start)};
+
+        std::vector<std::future<void>> workers;
+        for (int t = 0; t < n_threads; t++) {
+            workers.push_back(pool.push([&](int) -> void {
+                MonocleFloatingPointScope scope{};
+                TeleportChainParams worker_params = params;
+                TeleportChainResult chain_result;
+                SearchStats worker_stats;
+                std::vector<int> block_hits;
+
+                for (int block; (block = next_block.fetch_add(1, std::memory_order_relaxed)) < n_blocks;) {
+                    int begin = block * PARALLEL_BLOCK_SIZE;
+                    if (begin > best_iteration.load(std::memory_order_relaxed))
+                        break; // blocks are handed out in order, so every remaining block is past the hit
+                    int end = std::min(begin + PARALLEL_BLOCK_SIZE, n_iterations);
+                    auto gen = source.Block(block);
+                    SearchStats block_stats;
+
+                    for (int i = begin; i < end && i < best_iteration.load(std::memory_order_relaxed); i++) {
+                        auto gen_start = std::chrono::steady_clock::now();
+                        SearchResult st = gen(i, worker_params);
+                        block_stats.gen_ns += NsSince(gen_start);
+                        if (!EvaluateCandidate(st, worker_params, chain_result, block_stats))
+                            continue;
+
+                        int cur = best_iteration.load(std::memory_order_relaxed);
+                        while (i < cur && !best_iteration.compare_exchange_weak(cur, i, std::memory_order_relaxed))
+                            ;
+                        block_hits.push_back(i);
+                        std::lock_guard lock{mtx};
+                        hits.emplace(i, std::move(st));
+                        break;
+                    }
+                    worker_stats += block_stats;
+                    tracker.BlockDone(block, block_stats, block_hits);
+                    reporter.BlockDone(block_stats);
+                }
+                std::lock_guard lock{mtx};
+                total_stats += worker_stats;
+            }));
+        }
+        for (std::future<void>& w : workers)
+            w.get();
+        tracker.Finish(n_blocks);
+        reporter.Finish();
+        if (stats)
+            *stats += total_stats;
+
+        if (hits.empty())
+            return {};
+        MON_ASSERT(hits.begin()->first == best_iteration.load());
+        return std::move(hits.begin()->second);
+    }
+
+    // distance from a point inside the target space to its closest face, negative if the point is outside
+    float TargetMargin(const Vector& pt) const
+    {
+        return target_space.Margin(pt);
+    }
+
+    /*
+    * Samples an n*n grid of entry points over the part of the entry portal given by
+    * entry_pos_search (the same region that FindVag samples) and returns the fraction of them that
+    * are hits. params is used as scratch space. The chains are counted in stats->n_rank_chains.
+    */
+    float FaceVagFraction(const PortalPair& pp,
+                          int n,
+                          TeleportChainParams& scratch_params,
+                          TeleportChainResult& scratch_result,
+                          SearchStats* stats = nullptr) const
+    {
+        if (n <= 0)
+            return 0.f;
+        const Portal& p = tp_from_blue ? pp.blue : pp.orange;
+        auto [r_lo, r_hi, u_lo, u_hi] = EntryRange();
+        scratch_params.pp = &pp;
+        scratch_params.n_max_teleports = 3;
+        scratch_params.first_tp_from_blue = tp_from_blue;
+        int n_hits = 0;
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++) {
+                // sample cell centers
+                float rm = r_lo + (r_hi - r_lo) * ((x + .5f) / n);
+                float um = u_lo + (u_hi - u_lo) * ((y + .5f) / n);
+                scratch_params.ent = EntryEntity(p, rm, um);
+                GenerateTeleportChain(scratch_params, scratch_result);
+                n_hits += IsHit(scratch_result);
+            }
+        }
+        if (stats)
+            stats->n_rank_chains += (uint64_t)n * n;
+        return (float)n_hits / (float)(n * n);
+    }
+
+    RankedVagHit RankHit(SearchResult&& hit,
+                         int face_samples_per_side,
+                         TeleportChainParams& scratch_params,
+                         TeleportChainResult& scratch_result,
+                         SearchStats* stats = nullptr) const
+    {
+        float margin = TargetMargin(hit.chain_result.ents.back().GetCenter());
+        float frac = FaceVagFraction(hit.pp, face_samples_per_side, scratch_params, scratch_result, stats);
+        return {.hit = std::move(hit), .face_vag_fraction = frac, .target_margin = margin};
+    }
+
+    // the entry point that FindVag used for a hit as offsets along the portal r & u vectors (same units as FindVag)
+    std::pair<float, float> EntryOffsets(const SearchResult& hit) const
+    {
+        const Portal& p = tp_from_blue ? hit.pp.blue : hit.pp.orange;
+        Vector d = hit.chain_result.ents.front().GetCenter() - p.pos;
+        return {d.Dot(p.r) * 2.f, d.Dot(p.u) * 2.f};
+    }
+
+    /*
+    * Hits from a random search are usually in the middle of a bigger region of hits. This does a
+    * simple (1+batch_size) evolution strategy around a hit: every round perturbs the current best
+    * portal placements, yaws, and entry point, scores the candidates in parallel, and moves to the
+    * best one if it's more robust (see RankedVagHit). The step sizes double after an improvement
+    * and halve otherwise. Candidates always have to be hits themselves. The result only depends on
+    * the seed and the starting hit.
+    */
+    RankedVagHit RefineHit(const RankedVagHit& start, uint32_t seed, const VagRefineParams& rp = {}) const
+    {
+        int n_threads = rp.n_threads > 0 ? rp.n_threads : std::max(1, (int)std::thread::hardware_concurrency());
+        ctpl::thread_pool pool{n_threads};
+
+        struct Candidate {
+            std::optional<PortalPair> pp;
+            float rm, um;
+            std::optional<RankedVagHit> ranked;
+        };
+
+        const bool entry_blue = tp_from_blue;
+        auto [r_lo, r_hi, u_lo, u_hi] = EntryRange();
+
+        RankedVagHit best{
+            .hit{
+                .n_iterations = start.hit.n_iterations,
+                .ent = start.hit.ent,
+                .pp = start.hit.pp,
+            },
+            .face_vag_fraction = start.face_vag_fraction,
+            .target_margin = start.target_margin,
+        };
+        // chain results can't be copied, but only the recorded parts matter here
+        const TeleportChainResult& start_chain = start.hit.chain_result;
+        best.hit.chain_result.max_tps_exceeded = start_chain.max_tps_exceeded;
+        best.hit.chain_result.total_n_teleports = start_chain.total_n_teleports;
+        best.hit.chain_result.cum_teleports = start_chain.cum_teleports;
+        best.hit.chain_result.ent = start_chain.ent;
+        best.hit.chain_result.ents = start_chain.ents;
+        best.hit.chain_result.tp_dirs = start_chain.tp_dirs;
+        auto [best_rm, best_um] = EntryOffsets(start.hit);
+        std::vector<Candidate> batch(rp.batch_size);
+
+        float scale = 1.f;
+        for (int round = 0; round < rp.n_rounds && scale >= rp.min_step_scale; round++) {
+            small_prng rng = BlockPrng(seed, (uint32_t)round);
+            for (Candidate& c : batch) {
+                c.pp.emplace(blue_search.Perturb(best.hit.pp.blue, rng, rp.pos_step * scale, rp.ang_step * scale, gv),
+                             orange_search.Perturb(best.hit.pp.orange,
+                                                   rng,
+                                                   rp.pos_step * scale,
+                                                   rp.ang_step * scale,
+                                                   gv),
+                             best.hit.pp.order);
+                c.rm = std::clamp(best_rm + rng.next_float(-rp.entry_step, rp.entry_step) * scale, r_lo, r_hi);
+                c.um = std::clamp(best_um + rng.next_float(-rp.entry_step, rp.entry_step) * scale, u_lo, u_hi);
+                c.ranked.reset();
+            }
+
+            std::vector<std::future<void>> futures;
+            for (Candidate& c : batch) {
+                futures.push_back(pool.push([&, entry_blue](int) -> void {
+                    MonocleFloatingPointScope scope{};
+                    TeleportChainParams cand_params = params, scratch_params = params;
+                    TeleportChainResult chain_result, scratch_result;
+                    cand_params.pp = &*c.pp;
+                    cand_params.ent = EntryEntity(entry_blue ? c.pp->blue : c.pp->orange, c.rm, c.um);
+                    cand_params.n_max_teleports = 3;
+                    cand_params.first_tp_from_blue = tp_from_blue;
+                    GenerateTeleportChain(cand_params, chain_result);
+                    if (!IsHit(chain_result))
+                        return;
+                    SearchResult st{.n_iterations = start.hit.n_iterations, .pp = *c.pp};
+                    st.chain_result = std::move(chain_result);
+                    st.ent = st.chain_result.ent;
+                    c.ranked = RankHit(std::move(st), rp.face_samples_per_side, scratch_params, scratch_result);
+                }));
+            }
+            for (auto& f : futures)
+                f.get();
+
+            // the first candidate wins ties so that the result is deterministic
+            Candidate* round_best = nullptr;
+            for (Candidate& c : batch)
+                if (c.ranked && (!round_best || *round_best->ranked < *c.ranked))
+                    round_best = &c;
+            if (round_best && best < *round_best->ranked) {
+                best = std::move(*round_best->ranked);
+                best_rm = round_best->rm;
+                best_um = round_best->um;
+                scale = std::min(scale * 2.f, 1.f);
+            } else {
+                scale *= .5f;
+            }
+        }
+        return best;
+    }
+
+    /*
+    * Like FindVagParallel, but doesn't stop at the first hit. Every hit is ranked by how much of
+    * the entry portal VAGs and how far the landing point is from the edge of the target space,
+    * and the best (deduplicated) hits are returned best first. Each thread keeps its own top-k so
+    * there's no shared state on the hot path. Iteration i generates the same candidate as in
+    * FindVagParallel with the same seed.
+    */
+    std::vector<RankedVagHit> CollectVags(uint32_t seed,
+                                          int n_iterations,
+                                          const VagCollectParams& cp = {},
+                                          int n_threads = 0,
+                                          SearchStats* stats = nullptr,
+                                          const SearchCheckpointParams* checkpoint = nullptr,
+                                          const SearchProgressParams* progress = nullptr) const
+    {
+        return CollectVagsFrom(PrngCandidates{*this, seed}, n_iterations, cp, n_threads, stats, checkpoint, progress);
+    }
+
+    template <typename Sampler>
+    std::vector<RankedVagHit> CollectVagsSampled(const Sampler& sampler,
+                                                 int n_iterations,
+                                                 const VagCollectParams& cp = {},
+                                                 uint64_t first_index = 0,
+                                                 int n_threads = 0,
+                                                 SearchStats* stats = nullptr,
+                                                 const SearchCheckpointParams* checkpoint = nullptr,
+                                                 const SearchProgressParams* progress = nullptr) const
+    {
+        return CollectVagsFrom(SampledCandidates<Sampler>{*this, sampler, first_index},
+                               n_iterations,
+                               cp,
+                               n_threads,
+                               stats,
+                               checkpoint,
+                               progress);
+    }
+
+    template <typename Sampler>
+    std::vector<RankedVagHit> CollectVagsEnumerated(const Sampler& sampler,
+                                                    int n_samples,
+                                                    const VagCollectParams& cp = {},
+                                                    uint64_t first_index = 0,
+                                                    int n_threads = 0,
+                                                    SearchStats* stats = nullptr,
+                                                    const SearchCheckpointParams* checkpoint = nullptr,
+                                                    const SearchProgressParams* progress = nullptr) const
+    {
+        EnumeratedCandidates<Sampler> source{*this, sampler, first_index};
+        MON_ASSERT((uint64_t)n_samples * source.n_combos <= INT_MAX);
+        return CollectVagsFrom(source, n_samples * (int)source.n_combos, cp, n_threads, stats, checkpoint, progress);
+    }
+
+    template <typename CandidateSource>
+    std::vector<RankedVagHit> CollectVagsFrom(const CandidateSource& source,
+                                              int n_iterations,
+                                              const VagCollectParams& cp,
+                                              int n_threads,
+                                              SearchStats* stats = nullptr,
+                                              const SearchCheckpointParams* checkpoint = nullptr,
+                                              const SearchProgressParams* progress = nullptr) const
+    {
+        if (n_threads <= 0)
+            n_threads = std::max(1, (int)std::thread::hardware_concurrency());
+        ctpl::thread_pool pool{n_threads};
+        return CollectVagsFrom(source, n_iterations, cp, pool, stats, checkpoint, progress);
+    }
+
+    // same as above, but runs on an existing pool like FindVagFrom
+    template <typename CandidateSource>
+    std::vector<RankedVagHit> CollectVagsFrom(const CandidateSource& source,
+                                              int n_iterations,
+                                              const VagCollectParams& cp,
+                                              ctpl::thread_pool& pool,
+                                              SearchStats* stats = nullptr,
+                                              const SearchCheckpointParams* checkpoint = nullptr,
+                                              const SearchProgressParams* progress = nullptr) const
+    {
+        const int n_threads = pool.size();
+        const int n_blocks = (n_iterations + PARALLEL_BLOCK_SIZE - 1) / PARALLEL_BLOCK_SIZE;
+        SearchCheckpoint start = LoadCheckpoint(checkpoint, source, n_iterations, SCK_COLLECT);
+
+        std::atomic_int next_block{start.next_block};
+        std::vector<VagHitTopK> worker_hits;
+        std::vector<SearchStats> worker_stats(n_threads);
+        for (int t = 0; t < n_threads; t++)
+            worker_hits.emplace_back(cp);
+
+        VagHitTopK all{cp};
+        SearchStats total_stats = start.stats;
+        SearchProgressReporter reporter{progress, n_iterations, start.stats};
+        if (!start.hit_iterations.empty()) {
+            MonocleFloatingPointScope scope{};
+            TeleportChainParams replay_params = params, scratch_params = params;
+            TeleportChainResult chain_result, scratch_result;
+            for (int it : start.hit_iterations) {
+                SearchResult st = ReplayHit(source, it, replay_params, chain_result);
+                if (!all.Holds(st))
+                    all.Push(RankHit(
+                        std::move(st), cp.face_samples_per_side, scratch_params, scratch_result, &total_stats));
+            }
+        }
+        SearchCheckpointTracker tracker{checkpoint, std::move(start)};
+
+        std::vector<std::future<void>> workers;
+        for (int t = 0; t < n_threads; t++) {
+            workers.push_back(pool.push([&, t](int) -> void {
+                MonocleFloatingPointScope scope{};
+                TeleportChainParams worker_params = params, scratch_params = params;
+                TeleportChainResult chain_result, scratch_result;
+                VagHitTopK& top_k = worker_hits[t];
+                std::vector<int> block_hits;
+
+                for (int block; (block = next_block.fetch_add(1, std::memory_order_relaxed)) < n_blocks;) {
+                    int begin = block * PARALLEL_BLOCK_SIZE;
+                    int end = std::min(begin + PARALLEL_BLOCK_SIZE, n_iterations);
+                    auto gen = source.Block(block);
+                    SearchStats block_stats;
+
+                    for (int i = begin; i < end; i++) {
+                        auto gen_start = std::chrono::steady_clock::now();
+                        SearchResult st = gen(i, worker_params);
+                        block_stats.gen_ns += NsSince(gen_start);
+                        if (!EvaluateCandidate(st, worker_params, chain_result, block_stats))
+                            continue;
+                        block_hits.push_back(i);
+                        if (top_k.Holds(st))
+                            continue;
+                        top_k.Push(RankHit(
+                            std::move(st), cp.face_samples_per_side, scratch_params, scratch_result, &block_stats));
+                    }
+                    worker_stats[t] += block_stats;
+                    tracker.BlockDone(block, block_stats, block_hits);
+                    reporter.BlockDone(block_stats);
+                }
+            }));
+        }
+        for (std::future<void>& w : workers)
+            w.get();
+        tracker.Finish(n_blocks);
+        reporter.Finish();
+
+        /*
+        * Merge in a fixed order. With max_hits set, the result can still depend on which thread
+        * got which block if hits tie or near-duplicates were found by different threads.
+        */
+        for (VagHitTopK& top_k : worker_hits)
+            all.Merge(std::move(top_k));
+        if (stats) {
+            *stats += total_stats;
+            for (const SearchStats& ws : worker_stats)
+                *stats += ws;
+        }
+        return all.TakeSorted();
+    }
 };
 
 } // namespace mon
@@ -36,6 +36,16 @@ class RingQueue {
         first = 0;
     }
 
+    // moved from queues are left empty & usable, so a moved from chain result can generate another chain
+    void ResetToInitArr()
+    {
+        MON_ASSERT(!mem);
+        mem.reset(init_arr.data());
+        index_mask = STATIC_BUF_SIZE - 1;
+        first = 0;
+        n_elems = 0;
+    }
+
 public:
     using value_type = T;
 
@@ -48,6 +58,7 @@ public:
             mem.release();
             mem = std::unique_ptr<T[]>(init_arr.data());
         }
+        o.ResetToInitArr();
     };
 
     RingQueue& operator=(RingQueue&& o)
@@ -65,6 +76,7 @@ public:
             mem.release();
             mem = std::unique_ptr<T[]>(init_arr.data());
         }
+        o.ResetToInitArr();
         return *this;
     }
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "monocle_config.hpp"
+
 #include <cmath>
 #include <stdint.h>
 
@@ -28,6 +30,18 @@ inline uint32_t UlpDiffF(float f1, float f2)
     return i1 > i2 ? i1 - i2 : i2 - i1;
 }
 
+// equivalent to calling nextafterf n times (towards +inf if n is positive), -0.f is treated the same as 0.f
+inline float StepUlpsF(float f, int32_t n)
+{
+    MON_ASSERT(std::isfinite(f));
+    uint32_t i = *(uint32_t*)&f;
+    // map floats to a monotonic integer line where 0.f & -0.f are both 0
+    int64_t key = (i & 0x80000000u) ? -(int64_t)(i & 0x7fffffffu) : (int64_t)i;
+    key += n;
+    uint32_t out = key < 0 ? ((uint32_t)-key | 0x80000000u) : (uint32_t)key;
+    return *(float*)&out;
+}
+
 inline float DoubleToFloatRoundDown(double value)
 {
     float f = (float)value;